@@ -0,0 +1,145 @@
+
+#include <xcopy.h>
+#include "buffer.h"
+
+tc_mysql_buf_t *
+tc_mysql_buf_create(tc_pool_t *pool, unsigned char *data, uint32_t len)
+{
+    tc_mysql_buf_t *buf;
+
+    buf = tc_palloc(pool, sizeof(tc_mysql_buf_t) + len);
+    if (buf == NULL) {
+        tc_log_info(LOG_ERR, 0, "mysql buf alloc err");
+        return NULL;
+    }
+
+    buf->ref  = 1;
+    buf->len  = len;
+    buf->hash = 0;
+    memcpy(buf->data, data, len);
+
+    return buf;
+}
+
+
+tc_mysql_buf_t *
+tc_mysql_buf_get(tc_mysql_buf_t *buf)
+{
+    buf->ref++;
+    return buf;
+}
+
+
+void
+tc_mysql_buf_put(tc_pool_t *pool, tc_mysql_buf_t *buf)
+{
+    if (--buf->ref == 0) {
+#if (TC_DETECT_MEMORY)
+        tc_log_info(LOG_INFO, 0, "free buf:%p, len:%u", buf, buf->len);
+#endif
+        tc_pfree(pool, buf);
+    }
+}
+
+
+int
+tc_mysql_store_init(tc_mysql_store_t *store, tc_pool_t *pool, uint32_t size)
+{
+    tc_memzero(store, sizeof(tc_mysql_store_t));
+
+    store->pool  = pool;
+    store->table = hash_create(pool, size);
+    if (store->table == NULL) {
+        return TC_ERR;
+    }
+
+    return TC_OK;
+}
+
+
+static uint64_t
+get_content_hash(unsigned char *data, uint32_t len)
+{
+    uint32_t i;
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (i = 0; i < len; i++) {
+        hash ^= data[i];
+        hash *= 1099511628211ULL;
+    }
+
+    /* zero marks a buffer that is not interned */
+    return hash ? hash : 1;
+}
+
+
+/*
+ * Return a reference to a payload equal to data, creating it if needed.
+ * On the rare hash clash with different bytes the payload is stored
+ * privately and not interned.
+ */
+tc_mysql_buf_t *
+tc_mysql_store_intern(tc_mysql_store_t *store, unsigned char *data,
+        uint32_t len)
+{
+    uint64_t        hash;
+    tc_mysql_buf_t *buf;
+
+    hash = get_content_hash(data, len);
+    buf  = hash_find(store->table, hash);
+
+    if (buf != NULL) {
+        if (buf->len == len && memcmp(buf->data, data, len) == 0) {
+            store->refs++;
+            store->ref_bytes += len;
+            return tc_mysql_buf_get(buf);
+        }
+        tc_log_info(LOG_INFO, 0, "content hash clash:%llu", hash);
+        return tc_mysql_buf_create(store->pool, data, len);
+    }
+
+    buf = tc_mysql_buf_create(store->pool, data, len);
+    if (buf == NULL) {
+        return NULL;
+    }
+
+    buf->hash = hash;
+    hash_add(store->table, store->pool, hash, buf);
+
+    store->bufs++;
+    store->bytes += len;
+    store->refs++;
+    store->ref_bytes += len;
+
+    return buf;
+}
+
+
+/* another reference to a payload of the store, given back by store_put */
+tc_mysql_buf_t *
+tc_mysql_store_get(tc_mysql_store_t *store, tc_mysql_buf_t *buf)
+{
+    if (buf->hash != 0) {
+        store->refs++;
+        store->ref_bytes += buf->len;
+    }
+
+    return tc_mysql_buf_get(buf);
+}
+
+
+void
+tc_mysql_store_put(tc_mysql_store_t *store, tc_mysql_buf_t *buf)
+{
+    if (buf->hash != 0) {
+        store->refs--;
+        store->ref_bytes -= buf->len;
+        if (buf->ref == 1) {
+            hash_del(store->table, store->pool, buf->hash);
+            store->bufs--;
+            store->bytes -= buf->len;
+        }
+    }
+
+    tc_mysql_buf_put(store->pool, buf);
+}
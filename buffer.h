@@ -0,0 +1,45 @@
+#ifndef  BUFFER_INCLUDED
+#define  BUFFER_INCLUDED
+#include <xcopy.h>
+
+/*
+ * A stored tcp payload kept alive by reference instead of by copying.
+ * Only the mysql bytes are kept; the headers of a replayed packet are
+ * built when it is saved, from a packet of the session.
+ * hash is non zero for a payload interned in a tc_mysql_store_t.
+ */
+typedef struct {
+    uint32_t      ref;
+    uint32_t      len;
+    uint64_t      hash;
+    unsigned char data[];
+} tc_mysql_buf_t;
+
+/*
+ * Payloads shared by content: sessions storing the same bytes hold
+ * references to one buffer instead of a copy each.
+ */
+typedef struct {
+    tc_pool_t  *pool;
+    hash_table *table;
+    uint64_t    bufs;
+    uint64_t    bytes;
+    uint64_t    refs;
+    uint64_t    ref_bytes;
+} tc_mysql_store_t;
+
+tc_mysql_buf_t *tc_mysql_buf_create(tc_pool_t *pool, unsigned char *data,
+        uint32_t len);
+tc_mysql_buf_t *tc_mysql_buf_get(tc_mysql_buf_t *buf);
+void tc_mysql_buf_put(tc_pool_t *pool, tc_mysql_buf_t *buf);
+
+int tc_mysql_store_init(tc_mysql_store_t *store, tc_pool_t *pool,
+        uint32_t size);
+tc_mysql_buf_t *tc_mysql_store_intern(tc_mysql_store_t *store,
+        unsigned char *data, uint32_t len);
+tc_mysql_buf_t *tc_mysql_store_get(tc_mysql_store_t *store,
+        tc_mysql_buf_t *buf);
+void tc_mysql_store_put(tc_mysql_store_t *store, tc_mysql_buf_t *buf);
+
+#endif   /* ----- #ifndef BUFFER_INCLUDED  ----- */
+
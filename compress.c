@@ -0,0 +1,321 @@
+
+#include <xcopy.h>
+#include "compress.h"
+
+
+static voidpf
+zalloc_pool(voidpf opaque, uInt items, uInt size)
+{
+    return tc_palloc(opaque, items * size);
+}
+
+
+static void
+zfree_pool(voidpf opaque, voidpf address)
+{
+    tc_pfree(opaque, address);
+}
+
+
+/*
+ * The inflate stream is made on first use and reset after, its window is
+ * only allocated once a frame is inflated
+ */
+static z_stream *
+get_stream(z_stream **zs, tc_pool_t *pool)
+{
+    z_stream *z;
+
+    if (*zs != NULL) {
+        inflateReset(*zs);
+        return *zs;
+    }
+
+    z = tc_pcalloc(pool, sizeof(z_stream));
+    if (z == NULL) {
+        return NULL;
+    }
+
+    z->zalloc = zalloc_pool;
+    z->zfree  = zfree_pool;
+    z->opaque = pool;
+    if (inflateInit(z) != Z_OK) {
+        tc_log_info(LOG_ERR, 0, "mysql inflate init failed");
+        tc_pfree(pool, z);
+        return NULL;
+    }
+
+    *zs = z;
+
+    return z;
+}
+
+
+/* inflate up to size bytes of out from in, return how many came out */
+static uint32_t
+inflate_head(z_stream *z, unsigned char *in, uint32_t in_len,
+        unsigned char *out, uint32_t size)
+{
+    int ret;
+
+    z->next_in   = in;
+    z->avail_in  = in_len;
+    z->next_out  = out;
+    z->avail_out = size;
+
+    ret = inflate(z, Z_SYNC_FLUSH);
+    if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+        tc_log_debug1(LOG_INFO, 0, "mysql inflate failed:%d", ret);
+    }
+
+    return size - z->avail_out;
+}
+
+
+/* end a stream made by get_stream and give its memory back */
+void
+tc_mysql_zfree(z_stream **zs, tc_pool_t *pool)
+{
+    if (*zs == NULL) {
+        return;
+    }
+
+    inflateEnd(*zs);
+    tc_pfree(pool, *zs);
+    *zs = NULL;
+}
+
+
+void
+tc_mysql_zframer_init(tc_mysql_zframer_t *f, tc_pool_t *pool)
+{
+    tc_memzero(f, sizeof(tc_mysql_zframer_t));
+    f->pool = pool;
+}
+
+
+void
+tc_mysql_zframer_free(tc_mysql_zframer_t *f)
+{
+    tc_mysql_zfree(&f->zs, f->pool);
+}
+
+
+static void
+emit_frame(tc_mysql_zframer_t *f, tc_mysql_frames_t *frames, uint32_t off,
+        uint32_t prev_len, uint32_t seg_len)
+{
+    tc_mysql_pkt_t *pkt;
+
+    f->emitted = 1;
+
+    pkt = &frames->pkts[frames->num++];
+    pkt->off       = off;
+    pkt->prev_len  = prev_len;
+    pkt->seg_len   = seg_len;
+    pkt->frame_len = f->frame_len;
+    pkt->cont      = 0;
+    pkt->len       = 0;
+
+    if (f->head_len >= MYSQL_HEADER_LEN) {
+        pkt->len = f->head[0] + (f->head[1] << 8) + (f->head[2] << 16);
+    } else {
+        tc_memzero(f->head + f->head_len, MYSQL_HEADER_LEN - f->head_len);
+    }
+
+    /*
+     * The frames of a command and of its response are numbered from 0
+     * like the packets of uncompressed commands, so the packet number
+     * gives way to the frame's
+     */
+    memcpy(pkt->head, f->head, MYSQL_HEAD_LEN);
+    pkt->head[3]  = f->zhead[3];
+    pkt->head_len = f->head_len > MYSQL_HEADER_LEN ?
+        f->head_len : MYSQL_HEADER_LEN;
+}
+
+
+/* walk frames from p on until the segment ends or frames is full */
+static void
+walk_frames(tc_mysql_zframer_t *f, unsigned char *data, uint32_t len,
+        uint32_t p, uint32_t want, tc_mysql_frames_t *frames)
+{
+    uint32_t  n, m, off, prev_len;
+
+    if (want > MYSQL_HEAD_LEN) {
+        want = MYSQL_HEAD_LEN;
+    }
+
+    while (p < len && frames->num < MAX_PKTS_PER_SEG) {
+        off      = p;
+        prev_len = f->seen;
+
+        while (f->zhead_len < MYSQL_ZHEADER_LEN && p < len) {
+            f->zhead[f->zhead_len++] = data[p++];
+            f->seen++;
+        }
+
+        if (f->zhead_len < MYSQL_ZHEADER_LEN) {
+            break;
+        }
+
+        if (f->frame_len == 0) {
+            f->frame_len = MYSQL_ZHEADER_LEN + f->zhead[0]
+                + (f->zhead[1] << 8) + (f->zhead[2] << 16);
+            f->raw_len   = f->zhead[4] + (f->zhead[5] << 8)
+                + (f->zhead[6] << 16);
+            f->want      = want;
+            f->head_len  = 0;
+            f->emitted   = 0;
+            if (f->raw_len > 0 && want > 0
+                    && get_stream(&f->zs, f->pool) == NULL)
+            {
+                f->want = 0;
+            }
+        }
+
+        n = f->frame_len - f->seen;
+        if (n > len - p) {
+            n = len - p;
+        }
+
+        if (!f->emitted && f->head_len < f->want && n > 0) {
+            m = f->want - f->head_len;
+            if (f->raw_len == 0) {
+                m = n < m ? n : m;
+                memcpy(f->head + f->head_len, data + p, m);
+                f->head_len += m;
+            } else {
+                f->head_len += inflate_head(f->zs, data + p, n,
+                        f->head + f->head_len, m);
+            }
+        }
+
+        p       += n;
+        f->seen += n;
+
+        if (!f->emitted && (f->head_len >= f->want
+                    || f->seen == f->frame_len))
+        {
+            emit_frame(f, frames, off, prev_len, p - off);
+        }
+
+        if (f->seen == f->frame_len) {
+            f->seen      = 0;
+            f->zhead_len = 0;
+            f->frame_len = 0;
+        }
+    }
+
+    frames->end = p;
+}
+
+
+/*
+ * Walk the compressed frames of a segment like frame_mysql_packets walks
+ * packets: a frame is reported once the first want bytes it holds are
+ * known, with the head of the first packet in it
+ */
+void
+tc_mysql_zframes(tc_mysql_zframer_t *f, uint32_t seq, unsigned char *data,
+        uint32_t len, uint32_t want, tc_mysql_frames_t *frames)
+{
+    frames->skip = 0;
+    frames->lead = 0;
+    frames->num  = 0;
+    frames->end  = len;
+
+    if (f->synced) {
+        if (before(seq, f->next_seq)) {
+            if (!after(seq + len, f->next_seq)) {
+                frames->skip = len;
+                return;
+            }
+            frames->skip = f->next_seq - seq;
+        } else if (after(seq, f->next_seq)) {
+            tc_log_debug2(LOG_INFO, 0, "mysql zframer lost sync:%u,%u",
+                    seq, f->next_seq);
+            f->synced = 0;
+        }
+    }
+
+    if (!f->synced) {
+        f->seen      = 0;
+        f->zhead_len = 0;
+        f->frame_len = 0;
+        f->synced    = 1;
+    }
+
+    f->next_seq = seq + len;
+
+    walk_frames(f, data, len, frames->skip, want, frames);
+}
+
+
+/* the frames of the segment after a full batch, as frame_mysql_more */
+bool
+tc_mysql_zframes_more(tc_mysql_zframer_t *f, unsigned char *data,
+        uint32_t len, uint32_t want, tc_mysql_frames_t *frames)
+{
+    if (frames->end >= len) {
+        return false;
+    }
+
+    frames->num = 0;
+    walk_frames(f, data, len, frames->end, want, frames);
+
+    return true;
+}
+
+
+/* the first want bytes a whole compressed frame holds */
+uint32_t
+tc_mysql_zpeek(z_stream **zs, tc_pool_t *pool, unsigned char *frame,
+        uint32_t len, unsigned char *out, uint32_t want)
+{
+    uint32_t  frame_len, raw_len;
+    z_stream *z;
+
+    if (len < MYSQL_ZHEADER_LEN) {
+        return 0;
+    }
+
+    frame_len = MYSQL_ZHEADER_LEN + frame[0] + (frame[1] << 8)
+        + (frame[2] << 16);
+    raw_len   = frame[4] + (frame[5] << 8) + (frame[6] << 16);
+    if (frame_len < len) {
+        len = frame_len;
+    }
+
+    if (raw_len == 0) {
+        want = want < len - MYSQL_ZHEADER_LEN ? want : len - MYSQL_ZHEADER_LEN;
+        memcpy(out, frame + MYSQL_ZHEADER_LEN, want);
+        return want;
+    }
+
+    z = get_stream(zs, pool);
+    if (z == NULL) {
+        return 0;
+    }
+
+    return inflate_head(z, frame + MYSQL_ZHEADER_LEN, len - MYSQL_ZHEADER_LEN,
+            out, want);
+}
+
+
+/* put len bytes of packets into a frame of their own, not compressed */
+uint32_t
+tc_mysql_zwrap(unsigned char *out, unsigned char *data, uint32_t len)
+{
+    /* data may start where the frame does */
+    memmove(out + MYSQL_ZHEADER_LEN, data, len);
+    out[0] = len & 0xff;
+    out[1] = (len >> 8) & 0xff;
+    out[2] = (len >> 16) & 0xff;
+    out[3] = 0;
+    out[4] = 0;
+    out[5] = 0;
+    out[6] = 0;
+
+    return MYSQL_ZHEADER_LEN + len;
+}
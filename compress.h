@@ -0,0 +1,46 @@
+#ifndef  COMPRESS_INCLUDED
+#define  COMPRESS_INCLUDED
+#include <xcopy.h>
+#include <zlib.h>
+#include "protocol.h"
+
+/* length, sequence id and inflated length of a compressed frame */
+#define MYSQL_ZHEADER_LEN    7
+
+/*
+ * Compressed frames of one direction of a session that negotiated
+ * CLIENT_COMPRESS, from the end of its login on. Only the first want
+ * bytes a frame holds are inflated, into head, by a stream kept for the
+ * session and reset for every frame; the rest of the frame is skipped.
+ * seen counts the bytes of the current frame walked so far.
+ */
+typedef struct {
+    uint32_t       next_seq;
+    uint32_t       seen;
+    uint32_t       frame_len;
+    uint32_t       raw_len;
+    uint32_t       want;
+    uint32_t       zhead_len;
+    uint32_t       head_len;
+    uint32_t       synced:1;
+    uint32_t       emitted:1;
+    unsigned char  zhead[MYSQL_ZHEADER_LEN];
+    unsigned char  head[MYSQL_HEAD_LEN];
+    z_stream      *zs;
+    tc_pool_t     *pool;
+} tc_mysql_zframer_t;
+
+void tc_mysql_zfree(z_stream **zs, tc_pool_t *pool);
+void tc_mysql_zframer_init(tc_mysql_zframer_t *f, tc_pool_t *pool);
+void tc_mysql_zframer_free(tc_mysql_zframer_t *f);
+void tc_mysql_zframes(tc_mysql_zframer_t *f, uint32_t seq,
+        unsigned char *data, uint32_t len, uint32_t want,
+        tc_mysql_frames_t *frames);
+bool tc_mysql_zframes_more(tc_mysql_zframer_t *f, unsigned char *data,
+        uint32_t len, uint32_t want, tc_mysql_frames_t *frames);
+uint32_t tc_mysql_zpeek(z_stream **zs, tc_pool_t *pool, unsigned char *frame,
+        uint32_t len, unsigned char *out, uint32_t want);
+uint32_t tc_mysql_zwrap(unsigned char *out, unsigned char *data,
+        uint32_t len);
+
+#endif   /* ----- #ifndef COMPRESS_INCLUDED  ----- */
@@ -0,0 +1,639 @@
+
+#include <xcopy.h>
+#include "protocol.h"
+#include "digest.h"
+#if (defined __x86_64__ || defined __i386__)
+#include <nmmintrin.h>
+#endif
+
+#define DIGEST_TABLE_SIZE    65536
+#define DIGEST_FILE_MAGIC    "tcmydg01"
+#define MORE_RESULTS_EXISTS  0x0008
+
+#define PHASE_FIRST          0
+#define PHASE_COLS           1
+#define PHASE_COLS_EOF       2
+#define PHASE_ROWS           3
+#define PHASE_PARAMS         4
+#define PHASE_PARAMS_EOF     5
+#define PHASE_PCOLS          6
+#define PHASE_PCOLS_EOF      7
+
+typedef struct {
+    link_node             node;
+    tc_mysql_digest_rec_t rec;
+} tc_mysql_digest_node_t;
+
+static int      crc32c_hw = -1;
+static uint32_t crc32c_table[256];
+
+
+static void
+crc32c_init(void)
+{
+    int      j;
+    uint32_t i, c;
+
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (j = 0; j < 8; j++) {
+            c = (c & 1) ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+        }
+        crc32c_table[i] = c;
+    }
+
+#if (defined __x86_64__ || defined __i386__)
+    __builtin_cpu_init();
+    crc32c_hw = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+#else
+    crc32c_hw = 0;
+#endif
+}
+
+
+#if (defined __x86_64__ || defined __i386__)
+/*
+ * The crc32 instruction of SSE4.2 computes CRC32C, eight bytes at a time
+ * on x86_64. The build does not need -msse4.2, the function is compiled
+ * for it and only called when the cpu has it.
+ */
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_sse42(uint32_t crc, unsigned char *p, size_t len)
+{
+#if (defined __x86_64__)
+    uint64_t c, v;
+
+    while (len > 0 && ((uintptr_t) p & 7)) {
+        crc = _mm_crc32_u8(crc, *p++);
+        len--;
+    }
+
+    c = crc;
+    while (len >= 8) {
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+        p   += 8;
+        len -= 8;
+    }
+    crc = (uint32_t) c;
+#endif
+
+    while (len > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+        len--;
+    }
+
+    return crc;
+}
+#endif
+
+
+uint32_t
+tc_crc32c(uint32_t crc, unsigned char *data, size_t len)
+{
+    if (crc32c_hw < 0) {
+        crc32c_init();
+    }
+
+    crc = ~crc;
+
+#if (defined __x86_64__ || defined __i386__)
+    if (crc32c_hw) {
+        return ~crc32c_sse42(crc, data, len);
+    }
+#endif
+
+    while (len > 0) {
+        crc = crc32c_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+
+    return ~crc;
+}
+
+
+static unsigned char *
+get_lenenc(unsigned char *p, unsigned char *end, uint64_t *v)
+{
+    int      i, n;
+    uint64_t value;
+
+    if (p >= end) {
+        return NULL;
+    }
+
+    switch (*p) {
+    case 0xfc:
+        n = 2;
+        break;
+    case 0xfd:
+        n = 3;
+        break;
+    case 0xfe:
+        n = 8;
+        break;
+    case 0xfb:
+    case 0xff:
+        return NULL;
+    default:
+        *v = *p;
+        return p + 1;
+    }
+
+    if (end - p <= n) {
+        return NULL;
+    }
+
+    value = 0;
+    for (i = n; i > 0; i--) {
+        value = (value << 8) | p[i];
+    }
+    *v = value;
+
+    return p + n + 1;
+}
+
+
+/* the status flags of an OK packet, or of an EOF packet with eof set */
+static uint32_t
+get_status(tc_mysql_resp_t *r, int eof)
+{
+    uint64_t       v;
+    unsigned char *p, *end;
+
+    p   = r->peek;
+    end = r->peek + r->peek_len;
+
+    if (eof) {
+        return r->peek_len >= 5 ? p[3] + (p[4] << 8) : 0;
+    }
+
+    p = get_lenenc(p + 1, end, &v);
+    if (p != NULL) {
+        p = get_lenenc(p, end, &v);
+    }
+    if (p == NULL || end - p < 2) {
+        return 0;
+    }
+
+    return p[0] + (p[1] << 8);
+}
+
+
+static void
+set_type(tc_mysql_resp_t *r, uint32_t type)
+{
+    if (r->digest.type == 0) {
+        r->digest.type = type;
+    }
+}
+
+
+static int
+end_result(tc_mysql_resp_t *r, uint32_t status)
+{
+    if (status & MORE_RESULTS_EXISTS) {
+        r->phase = PHASE_FIRST;
+        return RESP_AGAIN;
+    }
+
+    return RESP_DONE;
+}
+
+
+static int
+end_err(tc_mysql_resp_t *r)
+{
+    r->digest.type     = RESP_TYPE_ERR;
+    r->digest.affected = 0;
+
+    if (r->peek_len >= 3) {
+        r->digest.affected = r->peek[1] + (r->peek[2] << 8);
+    }
+
+    return RESP_DONE;
+}
+
+
+static int
+end_prepare_params(tc_mysql_resp_t *r)
+{
+    if (r->next_defs == 0) {
+        return RESP_DONE;
+    }
+
+    r->defs  = r->next_defs;
+    r->phase = PHASE_PCOLS;
+
+    return RESP_AGAIN;
+}
+
+
+static int
+end_first(tc_mysql_resp_t *r)
+{
+    uint64_t       v;
+    unsigned char *end;
+
+    end = r->peek + r->peek_len;
+
+    if (r->peek_len == 0) {
+        return RESP_LOST;
+    }
+
+    if (r->kind == RESP_KIND_STRING) {
+        set_type(r, RESP_TYPE_OTHER);
+        return RESP_DONE;
+    }
+
+    switch (r->peek[0]) {
+    case 0x00:
+        set_type(r, RESP_TYPE_OK);
+
+        if (r->kind == RESP_KIND_PREPARE) {
+            if (r->peek_len < 9) {
+                return RESP_LOST;
+            }
+            /* parameters come first, the columns wait in next_defs */
+            r->next_defs = r->peek[5] + (r->peek[6] << 8);
+            r->defs      = r->peek[7] + (r->peek[8] << 8);
+            r->digest.columns = r->next_defs;
+            if (r->defs == 0) {
+                return end_prepare_params(r);
+            }
+            r->phase = PHASE_PARAMS;
+            return RESP_AGAIN;
+        }
+
+        if (get_lenenc(r->peek + 1, end, &v) == NULL) {
+            return RESP_LOST;
+        }
+        r->digest.affected += v;
+        return end_result(r, get_status(r, 0));
+
+    case 0xff:
+        return end_err(r);
+
+    case 0xfb:
+    case 0xfe:
+        /* LOCAL INFILE requests and EOF answers are not followed */
+        return RESP_LOST;
+    }
+
+    if (get_lenenc(r->peek, end, &v) == NULL || v == 0) {
+        return RESP_LOST;
+    }
+
+    set_type(r, RESP_TYPE_RESULT);
+    r->digest.columns += v;
+    r->defs  = v;
+    r->phase = PHASE_COLS;
+
+    return RESP_AGAIN;
+}
+
+
+/* a whole packet went by, move on by what it was */
+static int
+end_packet(tc_mysql_resp_t *r)
+{
+    switch (r->phase) {
+    case PHASE_FIRST:
+        return end_first(r);
+
+    case PHASE_COLS:
+        if (--r->defs == 0) {
+            r->phase = r->deprecate_eof ? PHASE_ROWS : PHASE_COLS_EOF;
+        }
+        return RESP_AGAIN;
+
+    case PHASE_COLS_EOF:
+        if (r->peek_len == 0 || r->peek[0] != 0xfe) {
+            return RESP_LOST;
+        }
+        r->phase = PHASE_ROWS;
+        return RESP_AGAIN;
+
+    case PHASE_ROWS:
+        if (r->row) {
+            if (r->pkt_len != MYSQL_MAX_PACKET_LEN) {
+                r->digest.rows++;
+            }
+            return RESP_AGAIN;
+        }
+        if (r->peek_len > 0 && r->peek[0] == 0xff) {
+            return end_err(r);
+        }
+        return end_result(r, get_status(r, !r->deprecate_eof));
+
+    case PHASE_PARAMS:
+        if (--r->defs == 0) {
+            if (!r->deprecate_eof) {
+                r->phase = PHASE_PARAMS_EOF;
+                return RESP_AGAIN;
+            }
+            return end_prepare_params(r);
+        }
+        return RESP_AGAIN;
+
+    case PHASE_PARAMS_EOF:
+        return end_prepare_params(r);
+
+    case PHASE_PCOLS:
+        if (--r->defs == 0) {
+            if (!r->deprecate_eof) {
+                r->phase = PHASE_PCOLS_EOF;
+                return RESP_AGAIN;
+            }
+            return RESP_DONE;
+        }
+        return RESP_AGAIN;
+
+    case PHASE_PCOLS_EOF:
+        return RESP_DONE;
+    }
+
+    return RESP_LOST;
+}
+
+
+void
+tc_mysql_resp_init(tc_mysql_resp_t *r, int kind, int deprecate_eof)
+{
+    tc_memzero(r, sizeof(tc_mysql_resp_t));
+
+    r->kind          = kind;
+    r->deprecate_eof = deprecate_eof;
+    r->seq_id        = 1;
+}
+
+
+/*
+ * Walk the bytes from *pos on. It stops right after the response is
+ * complete, so that what follows in the segment starts the next one.
+ * In the rows of a result set, a packet starting with 0xfe is the end
+ * unless it is 16M long, since a row can only start with 0xfe when its
+ * first value takes 16M or more.
+ */
+int
+tc_mysql_resp_parse(tc_mysql_resp_t *r, unsigned char **pos,
+        unsigned char *end)
+{
+    int            rc;
+    uint32_t       n, m;
+    unsigned char *p;
+
+    p = *pos;
+
+    for ( ;; ) {
+
+        if (r->hdr_len < MYSQL_HEADER_LEN) {
+            if (p == end) {
+                break;
+            }
+            r->hdr[r->hdr_len++] = *p++;
+            if (r->hdr_len < MYSQL_HEADER_LEN) {
+                continue;
+            }
+
+            if (r->hdr[3] != r->seq_id) {
+                *pos = p;
+                return RESP_LOST;
+            }
+            r->seq_id++;
+            r->pkt_len  = r->hdr[0] + (r->hdr[1] << 8) + (r->hdr[2] << 16);
+            r->pos      = 0;
+            r->peek_len = 0;
+            r->row      = (r->phase == PHASE_ROWS && r->large);
+        }
+
+        if (r->pos < r->pkt_len) {
+            if (p == end) {
+                break;
+            }
+
+            n = end - p;
+            if (n > r->pkt_len - r->pos) {
+                n = r->pkt_len - r->pos;
+            }
+
+            if (r->pos == 0 && r->phase == PHASE_ROWS && !r->large) {
+                r->row = !((p[0] == 0xfe && r->pkt_len < MYSQL_MAX_PACKET_LEN)
+                        || p[0] == 0xff);
+            }
+
+            if (r->pos < RESP_PEEK_LEN) {
+                m = n < RESP_PEEK_LEN - r->pos ? n : RESP_PEEK_LEN - r->pos;
+                memcpy(r->peek + r->pos, p, m);
+                r->peek_len = r->pos + m;
+            }
+
+            if (r->row) {
+                r->digest.crc = tc_crc32c(r->digest.crc, p, n);
+            }
+
+            r->pos += n;
+            p      += n;
+
+            if (r->pos < r->pkt_len) {
+                break;
+            }
+        }
+
+        r->hdr_len = 0;
+        rc = end_packet(r);
+        r->large = (r->pkt_len == MYSQL_MAX_PACKET_LEN);
+
+        if (rc != RESP_AGAIN) {
+            *pos = p;
+            return rc;
+        }
+    }
+
+    *pos = p;
+
+    return RESP_AGAIN;
+}
+
+
+static int
+load_digests(tc_mysql_digests_t *ds, char *path)
+{
+    int                    fd;
+    size_t                 i, num;
+    ssize_t                n;
+    struct stat            st;
+    unsigned char         *buf;
+    tc_mysql_digest_rec_t *recs;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        tc_log_info(LOG_ERR, errno, "open digest file:%s failed", path);
+        return TC_ERR;
+    }
+
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t) sizeof(DIGEST_FILE_MAGIC)
+            || (st.st_size - sizeof(DIGEST_FILE_MAGIC) + 1)
+            % sizeof(tc_mysql_digest_rec_t) != 0)
+    {
+        tc_log_info(LOG_ERR, 0, "digest file:%s is malformed", path);
+        close(fd);
+        return TC_ERR;
+    }
+
+    buf = tc_palloc(ds->pool, st.st_size);
+    if (buf == NULL) {
+        close(fd);
+        return TC_ERR;
+    }
+
+    n = read(fd, buf, st.st_size);
+    close(fd);
+
+    if (n != st.st_size || memcmp(buf, DIGEST_FILE_MAGIC,
+                sizeof(DIGEST_FILE_MAGIC) - 1) != 0)
+    {
+        tc_log_info(LOG_ERR, 0, "digest file:%s is malformed", path);
+        return TC_ERR;
+    }
+
+    recs = (tc_mysql_digest_rec_t *) (buf + sizeof(DIGEST_FILE_MAGIC) - 1);
+    num  = (st.st_size - sizeof(DIGEST_FILE_MAGIC) + 1)
+        / sizeof(tc_mysql_digest_rec_t);
+
+    for (i = 0; i < num; i++) {
+        hash_add(ds->table, ds->pool, recs[i].key, &recs[i]);
+    }
+    ds->num = num;
+
+    tc_log_info(LOG_NOTICE, 0, "%llu digests loaded from %s", ds->num, path);
+
+    return TC_OK;
+}
+
+
+int
+tc_mysql_digests_init(tc_mysql_digests_t *ds, int mode, char *path)
+{
+    tc_memzero(ds, sizeof(tc_mysql_digests_t));
+
+    ds->mode = mode;
+    ds->pool = tc_create_pool(TC_PLUGIN_POOL_SIZE, TC_PLUGIN_POOL_SUB_SIZE, 0);
+    if (ds->pool == NULL) {
+        return TC_ERR;
+    }
+
+    ds->table = hash_create(ds->pool, DIGEST_TABLE_SIZE);
+    if (ds->table == NULL) {
+        return TC_ERR;
+    }
+
+    if (mode == DIGEST_CHECK) {
+        return load_digests(ds, path);
+    }
+
+    ds->list = link_list_create(ds->pool);
+    if (ds->list == NULL) {
+        return TC_ERR;
+    }
+
+    return TC_OK;
+}
+
+
+tc_mysql_digest_rec_t *
+tc_mysql_digests_get(tc_mysql_digests_t *ds, uint64_t key)
+{
+    return hash_find(ds->table, key);
+}
+
+
+/*
+ * A request answered differently along the recording run, such as one
+ * reading the clock, is marked unstable and not checked later
+ */
+int
+tc_mysql_digests_record(tc_mysql_digests_t *ds, uint64_t key,
+        tc_mysql_digest_t *digest)
+{
+    tc_mysql_digest_rec_t  *rec;
+    tc_mysql_digest_node_t *dn;
+
+    rec = hash_find(ds->table, key);
+    if (rec != NULL) {
+        rec->hits++;
+        if (memcmp(&rec->digest, digest, sizeof(tc_mysql_digest_t)) != 0) {
+            rec->unstable = 1;
+        }
+        return TC_OK;
+    }
+
+    dn = tc_pcalloc(ds->pool, sizeof(tc_mysql_digest_node_t));
+    if (dn == NULL) {
+        return TC_ERR;
+    }
+
+    dn->rec.key    = key;
+    dn->rec.digest = *digest;
+    dn->rec.hits   = 1;
+    dn->node.data  = &dn->rec;
+    link_list_append(ds->list, &dn->node);
+    hash_add(ds->table, ds->pool, key, &dn->rec);
+    ds->num++;
+
+    return TC_OK;
+}
+
+
+int
+tc_mysql_digests_save(tc_mysql_digests_t *ds, char *path)
+{
+    char                   tmp[4096];
+    FILE                  *f;
+    p_link_node            ln;
+    tc_mysql_digest_rec_t *rec;
+
+    if (ds->list == NULL) {
+        return TC_OK;
+    }
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp)) {
+        return TC_ERR;
+    }
+
+    f = fopen(tmp, "w");
+    if (f == NULL) {
+        tc_log_info(LOG_WARN, errno, "open digest file:%s failed", tmp);
+        return TC_ERR;
+    }
+
+    fwrite(DIGEST_FILE_MAGIC, sizeof(DIGEST_FILE_MAGIC) - 1, 1, f);
+
+    ln = link_list_first(ds->list);
+    while (ln != NULL) {
+        rec = ln->data;
+        fwrite(rec, sizeof(tc_mysql_digest_rec_t), 1, f);
+        ln = link_list_get_next(ds->list, ln);
+    }
+
+    if (ferror(f) || fclose(f) != 0 || rename(tmp, path) == -1) {
+        tc_log_info(LOG_WARN, errno, "write digest file:%s failed", path);
+        return TC_ERR;
+    }
+
+    tc_log_info(LOG_NOTICE, 0, "%llu digests saved to %s", ds->num, path);
+
+    return TC_OK;
+}
+
+
+void
+tc_mysql_digests_exit(tc_mysql_digests_t *ds)
+{
+    if (ds->pool != NULL) {
+        tc_destroy_pool(ds->pool);
+        ds->pool  = NULL;
+        ds->table = NULL;
+        ds->list  = NULL;
+    }
+}
@@ -0,0 +1,98 @@
+#ifndef  DIGEST_INCLUDED
+#define  DIGEST_INCLUDED
+#include <xcopy.h>
+
+/* what a response turned out to be */
+#define RESP_TYPE_OK         1
+#define RESP_TYPE_ERR        2
+#define RESP_TYPE_RESULT     3
+#define RESP_TYPE_OTHER      4
+
+/* how the response to a command is laid out */
+#define RESP_KIND_RESULT     0
+#define RESP_KIND_PREPARE    1
+#define RESP_KIND_STRING     2
+
+/* what feeding bytes to a response parser ended with */
+#define RESP_AGAIN           0
+#define RESP_DONE            1
+#define RESP_LOST            2
+
+#define DIGEST_RECORD        1
+#define DIGEST_CHECK         2
+
+/* the peek covers an OK packet up to its status flags */
+#define RESP_PEEK_LEN        24
+
+/*
+ * A compact digest of one response. affected is the affected rows of an
+ * OK packet or the error code of an ERR packet, crc is the CRC32C of the
+ * bytes of every row. The responses to a multi statement add up.
+ */
+typedef struct {
+    uint64_t affected;
+    uint64_t rows;
+    uint32_t columns;
+    uint32_t crc;
+    uint32_t type;
+    uint32_t pad;
+} tc_mysql_digest_t;
+
+/*
+ * A response followed byte by byte as the segments come. Only the first
+ * RESP_PEEK_LEN bytes of a packet are kept to classify it, row bytes go
+ * straight into the crc.
+ */
+typedef struct {
+    uint32_t           phase;
+    uint32_t           kind:2;
+    uint32_t           deprecate_eof:1;
+    uint32_t           large:1;
+    uint32_t           row:1;
+    uint32_t           hdr_len;
+    uint32_t           pkt_len;
+    uint32_t           pos;
+    uint32_t           peek_len;
+    uint64_t           defs;
+    uint64_t           next_defs;
+    unsigned char      seq_id;
+    unsigned char      hdr[4];
+    unsigned char      peek[RESP_PEEK_LEN];
+    tc_mysql_digest_t  digest;
+} tc_mysql_resp_t;
+
+/* a digest kept for a request key, as it is laid out in the digest file */
+typedef struct {
+    uint64_t           key;
+    tc_mysql_digest_t  digest;
+    uint32_t           hits;
+    uint32_t           unstable;
+} tc_mysql_digest_rec_t;
+
+/*
+ * Digests by request key. A recording run keeps the records on a list to
+ * write them out, a checking run loads them once and only reads.
+ */
+typedef struct {
+    int          mode;
+    tc_pool_t   *pool;
+    hash_table  *table;
+    link_list   *list;
+    uint64_t     num;
+} tc_mysql_digests_t;
+
+uint32_t tc_crc32c(uint32_t crc, unsigned char *data, size_t len);
+
+void tc_mysql_resp_init(tc_mysql_resp_t *r, int kind, int deprecate_eof);
+int tc_mysql_resp_parse(tc_mysql_resp_t *r, unsigned char **pos,
+        unsigned char *end);
+
+int tc_mysql_digests_init(tc_mysql_digests_t *ds, int mode, char *path);
+tc_mysql_digest_rec_t *tc_mysql_digests_get(tc_mysql_digests_t *ds,
+        uint64_t key);
+int tc_mysql_digests_record(tc_mysql_digests_t *ds, uint64_t key,
+        tc_mysql_digest_t *digest);
+int tc_mysql_digests_save(tc_mysql_digests_t *ds, char *path);
+void tc_mysql_digests_exit(tc_mysql_digests_t *ds);
+
+#endif   /* ----- #ifndef DIGEST_INCLUDED  ----- */
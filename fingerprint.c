@@ -0,0 +1,797 @@
+
+#include <xcopy.h>
+#include "fingerprint.h"
+#if (defined __SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define C_PUNCT      0
+#define C_SPACE      1
+#define C_WORD       2
+#define C_DIGIT      3
+#define C_QUOTE      4
+#define C_BACKTICK   5
+#define C_SLASH      6
+#define C_DASH       7
+#define C_HASH       8
+
+typedef struct {
+    const char *word;
+    uint32_t    len;
+    int         cls;
+} sql_keyword_t;
+
+typedef struct {
+    char     *out;
+    uint32_t  len;
+    uint32_t  depth;
+    uint32_t  space:1;
+} fp_out_t;
+
+static unsigned char byte_class[256];
+static int           byte_class_ready;
+
+/* leading keywords, any other is SQL_CLASS_OTHER */
+#define KEYWORD(w, c) { w, sizeof(w) - 1, c }
+static sql_keyword_t sql_keywords[] = {
+    KEYWORD("select", SQL_CLASS_READ),
+    KEYWORD("show", SQL_CLASS_READ),
+    KEYWORD("describe", SQL_CLASS_READ),
+    KEYWORD("desc", SQL_CLASS_READ),
+    KEYWORD("explain", SQL_CLASS_READ),
+    KEYWORD("with", SQL_CLASS_READ),      /* by what follows, see below */
+    KEYWORD("table", SQL_CLASS_READ),
+    KEYWORD("values", SQL_CLASS_READ),
+    KEYWORD("do", SQL_CLASS_READ),
+    KEYWORD("insert", SQL_CLASS_WRITE),
+    KEYWORD("update", SQL_CLASS_WRITE),
+    KEYWORD("delete", SQL_CLASS_WRITE),
+    KEYWORD("replace", SQL_CLASS_WRITE),
+    KEYWORD("load", SQL_CLASS_WRITE),
+    KEYWORD("call", SQL_CLASS_WRITE),
+    KEYWORD("create", SQL_CLASS_DDL),
+    KEYWORD("alter", SQL_CLASS_DDL),
+    KEYWORD("drop", SQL_CLASS_DDL),
+    KEYWORD("truncate", SQL_CLASS_DDL),
+    KEYWORD("rename", SQL_CLASS_DDL),
+    KEYWORD("grant", SQL_CLASS_DDL),
+    KEYWORD("revoke", SQL_CLASS_DDL),
+    KEYWORD("optimize", SQL_CLASS_DDL),
+    KEYWORD("repair", SQL_CLASS_DDL),
+    KEYWORD("analyze", SQL_CLASS_DDL),
+    KEYWORD("import", SQL_CLASS_DDL),
+    KEYWORD("begin", SQL_CLASS_TXN),
+    KEYWORD("start", SQL_CLASS_TXN),
+    KEYWORD("commit", SQL_CLASS_TXN),
+    KEYWORD("rollback", SQL_CLASS_TXN),
+    KEYWORD("savepoint", SQL_CLASS_TXN),
+    KEYWORD("release", SQL_CLASS_TXN),
+    KEYWORD("xa", SQL_CLASS_TXN),
+    KEYWORD("lock", SQL_CLASS_TXN),
+    KEYWORD("unlock", SQL_CLASS_TXN)
+};
+
+#define SQL_KEYWORD_NUM (sizeof(sql_keywords) / sizeof(sql_keywords[0]))
+#define SQL_KEYWORD_LEN 16
+
+
+static void
+init_byte_class(void)
+{
+    int c;
+
+    for (c = 0; c < 256; c++) {
+        if (c >= 0x80 || c == '_' || c == '$' || (c >= 'a' && c <= 'z')
+                || (c >= 'A' && c <= 'Z'))
+        {
+            byte_class[c] = C_WORD;
+        } else if (c >= '0' && c <= '9') {
+            byte_class[c] = C_DIGIT;
+        } else if (c == ' ' || c == '\t' || c == '\r' || c == '\n'
+                || c == '\f' || c == '\v')
+        {
+            byte_class[c] = C_SPACE;
+        } else {
+            byte_class[c] = C_PUNCT;
+        }
+    }
+
+    byte_class['\''] = C_QUOTE;
+    byte_class['"']  = C_QUOTE;
+    byte_class['`']  = C_BACKTICK;
+    byte_class['/']  = C_SLASH;
+    byte_class['-']  = C_DASH;
+    byte_class['#']  = C_HASH;
+
+    byte_class_ready = 1;
+}
+
+
+/*
+ * Find the closing quote q from p on, skipping escapes and doubled
+ * quotes; literals are the bulk of the bytes of most statements, so they
+ * are scanned 16 bytes at a time
+ */
+static uint32_t
+skip_quoted(unsigned char *s, uint32_t p, uint32_t n, unsigned char q)
+{
+#if (defined __SSE2__)
+    int      mask;
+    __m128i  vq, vb, v;
+
+    vq = _mm_set1_epi8((char) q);
+    vb = _mm_set1_epi8('\\');
+#endif
+
+    while (p < n) {
+#if (defined __SSE2__)
+        while (p + 16 <= n) {
+            v    = _mm_loadu_si128((__m128i *) (s + p));
+            mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, vq),
+                        _mm_cmpeq_epi8(v, vb)));
+            if (mask != 0) {
+                p += __builtin_ctz(mask);
+                break;
+            }
+            p += 16;
+        }
+        if (p >= n) {
+            break;
+        }
+#endif
+        if (s[p] == '\\') {
+            p += 2;
+        } else if (s[p] == q) {
+            if (p + 1 < n && s[p + 1] == q) {
+                p += 2;
+            } else {
+                return p + 1;
+            }
+        } else {
+            p++;
+        }
+    }
+
+    return n;
+}
+
+
+static uint32_t
+skip_number(unsigned char *s, uint32_t p, uint32_t n)
+{
+    if (p + 1 < n && s[p] == '0' && (s[p + 1] == 'x' || s[p + 1] == 'X')) {
+        p += 2;
+        while (p < n && (byte_class[s[p]] == C_DIGIT
+                    || ((s[p] | 0x20) >= 'a' && (s[p] | 0x20) <= 'f')))
+        {
+            p++;
+        }
+        return p;
+    }
+
+    while (p < n && (byte_class[s[p]] == C_DIGIT || s[p] == '.')) {
+        p++;
+    }
+
+    if (p + 1 < n && (s[p] == 'e' || s[p] == 'E')
+            && (byte_class[s[p + 1]] == C_DIGIT
+                || ((s[p + 1] == '-' || s[p + 1] == '+') && p + 2 < n
+                    && byte_class[s[p + 2]] == C_DIGIT)))
+    {
+        p += 2;
+        while (p < n && byte_class[s[p]] == C_DIGIT) {
+            p++;
+        }
+    }
+
+    return p;
+}
+
+
+static int
+is_wordish(char c)
+{
+    unsigned char u = (unsigned char) c;
+
+    return byte_class[u] == C_WORD || byte_class[u] == C_DIGIT || c == '?'
+        || c == '`' || c == '*';
+}
+
+
+/* a space is kept only where two words, or a word and a *, would meet */
+static void
+start_token(fp_out_t *o, int word)
+{
+    if (o->space && word && o->len > 0 && is_wordish(o->out[o->len - 1])) {
+        o->out[o->len++] = ' ';
+    }
+    o->space = 0;
+}
+
+
+/* ?,?,? within parentheses is one ?, and (?),(?) is one (?) */
+static void
+put_literal(fp_out_t *o)
+{
+    start_token(o, 1);
+
+    if (o->depth > 0 && o->len >= 2 && o->out[o->len - 1] == ','
+            && o->out[o->len - 2] == '?')
+    {
+        o->len--;
+        return;
+    }
+
+    o->out[o->len++] = '?';
+}
+
+
+static void
+put_punct(fp_out_t *o, char c)
+{
+    start_token(o, c == '*');
+    o->out[o->len++] = c;
+
+    if (c == '(') {
+        o->depth++;
+
+    } else if (c == ')') {
+        if (o->depth > 0) {
+            o->depth--;
+        }
+        if (o->len >= 7 && memcmp(o->out + o->len - 7, "(?),(?)", 7) == 0) {
+            o->len -= 4;
+        }
+    }
+}
+
+
+/*
+ * Reduce a statement to its shape: literals become ?, lists of them
+ * collapse, comments go, words are lowercased and white space is kept
+ * only between words. The fingerprint is the FNV-1a hash of the shape.
+ */
+uint64_t
+tc_mysql_fingerprint(unsigned char *s, uint32_t n, char *norm,
+        uint32_t *norm_len)
+{
+    uint32_t  p, q, i;
+    uint64_t  hash;
+    fp_out_t  o;
+
+    if (!byte_class_ready) {
+        init_byte_class();
+    }
+
+    if (n > FP_SCAN_LEN) {
+        n = FP_SCAN_LEN;
+    }
+
+    o.out   = norm;
+    o.len   = 0;
+    o.depth = 0;
+    o.space = 0;
+    p = 0;
+
+    while (p < n && o.len < FP_NORM_LEN - 8) {
+
+        switch (byte_class[s[p]]) {
+
+        case C_SPACE:
+            o.space = 1;
+            p++;
+            break;
+
+        case C_WORD:
+            start_token(&o, 1);
+            while (p < n && (byte_class[s[p]] == C_WORD
+                        || byte_class[s[p]] == C_DIGIT)
+                    && o.len < FP_NORM_LEN - 8)
+            {
+                o.out[o.len++] = (s[p] >= 'A' && s[p] <= 'Z') ?
+                    s[p] | 0x20 : s[p];
+                p++;
+            }
+            break;
+
+        case C_DIGIT:
+            p = skip_number(s, p, n);
+            put_literal(&o);
+            break;
+
+        case C_QUOTE:
+            p = skip_quoted(s, p + 1, n, s[p]);
+            put_literal(&o);
+            break;
+
+        case C_BACKTICK:
+            start_token(&o, 1);
+            q = p + 1;
+            while (q < n && s[q] != '`') {
+                q++;
+            }
+            for (i = p; i <= q && i < n && o.len < FP_NORM_LEN - 8; i++) {
+                o.out[o.len++] = s[i];
+            }
+            p = q + 1;
+            break;
+
+        case C_SLASH:
+            if (p + 1 < n && s[p + 1] == '*') {
+                for (p += 2; p + 1 < n; p++) {
+                    if (s[p] == '*' && s[p + 1] == '/') {
+                        break;
+                    }
+                }
+                p += 2;
+                o.space = 1;
+            } else {
+                put_punct(&o, s[p++]);
+            }
+            break;
+
+        case C_DASH:
+            if (p + 1 < n && s[p + 1] == '-'
+                    && (p + 2 == n || s[p + 2] <= ' '))
+            {
+                while (p < n && s[p] != '\n') {
+                    p++;
+                }
+                o.space = 1;
+            } else {
+                put_punct(&o, s[p++]);
+            }
+            break;
+
+        case C_HASH:
+            while (p < n && s[p] != '\n') {
+                p++;
+            }
+            o.space = 1;
+            break;
+
+        default:
+            if (s[p] == '.' && p + 1 < n && byte_class[s[p + 1]] == C_DIGIT
+                    && (o.len == 0 || !is_wordish(o.out[o.len - 1])))
+            {
+                p = skip_number(s, p, n);
+                put_literal(&o);
+            } else {
+                put_punct(&o, s[p++]);
+            }
+            break;
+        }
+    }
+
+    hash = 14695981039346656037ULL;
+    for (i = 0; i < o.len; i++) {
+        hash ^= (unsigned char) o.out[i];
+        hash *= 1099511628211ULL;
+    }
+
+    *norm_len = o.len;
+
+    return hash ? hash : 1;
+}
+
+
+/*
+ * Past white space and comments. The body of an executable comment is
+ * run by the server, so it is looked into rather than skipped.
+ */
+static uint32_t
+skip_blank(unsigned char *s, uint32_t p, uint32_t n)
+{
+    while (p < n) {
+        if (byte_class[s[p]] == C_SPACE) {
+            p++;
+
+        } else if (s[p] == '/' && p + 1 < n && s[p + 1] == '*') {
+            if (p + 2 < n && s[p + 2] == '!') {
+                for (p += 3; p < n && byte_class[s[p]] == C_DIGIT; p++) {
+                    /* the version the body is for */
+                }
+                continue;
+            }
+            for (p += 2; p + 1 < n; p++) {
+                if (s[p] == '*' && s[p + 1] == '/') {
+                    break;
+                }
+            }
+            p += 2;
+
+        } else if ((s[p] == '-' && p + 2 < n && s[p + 1] == '-'
+                    && s[p + 2] <= ' ') || s[p] == '#')
+        {
+            while (p < n && s[p] != '\n') {
+                p++;
+            }
+
+        } else {
+            break;
+        }
+    }
+
+    return p < n ? p : n;
+}
+
+
+/* the class of the word at p, SQL_CLASS_NONE if p is at no word */
+static int
+word_class(unsigned char *s, uint32_t p, uint32_t n, uint32_t *len)
+{
+    char      word[SQL_KEYWORD_LEN];
+    uint32_t  i, k;
+
+    for (k = 0; p + k < n && byte_class[s[p + k]] == C_WORD; k++) {
+        if (k < SQL_KEYWORD_LEN) {
+            word[k] = s[p + k] | 0x20;
+        }
+    }
+
+    *len = k;
+    if (k == 0) {
+        return SQL_CLASS_NONE;
+    }
+
+    for (i = 0; k <= SQL_KEYWORD_LEN && i < SQL_KEYWORD_NUM; i++) {
+        if (sql_keywords[i].len == k
+                && memcmp(sql_keywords[i].word, word, k) == 0)
+        {
+            return sql_keywords[i].cls;
+        }
+    }
+
+    return SQL_CLASS_OTHER;
+}
+
+
+/*
+ * A statement starting with WITH is classed by the statement its common
+ * table expressions are for: name [(columns)] AS (query), ... then a
+ * SELECT, TABLE or VALUES, an UPDATE or a DELETE, or a query within
+ * parentheses. Text cut before that statement is taken for a write, so
+ * that a filter of writes does not let one through.
+ */
+static int
+classify_with(unsigned char *s, uint32_t p, uint32_t n)
+{
+    int       cls, closed;
+    uint32_t  len, depth;
+
+    depth  = 0;
+    closed = 0;
+
+    while ((p = skip_blank(s, p, n)) < n) {
+        if (byte_class[s[p]] == C_QUOTE || byte_class[s[p]] == C_BACKTICK) {
+            p = skip_quoted(s, p + 1, n, s[p]);
+            continue;
+        }
+
+        if (depth > 0) {
+            if (s[p] == '(') {
+                depth++;
+            } else if (s[p] == ')' && --depth == 0) {
+                closed = 1;
+            }
+            p++;
+            continue;
+        }
+
+        if (s[p] == '(') {
+            if (closed) {
+                return SQL_CLASS_READ;
+            }
+            depth++;
+            p++;
+            continue;
+        }
+
+        cls = word_class(s, p, n, &len);
+        if (len == 0) {
+            /* a comma goes on to the next expression */
+            closed = 0;
+            p++;
+            continue;
+        }
+
+        if (closed && (len != 2 || (s[p] | 0x20) != 'a'
+                    || (s[p + 1] | 0x20) != 's'))
+        {
+            return cls;
+        }
+        closed = 0;
+        p += len;
+    }
+
+    return SQL_CLASS_WRITE;
+}
+
+
+/*
+ * The class of a statement by its leading keyword, past white space,
+ * comments and opening parentheses
+ */
+int
+tc_mysql_classify(unsigned char *s, uint32_t n)
+{
+    int       cls;
+    uint32_t  p, len;
+
+    if (!byte_class_ready) {
+        init_byte_class();
+    }
+
+    p = skip_blank(s, 0, n);
+    while (p < n && s[p] == '(') {
+        p = skip_blank(s, p + 1, n);
+    }
+
+    cls = word_class(s, p, n, &len);
+    if (cls == SQL_CLASS_NONE) {
+        return SQL_CLASS_OTHER;
+    }
+
+    if (len == 4 && strncasecmp((char *) s + p, "with", 4) == 0) {
+        return classify_with(s, p + len, n);
+    }
+
+    return cls;
+}
+
+
+int
+tc_mysql_top_init(tc_mysql_top_t *top, tc_pool_t *pool, uint32_t size)
+{
+    uint32_t slots;
+
+    tc_memzero(top, sizeof(tc_mysql_top_t));
+
+    /* at most half of the index is used */
+    for (slots = 2; slots < size * 2; slots <<= 1) {
+        /* void */
+    }
+
+    top->size    = size;
+    top->mask    = slots - 1;
+    top->heap    = tc_palloc(pool, size * sizeof(uint32_t));
+    top->index   = tc_pcalloc(pool, slots * sizeof(uint32_t));
+    top->entries = tc_pcalloc(pool, size * sizeof(tc_mysql_top_entry_t));
+
+    if (top->heap == NULL || top->index == NULL || top->entries == NULL) {
+        return TC_ERR;
+    }
+
+    return TC_OK;
+}
+
+
+tc_mysql_top_entry_t *
+tc_mysql_top_find(tc_mysql_top_t *top, uint64_t fp)
+{
+    uint32_t              slot;
+    tc_mysql_top_entry_t *e;
+
+    for (slot = fp & top->mask; top->index[slot] != 0;
+            slot = (slot + 1) & top->mask)
+    {
+        e = &top->entries[top->index[slot] - 1];
+        if (e->fp == fp) {
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+
+static void
+index_add(tc_mysql_top_t *top, uint64_t fp, uint32_t i)
+{
+    uint32_t slot;
+
+    for (slot = fp & top->mask; top->index[slot] != 0;
+            slot = (slot + 1) & top->mask)
+    {
+        /* void */
+    }
+
+    top->index[slot] = i + 1;
+}
+
+
+/* deletion by shifting back the entries probed past the hole */
+static void
+index_del(tc_mysql_top_t *top, uint64_t fp)
+{
+    uint32_t i, j, home;
+
+    for (i = fp & top->mask; top->entries[top->index[i] - 1].fp != fp;
+            i = (i + 1) & top->mask)
+    {
+        /* void */
+    }
+
+    for (j = (i + 1) & top->mask; top->index[j] != 0;
+            j = (j + 1) & top->mask)
+    {
+        home = top->entries[top->index[j] - 1].fp & top->mask;
+        if (((j - home) & top->mask) >= ((j - i) & top->mask)) {
+            top->index[i] = top->index[j];
+            i = j;
+        }
+    }
+
+    top->index[i] = 0;
+}
+
+
+static void
+heap_swap(tc_mysql_top_t *top, uint32_t a, uint32_t b)
+{
+    uint32_t t;
+
+    t = top->heap[a];
+    top->heap[a] = top->heap[b];
+    top->heap[b] = t;
+    top->entries[top->heap[a]].heap_pos = a;
+    top->entries[top->heap[b]].heap_pos = b;
+}
+
+
+static void
+heap_down(tc_mysql_top_t *top, uint32_t i)
+{
+    uint32_t l, m;
+
+    for ( ;; ) {
+        m = i;
+        l = 2 * i + 1;
+        if (l < top->num && top->entries[top->heap[l]].count
+                < top->entries[top->heap[m]].count)
+        {
+            m = l;
+        }
+        if (l + 1 < top->num && top->entries[top->heap[l + 1]].count
+                < top->entries[top->heap[m]].count)
+        {
+            m = l + 1;
+        }
+        if (m == i) {
+            return;
+        }
+        heap_swap(top, i, m);
+        i = m;
+    }
+}
+
+
+static void
+heap_up(tc_mysql_top_t *top, uint32_t i)
+{
+    uint32_t parent;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (top->entries[top->heap[parent]].count
+                <= top->entries[top->heap[i]].count)
+        {
+            return;
+        }
+        heap_swap(top, i, parent);
+        i = parent;
+    }
+}
+
+
+/*
+ * Track a statement not tracked yet. Once the entries are all in use,
+ * the least counted one is taken over and its count carried on as the
+ * error of the newcomer, as space-saving does.
+ */
+tc_mysql_top_entry_t *
+tc_mysql_top_add(tc_mysql_top_t *top, uint64_t fp, char *text,
+        uint32_t text_len)
+{
+    uint32_t              i, j;
+    tc_mysql_top_entry_t *e;
+
+    if (top->num < top->size) {
+        i = top->num;
+        e = &top->entries[i];
+        e->count    = 0;
+        e->error    = 0;
+        e->heap_pos = top->num;
+        top->heap[top->num++] = i;
+        heap_up(top, e->heap_pos);
+    } else {
+        i = top->heap[0];
+        e = &top->entries[i];
+        index_del(top, e->fp);
+        e->error = e->count;
+    }
+
+    e->fp        = fp;
+    e->bytes     = 0;
+    e->resp_usec = 0;
+    e->resp_num  = 0;
+    e->text_len  = text_len < FP_TEXT_LEN ? text_len : FP_TEXT_LEN - 1;
+
+    /* quoted names may hold anything, the text goes to a line of its own */
+    for (j = 0; j < e->text_len; j++) {
+        e->text[j] = (unsigned char) text[j] < 0x20 ? '.' : text[j];
+    }
+    e->text[e->text_len] = '\0';
+
+    index_add(top, fp, i);
+
+    return e;
+}
+
+
+void
+tc_mysql_top_hit(tc_mysql_top_t *top, tc_mysql_top_entry_t *e,
+        uint64_t bytes)
+{
+    e->count++;
+    e->bytes += bytes;
+    heap_down(top, e->heap_pos);
+}
+
+
+static int
+cmp_fp(const void *a, const void *b)
+{
+    const tc_mysql_top_entry_t *x = a, *y = b;
+
+    return x->fp < y->fp ? -1 : x->fp > y->fp;
+}
+
+
+static int
+cmp_count(const void *a, const void *b)
+{
+    const tc_mysql_top_entry_t *x = a, *y = b;
+
+    return x->count > y->count ? -1 : x->count < y->count;
+}
+
+
+/*
+ * Add up the summaries of several shards into out, heaviest first. out
+ * has room for the entries of all of them.
+ */
+uint32_t
+tc_mysql_top_merge(tc_mysql_top_t **tops, uint32_t num,
+        tc_mysql_top_entry_t *out)
+{
+    uint32_t i, n, m;
+
+    n = 0;
+    for (i = 0; i < num; i++) {
+        memcpy(out + n, tops[i]->entries,
+                tops[i]->num * sizeof(tc_mysql_top_entry_t));
+        n += tops[i]->num;
+    }
+
+    if (num > 1 && n > 0) {
+        qsort(out, n, sizeof(tc_mysql_top_entry_t), cmp_fp);
+
+        for (i = 1, m = 0; i < n; i++) {
+            if (out[i].fp == out[m].fp) {
+                out[m].count     += out[i].count;
+                out[m].error     += out[i].error;
+                out[m].bytes     += out[i].bytes;
+                out[m].resp_usec += out[i].resp_usec;
+                out[m].resp_num  += out[i].resp_num;
+            } else if (++m != i) {
+                out[m] = out[i];
+            }
+        }
+        n = m + 1;
+    }
+
+    qsort(out, n, sizeof(tc_mysql_top_entry_t), cmp_count);
+
+    return n;
+}
@@ -0,0 +1,64 @@
+#ifndef  FINGERPRINT_INCLUDED
+#define  FINGERPRINT_INCLUDED
+#include <xcopy.h>
+
+/* only the start of a statement is normalized */
+#define FP_SCAN_LEN      8192
+#define FP_NORM_LEN      1024
+#define FP_TEXT_LEN      256
+#define DEFAULT_TOP_NUM  256
+#define MAX_TOP_NUM      65536
+
+/* statement classes, SQL_CLASS_NONE while a statement is not classified */
+#define SQL_CLASS_NONE   0
+#define SQL_CLASS_READ   1
+#define SQL_CLASS_WRITE  2
+#define SQL_CLASS_DDL    3
+#define SQL_CLASS_TXN    4
+#define SQL_CLASS_OTHER  5
+
+/*
+ * A statement tracked by the space-saving summary: count may be
+ * overestimated by at most error, the count of the entry it replaced.
+ * bytes and the response times are those seen since it was tracked.
+ */
+typedef struct {
+    uint64_t fp;
+    uint64_t count;
+    uint64_t error;
+    uint64_t bytes;
+    uint64_t resp_usec;
+    uint64_t resp_num;
+    uint32_t heap_pos;
+    uint32_t text_len;
+    char     text[FP_TEXT_LEN];
+} tc_mysql_top_entry_t;
+
+/*
+ * The heaviest statements in a fixed number of entries. heap keeps the
+ * entries in order of count, the least counted on top to be replaced,
+ * index finds an entry by fingerprint with linear probing.
+ */
+typedef struct {
+    uint32_t              size;
+    uint32_t              num;
+    uint32_t              mask;
+    uint32_t             *heap;
+    uint32_t             *index;
+    tc_mysql_top_entry_t *entries;
+} tc_mysql_top_t;
+
+uint64_t tc_mysql_fingerprint(unsigned char *sql, uint32_t len, char *norm,
+        uint32_t *norm_len);
+int tc_mysql_classify(unsigned char *sql, uint32_t len);
+
+int tc_mysql_top_init(tc_mysql_top_t *top, tc_pool_t *pool, uint32_t size);
+tc_mysql_top_entry_t *tc_mysql_top_find(tc_mysql_top_t *top, uint64_t fp);
+tc_mysql_top_entry_t *tc_mysql_top_add(tc_mysql_top_t *top, uint64_t fp,
+        char *text, uint32_t text_len);
+void tc_mysql_top_hit(tc_mysql_top_t *top, tc_mysql_top_entry_t *e,
+        uint64_t bytes);
+uint32_t tc_mysql_top_merge(tc_mysql_top_t **tops, uint32_t num,
+        tc_mysql_top_entry_t *out);
+
+#endif   /* ----- #ifndef FINGERPRINT_INCLUDED  ----- */
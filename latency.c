@@ -0,0 +1,154 @@
+
+#include <xcopy.h>
+#include "latency.h"
+
+static const char *command_names[LAT_CMD_NUM] = {
+    "other",
+    "quit",
+    "init_db",
+    "query",
+    "field_list",
+    "create_db",
+    "drop_db",
+    "refresh",
+    "shutdown",
+    "statistics",
+    "process_info",
+    "connect",
+    "process_kill",
+    "debug",
+    "ping",
+    "time",
+    "delayed_insert",
+    "change_user",
+    "binlog_dump",
+    "table_dump",
+    "connect_out",
+    "register_slave",
+    "stmt_prepare",
+    "stmt_execute",
+    "stmt_send_long_data",
+    "stmt_close",
+    "stmt_reset",
+    "set_option",
+    "stmt_fetch",
+    "daemon",
+    "binlog_dump_gtid",
+    "reset_connection"
+};
+
+
+uint64_t
+tc_mysql_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+const char *
+tc_mysql_command_name(uint32_t command)
+{
+    return command_names[command < LAT_CMD_NUM ? command : 0];
+}
+
+
+static uint32_t
+get_bucket(uint64_t value)
+{
+    uint32_t msb;
+
+    if (value < (1 << LAT_SUB_BITS)) {
+        return value;
+    }
+
+    msb = 63 - __builtin_clzll(value);
+    if (msb >= LAT_MAX_BITS) {
+        return LAT_BUCKET_NUM - 1;
+    }
+
+    return ((msb - LAT_SUB_BITS + 1) << LAT_SUB_BITS)
+        + (value >> (msb - LAT_SUB_BITS)) - (1 << LAT_SUB_BITS);
+}
+
+
+/* the middle of the values a bucket holds */
+static uint64_t
+get_bucket_value(uint32_t i)
+{
+    uint32_t shift;
+    uint64_t sub;
+
+    if (i < (1 << LAT_SUB_BITS)) {
+        return i;
+    }
+
+    shift = (i >> LAT_SUB_BITS) - 1;
+    sub   = (i & ((1 << LAT_SUB_BITS) - 1)) + (1 << LAT_SUB_BITS);
+
+    return (sub << shift) + ((1ULL << shift) >> 1);
+}
+
+
+void
+tc_mysql_hist_add(tc_mysql_hist_t *h, uint64_t value)
+{
+    h->buckets[get_bucket(value)]++;
+    h->count++;
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+
+
+void
+tc_mysql_hist_sum(tc_mysql_hist_t *to, tc_mysql_hist_t *from)
+{
+    uint32_t i;
+
+    if (from->count == 0) {
+        return;
+    }
+
+    for (i = 0; i < LAT_BUCKET_NUM; i++) {
+        to->buckets[i] += from->buckets[i];
+    }
+    to->count += from->count;
+    if (from->max > to->max) {
+        to->max = from->max;
+    }
+}
+
+
+uint64_t
+tc_mysql_hist_percentile(tc_mysql_hist_t *h, double q)
+{
+    uint32_t i;
+    uint64_t rank, seen;
+
+    if (h->count == 0) {
+        return 0;
+    }
+
+    rank = (uint64_t) ceil(q * h->count);
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    seen = 0;
+    for (i = 0; i < LAT_BUCKET_NUM; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            break;
+        }
+    }
+
+    if (i == LAT_BUCKET_NUM - 1 || get_bucket_value(i) > h->max) {
+        return h->max;
+    }
+
+    return get_bucket_value(i);
+}
@@ -0,0 +1,30 @@
+#ifndef  LATENCY_INCLUDED
+#define  LATENCY_INCLUDED
+#include <xcopy.h>
+
+/* commands are counted by their byte, unknown ones under COM_SLEEP */
+#define LAT_CMD_NUM      32
+
+/*
+ * Log-linear buckets: values below 2^LAT_SUB_BITS have a bucket each,
+ * every power of two above is split into 2^LAT_SUB_BITS buckets, so a
+ * bucket is at most 1/16 of its values wide. Microseconds up to 2^32,
+ * about 71 minutes, are covered; longer ones go to the last bucket.
+ */
+#define LAT_SUB_BITS     4
+#define LAT_MAX_BITS     32
+#define LAT_BUCKET_NUM   ((LAT_MAX_BITS - LAT_SUB_BITS + 1) << LAT_SUB_BITS)
+
+typedef struct {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[LAT_BUCKET_NUM];
+} tc_mysql_hist_t;
+
+uint64_t tc_mysql_usec(void);
+const char *tc_mysql_command_name(uint32_t command);
+void tc_mysql_hist_add(tc_mysql_hist_t *h, uint64_t value);
+void tc_mysql_hist_sum(tc_mysql_hist_t *to, tc_mysql_hist_t *from);
+uint64_t tc_mysql_hist_percentile(tc_mysql_hist_t *h, double q);
+
+#endif   /* ----- #ifndef LATENCY_INCLUDED  ----- */
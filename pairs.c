@@ -1,95 +1,246 @@
 
 #include <xcopy.h>
+#include <pthread.h>
 #include "pairs.h"
 
-static hash_table *user_pwd_table = NULL;
-static hash_table *user_map_table = NULL;
+#define MAX_DISP_TRIES 65536
+#define MAX_USER_FILE_LEN (16 * 1024 * 1024)
+
+/*
+ * The user directive is compiled at load time into an immutable table
+ * addressed by a perfect hash: the name hash picks a bucket, the bucket's
+ * displacement picks the slot, and no two users share a slot. A login
+ * costs one hash over the name and one strcmp.
+ */
+static mysql_user_table *user_table = NULL;
+static uint32_t          user_table_gen = 0;
+
+/*
+ * With a user file, every table compiled from it has a pool of its own.
+ * A table that is swapped out is kept until the next check, so that a
+ * user looked up from it is never freed under its reader. A mysql_user
+ * kept past the callback that looked it up, as a session keeps its own
+ * for the second auth, is kept with the generation of the table it came
+ * from and only used while that table is installed: user_table_gen moves
+ * on with every install, before the table it replaces is retired.
+ *
+ * Reading and compiling a changed file costs a SHA1 and a SHA256 stage per
+ * user and the placement of the perfect hash, far too long for a timer
+ * tick on the packet thread with a large file. A tick only starts a loader
+ * thread on the file; the thread fills a pool the tick created and no one
+ * else touches until load_state says it is done, and a later tick installs
+ * the table. Pools are only ever created and destroyed on the packet
+ * thread.
+ */
+#define LOAD_IDLE    0
+#define LOAD_RUNNING 1
+#define LOAD_DONE    2
+
+static char             *user_file = NULL;
+static time_t            user_file_mtime = 0;
+static off_t             user_file_size = 0;
+static tc_pool_t        *user_table_pool = NULL;
+static tc_pool_t        *retired_pool = NULL;
+
+static pthread_t         loader;
+static int               load_state = LOAD_IDLE;
+static tc_pool_t        *load_pool = NULL;
+static mysql_user_table *load_table = NULL;
+static struct stat       load_st;
+static uint64_t          load_usec = 0;
 
 static uint64_t
 get_key_from_user(char *user)
 {
-    size_t   len, i;
-    uint64_t key = 0;
+    uint64_t key = 14695981039346656037ULL;
 
     if (user == NULL) {
         return key;
     }
 
-    len = strlen(user);
-    for (i = 0; i < len; i++ ) {   
-        key = 31*key + user[i];
-    }   
+    while (*user) {
+        key ^= (unsigned char) *user++;
+        key *= 1099511628211ULL;
+    }
 
     return key;
 }
 
-char* 
-retrieve_user_map(char *user)
+static uint32_t
+get_slot(uint64_t key, uint32_t disp, uint32_t slot_num)
 {
+    key ^= (uint64_t) disp * 0x9e3779b97f4a7c15ULL;
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+
+    return (uint32_t) (key % slot_num);
+}
+
+mysql_user *
+retrieve_user_info(char *user)
+{
+    uint32_t    slot;
     uint64_t    key;
     mysql_user *p_user_info;
 
-    if (user_pwd_table == NULL) {
+    if (user_table == NULL) {
         tc_log_info(LOG_ERR, 0, "empty user info in conf/plugin.conf");
         fprintf(stderr, "empty user info in conf/plugin.conf\n");
         return NULL;
     }
 
-    key         = get_key_from_user(user);
-    p_user_info = hash_find(user_pwd_table, key);
+    key  = get_key_from_user(user);
+    slot = get_slot(key, user_table->disp[key % user_table->bucket_num],
+            user_table->slot_num);
+    p_user_info = user_table->slots[slot];
 
-    while (p_user_info) {
-        if (strcmp(p_user_info->user, user) == 0) {
-            return p_user_info->map_user;
-        }
-        p_user_info = p_user_info->next;
+    if (p_user_info != NULL && strcmp(p_user_info->user, user) == 0) {
+        return p_user_info;
     }
 
     return NULL;
 }
-char *
-retrieve_user_pwd(char *user)
+
+static int
+place_bucket(mysql_user_table *table, mysql_user *bucket, uint32_t disp,
+        uint32_t *slots)
 {
-    uint64_t    key;
-    mysql_user *p_user_info;
+    uint32_t    i, n = 0;
+    mysql_user *p;
 
-    if (user_pwd_table == NULL) {
-        tc_log_info(LOG_ERR, 0, "empty user info in conf/plugin.conf");
-        fprintf(stderr, "empty user info in conf/plugin.conf\n");
+    for (p = bucket; p; p = p->next) {
+        slots[n] = get_slot(get_key_from_user(p->user), disp, table->slot_num);
+        if (table->slots[slots[n]] != NULL) {
+            return 0;
+        }
+        for (i = 0; i < n; i++) {
+            if (slots[i] == slots[n]) {
+                return 0;
+            }
+        }
+        n++;
+    }
+
+    n = 0;
+    for (p = bucket; p; p = p->next) {
+        table->slots[slots[n++]] = p;
+    }
+
+    return 1;
+}
+
+static mysql_user_table *
+compile_user_table(tc_pool_t *pool, mysql_user *users, uint32_t user_num)
+{
+    uint32_t          i, j, size, max_size, disp, *slots, *sizes;
+    mysql_user       *p, *q, *next, **buckets;
+    mysql_user_table *table;
+
+    table = tc_pcalloc(pool, sizeof(mysql_user_table));
+    if (table == NULL) {
         return NULL;
     }
 
-    key         = get_key_from_user(user);
-    p_user_info = hash_find(user_pwd_table, key);
+    table->bucket_num = user_num / 4 + 1;
+    table->slot_num   = user_num + user_num / 4 + 1;
+    table->disp  = tc_pcalloc(pool, table->bucket_num * sizeof(uint32_t));
+    table->slots = tc_pcalloc(pool, table->slot_num * sizeof(mysql_user *));
+    buckets = tc_pcalloc(pool, table->bucket_num * sizeof(mysql_user *));
+    sizes   = tc_pcalloc(pool, table->bucket_num * sizeof(uint32_t));
+    if (table->disp == NULL || table->slots == NULL || buckets == NULL
+            || sizes == NULL) 
+    {
+        return NULL;
+    }
+
+    max_size = 0;
+    for (p = users; p; p = next) {
+        next = p->next;
+        i = get_key_from_user(p->user) % table->bucket_num;
+
+        for (q = buckets[i]; q; q = q->next) {
+            if (strcmp(q->user, p->user) == 0) {
+                break;
+            }
+        }
+        if (q != NULL) {
+            tc_log_info(LOG_WARN, 0, "duplicate user:%s is ignored", p->user);
+            continue;
+        }
 
-    while (p_user_info) {
-        if (strcmp(p_user_info->user, user) == 0) {
-            return p_user_info->password;
+        p->next = buckets[i];
+        buckets[i] = p;
+        sizes[i]++;
+        if (sizes[i] > max_size) {
+            max_size = sizes[i];
         }
-        p_user_info = p_user_info->next;
+
+        tc_sha1_digest_one(p->hash_stage1, SHA1_HASH_SIZE,
+                (const unsigned char *) p->password, strlen(p->password));
+        tc_sha1_digest_one(p->hash_stage2, SHA1_HASH_SIZE,
+                p->hash_stage1, SHA1_HASH_SIZE);
+        sha256_digest(p->sha2_stage1, (const unsigned char *) p->password,
+                strlen(p->password), NULL, 0);
+        sha256_digest(p->sha2_stage2, p->sha2_stage1, SHA256_HASH_SIZE,
+                NULL, 0);
     }
 
-    return NULL;
+    slots = tc_pcalloc(pool, (max_size + 1) * sizeof(uint32_t));
+    if (slots == NULL) {
+        return NULL;
+    }
+
+    /* the crowded buckets are the hard ones, place them first */
+    for (size = max_size; size > 0; size--) {
+        for (i = 0; i < table->bucket_num; i++) {
+            if (sizes[i] != size) {
+                continue;
+            }
+            for (disp = 1; disp < MAX_DISP_TRIES; disp++) {
+                if (place_bucket(table, buckets[i], disp, slots)) {
+                    break;
+                }
+            }
+            if (disp == MAX_DISP_TRIES) {
+                tc_log_info(LOG_ERR, 0, "can't place users of bucket:%u", i);
+                return NULL;
+            }
+            table->disp[i] = disp;
+        }
+    }
+
+    for (j = 0; j < table->slot_num; j++) {
+        if (table->slots[j] != NULL) {
+            table->slots[j]->next = NULL;
+        }
+    }
+
+    tc_pfree(pool, slots);
+    tc_pfree(pool, sizes);
+    tc_pfree(pool, buckets);
+
+    tc_log_info(LOG_NOTICE, 0, "user table compiled, users:%u, slots:%u",
+            user_num, table->slot_num);
+
+    return table;
 }
 
-int 
-retrieve_mysql_user_pwd_info(tc_pool_t *pool, char *pairs)
+static mysql_user_table *
+parse_user_table(tc_pool_t *pool, char *pairs)
 {
-    char       *p, *end, *q, *next, *pair_end,user_temp[256+256],*to_user,map_user[256];
+    char       *p, *end, *q, *next, *pair_end,user_temp[256+256],*to_user;
     size_t      len;  
-    uint64_t    key;
-    mysql_user *p_user_info, *p_tmp_user_info;
+    uint32_t    user_num = 0;
+    mysql_user *p_user_info, *users = NULL, *last = NULL;
     
-    user_pwd_table = hash_create(pool, 256);
-    user_pwd_table->pool = pool;
-
     p   = pairs;
     len = strlen(p);
     end = p + len;
 
     if (len <= 1) {
         tc_log_info(LOG_WARN, 0, "use password error:%s:", pairs);
-        return -1;
+        return NULL;
     }
 
     do {
@@ -101,7 +252,7 @@ retrieve_mysql_user_pwd_info(tc_pool_t *pool, char *pairs)
                 pair_end = next - 1;
             } else {
                 tc_log_info(LOG_WARN, 0, "use password error:%s:", pairs);
-                return -1;
+                return NULL;
             }
         } else {
             pair_end = p + strlen(p) - 1;
@@ -109,44 +260,43 @@ retrieve_mysql_user_pwd_info(tc_pool_t *pool, char *pairs)
 
         if (q == NULL || pair_end <= q) {
             tc_log_info(LOG_WARN, 0, "user without password is found");
-            return -1;
+            return NULL;
         }
 
         if ((q - p) >= 256 || (pair_end - q) >= 256) {
             tc_log_info(LOG_WARN, 0, "too long for user or password");
-            return -1;
+            return NULL;
         }
 
         p_user_info = (mysql_user *) tc_pcalloc(pool, sizeof(mysql_user));
         if (p_user_info == NULL) {
-            return -1;
+            return NULL;
         }
 
         
 //user_temp
         strncpy(user_temp, p, q - p);
         to_user = strchr(p, '#');
-        if (next != NULL) {
-            strncpy(p_user_info->map_user, to_user+1, q - to_user);
+        if (to_user != NULL && to_user < q) {
+            strncpy(p_user_info->map_user, to_user+1, q - to_user - 1);
             strncpy(p_user_info->user, p, to_user-p);
-            tc_log_info(LOG_INFO, 0, "add s_user:%s and add m_user: %s",p_user_info->user,p_user_info->map_user);
+            tc_log_debug2(LOG_INFO, 0, "add s_user:%s and add m_user: %s",p_user_info->user,p_user_info->map_user);
         }else{
             strncpy(p_user_info->user, p, q - p);
-            tc_log_info(LOG_INFO, 0, "add s_user:%s and m_user is null",p_user_info->user);
+            tc_log_debug1(LOG_INFO, 0, "add s_user:%s and m_user is null",p_user_info->user);
         }
 
         
 
 
         strncpy(p_user_info->password, q + 1, pair_end - q);
-        key = get_key_from_user(p_user_info->user);
-        p_tmp_user_info = hash_find(user_pwd_table, key);
-
-        if (p_tmp_user_info == NULL) {
-            hash_add(user_pwd_table, pool, key, (void *) p_user_info);
+        if (last == NULL) {
+            users = p_user_info;
         } else {
-            p_tmp_user_info->next = p_user_info;
+            last->next = p_user_info;
         }
+        last = p_user_info;
+        user_num++;
 
         if (next != NULL) {
             p = next + 1;
@@ -155,6 +305,262 @@ retrieve_mysql_user_pwd_info(tc_pool_t *pool, char *pairs)
         }
     } while (p < end);
 
+    return compile_user_table(pool, users, user_num);
+}
+
+
+/* the generation of the installed table, see user_table_gen */
+uint32_t
+get_mysql_user_table_gen(void)
+{
+    return user_table_gen;
+}
+
+mysql_user_table *
+compile_mysql_user_table(tc_pool_t *pool, char *pairs)
+{
+    return parse_user_table(pool, pairs);
+}
+
+/* install a table and hand back the one it replaces */
+mysql_user_table *
+swap_mysql_user_table(mysql_user_table *table)
+{
+    mysql_user_table *old = user_table;
+
+    user_table = table;
+    user_table_gen++;
+
+    return old;
+}
+
+int 
+retrieve_mysql_user_pwd_info(tc_pool_t *pool, char *pairs)
+{
+    mysql_user_table *table;
+
+    table = parse_user_table(pool, pairs);
+    if (table == NULL) {
+        return -1;
+    }
+
+    user_table = table;
+    user_table_gen++;
+
     return 0;
 }
 
+/*
+ * The user file holds the same user:password pairs as the user 
+ * directive, separated by commas, spaces or new lines
+ */
+static char *
+read_user_file(tc_pool_t *pool, struct stat *st)
+{
+    int      fd, sep;
+    char    *buf, *p, *q, *end;
+    ssize_t  n;
+
+    if (st->st_size <= 0 || st->st_size > MAX_USER_FILE_LEN) {
+        tc_log_info(LOG_ERR, 0, "invalid user file size:%s", user_file);
+        return NULL;
+    }
+
+    buf = tc_palloc(pool, st->st_size + 1);
+    if (buf == NULL) {
+        return NULL;
+    }
+
+    fd = open(user_file, O_RDONLY);
+    if (fd == -1) {
+        tc_log_info(LOG_ERR, errno, "open user file:%s failed", user_file);
+        return NULL;
+    }
+
+    n = read(fd, buf, st->st_size);
+    close(fd);
+    if (n != st->st_size) {
+        tc_log_info(LOG_ERR, 0, "read user file:%s failed", user_file);
+        return NULL;
+    }
+
+    /* join the pairs with single commas */
+    end = buf + n;
+    sep = 0;
+    for (p = buf, q = buf; p < end; p++) {
+        if (*p == ',' || *p == ' ' || *p == '\t' || *p == '\r' 
+                || *p == '\n')
+        {
+            sep = (q != buf);
+            continue;
+        }
+        if (sep) {
+            *q++ = ',';
+            sep = 0;
+        }
+        *q++ = *p;
+    }
+    *q = '\0';
+
+    return buf;
+}
+
+static uint64_t
+get_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* read and compile the user file into load_pool, off the packet thread */
+static void *
+load_user_file(void *arg)
+{
+    char     *pairs;
+    uint64_t  start;
+
+    start = get_usec();
+
+    pairs = read_user_file(load_pool, &load_st);
+    load_table = pairs != NULL ? parse_user_table(load_pool, pairs) : NULL;
+    load_usec  = get_usec() - start;
+
+    __atomic_store_n(&load_state, LOAD_DONE, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+/* install what the loader compiled, on the packet thread */
+static void
+finish_user_file_load(void)
+{
+    if (load_table == NULL) {
+        /* keep serving the table we have */
+        tc_log_info(LOG_ERR, 0, "user file:%s is not loaded, took:%llu us",
+                user_file, (unsigned long long) load_usec);
+        tc_destroy_pool(load_pool);
+    } else {
+        user_table = load_table;
+        user_table_gen++;
+        retired_pool = user_table_pool;
+        user_table_pool = load_pool;
+        tc_log_info(LOG_NOTICE, 0, "user file:%s loaded, took:%llu us",
+                user_file, (unsigned long long) load_usec);
+    }
+
+    load_pool  = NULL;
+    load_table = NULL;
+    load_state = LOAD_IDLE;
+}
+
+static void
+wait_user_file_load(void)
+{
+    if (__atomic_load_n(&load_state, __ATOMIC_ACQUIRE) != LOAD_IDLE) {
+        pthread_join(loader, NULL);
+        finish_user_file_load();
+    }
+}
+
+int
+load_mysql_user_file(char *path)
+{
+    struct stat st;
+
+    user_file = path;
+
+    /* the first load is done at start up, before any packet */
+    if (stat(user_file, &st) == -1) {
+        tc_log_info(LOG_ERR, errno, "stat user file:%s failed", user_file);
+        return -1;
+    }
+    user_file_mtime = st.st_mtime;
+    user_file_size  = st.st_size;
+
+    load_pool = tc_create_pool(TC_PLUGIN_POOL_SIZE, TC_PLUGIN_POOL_SUB_SIZE, 0);
+    if (load_pool == NULL) {
+        return -1;
+    }
+
+    load_st    = st;
+    load_state = LOAD_RUNNING;
+    load_user_file(NULL);
+    finish_user_file_load();
+
+    return user_table_pool != NULL ? 0 : -1;
+}
+
+void
+check_mysql_user_file(void)
+{
+    int         state;
+    struct stat st;
+
+    if (retired_pool != NULL) {
+        tc_destroy_pool(retired_pool);
+        retired_pool = NULL;
+    }
+
+    if (user_file == NULL) {
+        return;
+    }
+
+    state = __atomic_load_n(&load_state, __ATOMIC_ACQUIRE);
+    if (state == LOAD_RUNNING) {
+        return;
+    }
+
+    if (state == LOAD_DONE) {
+        pthread_join(loader, NULL);
+        finish_user_file_load();
+        return;
+    }
+
+    if (stat(user_file, &st) == -1) {
+        tc_log_info(LOG_WARN, errno, "stat user file:%s failed", user_file);
+        return;
+    }
+
+    if (st.st_mtime == user_file_mtime && st.st_size == user_file_size) {
+        return;
+    }
+    user_file_mtime = st.st_mtime;
+    user_file_size  = st.st_size;
+
+    load_pool = tc_create_pool(TC_PLUGIN_POOL_SIZE, TC_PLUGIN_POOL_SUB_SIZE, 0);
+    if (load_pool == NULL) {
+        return;
+    }
+
+    load_st    = st;
+    load_state = LOAD_RUNNING;
+    if (pthread_create(&loader, NULL, load_user_file, NULL) != 0) {
+        tc_log_info(LOG_ERR, errno, "start user file loader failed");
+        tc_destroy_pool(load_pool);
+        load_pool  = NULL;
+        load_state = LOAD_IDLE;
+        /* try again on the next tick */
+        user_file_mtime = 0;
+    }
+}
+
+void
+release_mysql_user_tables(void)
+{
+    wait_user_file_load();
+
+    if (retired_pool != NULL) {
+        tc_destroy_pool(retired_pool);
+        retired_pool = NULL;
+    }
+
+    if (user_table_pool != NULL) {
+        tc_destroy_pool(user_table_pool);
+        user_table_pool = NULL;
+        user_table = NULL;
+        user_table_gen++;
+    }
+}
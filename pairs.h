@@ -1,6 +1,7 @@
 #ifndef  PAIRS_INCLUDED
 #define  PAIRS_INCLUDED
 #include <xcopy.h>
+#include "password.h"
 #define MAX_PASSWORD_LEN 256
 #define MAX_USER_LEN 256
 
@@ -8,12 +9,28 @@ typedef struct mysql_user{
 	char user[MAX_USER_LEN];
 	char map_user[MAX_USER_LEN];
 	char password[MAX_PASSWORD_LEN];
+	unsigned char hash_stage1[SHA1_HASH_SIZE];
+	unsigned char hash_stage2[SHA1_HASH_SIZE];
+	unsigned char sha2_stage1[SHA256_HASH_SIZE];
+	unsigned char sha2_stage2[SHA256_HASH_SIZE];
 	struct mysql_user* next;
 }mysql_user;
 
-char *retrieve_user_pwd(char *user);
-char *retrieve_user_map(char *user);
+typedef struct {
+    uint32_t     bucket_num;
+    uint32_t     slot_num;
+    uint32_t    *disp;
+    mysql_user **slots;
+} mysql_user_table;
+
+mysql_user *retrieve_user_info(char *user);
+uint32_t get_mysql_user_table_gen(void);
+mysql_user_table *compile_mysql_user_table(tc_pool_t *pool, char *pairs);
+mysql_user_table *swap_mysql_user_table(mysql_user_table *table);
 int retrieve_mysql_user_pwd_info(tc_pool_t *, char *);
+int load_mysql_user_file(char *path);
+void check_mysql_user_file(void);
+void release_mysql_user_tables(void);
 
 #endif
 
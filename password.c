@@ -1,7 +1,12 @@
 #include <xcopy.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
 
 #include "password.h"
 
+#define MAX_RSA_PLAIN_LEN 512
+
 static void
 my_crypt(char *to, const unsigned char *s1, const unsigned char *s2, uint len)
 {
@@ -26,10 +31,125 @@ scramble(char *to, const char *message, const char *password)
             (const unsigned char *) password, strlen(password));
     tc_sha1_digest_one(hash_stage2, SHA1_HASH_SIZE, 
             hash_stage1, SHA1_HASH_SIZE);
+
+    scramble_from_stages(to, message, hash_stage1, hash_stage2);
+}
+
+/**
+ * The same as scramble() with SHA1(password) and SHA1(SHA1(password))
+ * already known, so that only the salted SHA1 is left per login
+ */
+void
+scramble_from_stages(char *to, const char *message,
+        const unsigned char *hash_stage1, const unsigned char *hash_stage2)
+{
     tc_sha1_digest_two((unsigned char *) to, SCRAMBLE_LENGTH, 
             (const unsigned char *) message, SCRAMBLE_LENGTH, 
-            (const unsigned char *) hash_stage2, SHA1_HASH_SIZE);
+            hash_stage2, SHA1_HASH_SIZE);
 
     my_crypt(to, (const unsigned char *) to, hash_stage1, SCRAMBLE_LENGTH);
 }
 
+/**
+ * SHA256(m1 <concat> m2), m2 may be NULL
+ */
+void
+sha256_digest(unsigned char *to, const unsigned char *m1, size_t len1,
+        const unsigned char *m2, size_t len2)
+{
+    EVP_MD_CTX *md_ctx;
+
+    md_ctx = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(md_ctx, EVP_sha256(), NULL);
+    EVP_DigestUpdate(md_ctx, m1, len1);
+    if (m2 != NULL) {
+        EVP_DigestUpdate(md_ctx, m2, len2);
+    }
+    EVP_DigestFinal_ex(md_ctx, to, NULL);
+    EVP_MD_CTX_free(md_ctx);
+}
+
+/**
+ * caching_sha2_password fast authentication:
+ * SHA256(password) XOR 
+ * SHA256(SHA256(SHA256(password)) <concat> "20-bytes random data from server")
+ */
+void
+scramble_sha2_from_stages(char *to, const char *message,
+        const unsigned char *sha2_stage1, const unsigned char *sha2_stage2)
+{
+    unsigned char stage3[SHA256_HASH_SIZE];
+
+    sha256_digest(stage3, sha2_stage2, SHA256_HASH_SIZE,
+            (const unsigned char *) message, SCRAMBLE_LENGTH);
+
+    my_crypt(to, stage3, sha2_stage1, SHA256_HASH_SIZE);
+}
+
+/**
+ * caching_sha2_password full authentication without ssl: the password
+ * with its terminating zero, xored with the scramble, is encrypted with
+ * the server's public key. Returns the length of the cipher text, which
+ * must be exactly to_len, or 0 on failure.
+ */
+int
+encrypt_password_rsa(unsigned char *to, size_t to_len, const char *password,
+        const char *message, const unsigned char *pem, size_t pem_len)
+{
+    int            ret = 0;
+    BIO           *bio;
+    size_t         i, len, out_len;
+    EVP_PKEY      *pkey = NULL;
+    EVP_PKEY_CTX  *pctx = NULL;
+    unsigned char  plain[MAX_RSA_PLAIN_LEN];
+
+    len = strlen(password) + 1;
+    if (len > MAX_RSA_PLAIN_LEN) {
+        tc_log_info(LOG_ERR, 0, "password is too long for rsa:%u", len);
+        return 0;
+    }
+
+    for (i = 0; i < len; i++) {
+        plain[i] = password[i] ^ message[i % SCRAMBLE_LENGTH];
+    }
+
+    bio = BIO_new_mem_buf(pem, (int) pem_len);
+    if (bio == NULL) {
+        return 0;
+    }
+
+    pkey = PEM_read_bio_PUBKEY(bio, NULL, NULL, NULL);
+    if (pkey == NULL) {
+        tc_log_info(LOG_ERR, 0, "invalid rsa public key");
+        goto done;
+    }
+
+    pctx = EVP_PKEY_CTX_new(pkey, NULL);
+    if (pctx == NULL || EVP_PKEY_encrypt_init(pctx) <= 0
+            || EVP_PKEY_CTX_set_rsa_padding(pctx, RSA_PKCS1_OAEP_PADDING) <= 0)
+    {
+        goto done;
+    }
+
+    out_len = 0;
+    if (EVP_PKEY_encrypt(pctx, NULL, &out_len, plain, len) <= 0
+            || out_len != to_len)
+    {
+        tc_log_info(LOG_WARN, 0, "rsa cipher len:%u, expected:%u",
+                out_len, to_len);
+        goto done;
+    }
+
+    if (EVP_PKEY_encrypt(pctx, to, &out_len, plain, len) > 0) {
+        ret = (int) out_len;
+    }
+
+done:
+
+    tc_memzero(plain, sizeof(plain));
+    EVP_PKEY_CTX_free(pctx);
+    EVP_PKEY_free(pkey);
+    BIO_free(bio);
+
+    return ret;
+}
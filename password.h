@@ -1,10 +1,21 @@
 #ifndef  PASSWORD_INCLUDED
 #define  PASSWORD_INCLUDED
+#include <xcopy.h>
 
 #define SCRAMBLE_LENGTH  20
 #define SHA1_HASH_SIZE   20
+#define SHA256_HASH_SIZE 32
 
 void scramble(char *to, const char *message, const char *password);
+void scramble_from_stages(char *to, const char *message,
+        const unsigned char *hash_stage1, const unsigned char *hash_stage2);
+void sha256_digest(unsigned char *to, const unsigned char *m1, size_t len1,
+        const unsigned char *m2, size_t len2);
+void scramble_sha2_from_stages(char *to, const char *message,
+        const unsigned char *sha2_stage1, const unsigned char *sha2_stage2);
+int encrypt_password_rsa(unsigned char *to, size_t to_len,
+        const char *password, const char *message,
+        const unsigned char *pem, size_t pem_len);
 
 #endif   /* ----- #ifndef PASSWORD_INCLUDED  ----- */
 
@@ -0,0 +1,125 @@
+
+#include <xcopy.h>
+#include <sys/resource.h>
+#include "digest.h"
+#include "profile.h"
+
+static const char *hook_names[PROF_HOOK_NUM] = {
+    "created",
+    "greet",
+    "auth",
+    "resp",
+    "recons",
+    "renew_check",
+    "renew"
+};
+
+
+uint64_t
+tc_mysql_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+void
+tc_mysql_prof_rewrite(tc_mysql_prof_t *prof, unsigned char *data,
+        uint32_t len)
+{
+    prof->rewrites++;
+    prof->rewrite_bytes += len;
+    prof->rewrite_sum   += tc_crc32c(0, data, len);
+}
+
+
+void
+tc_mysql_prof_sum(tc_mysql_prof_t *to, tc_mysql_prof_t *from)
+{
+    int i;
+
+    for (i = 0; i < PROF_HOOK_NUM; i++) {
+        to->hooks[i].calls += from->hooks[i].calls;
+        to->hooks[i].nsec  += from->hooks[i].nsec;
+    }
+    to->rewrites      += from->rewrites;
+    to->rewrite_bytes += from->rewrite_bytes;
+    to->rewrite_sum   += from->rewrite_sum;
+}
+
+
+/* what the process ever held, in kilobytes */
+static uint64_t
+get_peak_rss(void)
+{
+    struct rusage ru;
+
+    if (getrusage(RUSAGE_SELF, &ru) == -1) {
+        return 0;
+    }
+
+    return ru.ru_maxrss;
+}
+
+
+static double
+get_rate(uint64_t num, uint64_t usec)
+{
+    return usec > 0 ? (double) num * 1000000 / usec : 0;
+}
+
+
+/* usec is how long the module has been running */
+void
+tc_mysql_prof_log(tc_mysql_prof_t *prof, uint64_t usec)
+{
+    int                   i;
+    tc_mysql_prof_hook_t *h;
+
+    for (i = 0; i < PROF_HOOK_NUM; i++) {
+        h = &prof->hooks[i];
+        if (h->calls == 0) {
+            continue;
+        }
+        tc_log_info(LOG_INFO, 0, "mysql profile %s calls:%llu, ns/call:%llu",
+                hook_names[i], h->calls, h->nsec / h->calls);
+    }
+
+    tc_log_info(LOG_INFO, 0, "mysql profile pkts/s:%.0f, sessions/s:%.0f, "
+            "rewrites:%llu, rewrite sum:%016llx, peak rss:%llukB",
+            get_rate(prof->hooks[PROF_RECONS].calls
+                + prof->hooks[PROF_RESP].calls, usec),
+            get_rate(prof->hooks[PROF_CREATED].calls, usec),
+            prof->rewrites, prof->rewrite_sum, get_peak_rss());
+}
+
+
+void
+tc_mysql_prof_print(FILE *f, tc_mysql_prof_t *prof, uint64_t usec)
+{
+    int                   i;
+    tc_mysql_prof_hook_t *h;
+
+    for (i = 0; i < PROF_HOOK_NUM; i++) {
+        h = &prof->hooks[i];
+        fprintf(f, "prof.%s.calls %llu\n", hook_names[i],
+                (unsigned long long) h->calls);
+        fprintf(f, "prof.%s.ns_per_call %llu\n", hook_names[i],
+                (unsigned long long) (h->calls ? h->nsec / h->calls : 0));
+    }
+
+    fprintf(f, "prof.pkts_per_sec %.0f\n", get_rate(
+                prof->hooks[PROF_RECONS].calls + prof->hooks[PROF_RESP].calls,
+                usec));
+    fprintf(f, "prof.sessions_per_sec %.0f\n",
+            get_rate(prof->hooks[PROF_CREATED].calls, usec));
+    fprintf(f, "prof.rewrites %llu\n", (unsigned long long) prof->rewrites);
+    fprintf(f, "prof.rewrite_bytes %llu\n",
+            (unsigned long long) prof->rewrite_bytes);
+    fprintf(f, "prof.rewrite_sum %016llx\n",
+            (unsigned long long) prof->rewrite_sum);
+    fprintf(f, "prof.peak_rss_kb %llu\n", (unsigned long long) get_peak_rss());
+}
@@ -0,0 +1,39 @@
+#ifndef  PROFILE_INCLUDED
+#define  PROFILE_INCLUDED
+#include <xcopy.h>
+
+/* the callbacks tcpcopy calls for every session or packet */
+#define PROF_CREATED       0
+#define PROF_GREET         1
+#define PROF_AUTH          2
+#define PROF_RESP          3
+#define PROF_RECONS        4
+#define PROF_RENEW_CHECK   5
+#define PROF_RENEW         6
+#define PROF_HOOK_NUM      7
+
+typedef struct {
+    uint64_t calls;
+    uint64_t nsec;
+} tc_mysql_prof_hook_t;
+
+/*
+ * What the module costs per callback, and a fingerprint of the packets
+ * it rewrote: rewrite_sum adds up the CRC32C of every rewritten payload,
+ * so it does not depend on the order sessions are served in.
+ */
+typedef struct {
+    tc_mysql_prof_hook_t hooks[PROF_HOOK_NUM];
+    uint64_t             rewrites;
+    uint64_t             rewrite_bytes;
+    uint64_t             rewrite_sum;
+} tc_mysql_prof_t;
+
+uint64_t tc_mysql_nsec(void);
+void tc_mysql_prof_rewrite(tc_mysql_prof_t *prof, unsigned char *data,
+        uint32_t len);
+void tc_mysql_prof_sum(tc_mysql_prof_t *to, tc_mysql_prof_t *from);
+void tc_mysql_prof_log(tc_mysql_prof_t *prof, uint64_t usec);
+void tc_mysql_prof_print(FILE *f, tc_mysql_prof_t *prof, uint64_t usec);
+
+#endif   /* ----- #ifndef PROFILE_INCLUDED  ----- */
@@ -3,6 +3,21 @@
 #include "protocol.h"
 #include "password.h"
 
+/* the types of the binary protocol whose values are not length-encoded */
+#define MYSQL_TYPE_TINY      1
+#define MYSQL_TYPE_SHORT     2
+#define MYSQL_TYPE_LONG      3
+#define MYSQL_TYPE_FLOAT     4
+#define MYSQL_TYPE_DOUBLE    5
+#define MYSQL_TYPE_NULL      6
+#define MYSQL_TYPE_TIMESTAMP 7
+#define MYSQL_TYPE_LONGLONG  8
+#define MYSQL_TYPE_INT24     9
+#define MYSQL_TYPE_DATE      10
+#define MYSQL_TYPE_TIME      11
+#define MYSQL_TYPE_DATETIME  12
+#define MYSQL_TYPE_YEAR      13
+
 static void
 new_hash(uint64_t *result, const char *password)
 {
@@ -65,30 +80,257 @@ new_crypt(char *result, const char *password, char *message)
     }
 }
 
+/*
+ * Walk packets from p on until the segment ends or frames is full; end
+ * tells how far the walk got
+ */
+static void
+walk_packets(tc_mysql_framer_t *f, unsigned char *data, uint32_t len,
+        uint32_t p, tc_mysql_frames_t *frames)
+{
+    uint32_t        n, need, pkt_len, prev_len, start;
+    tc_mysql_pkt_t *pkt;
+
+    while (p < len && frames->num < MAX_PKTS_PER_SEG) {
+        start    = p;
+        prev_len = f->head_len;
+
+        /* gather the header first, then the rest of the head */
+        while (p < len) {
+            if (f->head_len < MYSQL_HEADER_LEN) {
+                need = MYSQL_HEADER_LEN;
+            } else {
+                pkt_len = f->head[0] + (f->head[1] << 8) + (f->head[2] << 16);
+                need = MYSQL_HEADER_LEN + pkt_len;
+                if (need > MYSQL_HEAD_LEN) {
+                    need = MYSQL_HEAD_LEN;
+                }
+                if (f->head_len >= need) {
+                    break;
+                }
+            }
+            f->head[f->head_len++] = data[p++];
+        }
+
+        if (f->head_len < MYSQL_HEADER_LEN) {
+            break;
+        }
+
+        pkt_len = f->head[0] + (f->head[1] << 8) + (f->head[2] << 16);
+        need = MYSQL_HEADER_LEN + pkt_len;
+        if (f->head_len < MYSQL_HEAD_LEN && f->head_len < need) {
+            break;
+        }
+
+        f->left = need - f->head_len;
+        n = len - p < f->left ? len - p : f->left;
+
+        pkt = &frames->pkts[frames->num++];
+        pkt->off       = start;
+        pkt->prev_len  = prev_len;
+        pkt->seg_len   = p - start + n;
+        pkt->len       = pkt_len;
+        pkt->head_len  = f->head_len;
+        pkt->cont      = f->large;
+        pkt->frame_len = 0;
+        memcpy(pkt->head, f->head, f->head_len);
+
+        f->large    = (pkt_len == MYSQL_MAX_PACKET_LEN);
+        f->head_len = 0;
+        f->left    -= n;
+        p += n;
+    }
+
+    frames->end = p;
+}
+
+
+void
+frame_mysql_packets(tc_mysql_framer_t *f, uint32_t seq, unsigned char *data,
+        uint32_t len, tc_mysql_frames_t *frames)
+{
+    uint32_t  p, n;
+
+    frames->skip = 0;
+    frames->lead = 0;
+    frames->num  = 0;
+    frames->end  = len;
+
+    if (f->synced) {
+        if (before(seq, f->next_seq)) {
+            if (!after(seq + len, f->next_seq)) {
+                /* all of it walked already */
+                frames->skip = len;
+                return;
+            }
+            frames->skip = f->next_seq - seq;
+        } else if (after(seq, f->next_seq)) {
+            tc_log_debug2(LOG_INFO, 0, "mysql framer lost sync:%u,%u",
+                    seq, f->next_seq);
+            f->synced = 0;
+        }
+    }
+
+    if (!f->synced) {
+        /* take the segment as starting a packet, as it mostly does */
+        f->left     = 0;
+        f->head_len = 0;
+        f->large    = 0;
+        f->synced   = 1;
+    }
+
+    f->next_seq = seq + len;
+    p = frames->skip;
+
+    if (f->head_len == 0 && f->left > 0) {
+        n = len - p < f->left ? len - p : f->left;
+        f->left -= n;
+        p += n;
+        frames->lead = n;
+    }
+
+    walk_packets(f, data, len, p, frames);
+}
+
+
+/*
+ * The packets of the segment after those frames holds, when more started
+ * in it than frames has room for; false once the segment is walked. The
+ * segment is drained before the next one is framed.
+ */
+bool
+frame_mysql_more(tc_mysql_framer_t *f, unsigned char *data, uint32_t len,
+        tc_mysql_frames_t *frames)
+{
+    if (frames->end >= len) {
+        return false;
+    }
+
+    frames->lead = 0;
+    frames->num  = 0;
+    walk_packets(f, data, len, frames->end, frames);
+
+    return true;
+}
+
+static const char *auth_plugin_names[] = {
+    "mysql_native_password",
+    "mysql_old_password",
+    "caching_sha2_password",
+    "mysql_clear_password",
+    "unknown"
+};
+
 int
-is_last_data_packet(unsigned char *payload)
+get_auth_plugin(const char *name, size_t len)
 {
-    size_t         len;
+    int i;
+
+    for (i = 0; i < AUTH_PLUGIN_UNKNOWN; i++) {
+        if (strlen(auth_plugin_names[i]) == len
+                && memcmp(auth_plugin_names[i], name, len) == 0)
+        {
+            return i;
+        }
+    }
+
+    return AUTH_PLUGIN_UNKNOWN;
+}
+
+const char *
+get_auth_plugin_name(int plugin)
+{
+    if (plugin < 0 || plugin > AUTH_PLUGIN_UNKNOWN) {
+        plugin = AUTH_PLUGIN_UNKNOWN;
+    }
+
+    return auth_plugin_names[plugin];
+}
+
+int
+parse_auth_resp(unsigned char *payload, size_t length, char *scramble,
+        int *plugin)
+{
+    /*
+     * What the server may answer to an authentication packet
+     *
+     * 0x00 ...                     OK
+     * 0xff ...                     ERR
+     * 0xfe                         switch to mysql_old_password (pre 5.5)
+     * 0xfe plugin\0 data           AuthSwitchRequest, data is the new
+     *                              scramble followed by \0 for the 
+     *                              built-in plugins
+     * 0x01 0x03                    caching_sha2 fast authentication done
+     * 0x01 0x04                    caching_sha2 full authentication needed
+     * 0x01 pem                     public key of the server
+     */
+    size_t         len, name_len;
     unsigned char *p;
 
     p   = payload;
     len = p[0] + (p[1] << 8) + (p[2] << 16);
+    /* skip packet length and packet number */
+    p   = p + 4;
+
+    if (len == 0 || length < 5) {
+        return AUTH_RESP_UNKNOWN;
+    }
+
+    switch (p[0]) {
+    case 0x00:
+        return AUTH_RESP_OK;
+
+    case 0xff:
+        return AUTH_RESP_ERR;
+
+    case 0xfe:
+        if (len == 1) {
+            *plugin = AUTH_PLUGIN_OLD;
+            return AUTH_RESP_OLD_SWITCH;
+        }
 
-    if (len < 9) {
-        /* skip packet length */
-        p = p + 3;
-        /* skip packet number */
-        p = p + 1;
-        if (254 == p[0]) {
-            return 1;
+        if (len + 4 > length) {
+            return AUTH_RESP_UNKNOWN;
         }
+
+        name_len = strnlen((char *) p + 1, len - 1);
+        *plugin  = get_auth_plugin((char *) p + 1, name_len);
+
+        /* skip the plugin name and its \0 */
+        p   = p + 1 + name_len + 1;
+        len = len > name_len + 2 ? len - name_len - 2 : 0;
+        if (len > 0 && p[len - 1] == 0) {
+            len--;
+        }
+        if (len > SCRAMBLE_LENGTH) {
+            len = SCRAMBLE_LENGTH;
+        }
+
+        if (len > 0) {
+            tc_memzero(scramble, SCRAMBLE_LENGTH + 1);
+            memcpy(scramble, p, len);
+        }
+        return AUTH_RESP_SWITCH;
+
+    case 0x01:
+        if (len == 2 && length > 5 && p[1] == 0x03) {
+            return AUTH_RESP_FAST_OK;
+        }
+        if (len == 2 && length > 5 && p[1] == 0x04) {
+            return AUTH_RESP_FULL_AUTH;
+        }
+        if (len > 2 && len + 4 <= length) {
+            return AUTH_RESP_PUBLIC_KEY;
+        }
+        break;
     }
-    return 0;
+
+    return AUTH_RESP_UNKNOWN;
 }
 
 int
 parse_handshake_init_cont(unsigned char *payload, size_t length, 
-        char *scramble_buff)
+        char *scramble_buff, int *plugin)
 {
     /*
      * The following is the protocol format of mysql handshake
@@ -108,11 +350,18 @@ parse_handshake_init_cont(unsigned char *payload, size_t length,
      *                              (at least 12 bytes) 
      * 1                            \0 byte, terminating 
      *                              the second part of a scramble
+     * n (Null-Terminated String)   auth plugin name (optional)
      */
     char          *str;
     size_t         len, count, str_len;
     unsigned char *p;
 
+    if (length <= 5) {
+        tc_log_info(LOG_ERR, 0, "payload len is too short for init:%u",
+                length);
+        return 0;
+    }
+
     p = payload;
     /* skip packet length */
     p = p + 3;
@@ -121,7 +370,7 @@ parse_handshake_init_cont(unsigned char *payload, size_t length,
     /* skip protocol_version */
     p++;
     str = (char *) p;
-    len = strlen(str);
+    len = strnlen(str, length - (p - payload));
     /* skip server_version */
     p   = p + len + 1;
     /* skip thread_id */
@@ -148,8 +397,15 @@ parse_handshake_init_cont(unsigned char *payload, size_t length,
     /* skip (filler)  always 0 */
     p = p + 10;
     str = (char *) p;
-    str_len = strlen(str) + 8;
-    count = p - payload + strlen(str);
+    count = p - payload;
+    if (count > length) {
+        tc_log_info(LOG_ERR, 0, "payload len is too short for init2:%u,%u",
+                length, count);
+        return 0;
+    }
+    len = strnlen(str, length - count);
+    str_len = len + 8;
+    count = count + len;
     if (str_len > SCRAMBLE_LENGTH|| count > length) {
         if (count >length) {
             tc_log_info(LOG_ERR, 0, "payload len is too short for init2:%u,%u",
@@ -160,14 +416,290 @@ parse_handshake_init_cont(unsigned char *payload, size_t length,
         return 0;
     }
     /* copy the rest of scramble_buff */
-    strncpy(scramble_buff + 8, str, strlen(str));
+    memcpy(scramble_buff + 8, str, len);
+
+    /* servers without an auth plugin name speak mysql_native_password */
+    *plugin = AUTH_PLUGIN_NATIVE;
+    p = p + len + 1;
+    if ((size_t) (p - payload) < length) {
+        *plugin = get_auth_plugin((char *) p,
+                strnlen((char *) p, length - (p - payload)));
+    }
+
+    return 1;
+}
+
+/*
+ * The capability flags of a handshake, the lower two bytes follow the
+ * first part of the scramble and the upper two the server status
+ */
+uint32_t
+get_server_capabilities(unsigned char *payload, size_t length)
+{
+    size_t         len;
+    unsigned char *p;
+
+    if (length <= 5) {
+        return 0;
+    }
+
+    p   = payload + MYSQL_HEADER_LEN + 1;
+    len = strnlen((char *) p, length - (p - payload));
+    /* server_version, thread_id, scramble_buff and the filler */
+    p  += len + 1 + 4 + 8 + 1;
+    if ((size_t) (p - payload) + 7 > length) {
+        return 0;
+    }
+
+    return p[0] + (p[1] << 8) + (p[5] << 16) + ((uint32_t) p[6] << 24);
+}
+
+/* the capability flags of a HandshakeResponse41, right after the header */
+uint32_t
+get_client_capabilities(unsigned char *payload, size_t length)
+{
+    if (length < MYSQL_HEADER_LEN + 4) {
+        return 0;
+    }
+
+    return payload[4] + (payload[5] << 8) + (payload[6] << 16)
+        + ((uint32_t) payload[7] << 24);
+}
+
+/* a length-encoded integer at p, NULL if it does not end before end */
+static unsigned char *
+get_lenenc_int(unsigned char *p, unsigned char *end, uint64_t *v)
+{
+    int n, i;
+
+    if (p >= end) {
+        return NULL;
+    }
+
+    switch (*p) {
+    case 0xfc:
+        n = 2;
+        break;
+    case 0xfd:
+        n = 3;
+        break;
+    case 0xfe:
+        n = 8;
+        break;
+    case 0xfb:
+    case 0xff:
+        return NULL;
+    default:
+        *v = *p;
+        return p + 1;
+    }
+
+    if (end - p <= n) {
+        return NULL;
+    }
+
+    for (*v = 0, i = n; i > 0; i--) {
+        *v = (*v << 8) | p[i];
+    }
+
+    return p + 1 + n;
+}
+
+
+/*
+ * Skip a value of the binary protocol: the types named have a length of
+ * their own or a length byte, any other is sent length-encoded
+ */
+static unsigned char *
+skip_binary_value(unsigned char *p, unsigned char *end, unsigned char type)
+{
+    uint64_t v;
+
+    switch (type) {
+    case MYSQL_TYPE_NULL:
+        return p;
+    case MYSQL_TYPE_TINY:
+        return p + 1;
+    case MYSQL_TYPE_SHORT:
+    case MYSQL_TYPE_YEAR:
+        return p + 2;
+    case MYSQL_TYPE_LONG:
+    case MYSQL_TYPE_INT24:
+    case MYSQL_TYPE_FLOAT:
+        return p + 4;
+    case MYSQL_TYPE_LONGLONG:
+    case MYSQL_TYPE_DOUBLE:
+        return p + 8;
+    case MYSQL_TYPE_TIMESTAMP:
+    case MYSQL_TYPE_DATE:
+    case MYSQL_TYPE_TIME:
+    case MYSQL_TYPE_DATETIME:
+        return p < end ? p + 1 + p[0] : NULL;
+    }
+
+    p = get_lenenc_int(p, end, &v);
+
+    return p != NULL && v <= (uint64_t) (end - p) ? p + v : NULL;
+}
+
+
+/*
+ * Where the text of a COM_QUERY starts, from its command byte at cmd,
+ * len bytes of it known. With CLIENT_QUERY_ATTRIBUTES the text follows
+ * the query attributes: their count, the count of sets (1) and for any
+ * attributes the null bitmap, the flag that types and names are sent,
+ * the type and name of every one and the values that are not null.
+ * 0 tells that the attributes do not end within len bytes.
+ */
+uint32_t
+get_query_text_off(unsigned char *cmd, uint32_t len, int attrs)
+{
+    uint64_t        i, num, sets, name_len, bitmap_len;
+    unsigned char  *p, *end, *bitmap, *types;
+
+    if (len == 0) {
+        return 0;
+    }
+
+    if (!attrs) {
+        return 1;
+    }
+
+    end = cmd + len;
+    p   = get_lenenc_int(cmd + 1, end, &num);
+    if (p == NULL || (p = get_lenenc_int(p, end, &sets)) == NULL) {
+        return 0;
+    }
+
+    if (num == 0) {
+        return p - cmd;
+    }
+
+    bitmap_len = (num + 7) / 8;
+    if (num > len || (uint64_t) (end - p) <= bitmap_len
+            || p[bitmap_len] != 1)
+    {
+        return 0;
+    }
+
+    bitmap = p;
+    types  = p + bitmap_len + 1;
+
+    for (p = types, i = 0; i < num; i++) {
+        if (end - p < 2) {
+            return 0;
+        }
+        p = get_lenenc_int(p + 2, end, &name_len);
+        if (p == NULL || name_len > (uint64_t) (end - p)) {
+            return 0;
+        }
+        p += name_len;
+    }
+
+    for (i = 0; i < num; i++) {
+        if (!(bitmap[i / 8] & (1 << (i % 8)))) {
+            p = skip_binary_value(p, end, types[0]);
+            if (p == NULL || p > end) {
+                return 0;
+            }
+        }
+        types = get_lenenc_int(types + 2, end, &name_len);
+        types += name_len;
+    }
+
+    return p - cmd;
+}
+
+
+/*
+ * The user a HandshakeResponse41 logs in as: it follows the header, the
+ * client flags, max_packet_size, the charset and 23 bytes of filler
+ */
+int
+get_clt_auth_user(unsigned char *payload, size_t length, char *user,
+        size_t size)
+{
+    size_t  off, len;
+
+    off = MYSQL_HEADER_LEN + 4 + 4 + 1 + 23;
+    if (length <= off) {
+        return 0;
+    }
+
+    len = strnlen((char *) payload + off, length - off);
+    if (off + len >= length || len >= size) {
+        return 0;
+    }
+
+    memcpy(user, payload + off, len);
+    user[len] = '\0';
 
     return 1;
 }
 
+/*
+ * A HandshakeResponse41 logging in as user with client flags caps and
+ * the default schema db, with a native scramble of zeros that is only
+ * filled in once the greeting of the target comes
+ */
+size_t
+build_clt_auth(unsigned char *buf, size_t size, uint32_t caps, char *user,
+        char *db)
+{
+    size_t         len, user_len, db_len, plugin_len;
+    const char    *plugin;
+    unsigned char *p;
+
+    plugin     = get_auth_plugin_name(AUTH_PLUGIN_NATIVE);
+    plugin_len = strlen(plugin);
+    user_len   = strlen(user);
+    db_len     = (caps & CLIENT_CONNECT_WITH_DB) ? strlen(db) + 1 : 0;
+
+    len = MYSQL_HEADER_LEN + 4 + 4 + 1 + 23 + user_len + 1
+        + 1 + SCRAMBLE_LENGTH + db_len + plugin_len + 1;
+    if (len > size || len - MYSQL_HEADER_LEN > MYSQL_MAX_PACKET_LEN) {
+        return 0;
+    }
+
+    tc_memzero(buf, len);
+
+    /* the response follows the greeting, so it is packet 1 */
+    p    = buf;
+    p[0] = (len - MYSQL_HEADER_LEN) & 0xff;
+    p[1] = ((len - MYSQL_HEADER_LEN) >> 8) & 0xff;
+    p[2] = ((len - MYSQL_HEADER_LEN) >> 16) & 0xff;
+    p[3] = 1;
+    p   += MYSQL_HEADER_LEN;
+
+    p[0] = caps & 0xff;
+    p[1] = (caps >> 8) & 0xff;
+    p[2] = (caps >> 16) & 0xff;
+    p[3] = (caps >> 24) & 0xff;
+    /* max_packet_size of 16M */
+    p[7] = 1;
+    /* utf8_general_ci */
+    p[8] = 33;
+    p   += 4 + 4 + 1 + 23;
+
+    memcpy(p, user, user_len);
+    p += user_len + 1;
+
+    *p++ = SCRAMBLE_LENGTH;
+    p   += SCRAMBLE_LENGTH;
+
+    if (db_len > 0) {
+        memcpy(p, db, db_len - 1);
+        p += db_len;
+    }
+
+    memcpy(p, plugin, plugin_len);
+
+    return len;
+}
+
 int
 change_clt_auth_content(unsigned char *payload, int length,
-        char* m_user,char *password, char *message)
+        char* m_user,char *password, char *message, mysql_user **info)
 {
     /*
      * 4                            client_flags
@@ -177,12 +709,17 @@ change_clt_auth_content(unsigned char *payload, int length,
      * n (Null-Terminated String)   user
      * n (Length Coded Binary)      scramble_buff (1 + x bytes) 
      * n (Null-Terminated String)   databasename (optional)
+     * n (Null-Terminated String)   auth plugin name (optional)
+     *
+     * The scramble is 20 bytes for mysql_native_password and 32 bytes for
+     * caching_sha2_password.
      */
-    char          *str, user[256],*pm_user, *pwd;
-    size_t         len, i;
-    unsigned char *p, *q, scramble_buff[SCRAMBLE_LENGTH + 1];
+    char          *str, user[256];
+    size_t         len, i, scramble_len;
+    mysql_user    *user_info;
+    unsigned char *p, *q, scramble_buff[SHA256_HASH_SIZE];
 
-    tc_memzero(scramble_buff, SCRAMBLE_LENGTH + 1);
+    tc_memzero(scramble_buff, SHA256_HASH_SIZE);
 
     p = payload;
     /* skip mysql packet header */
@@ -216,61 +753,83 @@ change_clt_auth_content(unsigned char *payload, int length,
     /* retrieve user */
     tc_memzero(user, 256);
 
-    len = strlen(str);
+    len = strnlen(str, length - (p - payload));
+    if ((int) (p - payload + len) >= length) {
+        tc_log_info(LOG_ERR, 0, "user is not terminated:%d", length);
+        return 0;
+    }
     if (len >= 256) {
-        tc_log_info(LOG_ERR, 0, "user len is too long:%s,%u", str, len);
+        tc_log_info(LOG_ERR, 0, "user len is too long:%u", len);
         return 0;
     }
     strcpy(user, str);
 
-    pwd = retrieve_user_pwd(user);
-    if (pwd == NULL) {
+    user_info = retrieve_user_info(user);
+    if (user_info == NULL) {
         tc_log_info(LOG_WARN, 0, "user:%s,pwd is null", user);
         return 0;
     }
-    pm_user = retrieve_user_map(user);
 
-    if (pm_user==NULL){
+    if (user_info->map_user[0] == 0){
         m_user[0]=0;
     }else{
-        strcpy(str, pm_user);
-        strcpy(m_user,pm_user);
-        tc_log_info(LOG_INFO, 0, "user:%s,change to map user: %s", user,pm_user);
+        strcpy(str, user_info->map_user);
+        strcpy(m_user,user_info->map_user);
+        tc_log_info(LOG_INFO, 0, "user:%s,change to map user: %s", user,
+                user_info->map_user);
     }
 
     /* skip user */
     p = p + len + 1;
 
+    if ((int) (p - payload) >= length) {
+        tc_log_info(LOG_ERR, 0, "payload len is too short too:%d", length);
+        return 0;
+    }
+
     /* skip scramble_buff length */
+    scramble_len = p[0];
     p = p + 1;
-    len = p - payload + SCRAMBLE_LENGTH;
+    len = p - payload + scramble_len;
     if ((int) len > length) {
         tc_log_info(LOG_ERR, 0, "payload len is too short too:%d,%u",
                 length, len);
         return 0;
     }
 
-    scramble((char *) scramble_buff, message, pwd);
+    if (scramble_len == SCRAMBLE_LENGTH) {
+        scramble_from_stages((char *) scramble_buff, message,
+                user_info->hash_stage1, user_info->hash_stage2);
+    } else if (scramble_len == SHA256_HASH_SIZE) {
+        scramble_sha2_from_stages((char *) scramble_buff, message,
+                user_info->sha2_stage1, user_info->sha2_stage2);
+    } else if (scramble_len != 0) {
+        tc_log_info(LOG_WARN, 0, "unsupported scramble len:%u,user:%s",
+                scramble_len, user);
+        return 0;
+    }
 
     /* change scramble_buff according the target server scramble */
-    for (i = 0; i < SCRAMBLE_LENGTH; i++) {
+    for (i = 0; i < scramble_len; i++) {
         p[i] = scramble_buff[i];
     }
 
     /* save password */
-    strcpy(password, pwd);
+    strcpy(password, user_info->password);
+    *info = user_info;
 
     return 1;
 }
 
 int 
 change_clt_second_auth_content(unsigned char *payload, size_t length,
-        char *new_content)
+        char *new_content, size_t content_len)
 {
     size_t         i, len;
     unsigned char *p;
 
     p = payload;
+    len = p[0] + (p[1] << 8) + (p[2] << 16);
     /* skip mysql packet header */
     /* skip packet length */
     p = p + 3;
@@ -278,18 +837,16 @@ change_clt_second_auth_content(unsigned char *payload, size_t length,
     /* skip packet number */
     p = p + 1;
 
-    len = p - payload + 8;
-    if (len > length) {
-        tc_log_info(LOG_ERR, 0, "payload len is too short for sec :%u,%u",
-                length, len);
+    if (len != content_len || p - payload + content_len > length) {
+        tc_log_info(LOG_ERR, 0, "payload len mismatches for sec :%u,%u",
+                len, content_len);
         return 0;
     }
 
     /* change scramble_buff according to the target server scramble */
-    for (i = 0; i < 8; i++) {
+    for (i = 0; i < content_len; i++) {
         p[i] = new_content[i];
     }
     return 1;
 
 }
-
@@ -1,19 +1,114 @@
 #ifndef  PROTOCOL_INCLUDED
 #define  PROTOCOL_INCLUDED
 #include <xcopy.h>
+#include "pairs.h"
 /*
  * We support only mysql 4.1 and later.
  * SSL is not supported here
  */
 
-int is_last_data_packet(unsigned char *payload);
+/* authentication plugins */
+#define AUTH_PLUGIN_NATIVE   0
+#define AUTH_PLUGIN_OLD      1
+#define AUTH_PLUGIN_SHA2     2
+#define AUTH_PLUGIN_CLEAR    3
+#define AUTH_PLUGIN_UNKNOWN  4
+
+/* packets the server sends while authenticating */
+#define AUTH_RESP_OK         0
+#define AUTH_RESP_ERR        1
+#define AUTH_RESP_OLD_SWITCH 2
+#define AUTH_RESP_SWITCH     3
+#define AUTH_RESP_FAST_OK    4
+#define AUTH_RESP_FULL_AUTH  5
+#define AUTH_RESP_PUBLIC_KEY 6
+#define AUTH_RESP_UNKNOWN    7
+
+#define MYSQL_HEADER_LEN     4
+/* header, command and the 4 bytes statement id of stmt commands */
+#define MYSQL_HEAD_LEN       9
+#define MYSQL_MAX_PACKET_LEN 0xffffff
+#define MAX_PKTS_PER_SEG     16
+#define CLIENT_CONNECT_WITH_DB   0x00000008
+#define CLIENT_COMPRESS          0x00000020
+#define CLIENT_PROTOCOL_41       0x00000200
+#define CLIENT_SSL               0x00000800
+#define CLIENT_SECURE_CONNECTION 0x00008000
+#define CLIENT_PLUGIN_AUTH       0x00080000
+#define CLIENT_CONNECT_ATTRS     0x00100000
+#define CLIENT_DEPRECATE_EOF     0x01000000
+#define CLIENT_QUERY_ATTRIBUTES  0x08000000
+
+/*
+ * Packet boundaries of one direction of a session. Only the heads of
+ * the packets are looked at, bodies are skipped by their length. A head
+ * split across segments is gathered in head.
+ */
+typedef struct {
+    uint32_t      next_seq;
+    uint32_t      left;
+    uint32_t      head_len;
+    uint32_t      synced:1;
+    uint32_t      large:1;
+    unsigned char head[MYSQL_HEAD_LEN];
+} tc_mysql_framer_t;
+
+/*
+ * A packet whose head completed in a segment: prev_len bytes of it came
+ * in earlier segments (they are in head), seg_len bytes are in the
+ * segment from off on. cont marks the continuation of a packet of
+ * MYSQL_MAX_PACKET_LEN bytes, which carries no command. frame_len is the
+ * length of a compressed frame, 0 for a plain packet.
+ */
+typedef struct {
+    uint32_t      off;
+    uint32_t      seg_len;
+    uint32_t      prev_len;
+    uint32_t      len;
+    uint32_t      frame_len;
+    uint32_t      head_len;
+    uint32_t      cont:1;
+    unsigned char head[MYSQL_HEAD_LEN];
+} tc_mysql_pkt_t;
+
+/*
+ * What a segment holds: skip bytes already walked (a retransmission),
+ * then lead bytes ending a packet whose head came earlier, then num
+ * packets with a head in the segment. A segment starting more packets
+ * than MAX_PKTS_PER_SEG is framed in batches: end is where the walk
+ * stopped, and is the segment's length once all of it is walked.
+ */
+typedef struct {
+    uint32_t        skip;
+    uint32_t        lead;
+    uint32_t        end;
+    int             num;
+    tc_mysql_pkt_t  pkts[MAX_PKTS_PER_SEG];
+} tc_mysql_frames_t;
+
+void frame_mysql_packets(tc_mysql_framer_t *f, uint32_t seq,
+        unsigned char *data, uint32_t len, tc_mysql_frames_t *frames);
+bool frame_mysql_more(tc_mysql_framer_t *f, unsigned char *data,
+        uint32_t len, tc_mysql_frames_t *frames);
+int get_auth_plugin(const char *name, size_t len);
+const char *get_auth_plugin_name(int plugin);
+int parse_auth_resp(unsigned char *payload, size_t length, char *scramble,
+        int *plugin);
 void new_crypt(char *result, const char *password, char *message);
 int parse_handshake_init_cont(unsigned char *payload,
-        size_t length, char *scramble);
+        size_t length, char *scramble, int *plugin);
+uint32_t get_server_capabilities(unsigned char *payload, size_t length);
+uint32_t get_client_capabilities(unsigned char *payload, size_t length);
+uint32_t get_query_text_off(unsigned char *cmd, uint32_t len, int attrs);
+int get_clt_auth_user(unsigned char *payload, size_t length, char *user,
+        size_t size);
+size_t build_clt_auth(unsigned char *buf, size_t size, uint32_t caps,
+        char *user, char *db);
 int change_clt_auth_content(unsigned char *payload, 
-        int length, char* m_user,char *password, char *message);
+        int length, char* m_user,char *password, char *message,
+        mysql_user **info);
 int change_clt_second_auth_content(unsigned char *payload,
-        size_t length, char *new_content);
+        size_t length, char *new_content, size_t content_len);
 
 #endif   /* ----- #ifndef PROTOCOL_INCLUDED  ----- */
 
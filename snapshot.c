@@ -0,0 +1,494 @@
+
+#include <xcopy.h>
+#include "snapshot.h"
+#include "latency.h"
+
+static unsigned char snap_pad[8];
+
+
+int
+tc_mysql_snapshot_open(tc_mysql_snapshot_t *snap, tc_pool_t *pool,
+        char *path)
+{
+    int                   fd;
+    void                 *base;
+    struct stat           st;
+    tc_mysql_snap_hdr_t  *hdr;
+
+    tc_memzero(snap, sizeof(tc_mysql_snapshot_t));
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        tc_log_info(LOG_NOTICE, errno, "no mysql snapshot:%s", path);
+        return TC_OK;
+    }
+
+    if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(*hdr)) {
+        tc_log_info(LOG_WARN, errno, "invalid mysql snapshot:%s", path);
+        close(fd);
+        return TC_OK;
+    }
+
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        tc_log_info(LOG_WARN, errno, "mmap mysql snapshot:%s failed", path);
+        return TC_OK;
+    }
+
+    hdr = base;
+    if (memcmp(hdr->magic, SNAP_MAGIC, sizeof(hdr->magic)) != 0
+            || hdr->rec_num > (st.st_size - sizeof(*hdr))
+                / sizeof(tc_mysql_snap_idx_t)
+            || hdr->payload_num > (st.st_size - sizeof(*hdr)
+                - hdr->rec_num * sizeof(tc_mysql_snap_idx_t))
+                / sizeof(uint64_t))
+    {
+        tc_log_info(LOG_WARN, 0, "invalid mysql snapshot:%s", path);
+        munmap(base, st.st_size);
+        return TC_OK;
+    }
+
+    snap->taken = tc_pcalloc(pool, hdr->rec_num / 8 + 1);
+    if (snap->taken == NULL) {
+        munmap(base, st.st_size);
+        return TC_ERR;
+    }
+
+    snap->base        = base;
+    snap->size        = st.st_size;
+    snap->rec_num     = hdr->rec_num;
+    snap->payload_num = hdr->payload_num;
+    snap->idx         = (tc_mysql_snap_idx_t *) (hdr + 1);
+    snap->payloads    = (uint64_t *) (snap->idx + hdr->rec_num);
+    snap->loaded      = tc_time();
+
+    tc_log_info(LOG_NOTICE, 0, "mysql snapshot:%s of %ld mapped, records:%llu,"
+            " payloads:%llu", path, (long) hdr->time, hdr->rec_num,
+            hdr->payload_num);
+
+    return TC_OK;
+}
+
+
+/* the payload numbered i, NULL unless it lies within the file */
+unsigned char *
+tc_mysql_snapshot_payload(tc_mysql_snapshot_t *snap, uint32_t i,
+        uint32_t *len)
+{
+    uint64_t                  off;
+    tc_mysql_snap_payload_t  *sp;
+
+    if (i >= snap->payload_num) {
+        return NULL;
+    }
+
+    off = snap->payloads[i];
+    if (off % 8 != 0 || off + sizeof(*sp) > snap->size) {
+        return NULL;
+    }
+
+    sp = (tc_mysql_snap_payload_t *) (snap->base + off);
+    if (sp->len > snap->size - off - sizeof(*sp)) {
+        return NULL;
+    }
+
+    *len = sp->len;
+
+    return (unsigned char *) (sp + 1);
+}
+
+
+/*
+ * The record is checked to lie within the file, and the payloads of its
+ * statements too, before it is handed out.
+ */
+static int
+check_rec(tc_mysql_snapshot_t *snap, uint64_t off)
+{
+    uint32_t              i, len;
+    uint64_t              end;
+    tc_mysql_snap_rec_t  *rec;
+    tc_mysql_snap_stmt_t *stmt;
+
+    if (off % 8 != 0 || off + sizeof(*rec) > snap->size) {
+        return 0;
+    }
+
+    rec = (tc_mysql_snap_rec_t *) (snap->base + off);
+    end = off + sizeof(*rec) + SNAP_ALIGN(rec->fir_len)
+        + SNAP_ALIGN(rec->sec_len) + SNAP_ALIGN(rec->state_len)
+        + (uint64_t) rec->stmt_num * sizeof(*stmt);
+    if (end > snap->size) {
+        return 0;
+    }
+
+    stmt = (tc_mysql_snap_stmt_t *) (snap->base + end) - rec->stmt_num;
+    for (i = 0; i < rec->stmt_num; i++) {
+        if (tc_mysql_snapshot_payload(snap, stmt[i].payload, &len) == NULL) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+tc_mysql_snap_rec_t *
+tc_mysql_snapshot_take(tc_mysql_snapshot_t *snap, uint64_t key)
+{
+    uint64_t lo, hi, mid;
+
+    if (snap->base == NULL) {
+        return NULL;
+    }
+
+    lo = 0;
+    hi = snap->rec_num;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (snap->idx[mid].key < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo == snap->rec_num || snap->idx[lo].key != key
+            || (snap->taken[lo >> 3] & (1 << (lo & 7))))
+    {
+        return NULL;
+    }
+
+    snap->taken[lo >> 3] |= 1 << (lo & 7);
+    snap->taken_num++;
+
+    if (!check_rec(snap, snap->idx[lo].off)) {
+        tc_log_info(LOG_WARN, 0, "broken snapshot record of key:%llu", key);
+        return NULL;
+    }
+
+    return (tc_mysql_snap_rec_t *) (snap->base + snap->idx[lo].off);
+}
+
+
+void
+tc_mysql_snapshot_close(tc_mysql_snapshot_t *snap, tc_pool_t *pool)
+{
+    if (snap->base == NULL) {
+        return;
+    }
+
+    tc_log_info(LOG_NOTICE, 0, "mysql snapshot unmapped, records taken:%llu "
+            "of %llu", snap->taken_num, snap->rec_num);
+
+    munmap(snap->base, snap->size);
+    tc_pfree(pool, snap->taken);
+    tc_memzero(snap, sizeof(tc_mysql_snapshot_t));
+}
+
+
+/* write data padded to the next 8 bytes */
+static int
+snapshot_put(FILE *f, void *data, uint32_t len)
+{
+    if (len > 0 && fwrite(data, len, 1, f) != 1) {
+        return TC_ERR;
+    }
+
+    len = SNAP_ALIGN(len) - len;
+    if (len > 0 && fwrite(snap_pad, len, 1, f) != 1) {
+        return TC_ERR;
+    }
+
+    return TC_OK;
+}
+
+
+static int
+cmp_rec_key(const void *a, const void *b)
+{
+    uint64_t ka = ((tc_mysql_snap_job_rec_t *) a)->key;
+    uint64_t kb = ((tc_mysql_snap_job_rec_t *) b)->key;
+
+    return ka < kb ? -1 : ka > kb;
+}
+
+
+static int
+cmp_payload(const void *a, const void *b)
+{
+    tc_mysql_buf_t *ba = (*(tc_mysql_snap_job_stmt_t **) a)->buf;
+    tc_mysql_buf_t *bb = (*(tc_mysql_snap_job_stmt_t **) b)->buf;
+
+    if (ba == bb) {
+        return 0;
+    }
+
+    if (ba->len != bb->len) {
+        return ba->len < bb->len ? -1 : 1;
+    }
+
+    return memcmp(ba->data, bb->data, ba->len);
+}
+
+
+/*
+ * Number the payloads of the statements by content, so that the same
+ * bytes prepared by many sessions are written once. The distinct ones are
+ * put into bufs, in the order of their numbers.
+ */
+static tc_mysql_buf_t **
+number_payloads(tc_mysql_snap_job_t *job)
+{
+    uint32_t                    j;
+    uint64_t                    i, n;
+    tc_mysql_buf_t            **bufs;
+    tc_mysql_snap_job_stmt_t  **stmts;
+
+    stmts = tc_palloc(job->pool,
+            (job->stmt_num + 1) * sizeof(tc_mysql_snap_job_stmt_t *));
+    bufs  = tc_palloc(job->pool, (job->stmt_num + 1) * sizeof(tc_mysql_buf_t *));
+    if (stmts == NULL || bufs == NULL) {
+        return NULL;
+    }
+
+    n = 0;
+    for (i = 0; i < job->rec_num; i++) {
+        for (j = 0; j < job->recs[i].stmt_num; j++) {
+            stmts[n++] = &job->recs[i].stmts[j];
+        }
+    }
+
+    qsort(stmts, n, sizeof(tc_mysql_snap_job_stmt_t *), cmp_payload);
+
+    job->payload_num = 0;
+    for (i = 0; i < n; i++) {
+        if (i == 0 || cmp_payload(&stmts[i - 1], &stmts[i]) != 0) {
+            bufs[job->payload_num++] = stmts[i]->buf;
+        }
+        stmts[i]->payload = job->payload_num - 1;
+    }
+
+    tc_pfree(job->pool, stmts);
+
+    return bufs;
+}
+
+
+static uint64_t
+get_rec_len(tc_mysql_snap_job_rec_t *rec)
+{
+    uint64_t len;
+
+    len = sizeof(tc_mysql_snap_rec_t) + SNAP_ALIGN(rec->fir_auth->len)
+        + SNAP_ALIGN(rec->state_len)
+        + (uint64_t) rec->stmt_num * sizeof(tc_mysql_snap_stmt_t);
+    if (rec->sec_auth != NULL) {
+        len += SNAP_ALIGN(rec->sec_auth->len);
+    }
+
+    return len;
+}
+
+
+static int
+put_rec(FILE *f, tc_mysql_snap_job_rec_t *rec)
+{
+    uint32_t              i;
+    tc_mysql_snap_rec_t   sr;
+    tc_mysql_snap_stmt_t  ss;
+
+    tc_memzero(&sr, sizeof(sr));
+    sr.access_time  = rec->access_time;
+    sr.fir_len      = rec->fir_auth->len;
+    sr.sec_len      = rec->sec_auth ? rec->sec_auth->len : 0;
+    sr.state_len    = rec->state_len;
+    sr.stmt_num     = rec->stmt_num;
+    sr.last_stmt_id = rec->last_stmt_id;
+
+    if (snapshot_put(f, &sr, sizeof(sr)) != TC_OK
+            || snapshot_put(f, rec->fir_auth->data, sr.fir_len) != TC_OK
+            || (sr.sec_len > 0
+                && snapshot_put(f, rec->sec_auth->data, sr.sec_len) != TC_OK)
+            || snapshot_put(f, rec->state, sr.state_len) != TC_OK)
+    {
+        return TC_ERR;
+    }
+
+    for (i = 0; i < rec->stmt_num; i++) {
+        ss.id      = rec->stmts[i].id;
+        ss.payload = rec->stmts[i].payload;
+        if (snapshot_put(f, &ss, sizeof(ss)) != TC_OK) {
+            return TC_ERR;
+        }
+    }
+
+    return TC_OK;
+}
+
+
+static int
+put_job(FILE *f, tc_mysql_snap_job_t *job, tc_mysql_buf_t **bufs)
+{
+    uint64_t                 i, off;
+    tc_mysql_snap_hdr_t      hdr;
+    tc_mysql_snap_idx_t      idx;
+    tc_mysql_snap_payload_t  sp;
+
+    tc_memzero(&hdr, sizeof(hdr));
+    memcpy(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic));
+    hdr.rec_num     = job->rec_num;
+    hdr.payload_num = job->payload_num;
+    hdr.time        = job->time;
+    if (snapshot_put(f, &hdr, sizeof(hdr)) != TC_OK) {
+        return TC_ERR;
+    }
+
+    /* the records follow the payloads, which follow both tables */
+    off = sizeof(hdr) + job->rec_num * sizeof(tc_mysql_snap_idx_t)
+        + job->payload_num * sizeof(uint64_t);
+    for (i = 0; i < job->payload_num; i++) {
+        off += sizeof(sp) + SNAP_ALIGN(bufs[i]->len);
+    }
+
+    for (i = 0; i < job->rec_num; i++) {
+        idx.key = job->recs[i].key;
+        idx.off = off;
+        if (snapshot_put(f, &idx, sizeof(idx)) != TC_OK) {
+            return TC_ERR;
+        }
+        off += get_rec_len(&job->recs[i]);
+    }
+
+    off = sizeof(hdr) + job->rec_num * sizeof(tc_mysql_snap_idx_t)
+        + job->payload_num * sizeof(uint64_t);
+    for (i = 0; i < job->payload_num; i++) {
+        if (snapshot_put(f, &off, sizeof(off)) != TC_OK) {
+            return TC_ERR;
+        }
+        off += sizeof(sp) + SNAP_ALIGN(bufs[i]->len);
+    }
+
+    for (i = 0; i < job->payload_num; i++) {
+        sp.len = bufs[i]->len;
+        sp.pad = 0;
+        if (snapshot_put(f, &sp, sizeof(sp)) != TC_OK
+                || snapshot_put(f, bufs[i]->data, sp.len) != TC_OK)
+        {
+            return TC_ERR;
+        }
+    }
+
+    for (i = 0; i < job->rec_num; i++) {
+        if (put_rec(f, &job->recs[i]) != TC_OK) {
+            return TC_ERR;
+        }
+    }
+
+    return TC_OK;
+}
+
+
+/*
+ * Write the snapshot of a job aside and rename it over path, which stays
+ * mapped as long as it is. Only the job and its pool are touched and
+ * nothing is logged, so that it may run off the packet thread.
+ */
+int
+tc_mysql_snapshot_write(tc_mysql_snap_job_t *job)
+{
+    char             tmp[4096];
+    FILE            *f;
+    uint64_t         start;
+    tc_mysql_buf_t **bufs;
+
+    start    = tc_mysql_usec();
+    job->err = 0;
+
+    qsort(job->recs, job->rec_num, sizeof(tc_mysql_snap_job_rec_t),
+            cmp_rec_key);
+
+    bufs = number_payloads(job);
+    if (bufs == NULL) {
+        job->err = ENOMEM;
+        goto done;
+    }
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", job->path) >= (int) sizeof(tmp))
+    {
+        job->err = ENAMETOOLONG;
+        goto done;
+    }
+
+    f = fopen(tmp, "w");
+    if (f == NULL) {
+        job->err = errno;
+        goto done;
+    }
+
+    if (put_job(f, job, bufs) != TC_OK) {
+        job->err = errno ? errno : EIO;
+        fclose(f);
+        goto done;
+    }
+
+    if (fclose(f) != 0 || rename(tmp, job->path) == -1) {
+        job->err = errno;
+    }
+
+done:
+
+    job->usec = tc_mysql_usec() - start;
+
+    return job->err == 0 ? TC_OK : TC_ERR;
+}
+
+
+static void *
+write_job(void *arg)
+{
+    tc_mysql_snap_job_t *job = arg;
+
+    tc_mysql_snapshot_write(job);
+    __atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+
+/* start writing a job on a thread of its own */
+int
+tc_mysql_snapshot_start(tc_mysql_snap_job_t *job)
+{
+    job->done     = 0;
+    job->threaded = 1;
+    if (pthread_create(&job->writer, NULL, write_job, job) != 0) {
+        job->threaded = 0;
+        return TC_ERR;
+    }
+
+    return TC_OK;
+}
+
+
+/*
+ * Whether the writing of a job is over, waiting for it if asked to. The
+ * job may be released by the caller once it is.
+ */
+int
+tc_mysql_snapshot_done(tc_mysql_snap_job_t *job, int wait)
+{
+    if (!job->threaded) {
+        return 1;
+    }
+
+    if (!wait && !__atomic_load_n(&job->done, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    pthread_join(job->writer, NULL);
+    job->threaded = 0;
+
+    return 1;
+}
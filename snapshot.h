@@ -0,0 +1,126 @@
+#ifndef  SNAPSHOT_INCLUDED
+#define  SNAPSHOT_INCLUDED
+#include <xcopy.h>
+#include <pthread.h>
+#include "buffer.h"
+
+#define SNAP_MAGIC      "tcmyss04"
+#define SNAP_ALIGN(len) (((len) + 7) & ~((uint64_t) 7))
+
+/*
+ * A snapshot file is the header, an index of the records sorted by key,
+ * the offsets of the prepare payloads, the payloads and the records,
+ * each 8 bytes aligned. A payload is written once however many
+ * statements prepared it, and statements refer to it by its number. A
+ * record is followed by the payloads of its first and second auth, the
+ * packets restoring its state and then by its prepared statements.
+ * Everything is in host byte order.
+ */
+typedef struct {
+    char      magic[8];
+    uint64_t  rec_num;
+    uint64_t  payload_num;
+    int64_t   time;
+} tc_mysql_snap_hdr_t;
+
+typedef struct {
+    uint64_t  key;
+    uint64_t  off;
+} tc_mysql_snap_idx_t;
+
+/* followed by len bytes */
+typedef struct {
+    uint32_t  len;
+    uint32_t  pad;
+} tc_mysql_snap_payload_t;
+
+typedef struct {
+    int64_t   access_time;
+    uint32_t  fir_len;
+    uint32_t  sec_len;
+    uint32_t  state_len;
+    uint32_t  stmt_num;
+    uint32_t  last_stmt_id;
+    uint32_t  pad;
+} tc_mysql_snap_rec_t;
+
+typedef struct {
+    uint32_t  id;
+    uint32_t  payload;
+} tc_mysql_snap_stmt_t;
+
+/*
+ * A snapshot mapped read only: pages are read in as records are taken.
+ * A record is taken once, by a renewal or by a new login of its key.
+ */
+typedef struct {
+    unsigned char        *base;
+    size_t                size;
+    uint64_t              rec_num;
+    uint64_t              payload_num;
+    uint64_t              taken_num;
+    time_t                loaded;
+    tc_mysql_snap_idx_t  *idx;
+    uint64_t             *payloads;
+    unsigned char        *taken;
+} tc_mysql_snapshot_t;
+
+/*
+ * What a snapshot is written from: for every record, copies of what the
+ * packet thread changes in place and references to its payloads, which
+ * are never written to once stored. The payload of a statement is set
+ * to its number in the file as it is written.
+ */
+typedef struct {
+    uint32_t         id;
+    uint32_t         payload;
+    tc_mysql_buf_t  *buf;
+} tc_mysql_snap_job_stmt_t;
+
+typedef struct {
+    uint64_t                   key;
+    int64_t                    access_time;
+    uint32_t                   shard;
+    uint32_t                   last_stmt_id;
+    uint32_t                   state_len;
+    uint32_t                   stmt_num;
+    unsigned char             *state;
+    tc_mysql_buf_t            *fir_auth;
+    tc_mysql_buf_t            *sec_auth;
+    tc_mysql_snap_job_stmt_t  *stmts;
+} tc_mysql_snap_job_rec_t;
+
+/*
+ * A snapshot being written to path, on a thread of its own or on the
+ * caller's. The packet thread fills the job and its pool; the writer
+ * sorts, numbers and writes it, touching nothing else, and sets done.
+ * err is the errno of a failed write, payload_num and usec tell what
+ * was written and how long it took.
+ */
+typedef struct {
+    tc_pool_t                 *pool;
+    char                      *path;
+    int64_t                    time;
+    uint64_t                   rec_num;
+    uint64_t                   stmt_num;
+    tc_mysql_snap_job_rec_t   *recs;
+    uint64_t                   payload_num;
+    uint64_t                   usec;
+    int                        err;
+    int                        done;
+    int                        threaded;
+    pthread_t                  writer;
+} tc_mysql_snap_job_t;
+
+int tc_mysql_snapshot_open(tc_mysql_snapshot_t *snap, tc_pool_t *pool,
+        char *path);
+tc_mysql_snap_rec_t *tc_mysql_snapshot_take(tc_mysql_snapshot_t *snap,
+        uint64_t key);
+unsigned char *tc_mysql_snapshot_payload(tc_mysql_snapshot_t *snap,
+        uint32_t i, uint32_t *len);
+void tc_mysql_snapshot_close(tc_mysql_snapshot_t *snap, tc_pool_t *pool);
+int tc_mysql_snapshot_write(tc_mysql_snap_job_t *job);
+int tc_mysql_snapshot_start(tc_mysql_snap_job_t *job);
+int tc_mysql_snapshot_done(tc_mysql_snap_job_t *job, int wait);
+
+#endif   /* ----- #ifndef SNAPSHOT_INCLUDED  ----- */
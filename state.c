@@ -0,0 +1,613 @@
+
+#include <xcopy.h>
+#include "protocol.h"
+#include "state.h"
+
+#define COM_INIT_DB          2
+#define COM_QUERY            3
+#define COM_CHANGE_USER      17
+#define COM_RESET_CONNECTION 31
+
+
+static int
+is_blank(unsigned char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\f'
+        || c == '\v';
+}
+
+
+static int
+is_word(unsigned char c)
+{
+    return c >= 0x80 || c == '_' || c == '$' || (c >= 'a' && c <= 'z')
+        || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+}
+
+
+/* white space and comments, executable comments excepted */
+static uint32_t
+skip_blank(unsigned char *s, uint32_t p, uint32_t n)
+{
+    while (p < n) {
+        if (is_blank(s[p])) {
+            p++;
+
+        } else if (s[p] == '/' && p + 2 < n && s[p + 1] == '*'
+                && s[p + 2] != '!')
+        {
+            for (p += 2; p + 1 < n; p++) {
+                if (s[p] == '*' && s[p + 1] == '/') {
+                    break;
+                }
+            }
+            p += 2;
+
+        } else if ((s[p] == '-' && p + 2 < n && s[p + 1] == '-'
+                    && s[p + 2] <= ' ') || s[p] == '#')
+        {
+            while (p < n && s[p] != '\n') {
+                p++;
+            }
+
+        } else {
+            break;
+        }
+    }
+
+    return p < n ? p : n;
+}
+
+
+/* the length of word if s at p starts with it in any case, or 0 */
+static uint32_t
+match_word(unsigned char *s, uint32_t p, uint32_t n, const char *word)
+{
+    uint32_t len;
+
+    len = strlen(word);
+    if (p + len > n || strncasecmp((char *) s + p, word, len) != 0) {
+        return 0;
+    }
+
+    /* prefixes such as @@session. end in a dot */
+    if (word[len - 1] != '.' && p + len < n && is_word(s[p + len])) {
+        return 0;
+    }
+
+    return len;
+}
+
+
+static uint64_t
+hash_name(unsigned char *s, uint32_t n)
+{
+    uint32_t i;
+    uint64_t hash;
+
+    hash = 14695981039346656037ULL;
+    for (i = 0; i < n; i++) {
+        hash ^= (s[i] >= 'A' && s[i] <= 'Z') ? s[i] | 0x20 : s[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+
+/*
+ * Tell the commands that change the state of a session by their first
+ * bytes: text is what follows the command byte, the statement of a query
+ * past its attributes
+ */
+int
+tc_mysql_state_class(unsigned char command, unsigned char *text,
+        uint32_t len)
+{
+    uint32_t p;
+
+    switch (command) {
+    case COM_INIT_DB:
+        return STATE_DB;
+
+    case COM_CHANGE_USER:
+    case COM_RESET_CONNECTION:
+        return STATE_RESET;
+
+    case COM_QUERY:
+        p = skip_blank(text, 0, len);
+        if (match_word(text, p, len, "set")) {
+            return STATE_SET;
+        }
+        if (match_word(text, p, len, "use")) {
+            return STATE_DB;
+        }
+        break;
+    }
+
+    return STATE_NONE;
+}
+
+
+static void
+remove_var(tc_pool_t *pool, tc_mysql_state_t *state, uint32_t i)
+{
+    tc_pfree(pool, state->vars[i].text);
+    state->var_num--;
+    memmove(state->vars + i, state->vars + i + 1,
+            (state->var_num - i) * sizeof(tc_mysql_var_t));
+}
+
+
+/* keep the text of an assignment under name, after prefix */
+static int
+set_var(tc_pool_t *pool, tc_mysql_state_t *state, uint64_t name,
+        int txn, const char *prefix, unsigned char *s, uint32_t n)
+{
+    char     *text;
+    uint32_t  i, len;
+
+    for (i = 0; i < state->var_num; i++) {
+        if (state->vars[i].name == name) {
+            break;
+        }
+    }
+
+    len = strlen(prefix);
+
+    /* an older value would be as wrong as none */
+    if (len + n > MAX_STATE_TEXT) {
+        if (i < state->var_num) {
+            remove_var(pool, state, i);
+        }
+        return TC_ERR;
+    }
+
+    if (i == MAX_STATE_VARS) {
+        return TC_ERR;
+    }
+
+    text = tc_palloc(pool, len + n);
+    if (text == NULL) {
+        return TC_ERR;
+    }
+    memcpy(text, prefix, len);
+    memcpy(text + len, s, n);
+
+    if (i < state->var_num) {
+        tc_pfree(pool, state->vars[i].text);
+    } else {
+        state->var_num++;
+    }
+
+    state->vars[i].name = name;
+    state->vars[i].len  = len + n;
+    state->vars[i].txn  = txn;
+    state->vars[i].text = text;
+
+    return TC_OK;
+}
+
+
+/*
+ * The characteristics of a SET SESSION TRANSACTION, from past its
+ * TRANSACTION on. The isolation level and the access mode are kept apart,
+ * each as a SET of its own, so that setting one does not undo the other.
+ */
+static int
+add_txn(tc_pool_t *pool, tc_mysql_state_t *state, unsigned char *s,
+        uint32_t n)
+{
+    int       ret;
+    uint32_t  p, q, end;
+    uint64_t  name;
+
+    ret = TC_OK;
+    p   = skip_blank(s, 0, n);
+
+    while (p < n) {
+        for (q = p; q < n && s[q] != ','; q++) {
+            /* characteristics hold no quotes */
+        }
+        for (end = q; end > p && is_blank(s[end - 1]); end--) {
+            /* trailing white space */
+        }
+
+        if (match_word(s, p, end, "isolation")) {
+            name = hash_name((unsigned char *) "transaction isolation", 21);
+        } else if (match_word(s, p, end, "read")) {
+            name = hash_name((unsigned char *) "transaction read", 16);
+        } else {
+            name = 0;
+        }
+
+        if (name == 0 || set_var(pool, state, name, 1,
+                    "SESSION TRANSACTION ", s + p, end - p) != TC_OK)
+        {
+            ret = TC_ERR;
+        }
+
+        p = skip_blank(s, q + 1, n);
+    }
+
+    return ret;
+}
+
+
+/* where the scope of an assignment ends, past its blanks */
+static uint32_t
+skip_scope(unsigned char *s, uint32_t n, uint32_t *session)
+{
+    uint32_t len;
+
+    *session = 0;
+
+    if ((len = match_word(s, 0, n, "session")) > 0
+            || (len = match_word(s, 0, n, "local")) > 0)
+    {
+        *session = 1;
+        return skip_blank(s, len, n);
+    }
+
+    if ((len = match_word(s, 0, n, "global")) > 0
+            || (len = match_word(s, 0, n, "persist")) > 0
+            || (len = match_word(s, 0, n, "persist_only")) > 0)
+    {
+        return skip_blank(s, len, n);
+    }
+
+    return 0;
+}
+
+
+/*
+ * Keep one assignment of a SET. A scope of SESSION or LOCAL is kept with
+ * it, GLOBAL and PERSIST ones do not belong to the session, and neither
+ * does SET TRANSACTION without a scope, which is for the next transaction
+ * only. Passwords, roles and resource groups are not replayed.
+ */
+static int
+add_var(tc_pool_t *pool, tc_mysql_state_t *state, unsigned char *s,
+        uint32_t n)
+{
+    uint32_t  p, len, session;
+    uint64_t  name;
+
+    if (match_word(s, 0, n, "global") || match_word(s, 0, n, "persist")
+            || match_word(s, 0, n, "persist_only")
+            || match_word(s, 0, n, "@@global.")
+            || match_word(s, 0, n, "@@persist.")
+            || match_word(s, 0, n, "@@persist_only.")
+            || match_word(s, 0, n, "password")
+            || match_word(s, 0, n, "default")
+            || match_word(s, 0, n, "role")
+            || match_word(s, 0, n, "resource"))
+    {
+        return TC_OK;
+    }
+
+    p = skip_scope(s, n, &session);
+    if (!session) {
+        if ((len = match_word(s, 0, n, "@@session.")) > 0
+                || (len = match_word(s, 0, n, "@@local.")) > 0)
+        {
+            p = len;
+        } else if (n > 2 && s[0] == '@' && s[1] == '@') {
+            p = 2;
+        }
+    }
+
+    if ((len = match_word(s, p, n, "transaction")) > 0) {
+        if (!session) {
+            return TC_OK;
+        }
+        return add_txn(pool, state, s + p + len, n - p - len);
+    }
+
+    if (match_word(s, p, n, "names") || match_word(s, p, n, "charset")
+            || match_word(s, p, n, "character"))
+    {
+        name = hash_name((unsigned char *) "names", 5);
+
+    } else {
+        /* a user variable keeps its @ */
+        len = (p < n && s[p] == '@') ? 1 : 0;
+        while (p + len < n && (is_word(s[p + len]) || s[p + len] == '.')) {
+            len++;
+        }
+        if (len == 0) {
+            return TC_ERR;
+        }
+        name = hash_name(s + p, len);
+    }
+
+    return set_var(pool, state, name, 0, "", s, n);
+}
+
+
+/* where the assignment at p ends: a comma outside of quotes, or a ; */
+static uint32_t
+get_var_end(unsigned char *s, uint32_t p, uint32_t n)
+{
+    uint32_t       q, depth, session;
+    unsigned char  quote;
+
+    /* the characteristics of a transaction are split by add_txn */
+    q = skip_scope(s + p, n - p, &session);
+    if (match_word(s + p, q, n - p, "transaction")) {
+        for (q = p; q < n && s[q] != ';'; q++) {
+            /* to the end of the statement */
+        }
+        return q;
+    }
+
+    depth = 0;
+    quote = 0;
+    for (q = p; q < n; q++) {
+        if (quote) {
+            if (s[q] == '\\' && quote != '`') {
+                q++;
+            } else if (s[q] == quote) {
+                quote = 0;
+            }
+        } else if (s[q] == '\'' || s[q] == '"' || s[q] == '`') {
+            quote = s[q];
+        } else if (s[q] == '(') {
+            depth++;
+        } else if (s[q] == ')' && depth > 0) {
+            depth--;
+        } else if ((s[q] == ',' || s[q] == ';') && depth == 0) {
+            break;
+        }
+    }
+
+    return q < n ? q : n;
+}
+
+
+/* the assignments of a SET, split at the commas outside of quotes */
+static int
+update_vars(tc_pool_t *pool, tc_mysql_state_t *state, unsigned char *s,
+        uint32_t n)
+{
+    int       ret;
+    uint32_t  p, q, end;
+
+    ret = TC_OK;
+    p   = skip_blank(s, 0, n);
+
+    while (p < n) {
+        q = get_var_end(s, p, n);
+        for (end = q; end > p && is_blank(s[end - 1]); end--) {
+            /* trailing white space */
+        }
+
+        if (end > p && add_var(pool, state, s + p, end - p) != TC_OK) {
+            ret = TC_ERR;
+        }
+
+        if (q < n && s[q] == ';') {
+            break;
+        }
+        p = skip_blank(s, q + 1, n);
+    }
+
+    return ret;
+}
+
+
+static int
+update_db(tc_mysql_state_t *state, unsigned char *s, uint32_t n)
+{
+    while (n > 0 && (is_blank(s[n - 1]) || s[n - 1] == ';')) {
+        n--;
+    }
+
+    if (n >= 2 && s[0] == '`' && s[n - 1] == '`') {
+        s++;
+        n -= 2;
+    }
+
+    if (n == 0 || n > MAX_DB_LEN) {
+        return TC_ERR;
+    }
+
+    memcpy(state->db, s, n);
+    state->db[n]  = '\0';
+    state->db_len = n;
+
+    return TC_OK;
+}
+
+
+/*
+ * Apply a command of class cls to the state of a session, which is
+ * created as it is first changed. TC_ERR tells that the change was not
+ * kept.
+ */
+int
+tc_mysql_state_update(tc_pool_t *pool, tc_mysql_state_t **state, int cls,
+        unsigned char command, unsigned char *text, uint32_t len)
+{
+    uint32_t p;
+
+    if (cls == STATE_NONE) {
+        return TC_OK;
+    }
+
+    if (cls == STATE_RESET) {
+        tc_mysql_state_free(pool, *state);
+        *state = NULL;
+        return TC_OK;
+    }
+
+    if (*state == NULL) {
+        *state = tc_pcalloc(pool, sizeof(tc_mysql_state_t));
+        if (*state == NULL) {
+            return TC_ERR;
+        }
+    }
+
+    switch (cls) {
+    case STATE_DB:
+        if (command == COM_INIT_DB) {
+            return update_db(*state, text, len);
+        }
+        p = skip_blank(text, 0, len);
+        p = skip_blank(text, p + 3, len);
+        return update_db(*state, text + p, len - p);
+
+    case STATE_SET:
+        p = skip_blank(text, 0, len) + 3;
+        return update_vars(pool, *state, text + p, len - p);
+    }
+
+    return TC_OK;
+}
+
+
+/*
+ * The length of the packets that restore the state: a COM_INIT_DB, one
+ * SET of every variable and a SET of the transaction characteristics,
+ * which cannot be listed with others
+ */
+uint32_t
+tc_mysql_state_len(tc_mysql_state_t *state)
+{
+    uint32_t i, len, set_len;
+
+    len     = 0;
+    set_len = 0;
+
+    if (state->db_len > 0) {
+        len += MYSQL_HEADER_LEN + 1 + state->db_len;
+    }
+
+    for (i = 0; i < state->var_num; i++) {
+        if (state->vars[i].txn) {
+            len += MYSQL_HEADER_LEN + 1 + 4 + state->vars[i].len;
+        } else {
+            set_len += (set_len == 0 ? 4 : 2) + state->vars[i].len;
+        }
+    }
+
+    if (set_len > 0) {
+        len += MYSQL_HEADER_LEN + 1 + set_len;
+    }
+
+    return len;
+}
+
+
+static unsigned char *
+put_header(unsigned char *p, uint32_t len, unsigned char command)
+{
+    p[0] = len & 0xff;
+    p[1] = (len >> 8) & 0xff;
+    p[2] = (len >> 16) & 0xff;
+    p[3] = 0;
+    p[4] = command;
+
+    return p + MYSQL_HEADER_LEN + 1;
+}
+
+
+/* write the packets of tc_mysql_state_len bytes to buf */
+uint32_t
+tc_mysql_state_build(tc_mysql_state_t *state, unsigned char *buf)
+{
+    uint32_t        i, set_len;
+    unsigned char  *p;
+    tc_mysql_var_t *var;
+
+    p = buf;
+
+    if (state->db_len > 0) {
+        p = put_header(p, 1 + state->db_len, COM_INIT_DB);
+        memcpy(p, state->db, state->db_len);
+        p += state->db_len;
+    }
+
+    set_len = 0;
+    for (i = 0; i < state->var_num; i++) {
+        if (!state->vars[i].txn) {
+            set_len += (set_len == 0 ? 4 : 2) + state->vars[i].len;
+        }
+    }
+
+    if (set_len > 0) {
+        p = put_header(p, 1 + set_len, COM_QUERY);
+        memcpy(p, "SET", 3);
+        p += 3;
+        for (i = 0, set_len = 0; i < state->var_num; i++) {
+            var = &state->vars[i];
+            if (var->txn) {
+                continue;
+            }
+            if (set_len++ > 0) {
+                *p++ = ',';
+            }
+            *p++ = ' ';
+            memcpy(p, var->text, var->len);
+            p += var->len;
+        }
+    }
+
+    for (i = 0; i < state->var_num; i++) {
+        var = &state->vars[i];
+        if (var->txn) {
+            p = put_header(p, 1 + 4 + var->len, COM_QUERY);
+            memcpy(p, "SET ", 4);
+            memcpy(p + 4, var->text, var->len);
+            p += 4 + var->len;
+        }
+    }
+
+    return p - buf;
+}
+
+
+/* put back a state from the packets tc_mysql_state_build wrote */
+int
+tc_mysql_state_load(tc_pool_t *pool, tc_mysql_state_t **state,
+        unsigned char *data, uint32_t len)
+{
+    uint32_t       pkt_len;
+    unsigned char *cmd;
+
+    while (len > 0) {
+        if (len <= MYSQL_HEADER_LEN) {
+            return TC_ERR;
+        }
+        pkt_len = data[0] + (data[1] << 8) + (data[2] << 16);
+        if (pkt_len == 0 || MYSQL_HEADER_LEN + pkt_len > len) {
+            return TC_ERR;
+        }
+
+        cmd = data + MYSQL_HEADER_LEN;
+        tc_mysql_state_update(pool, state,
+                tc_mysql_state_class(cmd[0], cmd + 1, pkt_len - 1), cmd[0],
+                cmd + 1, pkt_len - 1);
+
+        data += MYSQL_HEADER_LEN + pkt_len;
+        len  -= MYSQL_HEADER_LEN + pkt_len;
+    }
+
+    return TC_OK;
+}
+
+
+void
+tc_mysql_state_free(tc_pool_t *pool, tc_mysql_state_t *state)
+{
+    uint32_t i;
+
+    if (state == NULL) {
+        return;
+    }
+
+    for (i = 0; i < state->var_num; i++) {
+        tc_pfree(pool, state->vars[i].text);
+    }
+    tc_pfree(pool, state);
+}
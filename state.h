@@ -0,0 +1,50 @@
+#ifndef  STATE_INCLUDED
+#define  STATE_INCLUDED
+#include <xcopy.h>
+
+/* what a command does to the state of its session */
+#define STATE_NONE       0
+#define STATE_DB         1
+#define STATE_SET        2
+#define STATE_RESET      3
+
+#define MAX_DB_LEN       64
+#define MAX_STATE_VARS   16
+/* a longer assignment is not kept */
+#define MAX_STATE_TEXT   256
+/* what tc_mysql_state_len comes to at most */
+#define MAX_STATE_LEN    (MAX_DB_LEN + 32 \
+        + MAX_STATE_VARS * (MAX_STATE_TEXT + 16))
+/* the packets tc_mysql_state_build writes at most */
+#define MAX_STATE_PKTS   (MAX_STATE_VARS + 2)
+
+/*
+ * An assignment of a SET as it was sent, kept under the hash of the
+ * variable it sets, so that only the latest one of a variable is kept.
+ */
+typedef struct {
+    uint64_t  name;
+    uint32_t  len;
+    uint32_t  txn:1;
+    char     *text;
+} tc_mysql_var_t;
+
+/* the default schema and session variables a session has set */
+typedef struct {
+    uint32_t        db_len;
+    uint32_t        var_num;
+    char            db[MAX_DB_LEN + 1];
+    tc_mysql_var_t  vars[MAX_STATE_VARS];
+} tc_mysql_state_t;
+
+int tc_mysql_state_class(unsigned char command, unsigned char *text,
+        uint32_t len);
+int tc_mysql_state_update(tc_pool_t *pool, tc_mysql_state_t **state,
+        int cls, unsigned char command, unsigned char *text, uint32_t len);
+uint32_t tc_mysql_state_len(tc_mysql_state_t *state);
+uint32_t tc_mysql_state_build(tc_mysql_state_t *state, unsigned char *buf);
+int tc_mysql_state_load(tc_pool_t *pool, tc_mysql_state_t **state,
+        unsigned char *data, uint32_t len);
+void tc_mysql_state_free(tc_pool_t *pool, tc_mysql_state_t *state);
+
+#endif   /* ----- #ifndef STATE_INCLUDED  ----- */
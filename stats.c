@@ -0,0 +1,120 @@
+
+#include <xcopy.h>
+#include <stddef.h>
+#include "stats.h"
+
+static const char *stat_names[] = {
+    "sessions",
+    "sessions_skipped",
+    "logins",
+    "login_fails",
+    "auth_refused",
+    "sec_auths",
+    "renewals",
+    "renewal_bytes",
+    "adoptions",
+    "state_changes",
+    "state_dropped",
+    "state_replays",
+    "compressed",
+    "refreshes",
+    "refresh_saved_bytes",
+    "ps_stored",
+    "ps_dropped",
+    "ps_closed",
+    "ps_reset",
+    "ps_failed",
+    "ps_evicted",
+    "ps_holes_refused",
+    "recs_evicted",
+    "recs_restored",
+    "resp_recorded",
+    "resp_matched",
+    "resp_mismatched",
+    "resp_unknown",
+    "resp_unstable",
+    "resp_lost",
+    "stmts_filtered",
+    "stmts_unfiltered",
+    "recs",
+    "buckets",
+    "auth_bytes",
+    "ps_mem",
+    "ps_bytes",
+    "ps_ref_bytes"
+};
+
+#define STATS_NUM (sizeof(stat_names) / sizeof(stat_names[0]))
+
+/* a name for every field */
+typedef char stats_names_check[(offsetof(tc_mysql_stats_t, ps_ref_bytes)
+        + sizeof(uint64_t) == STATS_NUM * sizeof(uint64_t)) ? 1 : -1];
+
+
+void
+tc_mysql_stats_sum(tc_mysql_stats_t *to, tc_mysql_stats_t *from)
+{
+    size_t    i;
+    uint64_t *t = (uint64_t *) to, *f = (uint64_t *) from;
+
+    for (i = 0; i < STATS_NUM; i++) {
+        t[i] += f[i];
+    }
+}
+
+
+/*
+ * The stats are written to a temporary file renamed over path, readers
+ * never see a half written file
+ */
+FILE *
+tc_mysql_stats_open(char *path)
+{
+    char  tmp[4096];
+    FILE *f;
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp)) {
+        return NULL;
+    }
+
+    f = fopen(tmp, "w");
+    if (f == NULL) {
+        tc_log_info(LOG_WARN, errno, "open stats file:%s failed", tmp);
+    }
+
+    return f;
+}
+
+
+void
+tc_mysql_stats_print(FILE *f, const char *prefix, tc_mysql_stats_t *st)
+{
+    size_t    i;
+    uint64_t *v = (uint64_t *) st;
+
+    for (i = 0; i < STATS_NUM; i++) {
+        fprintf(f, "%s%s %llu\n", prefix, stat_names[i],
+                (unsigned long long) v[i]);
+    }
+
+    if (st->buckets > 0) {
+        fprintf(f, "%sload_factor %.3f\n", prefix,
+                (double) st->recs / st->buckets);
+    }
+}
+
+
+int
+tc_mysql_stats_close(FILE *f, char *path)
+{
+    char tmp[4096];
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    if (fclose(f) != 0 || rename(tmp, path) == -1) {
+        tc_log_info(LOG_WARN, errno, "write stats file:%s failed", path);
+        return TC_ERR;
+    }
+
+    return TC_OK;
+}
@@ -0,0 +1,61 @@
+#ifndef  STATS_INCLUDED
+#define  STATS_INCLUDED
+#include <xcopy.h>
+
+#define TC_MYSQL_CACHE_LINE 64
+
+/*
+ * Counters and gauges of a shard. They are only bumped on the packet
+ * thread, which runs every callback, so counting costs a plain increment.
+ * The block fills cache lines of its own. Every field is a uint64_t, in
+ * the order of the names in stats.c.
+ */
+typedef struct {
+    /* counters */
+    uint64_t sessions;
+    uint64_t sessions_skipped;
+    uint64_t logins;
+    uint64_t login_fails;
+    uint64_t auth_refused;
+    uint64_t sec_auths;
+    uint64_t renewals;
+    uint64_t renewal_bytes;
+    uint64_t adoptions;
+    uint64_t state_changes;
+    uint64_t state_dropped;
+    uint64_t state_replays;
+    uint64_t compressed;
+    uint64_t refreshes;
+    uint64_t refresh_saved_bytes;
+    uint64_t ps_stored;
+    uint64_t ps_dropped;
+    uint64_t ps_closed;
+    uint64_t ps_reset;
+    uint64_t ps_failed;
+    uint64_t ps_evicted;
+    uint64_t ps_holes_refused;
+    uint64_t recs_evicted;
+    uint64_t recs_restored;
+    uint64_t resp_recorded;
+    uint64_t resp_matched;
+    uint64_t resp_mismatched;
+    uint64_t resp_unknown;
+    uint64_t resp_unstable;
+    uint64_t resp_lost;
+    uint64_t stmts_filtered;
+    uint64_t stmts_unfiltered;
+    /* gauges */
+    uint64_t recs;
+    uint64_t buckets;
+    uint64_t auth_bytes;
+    uint64_t ps_mem;
+    uint64_t ps_bytes;
+    uint64_t ps_ref_bytes;
+} __attribute__((aligned(TC_MYSQL_CACHE_LINE))) tc_mysql_stats_t;
+
+void tc_mysql_stats_sum(tc_mysql_stats_t *to, tc_mysql_stats_t *from);
+FILE *tc_mysql_stats_open(char *path);
+void tc_mysql_stats_print(FILE *f, const char *prefix, tc_mysql_stats_t *st);
+int tc_mysql_stats_close(FILE *f, char *path);
+
+#endif   /* ----- #ifndef STATS_INCLUDED  ----- */
@@ -1,54 +1,410 @@
 #include "password.h"
 #include "pairs.h"
 #include "protocol.h"
+#include "buffer.h"
+#include "stats.h"
+#include "digest.h"
+#include "latency.h"
+#include "fingerprint.h"
+#include "profile.h"
+#include "snapshot.h"
+#include "state.h"
+#include "compress.h"
 #include <xcopy.h>
 #include <tcpcopy.h>
 
+#define COM_QUIT 1
+#define COM_QUERY 3
+#define COM_FIELD_LIST 4
+#define COM_SHUTDOWN 8
+#define COM_STATISTICS 9
+#define COM_DEBUG 13
+#define COM_CHANGE_USER 17
+#define COM_BINLOG_DUMP 18
 #define COM_STMT_PREPARE 22
 #define COM_STMT_EXECUTE 23
-#define COM_QUERY 3
-#define MAX_SP_SIZE 256
+#define COM_STMT_CLOSE 25
+#define COM_STMT_SEND_LONG_DATA 24
+#define COM_STMT_RESET 26
+#define COM_STMT_FETCH 28
+#define COM_BINLOG_DUMP_GTID 30
+#define MAX_STMT_HOLES 1024
+#define DEFAULT_PS_BUDGET (512 * 1024 * 1024)
 #define MAX_USER_INFO 4096
-#define ENCRYPT_LEN 16
 #define SEED_323_LENGTH  8
+#define MAX_SHARD_NUM 64
+#define MAX_AMPLIFY 64
+#define COPY_PORT_SHIFT 11
+#define SHARD_TABLE_SIZE 65536
+#define MIN_SHARD_TABLE_SIZE 4096
+#define MAX_SHARD_TABLE_SIZE (1 << 20)
+#define MAX_EVICT_PER_TICK 4096
+#define MAX_FRAME_LEN (ETHERNET_HDR_LEN + 65535)
+#define MAX_RSA_CIPHER_LEN 1024
+#define MAX_RSA_KEY_FILE_LEN 16384
+/* a public key in PEM is the longest packet of the auth exchange */
+#define MAX_AUTH_RESP_LEN 16384
+#define MAX_REPLAY_SEG_LEN 1400
+#define MAX_PENDING_REQS 8
+#define MAX_REQ_TEXT 48
+#define MIN_SHARD_TOP_NUM 32
+#define DEFAULT_SNAPSHOT_INTERVAL 300
+#define MAX_ADOPT_AUTH_LEN 1024
+/* long password and flags, found rows, 4.1 protocol and auth, multi */
+#define DEFAULT_ADOPT_CAPS 0x000fa207
+#define ADOPT_CAPS_ON (CLIENT_PROTOCOL_41 | CLIENT_SECURE_CONNECTION \
+        | CLIENT_PLUGIN_AUTH)
+#define ADOPT_CAPS_OFF (CLIENT_CONNECT_WITH_DB | CLIENT_COMPRESS | CLIENT_SSL \
+        | CLIENT_CONNECT_ATTRS | CLIENT_QUERY_ATTRIBUTES)
+#define SAMPLE_SCALE 1000000
+#define MAX_SAMPLE_USERS 64
+#define FILTER_STMT "DO 0"
+#define FILTER_STMT_LEN (sizeof(FILTER_STMT) - 1)
+
+/*
+ * A command sent to the target and waiting for its response. key is
+ * what the response is recorded and checked under: the CRC32C of the
+ * query, or of the parameters of an execute mixed with the content hash
+ * of the statement prepared.
+ */
+typedef struct {
+    uint64_t key;
+    uint32_t kind:2;
+    uint32_t compared:1;
+    char     text[MAX_REQ_TEXT + 1];
+} tc_mysql_req_t;
+
+
+/*
+ * Comparison state of a session: commands are queued as they are
+ * captured and popped as the target's responses complete, which come
+ * later than the captured commands when the target is slower than the
+ * online server. A command packet spanning segments is hashed at key_pos.
+ */
+typedef struct {
+    uint32_t         head;
+    uint32_t         num;
+    uint32_t         key_req;
+    uint32_t         key_crc;
+    uint32_t         key_pos;
+    uint32_t         key_from;
+    uint32_t         key_size;
+    uint64_t         key_seed;
+    uint32_t         srv_next_seq;
+    uint32_t         srv_caps;
+    uint32_t         clt_caps;
+    uint32_t         lost:1;
+    uint32_t         key_pending:1;
+    uint32_t         resp_started:1;
+    uint32_t         srv_synced:1;
+    tc_mysql_resp_t  resp;
+    tc_mysql_req_t   reqs[MAX_PENDING_REQS];
+} tc_mysql_cmp_t;
+
+
+/*
+ * Commands waiting for the first packet of their response, with the time
+ * they were captured and the fingerprint of their statement. prev_seq is
+ * one more than the packet number of the last response packet, 0 before
+ * any.
+ */
+typedef struct {
+    uint64_t      sent[MAX_PENDING_REQS];
+    uint64_t      fps[MAX_PENDING_REQS];
+    unsigned char cmds[MAX_PENDING_REQS];
+    uint32_t      head;
+    uint32_t      num;
+    uint32_t      prev_seq;
+    uint32_t      lost;
+} tc_mysql_lat_t;
+
 
 typedef struct {
     time_t   last_refresh_time;
     uint32_t seq_after_ps;
-    uint32_t sec_auth_checked:1;
+    uint32_t pending_stmt_id;
+    uint32_t auth_done:1;
     uint32_t sec_auth_not_yet_done:1;
     uint32_t first_auth_sent:1;
     uint32_t auth_packet_already_added:1;
     uint32_t update_auth_table_item_switch:4;
+    uint32_t auth_plugin:3;
+    uint32_t sha2_full_auth:1;
+    uint32_t clt_compress:1;
+    uint32_t srv_compress:1;
+    uint32_t compress:1;
+    uint32_t srv_query_attrs:1;
+    uint32_t query_attrs:1;
+    uint32_t rsa_key_len;
+    unsigned char *rsa_key;
+    uint32_t auth_resp_len;
+    uint32_t auth_resp_have;
+    unsigned char *auth_resp;
+    uint32_t ps_capture_len;
+    uint32_t ps_capture_size;
+    uint32_t filter_left;
+    unsigned char *ps_capture;
+    tc_mysql_cmp_t *cmp;
+    tc_mysql_lat_t lat;
+    tc_mysql_framer_t clt_framer;
+    tc_mysql_framer_t srv_framer;
+    tc_mysql_zframer_t clt_zframer;
+    tc_mysql_zframer_t srv_zframer;
     char     scramble[SCRAMBLE_LENGTH + 1];
     char     seed323[SEED_323_LENGTH + 1];
     char     password[MAX_PASSWORD_LEN];
     char     user[MAX_USER_LEN];
     char     map_user[MAX_USER_LEN];
+    /* the entry of the first auth, valid while user_gen is current */
+    mysql_user *user_info;
+    uint32_t    user_gen;
 } tc_mysql_session;
 
 
+/*
+ * A live prepared statement of a session. The payload is interned in the
+ * shard's store and shared with every session preparing the same bytes.
+ * id is the statement id the server hands out, which counts every
+ * COM_STMT_PREPARE of the connection from 1. Statements sit on the
+ * shard's lru in order of last execution. fp is the fingerprint of the
+ * statement once it is executed with sql_top on, sql_class its class once
+ * it is executed with filter on.
+ */
 typedef struct {
-    link_list *list;
-    int tot_cont_len;
-} mysql_table_item_t;
-
-
+    link_node        lru;
+    uint32_t         id;
+    uint32_t         sql_class;
+    void            *rec;
+    tc_mysql_buf_t  *payload;
+    uint64_t         fp;
+} tc_mysql_stmt_t;
+
+
+/*
+ * Everything stored for one client connection: the first auth packet, the
+ * optional second auth packet, the schema and session variables it set
+ * and the prepared statements, so that a renew or a release costs a
+ * single probe into the shard's record table.
+ */
 typedef struct {
-    tc_pool_t      *fir_auth_pool;
-    tc_pool_t      *sec_auth_pool;
-    tc_pool_t      *ps_pool;
-    hash_table     *fir_auth_table;
-    hash_table     *sec_auth_table;
-    hash_table     *ps_table;
+    uint64_t          key;
+    time_t            access_time;
+    link_node         lru;
+    tc_mysql_buf_t   *fir_auth;
+    tc_mysql_buf_t   *sec_auth;
+    tc_mysql_state_t *state;
+    tc_mysql_stmt_t **stmts;
+    uint32_t          stmt_num;
+    uint32_t          stmt_cap;
+    uint32_t          last_stmt_id;
+    int               ps_cont_len;
+} tc_mysql_rec_t;
+
+
+/*
+ * A shard is a partition of the stored session state, not a thread: every
+ * callback runs on tcpcopy's one packet thread, and sessions are routed to
+ * a shard by their hash key to keep its tables, lrus and budget small.
+ * Nothing is locked, and the packet path also touches what all shards
+ * share: the mapped snapshot, the digests while recording and the user
+ * table. The only other threads are the user file loader and the snapshot
+ * writer, which touch nothing but what they are handed.
+ * Records are kept in lru order of access time, oldest first, and
+ * prepared statements in order of last execution. stats.ps_mem is what
+ * the statements cost the shard and is kept under ps_budget. lat holds a
+ * latency histogram for every command byte, top the heaviest statements
+ * when sql_top_file is set, prof the cost of the callbacks with profile on.
+ * zs inflates the first command of compressed sessions to be renewed.
+ */
+typedef struct {
+    tc_mysql_stats_t  stats;
+    tc_mysql_prof_t   prof;
+    tc_mysql_hist_t  *lat;
+    tc_mysql_top_t   *top;
+    tc_pool_t        *pool;
+    hash_table       *rec_table;
+    link_list        *lru;
+    link_list        *stmt_lru;
+    tc_mysql_store_t  ps_store;
+    unsigned char    *frame;
+    z_stream         *zs;
+    uint64_t          ps_budget;
+} tc_mysql_shard_t;
+
+
+/*
+ * State shared by all shards, on the same packet thread as they are.
+ * Response digests are keyed by request content rather than by session;
+ * a recording run adds to them from every shard, a checking run only
+ * reads them.
+ * snapshot holds the records stored before a restart until they are
+ * taken or idle; snapshot_job is the snapshot being written, if any.
+ */
+typedef struct {
+    tc_pool_t             *pool;
+    uint32_t               shard_num;
+    tc_mysql_shard_t      *shards;
+    tc_mysql_hist_t       *lat;
+    tc_mysql_top_t       **tops;
+    tc_mysql_top_entry_t  *top_merged;
+    tc_mysql_digests_t     digests;
+    tc_mysql_prof_t        prof;
+    uint64_t               start_usec;
+    tc_mysql_snapshot_t    snapshot;
+    time_t                 snapshot_time;
+    tc_mysql_snap_job_t   *snapshot_job;
 } tc_mysql_ctx_t;
 
-/* TODO allocate it on heap */
-static tc_mysql_ctx_t ctx;
+static uint32_t        shard_num = 1;
+static uint32_t        amplify = 1;
+static uint64_t        ps_budget = DEFAULT_PS_BUDGET;
+static tc_mysql_ctx_t *ctx;
+
+static char           *stats_file;
+static int             digest_mode;
+static uint32_t        top_num = DEFAULT_TOP_NUM;
+static char           *top_file;
+static char           *digest_file;
+
+/* a bit for every statement class not to be replayed */
+static uint32_t        filter_classes;
+
+static int             profile;
+static char           *snapshot_file;
+static int             snapshot_interval = DEFAULT_SNAPSHOT_INTERVAL;
+
+/*
+ * Sessions that logged in before capture began log in as adopt_user. The
+ * login is built once at start up and only framed for every session.
+ */
+static char            adopt_user[MAX_USER_LEN];
+static char            adopt_db[MAX_DB_LEN + 1];
+static uint32_t        adopt_caps = DEFAULT_ADOPT_CAPS;
+static unsigned char   adopt_auth[MAX_ADOPT_AUTH_LEN];
+static uint32_t        adopt_auth_len;
+
+/* public key of the target for caching_sha2 full authentication */
+static unsigned char  *rsa_public_key;
+static size_t          rsa_public_key_len;
+
+/*
+ * Sessions kept out of every SAMPLE_SCALE, by default and for the users
+ * given their own ratio. sample_max is the largest of them, all that is
+ * known of a session before its auth packet names the user, sample_min
+ * the smallest, all that is known of a session adopted.
+ */
+typedef struct {
+    char     user[MAX_USER_LEN];
+    uint32_t ratio;
+} tc_mysql_sample_t;
+
+static uint32_t           sample_ratio = SAMPLE_SCALE;
+static uint32_t           sample_max = SAMPLE_SCALE;
+static uint32_t           sample_min = SAMPLE_SCALE;
+static uint32_t           sample_user_num;
+static tc_mysql_sample_t  sample_users[MAX_SAMPLE_USERS];
+
+static unsigned char   stmt_placeholder[] = {
+    5, 0, 0, 0, COM_STMT_PREPARE, 'D', 'O', ' ', '0'
+};
+
+/* what a query without attributes starts with when they are on */
+static unsigned char   no_query_attrs[] = { 0x00, 0x01 };
+
+/* the placeholder in a frame of its own for compressed sessions */
+static unsigned char   stmt_zplaceholder[] = {
+    9, 0, 0, 0, 0, 0, 0,
+    5, 0, 0, 0, COM_STMT_PREPARE, 'D', 'O', ' ', '0'
+};
+
+
+/*
+ * tcpcopy clones a session by shifting its client port by multiples of
+ * 1 << COPY_PORT_SHIFT, so with sessions amplified the low bits of the
+ * port tell the session and the high bits the copy. The key carries the
+ * port in network order.
+ */
+static inline uint32_t
+get_copy_index(uint64_t key)
+{
+    return ntohs((uint16_t) key) >> COPY_PORT_SHIFT;
+}
+
+
+/*
+ * Shards are picked on the whole key, with only the copy bits of the port
+ * taken out when sessions are amplified: a session and its clones share a
+ * shard and the prepares they intern in its store, while the sessions of
+ * one client host still spread over every shard.
+ */
+static inline tc_mysql_shard_t *
+get_shard(uint64_t key)
+{
+    uint16_t port;
+
+    if (amplify > 1) {
+        port = ntohs((uint16_t) key) & ((1 << COPY_PORT_SHIFT) - 1);
+        key  = (key & ~(uint64_t) 0xffff) | htons(port);
+    }
+
+    /* mix the port bits into the high part before picking a shard */
+    key = (key ^ (key >> 29)) * 0x9e3779b97f4a7c15ULL;
+
+    return &ctx->shards[(key >> 32) % ctx->shard_num];
+}
+
+
+/*
+ * The decision depends on the session key alone, so a session renewed
+ * later and the same traffic replayed again are sampled alike. A session
+ * kept under a ratio is kept under every larger one.
+ */
+static inline int
+is_sampled(uint64_t key, uint32_t ratio)
+{
+    if (ratio >= SAMPLE_SCALE) {
+        return 1;
+    }
+
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+
+    return key % SAMPLE_SCALE < ratio;
+}
+
+
+static uint32_t
+get_user_sample_ratio(char *user)
+{
+    uint32_t i;
+
+    for (i = 0; i < sample_user_num; i++) {
+        if (strcmp(sample_users[i].user, user) == 0) {
+            return sample_users[i].ratio;
+        }
+    }
+
+    return sample_ratio;
+}
+
+
+/*
+ * The user of a session seen only after it logged in is not known, so it
+ * is adopted under the smallest ratio: a session kept out by any ratio,
+ * at its SYN or at its login, is not brought back by adoption.
+ */
+static inline int
+is_adoptable(uint64_t key)
+{
+    return adopt_auth_len > 0 && is_sampled(key, sample_min);
+}
 
 
 static int 
-init_mysql_module()
+init_shard(tc_mysql_shard_t *shard, uint32_t table_size)
 {
     tc_pool_t *pool;
 
@@ -57,489 +413,3627 @@ init_mysql_module()
 #if (TC_DETECT_MEMORY)
         pool->d.is_traced = 1;
 #endif
-        ctx.fir_auth_pool = pool;
+        shard->pool = pool;
     } else {
         return TC_ERR;
     }
 
-    pool = tc_create_pool(TC_PLUGIN_POOL_SIZE, TC_PLUGIN_POOL_SUB_SIZE, 0);
-    if (pool) {
-        ctx.sec_auth_pool = pool;
-    } else {
+    shard->rec_table = hash_create(shard->pool, table_size);
+    if (shard->rec_table == NULL) {
         return TC_ERR;
     }
 
-    pool = tc_create_pool(TC_PLUGIN_POOL_SIZE, TC_PLUGIN_POOL_SUB_SIZE, 0);
-    if (pool) {
-        ctx.ps_pool = pool;
-    } else {
+    shard->lru = link_list_create(shard->pool);
+    if (shard->lru == NULL) {
         return TC_ERR;
     }
 
-    ctx.fir_auth_table = hash_create(ctx.fir_auth_pool, 65536);
-    if (ctx.fir_auth_table == NULL) {
+    shard->stmt_lru = link_list_create(shard->pool);
+    if (shard->stmt_lru == NULL) {
         return TC_ERR;
     }
 
-    ctx.sec_auth_table = hash_create(ctx.sec_auth_pool, 65536);
-    if (ctx.sec_auth_table == NULL) {
+    if (tc_mysql_store_init(&shard->ps_store, shard->pool, table_size)
+            != TC_OK)
+    {
+        return TC_ERR;
+    }
+
+    shard->frame = tc_palloc(shard->pool, MAX_FRAME_LEN);
+    if (shard->frame == NULL) {
         return TC_ERR;
     }
 
-    ctx.ps_table = hash_create(ctx.ps_pool, 65536);
-    if (ctx.ps_table == NULL) {
+    shard->lat = tc_pcalloc(shard->pool, LAT_CMD_NUM * sizeof(tc_mysql_hist_t));
+    if (shard->lat == NULL) {
         return TC_ERR;
     }
 
     return TC_OK;
 }
 
-static unsigned char *
-copy_packet(tc_pool_t *pool, void *data)
+
+/*
+ * sql_top entries are shared out among the shards, a statement counted
+ * in several of them is added up when reported
+ */
+static int
+init_top(void)
 {
-    int            frame_len;
-    uint16_t       tot_len;
-    unsigned char *frame;
-    
-    tc_iph_t *ip = (tc_iph_t *) (((unsigned char *) data) + ETHERNET_HDR_LEN);
-    tot_len   = ntohs(ip->tot_len);
-    frame_len = ETHERNET_HDR_LEN + tot_len;
+    uint32_t          i, size;
+    tc_mysql_shard_t *shard;
+
+    size = top_num / ctx->shard_num;
+    if (size < MIN_SHARD_TOP_NUM) {
+        size = MIN_SHARD_TOP_NUM;
+    }
 
-    frame = (unsigned char *) tc_palloc(pool, frame_len);
+    ctx->tops = tc_palloc(ctx->pool, ctx->shard_num * sizeof(tc_mysql_top_t *));
+    ctx->top_merged = tc_palloc(ctx->pool,
+            ctx->shard_num * size * sizeof(tc_mysql_top_entry_t));
+    if (ctx->tops == NULL || ctx->top_merged == NULL) {
+        return TC_ERR;
+    }
 
-    if (frame != NULL) {    
-        memcpy(frame + ETHERNET_HDR_LEN, ip, tot_len);
-    }    
+    for (i = 0; i < ctx->shard_num; i++) {
+        shard = &ctx->shards[i];
+        shard->top = tc_palloc(shard->pool, sizeof(tc_mysql_top_t));
+        if (shard->top == NULL
+                || tc_mysql_top_init(shard->top, shard->pool, size) != TC_OK)
+        {
+            return TC_ERR;
+        }
+        ctx->tops[i] = shard->top;
+    }
 
-    return frame;
+    return TC_OK;
 }
 
 
-static int 
-remove_or_refresh_fir_auth(uint64_t key, int is_refresh)
+static int
+init_adopt(void)
 {
-    void *value, *new_value;
-    value = hash_find(ctx.fir_auth_table, key);
+    uint32_t caps;
 
-    if (value != NULL) {
-        hash_del(ctx.fir_auth_table, ctx.fir_auth_pool, key);
-        if (is_refresh) {
-            new_value = copy_packet(ctx.fir_auth_pool, value);
-            hash_add(ctx.fir_auth_table, ctx.fir_auth_pool, key, new_value);
-#if (TC_DETECT_MEMORY)
-            tc_log_info(LOG_INFO, 0, "refresh fir auth:%llu, new addr:%p",
-                    key, new_value);
-#endif
-        }
-#if (TC_DETECT_MEMORY)
-        tc_log_info(LOG_INFO, 0, "free value:%p for key:%llu", value, key);
-#endif
-        tc_pfree(ctx.fir_auth_pool, value);
+    caps = (adopt_caps | ADOPT_CAPS_ON) & ~ADOPT_CAPS_OFF;
+    if (adopt_db[0] != '\0') {
+        caps |= CLIENT_CONNECT_WITH_DB;
+    }
+
+    adopt_auth_len = build_clt_auth(adopt_auth, MAX_ADOPT_AUTH_LEN, caps,
+            adopt_user, adopt_db);
+    if (adopt_auth_len == 0) {
+        tc_log_info(LOG_ERR, 0, "adopt login of %s is too long", adopt_user);
+        return TC_ERR;
     }
 
+    if (retrieve_user_info(adopt_user) == NULL) {
+        tc_log_info(LOG_WARN, 0, "adopt user:%s has no password", adopt_user);
+    }
+
+    tc_log_info(LOG_NOTICE, 0, "mysql adopts sessions as %s, db:%s, caps:%x",
+            adopt_user, adopt_db, caps);
+
     return TC_OK;
 }
 
 
 static int 
-remove_or_refresh_sec_auth(uint64_t key, int is_refresh)
+init_mysql_module()
 {
-    void *value, *new_value;
+    void      *p;
+    uint32_t   i, table_size;
+    tc_pool_t *pool;
 
-    value = hash_find(ctx.sec_auth_table, key);
-    if (value != NULL) {
-        hash_del(ctx.sec_auth_table, ctx.sec_auth_pool, key);
-        if (is_refresh) {
-            new_value = copy_packet(ctx.sec_auth_pool, value);
-            hash_add(ctx.sec_auth_table, ctx.sec_auth_pool, key, new_value);
-#if (TC_DETECT_MEMORY)
-            tc_log_info(LOG_INFO, 0, "refresh sec auth:%llu, new addr:%p", 
-                    key, new_value);
-#endif
-        }
-#if (TC_DETECT_MEMORY)
-        tc_log_info(LOG_INFO, 0, "free value:%p for key:%llu", value, key);
-#endif
-        tc_pfree(ctx.sec_auth_pool, value);
+    pool = tc_create_pool(TC_PLUGIN_POOL_SIZE, TC_PLUGIN_POOL_SUB_SIZE, 0);
+    if (pool == NULL) {
+        return TC_ERR;
     }
 
-    return TC_OK;
-}
+    ctx = (tc_mysql_ctx_t *) tc_pcalloc(pool, sizeof(tc_mysql_ctx_t));
+    if (ctx == NULL) {
+        tc_destroy_pool(pool);
+        return TC_ERR;
+    }
 
+    ctx->pool       = pool;
+    ctx->shard_num  = shard_num;
+    ctx->start_usec = tc_mysql_usec();
 
-static int 
-remove_or_refresh_ps_stmt(uint64_t key, int is_refresh)
-{
-    void               *value, *pkt;
-    link_list          *list;
-    p_link_node         ln, tln, new_ln;
-    mysql_table_item_t *item, *new_item;
-
-    value = hash_find(ctx.ps_table, key);
-    if (value != NULL) {
-
-        item = value;
-
-        if (is_refresh) {
-            new_item = tc_pcalloc(ctx.ps_pool, sizeof(mysql_table_item_t));
-            if (new_item != NULL) {
-                new_item->list = link_list_create(ctx.ps_pool);
-                if (new_item->list == NULL) {
-                    tc_log_info(LOG_ERR, 0, "list create err");
-                    is_refresh = 0;
-                } else {
-                    new_item->tot_cont_len = item->tot_cont_len;
-                }
-            } else {
-                tc_log_info(LOG_ERR, 0, "mysql item create err");
-                is_refresh = 0;
-            }
-        }
+    /* the pool does not align to cache lines, the stats need it */
+    p = tc_pcalloc(pool, shard_num * sizeof(tc_mysql_shard_t)
+            + TC_MYSQL_CACHE_LINE);
+    if (p == NULL) {
+        return TC_ERR;
+    }
+    ctx->shards = (tc_mysql_shard_t *) (((uintptr_t) p + TC_MYSQL_CACHE_LINE
+                - 1) & ~((uintptr_t) TC_MYSQL_CACHE_LINE - 1));
 
-        list = item->list;
-        ln   = link_list_first(list);
-        while (ln) {
-            tln = ln;
-            ln = link_list_get_next(list, ln);
-            link_list_remove(list, tln);
-            if (is_refresh) {
-                pkt = (unsigned char *) copy_packet(ctx.ps_pool, tln->data);
-                new_ln  = link_node_malloc(ctx.ps_pool, pkt);
-                new_ln->key = tln->key;
-                link_list_append_by_order(new_item->list, new_ln);
-#if (TC_DETECT_MEMORY)
-                tc_log_info(LOG_INFO, 0, "refresh ps:%llu, new addr:%p, ln:%p",
-                        key, pkt, new_ln);
-#endif
-            }
-            tc_pfree(ctx.ps_pool, tln->data);
-            tc_pfree(ctx.ps_pool, tln);
+    /* where the shards' histograms are summed up */
+    ctx->lat = tc_palloc(pool, LAT_CMD_NUM * sizeof(tc_mysql_hist_t));
+    if (ctx->lat == NULL) {
+        return TC_ERR;
+    }
+
+    /* every clone keeps a record of its own */
+    table_size = SHARD_TABLE_SIZE / shard_num * amplify;
+    if (table_size < MIN_SHARD_TABLE_SIZE) {
+        table_size = MIN_SHARD_TABLE_SIZE;
+    } else if (table_size > MAX_SHARD_TABLE_SIZE) {
+        table_size = MAX_SHARD_TABLE_SIZE;
+    }
+
+    for (i = 0; i < shard_num; i++) {
+        if (init_shard(&ctx->shards[i], table_size) != TC_OK) {
+            tc_log_info(LOG_ERR, 0, "init mysql shard:%u failed", i);
+            return TC_ERR;
         }
+        ctx->shards[i].ps_budget = ps_budget / shard_num;
+    }
 
-        tc_pfree(ctx.ps_pool, value);
-        tc_pfree(ctx.ps_pool, list);
+    if (top_file != NULL && init_top() != TC_OK) {
+        tc_log_info(LOG_ERR, 0, "init mysql sql top failed");
+        return TC_ERR;
+    }
 
-        hash_del(ctx.ps_table, ctx.ps_pool, key);
-                    
-        if (is_refresh) {
-            hash_add(ctx.ps_table, ctx.ps_pool, key, new_item);
-#if (TC_DETECT_MEMORY)
-            tc_log_info(LOG_INFO, 0, "refresh:%llu, new item:%p",
-                    key, new_item);
-#endif
+    if (adopt_user[0] != '\0') {
+        if (init_adopt() != TC_OK) {
+            return TC_ERR;
         }
     }
 
-    return TC_OK;
-}
+    if (snapshot_file != NULL) {
+        if (tc_mysql_snapshot_open(&ctx->snapshot, pool, snapshot_file)
+                != TC_OK)
+        {
+            return TC_ERR;
+        }
+        ctx->snapshot_time = tc_time();
+    }
 
+    if (digest_mode) {
+        if (tc_mysql_digests_init(&ctx->digests, digest_mode, digest_file)
+                != TC_OK)
+        {
+            tc_log_info(LOG_ERR, 0, "init mysql digests failed");
+            return TC_ERR;
+        }
+    }
 
-static int 
-release_resources(uint64_t key)
-{
-    remove_or_refresh_fir_auth(key, 0);
-    remove_or_refresh_sec_auth(key, 0);
-    remove_or_refresh_ps_stmt(key, 0);
+    sample_max = sample_ratio;
+    sample_min = sample_ratio;
+    for (i = 0; i < sample_user_num; i++) {
+        if (sample_users[i].ratio > sample_max) {
+            sample_max = sample_users[i].ratio;
+        }
+        if (sample_users[i].ratio < sample_min) {
+            sample_min = sample_users[i].ratio;
+        }
+    }
+
+    tc_log_info(LOG_NOTICE, 0, "mysql module shards:%u, table size:%u",
+            shard_num, table_size);
+    if (amplify > 1) {
+        tc_log_info(LOG_NOTICE, 0,
+                "mysql sessions amplified:%u, run tcpcopy with -n %u",
+                amplify, amplify);
+    }
+    if (sample_max < SAMPLE_SCALE || sample_user_num > 0) {
+        tc_log_info(LOG_NOTICE, 0, "mysql sample ratio:%.4f, users:%u",
+                (double) sample_ratio / SAMPLE_SCALE, sample_user_num);
+    }
 
     return TC_OK;
 }
 
-static int 
-refresh_resources(uint64_t key)
+static void
+touch_rec(tc_mysql_shard_t *shard, tc_mysql_rec_t *rec)
 {
-    remove_or_refresh_fir_auth(key, 1);
-    remove_or_refresh_sec_auth(key, 1);
-    remove_or_refresh_ps_stmt(key, 1);
+    time_t now = tc_time();
 
-    return TC_OK;
+    /* order within the same second does not matter for eviction */
+    if (rec->access_time != now) {
+        rec->access_time = now;
+        link_list_remove(shard->lru, &rec->lru);
+        link_list_append(shard->lru, &rec->lru);
+    }
 }
 
-static void 
-remove_table_obsolete_items(time_t thresh_access_tme) 
+
+static tc_mysql_rec_t *
+find_rec(tc_mysql_shard_t *shard, uint64_t key)
 {
-    uint32_t    i, cnt = 0;
-    link_list  *l;
-    hash_node  *hn;
-    p_link_node ln, next_ln;
+    tc_mysql_rec_t *rec;
 
-    if (ctx.fir_auth_table == NULL || ctx.fir_auth_table->total == 0) {
-        return;
+    rec = hash_find(shard->rec_table, key);
+    if (rec != NULL) {
+        touch_rec(shard, rec);
     }
 
-    for (i = 0; i < ctx.fir_auth_table->size; i ++) {
-        l  = get_link_list(ctx.fir_auth_table, i);
-        if (l->size > 0) {
-            ln = link_list_first(l);
-            while (ln) {
-                hn = (hash_node *) ln->data;
-                next_ln = link_list_get_next(l, ln);
-                if (hn->access_time < thresh_access_tme) {
-                    tc_log_info(LOG_INFO, 0, 
-                            "key:%llu, access time:%u, thresh_access_tme:%u",
-                            hn->key, hn->access_time, thresh_access_tme);
-
-                    release_resources(hn->key);
-                }
-                ln = next_ln;
-            }
+    return rec;
+}
 
-            cnt += l->size;
 
-            if (ctx.fir_auth_table->total == cnt) {
-                break;
-            }
+static tc_mysql_rec_t *
+get_rec(tc_mysql_shard_t *shard, uint64_t key)
+{
+    tc_mysql_rec_t *rec;
+
+    rec = find_rec(shard, key);
+    if (rec == NULL) {
+        rec = tc_pcalloc(shard->pool, sizeof(tc_mysql_rec_t));
+        if (rec == NULL) {
+            tc_log_info(LOG_ERR, 0, "mysql rec create err");
+            return NULL;
         }
+        rec->key         = key;
+        rec->access_time = tc_time();
+        rec->lru.data    = rec;
+        link_list_append(shard->lru, &rec->lru);
+        hash_add(shard->rec_table, shard->pool, key, rec);
+
+        /* what is stored from now on replaces what was before a restart */
+        tc_mysql_snapshot_take(&ctx->snapshot, key);
     }
+
+    return rec;
 }
 
 
-static void 
-remove_obsolete_resources(int is_full) 
+/* whether the client of a stored login asked for compression */
+static int
+is_compressed_rec(tc_mysql_rec_t *rec)
 {
-    time_t      thresh_access_tme;
-
-    if (is_full) {
-        thresh_access_tme = tc_time() + 1;
-    } else {
-        thresh_access_tme = tc_time() - MAX_IDLE_TIME;
+    if (rec->fir_auth == NULL) {
+        return 0;
     }
 
-    remove_table_obsolete_items(thresh_access_tme);
+    return (get_client_capabilities(rec->fir_auth->data, rec->fir_auth->len)
+            & CLIENT_COMPRESS) != 0;
 }
 
 
-static void 
-exit_mysql_module() 
+/*
+ * Clients ask for query attributes only of servers offering them, so the
+ * stored login tells whether a renewed session sends them
+ */
+static int
+is_query_attrs_rec(tc_mysql_rec_t *rec)
 {
-    tc_log_info(LOG_INFO, 0, "call exit_mysql_module");
+    if (rec->fir_auth == NULL) {
+        return 0;
+    }
 
-    remove_obsolete_resources(1);
+    return (get_client_capabilities(rec->fir_auth->data, rec->fir_auth->len)
+            & CLIENT_QUERY_ATTRIBUTES) != 0;
+}
 
-    if (ctx.fir_auth_pool != NULL) {
-        tc_destroy_pool(ctx.fir_auth_pool);
-        ctx.fir_auth_pool = NULL;
-        ctx.fir_auth_table = NULL;
-    }
 
-    if (ctx.sec_auth_pool != NULL) {
-        tc_destroy_pool(ctx.sec_auth_pool);
-        ctx.sec_auth_pool = NULL;
-        ctx.sec_auth_table = NULL;
+static int
+find_stmt(tc_mysql_rec_t *rec, uint32_t id)
+{
+    int low, high, mid;
+
+    /* ids only grow, so the array is sorted */
+    low  = 0;
+    high = (int) rec->stmt_num - 1;
+    while (low <= high) {
+        mid = (low + high) >> 1;
+        if (rec->stmts[mid]->id == id) {
+            return mid;
+        } else if (rec->stmts[mid]->id < id) {
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
     }
 
-    if (ctx.ps_pool != NULL) {
-        tc_destroy_pool(ctx.ps_pool);
-        ctx.ps_pool = NULL;
-        ctx.ps_table = NULL;
-    }
+    return -1;
 }
 
 
-static bool
-check_renew_session(tc_iph_t *ip, tc_tcph_t *tcp)
+static void
+remove_stmt(tc_mysql_shard_t *shard, tc_mysql_rec_t *rec, int i)
 {
-    void           *value;
-    uint16_t        size_ip, size_tcp, tot_len, cont_len;
-    uint64_t        key;
-    unsigned char  *payload, command, pack_number;
+    tc_mysql_stmt_t *stmt = rec->stmts[i];
 
-    if (ctx.fir_auth_table == NULL) {
-        return false;
-    }
+    rec->stmt_num--;
+    memmove(rec->stmts + i, rec->stmts + i + 1,
+            (rec->stmt_num - i) * sizeof(tc_mysql_stmt_t *));
+    rec->ps_cont_len -= stmt->payload->len;
 
-    key   = get_key(ip->saddr, tcp->source);
-    value = hash_find(ctx.fir_auth_table, key);
-    if (value == NULL) {
-        return false;
+    if (stmt->payload->ref == 1) {
+        shard->stats.ps_mem -= stmt->payload->len;
     }
+    shard->stats.ps_mem -= sizeof(tc_mysql_stmt_t);
 
-    size_ip  = ip->ihl << 2;
-    size_tcp = tcp->doff << 2;
-    tot_len  = ntohs(ip->tot_len);
-    cont_len = tot_len - size_tcp - size_ip;
+    link_list_remove(shard->stmt_lru, &stmt->lru);
+    tc_mysql_store_put(&shard->ps_store, stmt->payload);
+    tc_pfree(shard->pool, stmt);
+}
 
-    if (cont_len > 0) {
-        payload = (unsigned char *) ((char *) tcp + size_tcp);
-        /* skip packet length */
-        payload = payload + 3;
-        /* retrieve packet number */
-        pack_number = payload[0];
-        /* if it is the second authenticate_user, skip it */
-        if (pack_number != 0) {
-            return false;
+
+/*
+ * Evict the least recently executed statements until the shard is within
+ * its budget. An evicted statement can't be restored on renewal any more.
+ */
+static void
+check_ps_budget(tc_mysql_shard_t *shard)
+{
+    int              i;
+    p_link_node      ln;
+    tc_mysql_rec_t  *rec;
+    tc_mysql_stmt_t *stmt;
+
+    while (shard->stats.ps_mem > shard->ps_budget) {
+        ln = link_list_first(shard->stmt_lru);
+        if (ln == NULL) {
+            break;
         }
-        /* skip packet number */
-        payload = payload + 1;
 
-        command = payload[0];
-        tc_log_debug1(LOG_DEBUG, 0, "mysql command:%u", command);
-        if (command == COM_QUERY || command == COM_STMT_EXECUTE) {
-            return true;
+        stmt = ln->data;
+        rec  = stmt->rec;
+        i    = find_stmt(rec, stmt->id);
+        if (i < 0) {
+            link_list_remove(shard->stmt_lru, ln);
+            continue;
         }
-    }
 
-    return false;
+        tc_log_debug2(LOG_INFO, 0, "evict stmt:%u of key:%llu",
+                stmt->id, rec->key);
+        remove_stmt(shard, rec, i);
+        shard->stats.ps_evicted++;
+    }
 }
-        
 
-static bool 
-check_pack_needed_for_recons(tc_sess_t *s, tc_iph_t *ip, tc_tcph_t *tcp)
-{
-    int                 diff;
-    uint16_t            size_tcp;
-    p_link_node         ln;
-    unsigned char      *payload, command, *pkt;
-    tc_mysql_session   *mysql_sess;
-    mysql_table_item_t *item;
-
-    mysql_sess = s->data;
 
-    if (s->sm.fake_syn) {
-        if (before(ntohl(tcp->seq), mysql_sess->seq_after_ps)) {
-            return false;
+static int
+add_stmt(tc_mysql_shard_t *shard, tc_mysql_rec_t *rec, uint32_t id,
+        unsigned char *payload, uint32_t len)
+{
+    uint32_t          cap;
+    tc_mysql_stmt_t  *stmt, **stmts;
+
+    if (rec->stmt_num == rec->stmt_cap) {
+        cap   = rec->stmt_cap ? rec->stmt_cap << 1 : 8;
+        stmts = tc_palloc(shard->pool, cap * sizeof(tc_mysql_stmt_t *));
+        if (stmts == NULL) {
+            tc_log_info(LOG_ERR, 0, "mysql stmt array create err");
+            shard->stats.ps_dropped++;
+            return TC_ERR;
+        }
+        if (rec->stmts != NULL) {
+            memcpy(stmts, rec->stmts,
+                    rec->stmt_num * sizeof(tc_mysql_stmt_t *));
+            tc_pfree(shard->pool, rec->stmts);
         }
+        rec->stmts    = stmts;
+        rec->stmt_cap = cap;
     }
 
-    if (s->cur_pack.cont_len > 0) {
-
-        size_tcp = tcp->doff << 2;
-        payload = (unsigned char *) ((char *) tcp + size_tcp);
-        /* skip packet length */
-        payload  = payload + 3;
-        /* skip packet number */
-        payload  = payload + 1;
-        command  = payload[0];
-
-        if (command != COM_STMT_PREPARE) {
-            
-            diff = tc_time() - mysql_sess->last_refresh_time;
-
-            if (diff >= MAX_RETHRESH_TIME) {
-                refresh_resources(s->hash_key);
-                mysql_sess->last_refresh_time = tc_time();
-                mysql_sess->update_auth_table_item_switch = 0;
-#if (TC_DETECT_MEMORY)
-                tc_log_info(LOG_NOTICE, 0, "refresh time:%u for key:%llu", 
-                        mysql_sess->last_refresh_time, s->hash_key);
-#endif
-            }
+    stmt = tc_pcalloc(shard->pool, sizeof(tc_mysql_stmt_t));
+    if (stmt == NULL) {
+        tc_log_info(LOG_ERR, 0, "mysql stmt create err");
+        shard->stats.ps_dropped++;
+        return TC_ERR;
+    }
 
-            mysql_sess->update_auth_table_item_switch++;
-            if (mysql_sess->update_auth_table_item_switch == 0) {
-                if (hash_find(ctx.fir_auth_table, s->hash_key) == NULL) {
-                    tc_log_info(LOG_NOTICE, 0, "no fir auth for key:%llu", 
-                            s->hash_key);
-                }
-            }
+    stmt->payload = tc_mysql_store_intern(&shard->ps_store, payload, len);
+    if (stmt->payload == NULL) {
+        tc_pfree(shard->pool, stmt);
+        shard->stats.ps_dropped++;
+        return TC_ERR;
+    }
 
-            return false;
-        }
+    stmt->id       = id;
+    stmt->rec      = rec;
+    stmt->lru.data = stmt;
+    link_list_append(shard->stmt_lru, &stmt->lru);
 
-        item = hash_find(ctx.ps_table, s->hash_key);
+    rec->stmts[rec->stmt_num++] = stmt;
+    rec->ps_cont_len += len;
 
-        if (!item) {
-            item = tc_pcalloc(ctx.ps_pool, sizeof(mysql_table_item_t));
-            if (item != NULL) {
-                item->list = link_list_create(ctx.ps_pool);
-                if (item->list != NULL) {
-                    hash_add(ctx.ps_table, ctx.ps_pool, s->hash_key, item);
-                } else {
-                    tc_log_info(LOG_ERR, 0, "list create err");
-                    return false;
-                }
-            } else {
-                tc_log_info(LOG_ERR, 0, "mysql item create err");
-                return false;
-            }
-        }
+    if (stmt->payload->ref == 1) {
+        shard->stats.ps_mem += len;
+    }
+    shard->stats.ps_mem += sizeof(tc_mysql_stmt_t);
+    shard->stats.ps_stored++;
 
-        if (item->list->size > MAX_SP_SIZE) {
-            tc_log_info(LOG_INFO, 0, "too many prepared stmts for a session");
-            return false;
-        }
+    check_ps_budget(shard);
 
-        tc_log_debug1(LOG_INFO, 0, "push packet:%u", ntohs(s->src_port));
+    return TC_OK;
+}
 
-        pkt = (unsigned char *) cp_fr_ip_pack(ctx.ps_pool, ip);
-        ln  = link_node_malloc(ctx.ps_pool, pkt);
-        ln->key = ntohl(tcp->seq);
-        link_list_append_by_order(item->list, ln);
-        item->tot_cont_len += s->cur_pack.cont_len;
 
-        return true;
+static void
+free_rec_ps(tc_mysql_shard_t *shard, tc_mysql_rec_t *rec)
+{
+    while (rec->stmt_num > 0) {
+        remove_stmt(shard, rec, rec->stmt_num - 1);
     }
 
-    return false;
+    if (rec->stmts != NULL) {
+        tc_pfree(shard->pool, rec->stmts);
+        rec->stmts    = NULL;
+        rec->stmt_cap = 0;
+    }
 }
 
 
-static int
-mysql_dispose_auth(tc_sess_t *s, tc_iph_t *ip, tc_tcph_t *tcp)
+static int 
+release_resources(uint64_t key)
 {
-    int               auth_success;
-    void             *value;
-    char              encryption[ENCRYPT_LEN];
-    uint16_t          size_tcp, cont_len;
-    unsigned char    *payload;
-    tc_mysql_session *mysql_sess;
+    tc_mysql_rec_t   *rec;
+    tc_mysql_shard_t *shard;
 
-    mysql_sess = s->data;
+    if (ctx == NULL) {
+        return TC_OK;
+    }
+
+    shard = get_shard(key);
+    rec   = hash_find(shard->rec_table, key);
+    if (rec == NULL) {
+        return TC_OK;
+    }
+
+    hash_del(shard->rec_table, shard->pool, key);
+    link_list_remove(shard->lru, &rec->lru);
+
+#if (TC_DETECT_MEMORY)
+    tc_log_info(LOG_INFO, 0, "free rec:%p for key:%llu", rec, key);
+#endif
+    if (rec->fir_auth != NULL) {
+        shard->stats.auth_bytes -= rec->fir_auth->len;
+        tc_mysql_buf_put(shard->pool, rec->fir_auth);
+    }
+
+    if (rec->sec_auth != NULL) {
+        shard->stats.auth_bytes -= rec->sec_auth->len;
+        tc_mysql_buf_put(shard->pool, rec->sec_auth);
+    }
+
+    tc_mysql_state_free(shard->pool, rec->state);
+    free_rec_ps(shard, rec);
+    tc_pfree(shard->pool, rec);
+
+    return TC_OK;
+}
+
+
+static tc_mysql_buf_t *
+restore_auth(tc_mysql_shard_t *shard, unsigned char *data, uint32_t len)
+{
+    tc_mysql_buf_t *buf;
+
+    if (len <= MYSQL_HEADER_LEN
+            || (uint32_t) (data[0] + (data[1] << 8) + (data[2] << 16))
+            + MYSQL_HEADER_LEN != len)
+    {
+        return NULL;
+    }
+
+    buf = tc_mysql_buf_create(shard->pool, data, len);
+    if (buf != NULL) {
+        shard->stats.auth_bytes += buf->len;
+    }
+
+    return buf;
+}
+
+
+/*
+ * Put back a record stored before a restart, the first time its key is
+ * seen again. Its prepares are interned again as they are added.
+ */
+static tc_mysql_rec_t *
+restore_rec(tc_mysql_shard_t *shard, uint64_t key)
+{
+    uint32_t              i, len;
+    unsigned char        *p, *data;
+    tc_mysql_rec_t       *rec;
+    tc_mysql_snap_rec_t  *sr;
+    tc_mysql_snap_stmt_t *ss;
+
+    sr = tc_mysql_snapshot_take(&ctx->snapshot, key);
+    if (sr == NULL) {
+        return NULL;
+    }
+
+    rec = get_rec(shard, key);
+    if (rec == NULL) {
+        return NULL;
+    }
+
+    p = (unsigned char *) (sr + 1);
+    rec->fir_auth = restore_auth(shard, p, sr->fir_len);
+    if (rec->fir_auth == NULL) {
+        release_resources(key);
+        return NULL;
+    }
+    p += SNAP_ALIGN(sr->fir_len);
+
+    if (sr->sec_len > 0) {
+        rec->sec_auth = restore_auth(shard, p, sr->sec_len);
+    }
+    p += SNAP_ALIGN(sr->sec_len);
+
+    if (sr->state_len > 0) {
+        tc_mysql_state_load(shard->pool, &rec->state, p, sr->state_len);
+    }
+    p += SNAP_ALIGN(sr->state_len);
+
+    ss = (tc_mysql_snap_stmt_t *) p;
+    for (i = 0; i < sr->stmt_num; i++) {
+        data = tc_mysql_snapshot_payload(&ctx->snapshot, ss[i].payload, &len);
+        add_stmt(shard, rec, ss[i].id, data, len);
+    }
+    rec->last_stmt_id = sr->last_stmt_id;
+
+    shard->stats.recs_restored++;
+    tc_log_debug1(LOG_INFO, 0, "restore rec of key:%llu", key);
+
+    return rec;
+}
+
+
+/*
+ * Take in every record of the mapped snapshot no session has asked for,
+ * with the access time it was saved with, so that a snapshot written
+ * over it keeps them
+ */
+static void
+restore_untaken_recs(void)
+{
+    uint64_t              i, key;
+    tc_mysql_rec_t       *rec;
+    tc_mysql_snapshot_t  *snap;
+    tc_mysql_snap_rec_t  *sr;
+
+    snap = &ctx->snapshot;
+
+    for (i = 0; i < snap->rec_num; i++) {
+        if (snap->taken[i >> 3] & (1 << (i & 7))) {
+            continue;
+        }
+
+        key = snap->idx[i].key;
+        rec = restore_rec(get_shard(key), key);
+        if (rec != NULL) {
+            sr = (tc_mysql_snap_rec_t *) (snap->base + snap->idx[i].off);
+            rec->access_time = sr->access_time;
+        }
+    }
+}
+
+
+/*
+ * Gather what the snapshot is written from, on the packet thread: every
+ * record a session could be renewed from, with a reference on each of its
+ * payloads and a copy of its state.
+ */
+static tc_mysql_snap_job_t *
+create_snapshot_job(void)
+{
+    uint32_t                  i, j, k, len;
+    uint64_t                  num;
+    tc_pool_t                *pool;
+    p_link_node               ln;
+    tc_mysql_rec_t           *rec;
+    tc_mysql_shard_t         *shard;
+    tc_mysql_snap_job_t      *job;
+    tc_mysql_snap_job_rec_t  *jr;
+    unsigned char             state[MAX_STATE_LEN];
+
+    pool = tc_create_pool(TC_PLUGIN_POOL_SIZE, TC_PLUGIN_POOL_SUB_SIZE, 0);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    num = 0;
+    for (i = 0; i < ctx->shard_num; i++) {
+        num += ctx->shards[i].rec_table->total;
+    }
+
+    job = tc_pcalloc(pool, sizeof(tc_mysql_snap_job_t));
+    if (job == NULL) {
+        tc_destroy_pool(pool);
+        return NULL;
+    }
+    job->pool = pool;
+    job->path = snapshot_file;
+    job->time = ctx->snapshot_time;
+    job->recs = tc_pcalloc(pool, (num + 1) * sizeof(tc_mysql_snap_job_rec_t));
+    if (job->recs == NULL) {
+        tc_destroy_pool(pool);
+        return NULL;
+    }
+
+    for (i = 0; i < ctx->shard_num; i++) {
+        shard = &ctx->shards[i];
+        for (ln = link_list_first(shard->lru);
+                ln != NULL && job->rec_num < num;
+                ln = link_list_get_next(shard->lru, ln))
+        {
+            rec = ln->data;
+            if (rec->fir_auth == NULL) {
+                continue;
+            }
+
+            jr = &job->recs[job->rec_num];
+            jr->key          = rec->key;
+            jr->access_time  = rec->access_time;
+            jr->shard        = i;
+            jr->last_stmt_id = rec->last_stmt_id;
+
+            if (rec->state != NULL) {
+                len = tc_mysql_state_build(rec->state, state);
+                jr->state = tc_palloc(pool, len + 1);
+                if (jr->state == NULL) {
+                    continue;
+                }
+                memcpy(jr->state, state, len);
+                jr->state_len = len;
+            }
+
+            jr->stmts = tc_palloc(pool,
+                    (rec->stmt_num + 1) * sizeof(tc_mysql_snap_job_stmt_t));
+            if (jr->stmts == NULL) {
+                continue;
+            }
+            for (j = 0, k = 0; j < rec->stmt_num; j++) {
+                if (rec->stmts[j]->payload != NULL) {
+                    jr->stmts[k].id  = rec->stmts[j]->id;
+                    jr->stmts[k].buf = tc_mysql_store_get(&shard->ps_store,
+                            rec->stmts[j]->payload);
+                    k++;
+                }
+            }
+            jr->stmt_num = k;
+            job->stmt_num += k;
+
+            jr->fir_auth = tc_mysql_buf_get(rec->fir_auth);
+            if (rec->sec_auth != NULL) {
+                jr->sec_auth = tc_mysql_buf_get(rec->sec_auth);
+            }
+            job->rec_num++;
+        }
+    }
+
+    return job;
+}
+
+
+/* give back what a job held, on the packet thread */
+static void
+release_snapshot_job(tc_mysql_snap_job_t *job)
+{
+    uint32_t                  j;
+    uint64_t                  i;
+    tc_mysql_buf_t           *buf;
+    tc_mysql_shard_t         *shard;
+    tc_mysql_snap_job_rec_t  *jr;
+
+    for (i = 0; i < job->rec_num; i++) {
+        jr = &job->recs[i];
+        shard = &ctx->shards[jr->shard];
+
+        for (j = 0; j < jr->stmt_num; j++) {
+            buf = jr->stmts[j].buf;
+            /* the statements that shared it are all gone */
+            if (buf->ref == 1) {
+                shard->stats.ps_mem -= buf->len;
+            }
+            tc_mysql_store_put(&shard->ps_store, buf);
+        }
+
+        tc_mysql_buf_put(shard->pool, jr->fir_auth);
+        if (jr->sec_auth != NULL) {
+            tc_mysql_buf_put(shard->pool, jr->sec_auth);
+        }
+    }
+
+    tc_destroy_pool(job->pool);
+}
+
+
+static void
+finish_snapshot_job(tc_mysql_snap_job_t *job)
+{
+    if (job->err != 0) {
+        tc_log_info(LOG_WARN, job->err, "write mysql snapshot:%s failed",
+                job->path);
+    } else {
+        tc_log_info(LOG_INFO, 0, "mysql snapshot written, records:%llu, "
+                "payloads:%llu of %llu statements, took:%llu us",
+                job->rec_num, job->payload_num, job->stmt_num, job->usec);
+    }
+
+    release_snapshot_job(job);
+}
+
+
+/*
+ * Checkpoint every record a session could be renewed from. Sorting the
+ * records and writing the file is left to a thread of its own, which a
+ * later tick waits for before the next one is started.
+ */
+static void
+check_snapshot(void)
+{
+    tc_mysql_snap_job_t *job;
+
+    job = ctx->snapshot_job;
+    if (job != NULL) {
+        if (tc_mysql_snapshot_done(job, 0)) {
+            finish_snapshot_job(job);
+            ctx->snapshot_job = NULL;
+        }
+        return;
+    }
+
+    ctx->snapshot_time = tc_time();
+
+    job = create_snapshot_job();
+    if (job == NULL) {
+        return;
+    }
+
+    if (tc_mysql_snapshot_start(job) != TC_OK) {
+        tc_log_info(LOG_ERR, errno, "start mysql snapshot writer failed");
+        release_snapshot_job(job);
+        return;
+    }
+
+    ctx->snapshot_job = job;
+}
+
+
+/* the last snapshot, written on the packet thread as the module exits */
+static void
+write_snapshot(void)
+{
+    tc_mysql_snap_job_t *job;
+
+    if (ctx->snapshot_job != NULL) {
+        tc_mysql_snapshot_done(ctx->snapshot_job, 1);
+        finish_snapshot_job(ctx->snapshot_job);
+        ctx->snapshot_job = NULL;
+    }
+
+    ctx->snapshot_time = tc_time();
+
+    job = create_snapshot_job();
+    if (job != NULL) {
+        tc_mysql_snapshot_write(job);
+        finish_snapshot_job(job);
+    }
+}
+
+
+/*
+ * Keeping the stored payloads of a session alive used to mean copying
+ * them into fresh blocks of the pool. They are kept by reference now, so
+ * nothing is touched; only the bytes the copy would have moved are
+ * counted, from the lengths the record already keeps.
+ */
+static int 
+refresh_resources(uint64_t key)
+{
+    uint64_t          bytes;
+    tc_mysql_rec_t   *rec;
+    tc_mysql_shard_t *shard;
+
+    shard = get_shard(key);
+    rec   = find_rec(shard, key);
+    if (rec == NULL) {
+        return TC_OK;
+    }
+
+    bytes = rec->ps_cont_len;
+    if (rec->fir_auth != NULL) {
+        bytes += rec->fir_auth->len;
+    }
+    if (rec->sec_auth != NULL) {
+        bytes += rec->sec_auth->len;
+    }
+
+    shard->stats.refreshes++;
+    shard->stats.refresh_saved_bytes += bytes;
+
+#if (TC_DETECT_MEMORY)
+    tc_log_info(LOG_INFO, 0, "refresh rec:%llu, bytes not copied:%llu",
+            key, bytes);
+#endif
+
+    return TC_OK;
+}
+
+/*
+ * The lru keeps the oldest record first, so only expired records are
+ * visited. Unless a full cleanup is asked for, at most MAX_EVICT_PER_TICK
+ * records go per tick and the rest are left for the following ticks.
+ */
+static void 
+remove_table_obsolete_items(tc_mysql_shard_t *shard, time_t thresh_access_tme,
+        uint32_t limit) 
+{
+    uint32_t        cnt = 0;
+    p_link_node     ln;
+    tc_mysql_rec_t *rec;
+
+    if (shard->lru == NULL) {
+        return;
+    }
+
+    while (cnt < limit) {
+        ln = link_list_first(shard->lru);
+        if (ln == NULL) {
+            break;
+        }
+
+        rec = ln->data;
+        if (rec->access_time >= thresh_access_tme) {
+            break;
+        }
+
+        tc_log_info(LOG_INFO, 0,
+                "key:%llu, access time:%u, thresh_access_tme:%u",
+                rec->key, rec->access_time, thresh_access_tme);
+
+        release_resources(rec->key);
+        shard->stats.recs_evicted++;
+        cnt++;
+    }
+}
+
+
+static void
+sum_latency(void)
+{
+    uint32_t i, j;
+
+    tc_memzero(ctx->lat, LAT_CMD_NUM * sizeof(tc_mysql_hist_t));
+
+    for (i = 0; i < ctx->shard_num; i++) {
+        for (j = 0; j < LAT_CMD_NUM; j++) {
+            tc_mysql_hist_sum(&ctx->lat[j], &ctx->shards[i].lat[j]);
+        }
+    }
+
+    for (j = 0; j < LAT_CMD_NUM; j++) {
+        if (ctx->lat[j].count == 0) {
+            continue;
+        }
+        tc_log_info(LOG_INFO, 0, "mysql latency %s count:%llu, p50:%lluus, "
+                "p99:%lluus, p999:%lluus, max:%lluus",
+                tc_mysql_command_name(j), ctx->lat[j].count,
+                tc_mysql_hist_percentile(&ctx->lat[j], 0.5),
+                tc_mysql_hist_percentile(&ctx->lat[j], 0.99),
+                tc_mysql_hist_percentile(&ctx->lat[j], 0.999),
+                ctx->lat[j].max);
+    }
+}
+
+
+static void
+print_latency(FILE *f)
+{
+    uint32_t         j;
+    const char      *name;
+    tc_mysql_hist_t *h;
+
+    for (j = 0; j < LAT_CMD_NUM; j++) {
+        h = &ctx->lat[j];
+        if (h->count == 0) {
+            continue;
+        }
+        name = tc_mysql_command_name(j);
+        fprintf(f, "lat.%s.count %llu\n", name, (unsigned long long) h->count);
+        fprintf(f, "lat.%s.p50 %llu\n", name,
+                (unsigned long long) tc_mysql_hist_percentile(h, 0.5));
+        fprintf(f, "lat.%s.p99 %llu\n", name,
+                (unsigned long long) tc_mysql_hist_percentile(h, 0.99));
+        fprintf(f, "lat.%s.p999 %llu\n", name,
+                (unsigned long long) tc_mysql_hist_percentile(h, 0.999));
+        fprintf(f, "lat.%s.max %llu\n", name, (unsigned long long) h->max);
+    }
+}
+
+
+static void
+write_top(void)
+{
+    FILE                 *f;
+    uint32_t              i, n;
+    tc_mysql_top_entry_t *e;
+
+    n = tc_mysql_top_merge(ctx->tops, ctx->shard_num, ctx->top_merged);
+    if (n > top_num) {
+        n = top_num;
+    }
+
+    f = tc_mysql_stats_open(top_file);
+    if (f == NULL) {
+        return;
+    }
+
+    fprintf(f, "# count\terror\tbytes\tresponses\tavg_resp_us\tstatement\n");
+
+    for (i = 0; i < n; i++) {
+        e = &ctx->top_merged[i];
+        fprintf(f, "%llu\t%llu\t%llu\t%llu\t%llu\t%s\n",
+                (unsigned long long) e->count, (unsigned long long) e->error,
+                (unsigned long long) e->bytes,
+                (unsigned long long) e->resp_num,
+                (unsigned long long) (e->resp_num ?
+                    e->resp_usec / e->resp_num : 0), e->text);
+    }
+
+    tc_mysql_stats_close(f, top_file);
+}
+
+
+static void
+write_stats(tc_mysql_stats_t *total)
+{
+    char     prefix[32];
+    FILE    *f;
+    uint32_t i;
+
+    f = tc_mysql_stats_open(stats_file);
+    if (f == NULL) {
+        return;
+    }
+
+    fprintf(f, "time %ld\nshards %u\n", (long) tc_time(), ctx->shard_num);
+    tc_mysql_stats_print(f, "", total);
+    print_latency(f);
+    if (profile) {
+        tc_mysql_prof_print(f, &ctx->prof, tc_mysql_usec() - ctx->start_usec);
+    }
+
+    if (ctx->shard_num > 1) {
+        for (i = 0; i < ctx->shard_num; i++) {
+            snprintf(prefix, sizeof(prefix), "shard%u.", i);
+            tc_mysql_stats_print(f, prefix, &ctx->shards[i].stats);
+        }
+    }
+
+    tc_mysql_stats_close(f, stats_file);
+}
+
+
+static void 
+remove_obsolete_resources(int is_full) 
+{
+    time_t            thresh_access_tme;
+    uint32_t          i, limit;
+    tc_mysql_stats_t  total;
+    tc_mysql_shard_t *shard;
+
+    if (ctx == NULL) {
+        return;
+    }
+
+    check_mysql_user_file();
+
+    if (is_full) {
+        thresh_access_tme = tc_time() + 1;
+        limit = UINT32_MAX;
+    } else {
+        thresh_access_tme = tc_time() - MAX_IDLE_TIME;
+        limit = MAX_EVICT_PER_TICK;
+    }
+
+    tc_memzero(&total, sizeof(tc_mysql_stats_t));
+    tc_memzero(&ctx->prof, sizeof(tc_mysql_prof_t));
+
+    for (i = 0; i < ctx->shard_num; i++) {
+        shard = &ctx->shards[i];
+        remove_table_obsolete_items(shard, thresh_access_tme, limit);
+
+        shard->stats.recs         = shard->rec_table->total;
+        shard->stats.buckets      = shard->rec_table->size;
+        shard->stats.ps_bytes     = shard->ps_store.bytes;
+        shard->stats.ps_ref_bytes = shard->ps_store.ref_bytes;
+        tc_mysql_stats_sum(&total, &shard->stats);
+        tc_mysql_prof_sum(&ctx->prof, &shard->prof);
+    }
+
+    tc_log_info(LOG_INFO, 0, "mysql refreshes:%llu, bytes not copied:%llu",
+            total.refreshes, total.refresh_saved_bytes);
+    tc_log_info(LOG_INFO, 0, "mysql ps stored:%llu, referenced:%llu",
+            total.ps_bytes, total.ps_ref_bytes);
+    if (filter_classes) {
+        tc_log_info(LOG_INFO, 0, "mysql stmts filtered:%llu, not filtered:%llu",
+                total.stmts_filtered, total.stmts_unfiltered);
+    }
+    tc_log_info(LOG_INFO, 0,
+            "mysql stmts prepared:%llu, closed:%llu, reset:%llu, failed:%llu, "
+            "evicted:%llu, mem:%llu",
+            total.ps_stored, total.ps_closed, total.ps_reset, total.ps_failed,
+            total.ps_evicted, total.ps_mem);
+
+    if (total.sessions > 0
+            && (sample_max < SAMPLE_SCALE || sample_user_num > 0))
+    {
+        tc_log_info(LOG_INFO, 0,
+                "mysql sessions:%llu, skipped:%llu, effective ratio:%.4f",
+                total.sessions, total.sessions_skipped,
+                (double) (total.sessions - total.sessions_skipped)
+                / total.sessions);
+    }
+
+    sum_latency();
+
+    if (profile) {
+        tc_mysql_prof_log(&ctx->prof, tc_mysql_usec() - ctx->start_usec);
+    }
+
+    if (stats_file != NULL) {
+        write_stats(&total);
+    }
+
+    if (top_file != NULL) {
+        write_top();
+    }
+
+    /* sessions idle this long would not have been kept anyway */
+    if (ctx->snapshot.base != NULL
+            && tc_time() - ctx->snapshot.loaded >= MAX_IDLE_TIME)
+    {
+        tc_mysql_snapshot_close(&ctx->snapshot, ctx->pool);
+    }
+
+    /* the records of a snapshot still mapped are not lost by a rewrite */
+    if (snapshot_file != NULL && !is_full && snapshot_interval > 0
+            && ctx->snapshot.base == NULL
+            && (ctx->snapshot_job != NULL
+                || tc_time() - ctx->snapshot_time >= snapshot_interval))
+    {
+        check_snapshot();
+    }
+}
+
+
+static void 
+exit_shard(tc_mysql_shard_t *shard)
+{
+    if (shard->pool != NULL) {
+        tc_mysql_zfree(&shard->zs, shard->pool);
+        tc_destroy_pool(shard->pool);
+        shard->pool = NULL;
+        shard->rec_table = NULL;
+    }
+}
+
+
+static void 
+exit_mysql_module() 
+{
+    uint32_t i;
+
+    tc_log_info(LOG_INFO, 0, "call exit_mysql_module");
+
+    if (ctx == NULL) {
+        return;
+    }
+
+    if (snapshot_file != NULL) {
+        if (ctx->snapshot.base != NULL) {
+            restore_untaken_recs();
+        }
+        write_snapshot();
+        tc_mysql_snapshot_close(&ctx->snapshot, ctx->pool);
+    }
+
+    remove_obsolete_resources(1);
+
+    for (i = 0; i < ctx->shard_num; i++) {
+        exit_shard(&ctx->shards[i]);
+    }
+
+    if (digest_mode == DIGEST_RECORD) {
+        tc_mysql_digests_save(&ctx->digests, digest_file);
+    }
+    tc_mysql_digests_exit(&ctx->digests);
+
+    tc_destroy_pool(ctx->pool);
+    ctx = NULL;
+
+    release_mysql_user_tables();
+}
+
+
+static bool
+check_renew_session(tc_iph_t *ip, tc_tcph_t *tcp)
+{
+    bool              adopt;
+    uint16_t          size_ip, size_tcp, tot_len, cont_len;
+    uint64_t          key;
+    unsigned char    *payload, command, pack_number;
+    unsigned char     head[MYSQL_HEAD_LEN];
+    tc_mysql_rec_t   *rec;
+    tc_mysql_shard_t *shard;
+
+    if (ctx == NULL) {
+        return false;
+    }
+
+    key   = get_key(ip->saddr, tcp->source);
+    shard = get_shard(key);
+    rec   = find_rec(shard, key);
+    if (rec == NULL) {
+        rec = restore_rec(shard, key);
+    }
+
+    adopt = (rec == NULL || rec->fir_auth == NULL);
+    if (adopt && !is_adoptable(key)) {
+        return false;
+    }
+
+    size_ip  = ip->ihl << 2;
+    size_tcp = tcp->doff << 2;
+    tot_len  = ntohs(ip->tot_len);
+    cont_len = tot_len - size_tcp - size_ip;
+    payload  = (unsigned char *) ((char *) tcp + size_tcp);
+
+    /* the frame of a command is numbered 0 like its packet */
+    if (!adopt && is_compressed_rec(rec)) {
+        if (cont_len <= MYSQL_ZHEADER_LEN || payload[3] != 0) {
+            return false;
+        }
+        cont_len = tc_mysql_zpeek(&shard->zs, shard->pool, payload, cont_len,
+                head, MYSQL_HEAD_LEN);
+        payload  = head;
+    }
+
+    if (cont_len > MYSQL_HEADER_LEN) {
+        /* skip packet length */
+        payload = payload + 3;
+        /* retrieve packet number */
+        pack_number = payload[0];
+        /* if it is the second authenticate_user, skip it */
+        if (pack_number != 0) {
+            return false;
+        }
+        /* skip packet number */
+        payload = payload + 1;
+
+        command = payload[0];
+        tc_log_debug1(LOG_DEBUG, 0, "mysql command:%u", command);
+        /* the statements of an adopted session were never seen prepared */
+        if (command == COM_QUERY || (command == COM_STMT_EXECUTE && !adopt)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+        
+
+static uint32_t
+get_stmt_id(unsigned char *payload, uint16_t cont_len)
+{
+    /* 3 bytes length, 1 byte packet number, 1 byte command, 4 bytes id */
+    if (cont_len < 9) {
+        return 0;
+    }
+
+    return payload[5] | (payload[6] << 8) | (payload[7] << 16)
+        | ((uint32_t) payload[8] << 24);
+}
+
+
+static void
+proc_stmt_command(tc_mysql_shard_t *shard, tc_mysql_rec_t *rec,
+        unsigned char command, uint32_t id)
+{
+    int              i;
+    tc_mysql_stmt_t *stmt;
+
+    i = find_stmt(rec, id);
+    if (i < 0) {
+        return;
+    }
+
+    stmt = rec->stmts[i];
+
+    switch (command) {
+    case COM_STMT_EXECUTE:
+        link_list_remove(shard->stmt_lru, &stmt->lru);
+        link_list_append(shard->stmt_lru, &stmt->lru);
+        break;
+    case COM_STMT_CLOSE:
+        tc_log_debug2(LOG_INFO, 0, "close stmt:%u of key:%llu",
+                id, rec->key);
+        remove_stmt(shard, rec, i);
+        shard->stats.ps_closed++;
+        break;
+    case COM_STMT_RESET:
+        shard->stats.ps_reset++;
+        break;
+    }
+}
+
+
+static void
+proc_command(tc_sess_t *s, tc_mysql_pkt_t *pkt)
+{
+    int                 diff;
+    unsigned char       command;
+    tc_mysql_rec_t     *rec;
+    tc_mysql_shard_t   *shard;
+    tc_mysql_session   *mysql_sess;
+
+    mysql_sess = s->data;
+    shard      = get_shard(s->hash_key);
+    command    = pkt->head[MYSQL_HEADER_LEN];
+
+    diff = tc_time() - mysql_sess->last_refresh_time;
+
+    if (diff >= MAX_RETHRESH_TIME) {
+        refresh_resources(s->hash_key);
+        mysql_sess->last_refresh_time = tc_time();
+        mysql_sess->update_auth_table_item_switch = 0;
+#if (TC_DETECT_MEMORY)
+        tc_log_info(LOG_NOTICE, 0, "refresh time:%u for key:%llu", 
+                mysql_sess->last_refresh_time, s->hash_key);
+#endif
+    }
+
+    if (command == COM_STMT_EXECUTE || command == COM_STMT_CLOSE
+            || command == COM_STMT_RESET)
+    {
+        rec = hash_find(shard->rec_table, s->hash_key);
+        if (rec != NULL) {
+            proc_stmt_command(shard, rec, command,
+                    get_stmt_id(pkt->head, pkt->head_len));
+        }
+    }
+
+    mysql_sess->update_auth_table_item_switch++;
+    if (mysql_sess->update_auth_table_item_switch == 0) {
+        rec = find_rec(shard, s->hash_key);
+        if (rec == NULL || rec->fir_auth == NULL) {
+            tc_log_info(LOG_NOTICE, 0, "no fir auth for key:%llu", 
+                    s->hash_key);
+        }
+    }
+}
+
+
+/*
+ * Keep what a command changes of the schema and session variables, for
+ * a renewal to restore. Only a command within one segment is kept.
+ */
+static void
+proc_state(tc_sess_t *s, unsigned char *payload, tc_mysql_pkt_t *pkt)
+{
+    int               cls;
+    uint32_t          off, len;
+    unsigned char    *cmd;
+    tc_mysql_rec_t   *rec;
+    tc_mysql_shard_t *shard;
+    tc_mysql_session *mysql_sess;
+
+    if (pkt->prev_len > 0) {
+        return;
+    }
+
+    mysql_sess = s->data;
+    cmd = payload + pkt->off + MYSQL_HEADER_LEN;
+    len = pkt->seg_len - MYSQL_HEADER_LEN;
+    off = 1;
+    if (cmd[0] == COM_QUERY) {
+        off = get_query_text_off(cmd, len, mysql_sess->query_attrs);
+        if (off == 0) {
+            return;
+        }
+    }
+
+    cls = tc_mysql_state_class(cmd[0], cmd + off, len - off);
+    if (cls == STATE_NONE) {
+        return;
+    }
+
+    shard = get_shard(s->hash_key);
+    rec   = hash_find(shard->rec_table, s->hash_key);
+    if (rec == NULL) {
+        return;
+    }
+
+    if (pkt->seg_len == MYSQL_HEADER_LEN + pkt->len
+            && tc_mysql_state_update(shard->pool, &rec->state, cls, cmd[0],
+                cmd + off, pkt->len - off) == TC_OK)
+    {
+        shard->stats.state_changes++;
+    } else {
+        shard->stats.state_dropped++;
+        tc_log_debug1(LOG_INFO, 0, "state change not kept:%u",
+                ntohs(s->src_port));
+    }
+}
+
+
+static void
+drop_prepare_capture(tc_sess_t *s)
+{
+    tc_mysql_session *mysql_sess = s->data;
+
+    if (mysql_sess->ps_capture != NULL) {
+        if (mysql_sess->ps_capture_len < mysql_sess->ps_capture_size) {
+            get_shard(s->hash_key)->stats.ps_dropped++;
+        }
+        tc_pfree(s->pool, mysql_sess->ps_capture);
+        mysql_sess->ps_capture = NULL;
+    }
+    mysql_sess->ps_capture_len  = 0;
+    mysql_sess->ps_capture_size = 0;
+}
+
+
+/*
+ * A prepare spanning several segments is gathered here and stored once
+ * it is complete
+ */
+static void
+capture_prepare(tc_sess_t *s, unsigned char *data, uint32_t len)
+{
+    tc_mysql_rec_t   *rec;
+    tc_mysql_shard_t *shard;
+    tc_mysql_session *mysql_sess;
+
+    mysql_sess = s->data;
+
+    if (len > mysql_sess->ps_capture_size - mysql_sess->ps_capture_len) {
+        len = mysql_sess->ps_capture_size - mysql_sess->ps_capture_len;
+    }
+    memcpy(mysql_sess->ps_capture + mysql_sess->ps_capture_len, data, len);
+    mysql_sess->ps_capture_len += len;
+
+    if (mysql_sess->ps_capture_len < mysql_sess->ps_capture_size) {
+        return;
+    }
+
+    shard = get_shard(s->hash_key);
+    rec   = hash_find(shard->rec_table, s->hash_key);
+    if (rec != NULL) {
+        tc_log_debug2(LOG_INFO, 0, "push prepare:%u, len:%u",
+                ntohs(s->src_port), mysql_sess->ps_capture_size);
+        add_stmt(shard, rec, mysql_sess->pending_stmt_id,
+                mysql_sess->ps_capture, mysql_sess->ps_capture_size);
+    }
+
+    drop_prepare_capture(s);
+}
+
+
+static bool
+proc_prepare(tc_sess_t *s, unsigned char *payload, tc_mysql_pkt_t *pkt)
+{
+    uint32_t          size;
+    tc_mysql_rec_t   *rec;
+    tc_mysql_shard_t *shard;
+    tc_mysql_session *mysql_sess;
+
+    mysql_sess = s->data;
+    shard      = get_shard(s->hash_key);
+
+    rec = get_rec(shard, s->hash_key);
+    if (rec == NULL) {
+        return false;
+    }
+
+    /* the server spends an id on every prepare, even a failed one */
+    rec->last_stmt_id++;
+    mysql_sess->pending_stmt_id = rec->last_stmt_id;
+
+    size = MYSQL_HEADER_LEN + pkt->len;
+
+    if (pkt->prev_len == 0 && pkt->seg_len == size) {
+        tc_log_debug1(LOG_INFO, 0, "push packet:%u", ntohs(s->src_port));
+        return add_stmt(shard, rec, rec->last_stmt_id, payload + pkt->off,
+                size) == TC_OK;
+    }
+
+    drop_prepare_capture(s);
+
+    if (pkt->len == MYSQL_MAX_PACKET_LEN) {
+        tc_log_info(LOG_NOTICE, 0, "prepare over 16M is not kept, p:%u",
+                ntohs(s->src_port));
+        shard->stats.ps_dropped++;
+        return false;
+    }
+
+    mysql_sess->ps_capture = tc_palloc(s->pool, size);
+    if (mysql_sess->ps_capture == NULL) {
+        return false;
+    }
+    mysql_sess->ps_capture_size = size;
+
+    memcpy(mysql_sess->ps_capture, pkt->head, pkt->prev_len);
+    mysql_sess->ps_capture_len = pkt->prev_len;
+    capture_prepare(s, payload + pkt->off, pkt->seg_len);
+
+    return true;
+}
+
+
+/*
+ * A prepare of a compressed session is stored as the frame it came in,
+ * to be replayed as it is. A frame spanning segments is not kept, its id
+ * is replayed as a placeholder.
+ */
+static void
+proc_zprepare(tc_sess_t *s, unsigned char *payload, tc_mysql_pkt_t *pkt)
+{
+    tc_mysql_rec_t   *rec;
+    tc_mysql_shard_t *shard;
+    tc_mysql_session *mysql_sess;
+
+    mysql_sess = s->data;
+    shard      = get_shard(s->hash_key);
+
+    rec = get_rec(shard, s->hash_key);
+    if (rec == NULL) {
+        return;
+    }
+
+    rec->last_stmt_id++;
+    mysql_sess->pending_stmt_id = rec->last_stmt_id;
+
+    if (pkt->prev_len == 0 && pkt->seg_len == pkt->frame_len) {
+        add_stmt(shard, rec, rec->last_stmt_id, payload + pkt->off,
+                pkt->frame_len);
+    } else {
+        shard->stats.ps_dropped++;
+        tc_log_debug1(LOG_INFO, 0, "compressed prepare not kept, p:%u",
+                ntohs(s->src_port));
+    }
+}
+
+
+static void
+lose_cmp(tc_sess_t *s, tc_mysql_cmp_t *cmp)
+{
+    if (!cmp->lost) {
+        cmp->lost = 1;
+        get_shard(s->hash_key)->stats.resp_lost++;
+        tc_log_debug1(LOG_INFO, 0, "stop comparing responses, p:%u",
+                ntohs(s->src_port));
+    }
+}
+
+
+static void
+copy_req_text(tc_mysql_req_t *req, unsigned char *data, uint32_t len)
+{
+    uint32_t i, n;
+
+    n = strlen(req->text);
+    for (i = 0; i < len && n < MAX_REQ_TEXT; i++) {
+        req->text[n++] = (data[i] >= 0x20 && data[i] < 0x7f) ? data[i] : '.';
+    }
+}
+
+
+/*
+ * Hash the bytes of the command packet from key_from on, data being the
+ * next len bytes of it. The text of a query is kept for the log.
+ */
+static void
+feed_req_key(tc_mysql_cmp_t *cmp, unsigned char *data, uint32_t len)
+{
+    uint32_t        n;
+    tc_mysql_req_t *req;
+
+    req = &cmp->reqs[cmp->key_req];
+
+    if (len > cmp->key_size - cmp->key_pos) {
+        len = cmp->key_size - cmp->key_pos;
+    }
+
+    if (cmp->key_pos < cmp->key_from) {
+        n = cmp->key_from - cmp->key_pos;
+        if (n > len) {
+            n = len;
+        }
+        cmp->key_pos += n;
+        data += n;
+        len  -= n;
+    }
+
+    if (req->kind == RESP_KIND_RESULT && cmp->key_from == MYSQL_HEADER_LEN) {
+        /* past the command byte */
+        if (cmp->key_pos > MYSQL_HEADER_LEN) {
+            copy_req_text(req, data, len);
+        } else if (len > 1) {
+            copy_req_text(req, data + 1, len - 1);
+        }
+    }
+
+    cmp->key_crc  = tc_crc32c(cmp->key_crc, data, len);
+    cmp->key_pos += len;
+
+    if (cmp->key_pos == cmp->key_size) {
+        req->key = cmp->key_seed
+            ^ (((uint64_t) cmp->key_crc << 32) | cmp->key_size);
+        cmp->key_pending = 0;
+    }
+}
+
+
+/*
+ * Queue a command for its response. Commands answered by nothing are
+ * not queued, the few whose responses are not followed stop the
+ * comparison of the session.
+ */
+static void
+push_req(tc_sess_t *s, unsigned char *payload, tc_mysql_pkt_t *pkt)
+{
+    int               i;
+    unsigned char     command;
+    tc_mysql_cmp_t   *cmp;
+    tc_mysql_rec_t   *rec;
+    tc_mysql_req_t   *req;
+    tc_mysql_stmt_t  *stmt;
+    tc_mysql_session *mysql_sess;
+
+    mysql_sess = s->data;
+    cmp        = mysql_sess->cmp;
+    command    = pkt->head[MYSQL_HEADER_LEN];
+
+    switch (command) {
+    case COM_QUIT:
+    case COM_STMT_SEND_LONG_DATA:
+    case COM_STMT_CLOSE:
+        return;
+
+    case COM_FIELD_LIST:
+    case COM_SHUTDOWN:
+    case COM_DEBUG:
+    case COM_CHANGE_USER:
+    case COM_BINLOG_DUMP:
+    case COM_STMT_FETCH:
+    case COM_BINLOG_DUMP_GTID:
+        lose_cmp(s, cmp);
+        return;
+    }
+
+    if (cmp->num == MAX_PENDING_REQS || cmp->key_pending) {
+        lose_cmp(s, cmp);
+        return;
+    }
+
+    cmp->key_req = (cmp->head + cmp->num) % MAX_PENDING_REQS;
+    cmp->num++;
+
+    req = &cmp->reqs[cmp->key_req];
+    tc_memzero(req, sizeof(tc_mysql_req_t));
+
+    switch (command) {
+    case COM_STMT_PREPARE:
+        req->kind = RESP_KIND_PREPARE;
+        return;
+    case COM_STATISTICS:
+        req->kind = RESP_KIND_STRING;
+        return;
+    case COM_QUERY:
+        cmp->key_seed = 0;
+        cmp->key_from = MYSQL_HEADER_LEN;
+        break;
+    case COM_STMT_EXECUTE:
+        rec = hash_find(get_shard(s->hash_key)->rec_table, s->hash_key);
+        i   = rec != NULL ? find_stmt(rec, get_stmt_id(pkt->head,
+                    pkt->head_len)) : -1;
+        if (i < 0 || rec->stmts[i]->payload == NULL) {
+            return;
+        }
+        stmt = rec->stmts[i];
+        cmp->key_seed = stmt->payload->hash;
+        cmp->key_from = MYSQL_HEAD_LEN;
+        copy_req_text(req, stmt->payload->data + MYSQL_HEADER_LEN + 1,
+                stmt->payload->len - MYSQL_HEADER_LEN - 1);
+        break;
+    default:
+        return;
+    }
+
+    req->compared    = 1;
+    cmp->key_crc     = 0;
+    cmp->key_pos     = 0;
+    cmp->key_size    = MYSQL_HEADER_LEN + pkt->len;
+    cmp->key_pending = 1;
+
+    if (pkt->prev_len > 0) {
+        feed_req_key(cmp, pkt->head, pkt->prev_len);
+    }
+    feed_req_key(cmp, payload + pkt->off, pkt->seg_len);
+}
+
+
+static void
+log_mismatch(tc_sess_t *s, tc_mysql_req_t *req, tc_mysql_digest_t *want,
+        tc_mysql_digest_t *got)
+{
+    tc_log_info(LOG_WARN, 0, "resp mismatch p:%u, key:%llu, type:%u/%u, "
+            "affected:%llu/%llu, cols:%u/%u, rows:%llu/%llu, crc:%u/%u, "
+            "req:%s", ntohs(s->src_port), req->key, want->type, got->type,
+            want->affected, got->affected, want->columns, got->columns,
+            want->rows, got->rows, want->crc, got->crc, req->text);
+}
+
+
+static void
+proc_resp_digest(tc_sess_t *s, tc_mysql_req_t *req, tc_mysql_digest_t *digest)
+{
+    tc_mysql_shard_t      *shard;
+    tc_mysql_digest_rec_t *rec;
+
+    if (!req->compared || req->key == 0) {
+        return;
+    }
+
+    shard = get_shard(s->hash_key);
+
+    if (digest_mode == DIGEST_RECORD) {
+        if (tc_mysql_digests_record(&ctx->digests, req->key, digest)
+                == TC_OK)
+        {
+            shard->stats.resp_recorded++;
+        }
+        return;
+    }
+
+    rec = tc_mysql_digests_get(&ctx->digests, req->key);
+    if (rec == NULL) {
+        shard->stats.resp_unknown++;
+    } else if (rec->unstable) {
+        shard->stats.resp_unstable++;
+    } else if (memcmp(&rec->digest, digest, sizeof(tc_mysql_digest_t))
+            == 0)
+    {
+        shard->stats.resp_matched++;
+    } else {
+        shard->stats.resp_mismatched++;
+        log_mismatch(s, req, &rec->digest, digest);
+    }
+}
+
+
+/*
+ * Follow the target's responses past the bytes already seen. A gap in
+ * them cannot be walked over, the session is not compared from then on.
+ */
+static void
+proc_resp_data(tc_sess_t *s, uint32_t seq, unsigned char *data,
+        uint32_t len, uint32_t skip)
+{
+    int               rc;
+    unsigned char    *p, *end;
+    tc_mysql_cmp_t   *cmp;
+    tc_mysql_req_t   *req;
+    tc_mysql_session *mysql_sess;
+
+    mysql_sess = s->data;
+    cmp        = mysql_sess->cmp;
+
+    if (cmp->srv_synced && after(seq, cmp->srv_next_seq)) {
+        lose_cmp(s, cmp);
+        return;
+    }
+    if (!cmp->srv_synced || after(seq + len, cmp->srv_next_seq)) {
+        cmp->srv_next_seq = seq + len;
+        cmp->srv_synced   = 1;
+    }
+
+    p   = data + skip;
+    end = data + len;
+
+    while (p < end) {
+        if (cmp->num == 0) {
+            lose_cmp(s, cmp);
+            return;
+        }
+
+        req = &cmp->reqs[cmp->head];
+
+        if (!cmp->resp_started) {
+            tc_mysql_resp_init(&cmp->resp, req->kind,
+                    (cmp->srv_caps & cmp->clt_caps & CLIENT_DEPRECATE_EOF)
+                    != 0);
+            cmp->resp_started = 1;
+        }
+
+        rc = tc_mysql_resp_parse(&cmp->resp, &p, end);
+        if (rc == RESP_AGAIN) {
+            break;
+        }
+        if (rc == RESP_LOST) {
+            lose_cmp(s, cmp);
+            return;
+        }
+
+        proc_resp_digest(s, req, &cmp->resp.digest);
+        cmp->head = (cmp->head + 1) % MAX_PENDING_REQS;
+        cmp->num--;
+        cmp->resp_started = 0;
+    }
+}
+
+
+/*
+ * Count a query or an execute under the fingerprint of its statement. A
+ * query is fingerprinted from the part in the segment, an execute from
+ * the statement prepared, once per statement.
+ */
+static uint64_t
+count_statement(tc_sess_t *s, unsigned char *payload, tc_mysql_pkt_t *pkt)
+{
+    int                   i;
+    char                  norm[FP_NORM_LEN];
+    uint32_t              norm_len, off, len;
+    uint64_t              fp;
+    unsigned char        *cmd;
+    tc_mysql_rec_t       *rec;
+    tc_mysql_stmt_t      *stmt;
+    tc_mysql_shard_t     *shard;
+    tc_mysql_session     *mysql_sess;
+    tc_mysql_top_entry_t *e;
+
+    mysql_sess = s->data;
+    shard    = get_shard(s->hash_key);
+    stmt     = NULL;
+    norm_len = 0;
+
+    switch (pkt->head[MYSQL_HEADER_LEN]) {
+    case COM_QUERY:
+        if (pkt->prev_len > 0) {
+            return 0;
+        }
+        cmd = payload + pkt->off + MYSQL_HEADER_LEN;
+        len = pkt->seg_len - MYSQL_HEADER_LEN;
+        off = get_query_text_off(cmd, len, mysql_sess->query_attrs);
+        if (off == 0) {
+            return 0;
+        }
+        fp = tc_mysql_fingerprint(cmd + off, len - off, norm, &norm_len);
+        break;
+
+    case COM_STMT_EXECUTE:
+        rec = hash_find(shard->rec_table, s->hash_key);
+        i   = rec != NULL ? find_stmt(rec, get_stmt_id(pkt->head,
+                    pkt->head_len)) : -1;
+        if (i < 0 || rec->stmts[i]->payload == NULL) {
+            return 0;
+        }
+        stmt = rec->stmts[i];
+        if (stmt->fp == 0) {
+            stmt->fp = tc_mysql_fingerprint(stmt->payload->data
+                    + MYSQL_HEADER_LEN + 1,
+                    stmt->payload->len - MYSQL_HEADER_LEN - 1, norm,
+                    &norm_len);
+        }
+        fp = stmt->fp;
+        break;
+
+    default:
+        return 0;
+    }
+
+    e = tc_mysql_top_find(shard->top, fp);
+    if (e == NULL) {
+        if (stmt != NULL && norm_len == 0) {
+            tc_mysql_fingerprint(stmt->payload->data + MYSQL_HEADER_LEN + 1,
+                    stmt->payload->len - MYSQL_HEADER_LEN - 1, norm,
+                    &norm_len);
+        }
+        e = tc_mysql_top_add(shard->top, fp, norm, norm_len);
+    }
+    tc_mysql_top_hit(shard->top, e, MYSQL_HEADER_LEN + pkt->len);
+
+    return fp;
+}
+
+
+/*
+ * Keep a filtered statement from the target without touching the bytes
+ * the session is made of, so sequence numbers on both sides stay as
+ * captured: a query or an execute is overwritten with a query doing
+ * nothing padded with spaces to the length of the packet, and the bytes
+ * of it in later segments are blanked as they come. The target answers
+ * it with an OK packet. Bytes sent in earlier segments cannot be taken
+ * back, such statements are replayed as they are. A session sending
+ * query attributes sends the filler with none.
+ */
+static void
+filter_command(tc_sess_t *s, unsigned char *payload, tc_mysql_pkt_t *pkt)
+{
+    int                i, cls;
+    uint32_t           len, off, attrs_len;
+    unsigned char     *p, command;
+    tc_mysql_rec_t    *rec;
+    tc_mysql_stmt_t   *stmt;
+    tc_mysql_shard_t  *shard;
+    tc_mysql_session  *mysql_sess;
+
+    mysql_sess = s->data;
+    shard      = get_shard(s->hash_key);
+    command    = pkt->head[MYSQL_HEADER_LEN];
+    len        = 0;
+
+    if (pkt->prev_len > 0) {
+        return;
+    }
+    len = pkt->seg_len - MYSQL_HEADER_LEN - 1;
+
+    switch (command) {
+    case COM_QUERY:
+        p   = payload + pkt->off + MYSQL_HEADER_LEN;
+        off = get_query_text_off(p, len + 1, mysql_sess->query_attrs);
+        if (off == 0) {
+            return;
+        }
+        cls = tc_mysql_classify(p + off, len + 1 - off);
+        break;
+
+    case COM_STMT_EXECUTE:
+        rec = hash_find(shard->rec_table, s->hash_key);
+        i   = rec != NULL ? find_stmt(rec, get_stmt_id(pkt->head,
+                    pkt->head_len)) : -1;
+        if (i < 0 || rec->stmts[i]->payload == NULL) {
+            return;
+        }
+        stmt = rec->stmts[i];
+        if (stmt->sql_class == SQL_CLASS_NONE) {
+            stmt->sql_class = tc_mysql_classify(stmt->payload->data
+                    + MYSQL_HEADER_LEN + 1,
+                    stmt->payload->len - MYSQL_HEADER_LEN - 1);
+        }
+        cls = stmt->sql_class;
+        break;
+
+    default:
+        return;
+    }
+
+    if (!(filter_classes & (1 << cls))) {
+        return;
+    }
+
+    attrs_len = mysql_sess->query_attrs ? sizeof(no_query_attrs) : 0;
+
+    if (len < attrs_len + FILTER_STMT_LEN
+            || pkt->len == MYSQL_MAX_PACKET_LEN)
+    {
+        shard->stats.stmts_unfiltered++;
+        tc_log_debug1(LOG_INFO, 0, "statement not filtered:%u",
+                ntohs(s->src_port));
+        return;
+    }
+
+    p = payload + pkt->off + MYSQL_HEADER_LEN;
+    *p++ = COM_QUERY;
+    memcpy(p, no_query_attrs, attrs_len);
+    p   += attrs_len;
+    len -= attrs_len;
+    memcpy(p, FILTER_STMT, FILTER_STMT_LEN);
+    memset(p + FILTER_STMT_LEN, ' ', len - FILTER_STMT_LEN);
+    mysql_sess->filter_left = MYSQL_HEADER_LEN + pkt->len - pkt->seg_len;
+
+    shard->stats.stmts_filtered++;
+    if (profile) {
+        tc_mysql_prof_rewrite(&shard->prof, payload + pkt->off, pkt->seg_len);
+    }
+}
+
+
+/*
+ * Time a command that is answered. Once commands pile up past the queue,
+ * the response that comes next cannot be told, so the session is not
+ * timed any more.
+ */
+static void
+push_lat(tc_sess_t *s, unsigned char command, uint64_t fp, uint64_t *now)
+{
+    tc_mysql_lat_t   *lat;
+    tc_mysql_session *mysql_sess;
+
+    if (command == COM_QUIT || command == COM_STMT_SEND_LONG_DATA
+            || command == COM_STMT_CLOSE)
+    {
+        return;
+    }
+
+    mysql_sess = s->data;
+    lat        = &mysql_sess->lat;
+
+    if (lat->lost) {
+        return;
+    }
+
+    if (lat->num == MAX_PENDING_REQS) {
+        lat->num  = 0;
+        lat->lost = 1;
+        return;
+    }
+
+    if (*now == 0) {
+        *now = tc_mysql_usec();
+    }
+
+    lat->cmds[(lat->head + lat->num) % MAX_PENDING_REQS] = command;
+    lat->sent[(lat->head + lat->num) % MAX_PENDING_REQS] = *now;
+    lat->fps[(lat->head + lat->num) % MAX_PENDING_REQS]  = fp;
+    lat->num++;
+}
+
+
+/*
+ * A response starts with packet number 1. A result set of 256 packets
+ * or more comes to 1 again too, but only right after 0.
+ */
+static void
+proc_lat_resp(tc_sess_t *s, tc_mysql_pkt_t *pkt, uint64_t *now)
+{
+    uint64_t              usec;
+    unsigned char         seq_id;
+    tc_mysql_lat_t       *lat;
+    tc_mysql_shard_t     *shard;
+    tc_mysql_session     *mysql_sess;
+    tc_mysql_top_entry_t *e;
+
+    mysql_sess = s->data;
+    lat        = &mysql_sess->lat;
+    seq_id     = pkt->head[3];
+
+    if (seq_id == 1 && lat->prev_seq != 1 && lat->num > 0) {
+        if (*now == 0) {
+            *now = tc_mysql_usec();
+        }
+        shard = get_shard(s->hash_key);
+        usec  = *now - lat->sent[lat->head];
+        tc_mysql_hist_add(&shard->lat[lat->cmds[lat->head] % LAT_CMD_NUM],
+                usec);
+
+        if (lat->fps[lat->head] != 0 && shard->top != NULL) {
+            e = tc_mysql_top_find(shard->top, lat->fps[lat->head]);
+            if (e != NULL) {
+                e->resp_usec += usec;
+                e->resp_num++;
+            }
+        }
+
+        lat->head = (lat->head + 1) % MAX_PENDING_REQS;
+        lat->num--;
+    }
+
+    lat->prev_seq = seq_id + 1;
+}
+
+
+/*
+ * The next batch of packets of a segment that started more of them than
+ * a batch holds, through the compressed framer zf if it is given
+ */
+static bool
+more_frames(tc_mysql_zframer_t *zf, tc_mysql_framer_t *f,
+        unsigned char *payload, uint32_t len, uint32_t want,
+        tc_mysql_frames_t *frames)
+{
+    if (zf != NULL) {
+        return tc_mysql_zframes_more(zf, payload, len, want, frames);
+    }
+
+    return frame_mysql_more(f, payload, len, frames);
+}
+
+
+/* a client packet whose head is known; true if the segment is needed */
+static bool
+proc_clt_pkt(tc_sess_t *s, unsigned char *payload, tc_mysql_pkt_t *pkt,
+        tc_mysql_cmp_t *cmp, uint64_t *now)
+{
+    bool               needed;
+    uint64_t           fp;
+    tc_mysql_session  *mysql_sess;
+
+    mysql_sess = s->data;
+    needed     = false;
+
+    if (pkt->cont) {
+        if (mysql_sess->ps_capture != NULL) {
+            drop_prepare_capture(s);
+        }
+        return false;
+    }
+
+    /* commands come with packet number 0 and at least one byte */
+    if (pkt->head[3] != 0 || pkt->head_len <= MYSQL_HEADER_LEN) {
+        return false;
+    }
+
+    if (cmp != NULL) {
+        push_req(s, payload, pkt);
+    }
+    /* the text of a compressed statement is not inflated */
+    fp = 0;
+    if (get_shard(s->hash_key)->top != NULL && !mysql_sess->compress) {
+        fp = count_statement(s, payload, pkt);
+    }
+    if (!s->sm.fake_syn) {
+        push_lat(s, pkt->head[MYSQL_HEADER_LEN], fp, now);
+    }
+
+    if (pkt->head[MYSQL_HEADER_LEN] == COM_STMT_PREPARE) {
+        if (mysql_sess->compress) {
+            proc_zprepare(s, payload, pkt);
+        } else if (proc_prepare(s, payload, pkt)) {
+            needed = true;
+        }
+    } else {
+        proc_command(s, pkt);
+        if (!mysql_sess->compress) {
+            proc_state(s, payload, pkt);
+        }
+    }
+
+    if (filter_classes && !mysql_sess->compress) {
+        filter_command(s, payload, pkt);
+    }
+
+    return needed;
+}
+
+
+/*
+ * The client's segments are framed into mysql packets, so that commands
+ * are recognized wherever their packets start and prepares spanning
+ * several segments are kept whole
+ */
+static bool 
+check_pack_needed_for_recons(tc_sess_t *s, tc_iph_t *ip, tc_tcph_t *tcp)
+{
+    int                 i;
+    bool                needed;
+    uint16_t            size_tcp, cont_len;
+    uint32_t            n;
+    unsigned char      *payload;
+    uint64_t            now;
+    tc_mysql_cmp_t     *cmp;
+    tc_mysql_session   *mysql_sess;
+    tc_mysql_frames_t   frames;
+
+    mysql_sess = s->data;
+    now        = 0;
+
+    if (mysql_sess == NULL) {
+        return false;
+    }
+
+    if (s->sm.fake_syn) {
+        if (before(ntohl(tcp->seq), mysql_sess->seq_after_ps)) {
+            return false;
+        }
+    }
+
+    cont_len = s->cur_pack.cont_len;
+    if (cont_len == 0) {
+        return false;
+    }
+
+    size_tcp = tcp->doff << 2;
+    payload = (unsigned char *) ((char *) tcp + size_tcp);
+
+    if (mysql_sess->compress) {
+        tc_mysql_zframes(&mysql_sess->clt_zframer, ntohl(tcp->seq), payload,
+                cont_len, MYSQL_HEAD_LEN, &frames);
+    } else {
+        frame_mysql_packets(&mysql_sess->clt_framer, ntohl(tcp->seq), payload,
+                cont_len, &frames);
+    }
+
+    needed = false;
+    cmp    = mysql_sess->cmp;
+    if (cmp != NULL && cmp->lost) {
+        cmp = NULL;
+    }
+
+    if (frames.lead > 0 && cmp != NULL && cmp->key_pending) {
+        feed_req_key(cmp, payload + frames.skip, frames.lead);
+    }
+
+    if (frames.lead > 0 && mysql_sess->ps_capture != NULL) {
+        capture_prepare(s, payload + frames.skip, frames.lead);
+        needed = true;
+    }
+
+    if (mysql_sess->filter_left > 0) {
+        n = frames.lead < mysql_sess->filter_left ?
+            frames.lead : mysql_sess->filter_left;
+        memset(payload + frames.skip, ' ', n);
+        mysql_sess->filter_left -= n;
+        if (frames.num > 0) {
+            mysql_sess->filter_left = 0;
+        }
+    }
+
+    do {
+        for (i = 0; i < frames.num; i++) {
+            if (proc_clt_pkt(s, payload, &frames.pkts[i], cmp, &now)) {
+                needed = true;
+            }
+        }
+    } while (more_frames(mysql_sess->compress ? &mysql_sess->clt_zframer : NULL,
+                &mysql_sess->clt_framer, payload, cont_len, MYSQL_HEAD_LEN,
+                &frames));
+
+    return needed;
+}
+
+
+/*
+ * The first packet of the response to a COM_STMT_PREPARE is either
+ * PREPARE_OK carrying the statement id or an ERR packet.
+ */
+static void
+proc_prepare_resp(tc_sess_t *s, unsigned char *payload, uint16_t cont_len)
+{
+    int               i;
+    uint32_t          id;
+    tc_mysql_rec_t   *rec;
+    tc_mysql_shard_t *shard;
+    tc_mysql_session *mysql_sess;
+
+    mysql_sess = s->data;
+
+    /* the response starts with packet number 1 */
+    if (cont_len < 5 || payload[3] != 1) {
+        return;
+    }
+
+    id = mysql_sess->pending_stmt_id;
+    mysql_sess->pending_stmt_id = 0;
+
+    shard = get_shard(s->hash_key);
+    rec   = hash_find(shard->rec_table, s->hash_key);
+    if (rec == NULL) {
+        return;
+    }
+
+    if (payload[4] == 0x00 && cont_len >= 9) {
+        if (get_stmt_id(payload, cont_len) != id) {
+            tc_log_info(LOG_NOTICE, 0, "stmt id:%u, expected:%u, p:%u",
+                    get_stmt_id(payload, cont_len), id, ntohs(s->src_port));
+        }
+    } else if (payload[4] == 0xff) {
+        /* keep the id as a hole, there is nothing to prepare again */
+        i = find_stmt(rec, id);
+        if (i >= 0) {
+            remove_stmt(shard, rec, i);
+            shard->stats.ps_failed++;
+        }
+    }
+}
+
+
+/*
+ * caching_sha2_password full authentication without ssl: the client asks
+ * for the public key, sends the password encrypted with the public key
+ * it has, or sends it in clear if the transport is secure
+ */
+static int
+change_full_auth(tc_sess_t *s, unsigned char *payload, uint16_t cont_len)
+{
+    size_t            len, pwd_len, key_len;
+    unsigned char    *key, cipher[MAX_RSA_CIPHER_LEN];
+    tc_mysql_session *mysql_sess;
+
+    mysql_sess = s->data;
+    len = payload[0] + (payload[1] << 8) + (payload[2] << 16);
+    if (len == 0 || len + 4 > cont_len) {
+        return TC_ERR;
+    }
+
+    if (len == 1 && payload[4] == 0x02) {
+        /* the target answers with its own public key */
+        return TC_OK;
+    }
+
+    pwd_len = strlen(mysql_sess->password) + 1;
+    if (len == pwd_len && payload[4 + len - 1] == 0) {
+        if (!change_clt_second_auth_content(payload, cont_len,
+                    mysql_sess->password, pwd_len))
+        {
+            return TC_ERR;
+        }
+        return TC_OK;
+    }
+
+    if (mysql_sess->rsa_key != NULL) {
+        key     = mysql_sess->rsa_key;
+        key_len = mysql_sess->rsa_key_len;
+    } else if (rsa_public_key != NULL) {
+        key     = rsa_public_key;
+        key_len = rsa_public_key_len;
+    } else {
+        tc_log_info(LOG_WARN, 0, "no public key of the target, p:%u",
+                ntohs(s->src_port));
+        return TC_ERR;
+    }
+
+    if (len > MAX_RSA_CIPHER_LEN) {
+        return TC_ERR;
+    }
+
+    if (!encrypt_password_rsa(cipher, len, mysql_sess->password,
+                mysql_sess->scramble, key, key_len))
+    {
+        return TC_ERR;
+    }
+
+    if (!change_clt_second_auth_content(payload, cont_len, (char *) cipher,
+                len))
+    {
+        return TC_ERR;
+    }
+
+    return TC_OK;
+}
+
+
+/*
+ * Answer what the target asked for after the first auth packet,
+ * according to the plugin it switched to. The stages of the user are
+ * those of its entry unless the user table was reloaded since the first
+ * auth, when they are worked out from the password again.
+ */
+static int
+change_sec_auth(tc_sess_t *s, unsigned char *payload, uint16_t cont_len)
+{
+    char              content[SHA256_HASH_SIZE + 1];
+    size_t            len;
+    mysql_user       *user_info;
+    unsigned char     stage1[SHA256_HASH_SIZE], stage2[SHA256_HASH_SIZE];
+    tc_mysql_session *mysql_sess;
+
+    mysql_sess = s->data;
+
+    user_info = NULL;
+    if (mysql_sess->user_gen == get_mysql_user_table_gen()) {
+        user_info = mysql_sess->user_info;
+    }
+
+    if (mysql_sess->sha2_full_auth) {
+        return change_full_auth(s, payload, cont_len);
+    }
+
+    tc_memzero(content, sizeof(content));
+
+    switch (mysql_sess->auth_plugin) {
+    case AUTH_PLUGIN_OLD:
+        tc_memzero(mysql_sess->seed323, SEED_323_LENGTH + 1);
+        memcpy(mysql_sess->seed323, mysql_sess->scramble, SEED_323_LENGTH);
+        new_crypt(content, mysql_sess->password, mysql_sess->seed323);
+        /* with the terminating \0 */
+        len = SEED_323_LENGTH + 1;
+        break;
+
+    case AUTH_PLUGIN_NATIVE:
+        if (user_info != NULL) {
+            scramble_from_stages(content, mysql_sess->scramble,
+                    user_info->hash_stage1, user_info->hash_stage2);
+        } else {
+            scramble(content, mysql_sess->scramble, mysql_sess->password);
+        }
+        len = SCRAMBLE_LENGTH;
+        break;
+
+    case AUTH_PLUGIN_SHA2:
+        if (user_info != NULL) {
+            scramble_sha2_from_stages(content, mysql_sess->scramble,
+                    user_info->sha2_stage1, user_info->sha2_stage2);
+        } else {
+            sha256_digest(stage1, (unsigned char *) mysql_sess->password,
+                    strlen(mysql_sess->password), NULL, 0);
+            sha256_digest(stage2, stage1, SHA256_HASH_SIZE, NULL, 0);
+            scramble_sha2_from_stages(content, mysql_sess->scramble, stage1,
+                    stage2);
+        }
+        len = SHA256_HASH_SIZE;
+        break;
+
+    case AUTH_PLUGIN_CLEAR:
+        if (!change_clt_second_auth_content(payload, cont_len,
+                    mysql_sess->password, strlen(mysql_sess->password) + 1))
+        {
+            return TC_ERR;
+        }
+        return TC_OK;
+
+    default:
+        tc_log_info(LOG_WARN, 0, "unsupported auth plugin, p:%u",
+                ntohs(s->src_port));
+        return TC_ERR;
+    }
+
+    if (!change_clt_second_auth_content(payload, cont_len, content, len)) {
+        return TC_ERR;
+    }
+
+    return TC_OK;
+}
+
+
+static void
+save_rsa_key(tc_sess_t *s, unsigned char *key, uint32_t len)
+{
+    tc_mysql_session *mysql_sess = s->data;
+
+    if (mysql_sess->rsa_key != NULL) {
+        tc_pfree(s->pool, mysql_sess->rsa_key);
+    }
+
+    mysql_sess->rsa_key = tc_palloc(s->pool, len);
+    if (mysql_sess->rsa_key == NULL) {
+        mysql_sess->rsa_key_len = 0;
+        return;
+    }
+
+    memcpy(mysql_sess->rsa_key, key, len);
+    mysql_sess->rsa_key_len = len;
+}
+
+
+/*
+ * Both directions are framed compressed from the end of the login on.
+ * Responses are not inflated, so they are not compared.
+ */
+static void
+start_compress(tc_sess_t *s)
+{
+    tc_mysql_session *mysql_sess = s->data;
+
+    mysql_sess->compress = 1;
+    tc_mysql_zframer_init(&mysql_sess->clt_zframer, s->pool);
+    tc_mysql_zframer_init(&mysql_sess->srv_zframer, s->pool);
+
+    if (mysql_sess->cmp != NULL) {
+        lose_cmp(s, mysql_sess->cmp);
+    }
+
+    get_shard(s->hash_key)->stats.compressed++;
+    tc_log_debug1(LOG_INFO, 0, "compressed session:%u", ntohs(s->src_port));
+}
+
+
+/*
+ * Follow the target through authentication, one packet at a time
+ */
+static void
+proc_auth_resp(tc_sess_t *s, unsigned char *payload, uint32_t cont_len)
+{
+    int               kind, plugin;
+    uint32_t          len;
+    tc_mysql_session *mysql_sess;
+
+    mysql_sess = s->data;
+
+    len    = payload[0] + (payload[1] << 8) + (payload[2] << 16);
+    plugin = AUTH_PLUGIN_UNKNOWN;
+    kind   = parse_auth_resp(payload, cont_len, mysql_sess->scramble, &plugin);
+
+    switch (kind) {
+    case AUTH_RESP_OK:
+        mysql_sess->auth_done = 1;
+        if (mysql_sess->clt_compress && mysql_sess->srv_compress) {
+            start_compress(s);
+        }
+        break;
+
+    case AUTH_RESP_ERR:
+        tc_log_info(LOG_WARN, 0, "target refuses auth, p:%u",
+                ntohs(s->src_port));
+        get_shard(s->hash_key)->stats.auth_refused++;
+        mysql_sess->auth_done = 1;
+        break;
+
+    case AUTH_RESP_OLD_SWITCH:
+    case AUTH_RESP_SWITCH:
+        tc_log_debug2(LOG_INFO, 0, "switch to %s:%u",
+                get_auth_plugin_name(plugin), ntohs(s->src_port));
+        mysql_sess->auth_plugin = plugin;
+        mysql_sess->sha2_full_auth = 0;
+        mysql_sess->sec_auth_not_yet_done = 1;
+        break;
+
+    case AUTH_RESP_FULL_AUTH:
+        tc_log_debug1(LOG_INFO, 0, "needs full auth:%u", ntohs(s->src_port));
+        mysql_sess->sha2_full_auth = 1;
+        mysql_sess->sec_auth_not_yet_done = 1;
+        break;
+
+    case AUTH_RESP_PUBLIC_KEY:
+        /* skip the header and the 0x01 status byte */
+        save_rsa_key(s, payload + MYSQL_HEADER_LEN + 1, len - 1);
+        mysql_sess->sec_auth_not_yet_done = 1;
+        break;
+    }
+}
+
+
+/* bytes of the response being gathered; it is parsed once it is whole */
+static void
+add_auth_resp(tc_sess_t *s, unsigned char *data, uint32_t len)
+{
+    unsigned char    *resp;
+    tc_mysql_session *mysql_sess = s->data;
+
+    if (len > mysql_sess->auth_resp_len - mysql_sess->auth_resp_have) {
+        len = mysql_sess->auth_resp_len - mysql_sess->auth_resp_have;
+    }
+    memcpy(mysql_sess->auth_resp + mysql_sess->auth_resp_have, data, len);
+    mysql_sess->auth_resp_have += len;
+
+    if (mysql_sess->auth_resp_have == mysql_sess->auth_resp_len) {
+        resp = mysql_sess->auth_resp;
+        mysql_sess->auth_resp = NULL;
+        proc_auth_resp(s, resp, mysql_sess->auth_resp_len);
+        tc_pfree(s->pool, resp);
+    }
+}
+
+
+/*
+ * A packet of the target while authenticating. One that does not end in
+ * its segment is gathered whole, so that a switch request or a public
+ * key split across segments is parsed as it was sent; only one longer
+ * than MAX_AUTH_RESP_LEN is parsed from its head alone.
+ */
+static void
+proc_auth_pkt(tc_sess_t *s, unsigned char *payload, tc_mysql_pkt_t *pkt)
+{
+    uint32_t          size;
+    tc_mysql_session *mysql_sess = s->data;
+
+    size = MYSQL_HEADER_LEN + pkt->len;
+    if (pkt->prev_len == 0 && pkt->seg_len == size) {
+        proc_auth_resp(s, payload + pkt->off, pkt->seg_len);
+        return;
+    }
+
+    if (mysql_sess->auth_resp != NULL) {
+        tc_pfree(s->pool, mysql_sess->auth_resp);
+    }
+
+    mysql_sess->auth_resp = NULL;
+    if (size <= MAX_AUTH_RESP_LEN) {
+        mysql_sess->auth_resp = tc_palloc(s->pool, size);
+    }
+    if (mysql_sess->auth_resp == NULL) {
+        proc_auth_resp(s, pkt->head, pkt->head_len);
+        return;
+    }
+
+    mysql_sess->auth_resp_len  = size;
+    mysql_sess->auth_resp_have = pkt->prev_len;
+    memcpy(mysql_sess->auth_resp, pkt->head, pkt->prev_len);
+    add_auth_resp(s, payload + pkt->off, pkt->seg_len);
+}
+
+
+static int
+mysql_dispose_auth(tc_sess_t *s, tc_iph_t *ip, tc_tcph_t *tcp)
+{
+    int               auth_success;
+    char              user[MAX_USER_LEN];
+    uint16_t          size_tcp, cont_len;
+    unsigned char    *payload;
+    tc_mysql_rec_t   *rec;
+    tc_mysql_shard_t *shard;
+    tc_mysql_session *mysql_sess;
+
+    mysql_sess = s->data;
+    shard      = get_shard(s->hash_key);
+
+    size_tcp = tcp->doff << 2;
+    cont_len = s->cur_pack.cont_len;
+
+    if (!mysql_sess->first_auth_sent) {
+
+        payload = (unsigned char *) ((char *) tcp + size_tcp);
+
+        /* the user's own ratio, before anything of the session is stored */
+        if (sample_user_num > 0 && !s->sm.fake_syn
+                && get_clt_auth_user(payload, cont_len, user, MAX_USER_LEN)
+                && !is_sampled(s->hash_key, get_user_sample_ratio(user)))
+        {
+            shard->stats.sessions_skipped++;
+            s->sm.sess_over = 1;
+            tc_log_debug2(LOG_INFO, 0, "session of %s not sampled, p:%u",
+                    user, ntohs(s->src_port));
+            return TC_ERR;
+        }
+
+        tc_log_debug1(LOG_INFO, 0, "change fir auth:%u", ntohs(s->src_port));
+        auth_success = change_clt_auth_content(payload, (int) cont_len, 
+               mysql_sess->map_user, mysql_sess->password, mysql_sess->scramble,
+               &mysql_sess->user_info);
+        mysql_sess->user_gen = get_mysql_user_table_gen();
+
+        if (!auth_success) {
+            shard->stats.login_fails++;
+            s->sm.sess_over  = 1; 
+            tc_log_info(LOG_WARN, 0, "change fir auth unsuccessful");
+            return TC_ERR;
+        }
+
+        mysql_sess->first_auth_sent = 1;
+        shard->stats.logins++;
+        if (profile) {
+            tc_mysql_prof_rewrite(&shard->prof, payload, cont_len);
+        }
+
+        mysql_sess->clt_compress = (get_client_capabilities(payload,
+                    cont_len) & CLIENT_COMPRESS) != 0;
+        mysql_sess->query_attrs = mysql_sess->srv_query_attrs
+            && (get_client_capabilities(payload, cont_len)
+                    & CLIENT_QUERY_ATTRIBUTES) != 0;
+
+        if (mysql_sess->cmp != NULL) {
+            mysql_sess->cmp->clt_caps = get_client_capabilities(payload,
+                    cont_len);
+        }
+
+        if (!s->sm.fake_syn) {
+            release_resources(s->hash_key);
+
+            rec = get_rec(shard, s->hash_key);
+            if (rec == NULL) {
+                return TC_ERR;
+            }
+            rec->fir_auth = tc_mysql_buf_create(shard->pool, payload, cont_len);
+            if (rec->fir_auth != NULL) {
+                shard->stats.auth_bytes += rec->fir_auth->len;
+            }
+            mysql_sess->last_refresh_time = tc_time();
+
+#if (TC_DETECT_MEMORY)
+            tc_log_info(LOG_INFO, 0, "s:%p,hash add fir auth:%llu,value:%p, p:%u",
+                    s, s->hash_key, rec->fir_auth, ntohs(s->src_port));
+#endif
+        } else {
+            hash_node *hn = hash_find_node(shard->rec_table, s->hash_key);
+            if (hn != NULL) {
+                mysql_sess->last_refresh_time = hn->create_time;
+            } else {
+                tc_log_info(LOG_WARN, 0, "hash node for key:%llu is nil", 
+                        s->hash_key);
+            }
+        }
+
+    } else if (mysql_sess->sec_auth_not_yet_done && cont_len > 4) {
+        payload = (unsigned char *) ((char *) tcp + size_tcp);
+
+        /* packet number 0 starts a command */
+        if (payload[3] == 0) {
+            tc_log_info(LOG_WARN, 0,
+                    "target wants %s%s auth the client never did, p:%u",
+                    get_auth_plugin_name(mysql_sess->auth_plugin),
+                    mysql_sess->sha2_full_auth ? " full" : "",
+                    ntohs(s->src_port));
+            s->sm.sess_over = 1;
+            return TC_ERR;
+        }
+
+        tc_log_debug1(LOG_INFO, 0, "change sec auth:%u", ntohs(s->src_port));
+        if (change_sec_auth(s, payload, cont_len) != TC_OK) {
+            s->sm.sess_over = 1;
+            tc_log_info(LOG_WARN, 0, "change sec auth unsuccessful, p:%u",
+                    ntohs(s->src_port));
+            return TC_ERR;
+        }
+        mysql_sess->sec_auth_not_yet_done = 0;
+        shard->stats.sec_auths++;
+        if (profile) {
+            tc_mysql_prof_rewrite(&shard->prof, payload, cont_len);
+        }
+
+        /*
+         * A renewed session is served from the target's cache once full
+         * authentication passed, so only deterministic answers are kept
+         */
+        if (!s->sm.fake_syn && !mysql_sess->sha2_full_auth) {
+            rec = find_rec(shard, s->hash_key);
+            if (rec != NULL && rec->sec_auth == NULL) {
+                rec->sec_auth = tc_mysql_buf_create(shard->pool, payload,
+                        cont_len);
+                if (rec->sec_auth != NULL) {
+                    shard->stats.auth_bytes += rec->sec_auth->len;
+                }
+            }
+        }
+    }
+
+    return TC_OK;
+}
+
+
+/*
+ * Build a frame carrying data into the shard's scratch frame, with the ip
+ * and tcp headers of the session's template packet. tc_save_pack copies
+ * it, so the scratch frame is free again once the packet is saved.
+ * Stored payloads get their headers only here, when they are replayed.
+ */
+static tc_iph_t *
+build_frame(tc_mysql_shard_t *shard, tc_iph_t *tmpl_ip, unsigned char *data,
+        uint32_t len, uint32_t seq)
+{
+    uint16_t   size_ip, size_tcp;
+    tc_iph_t  *ip;
+    tc_tcph_t *tcp;
+
+    size_ip  = tmpl_ip->ihl << 2;
+    size_tcp = ((tc_tcph_t *) ((char *) tmpl_ip + size_ip))->doff << 2;
+
+    if (ETHERNET_HDR_LEN + size_ip + size_tcp + len > MAX_FRAME_LEN) {
+        tc_log_info(LOG_WARN, 0, "payload too long for a frame:%u", len);
+        return NULL;
+    }
+
+    ip  = (tc_iph_t *) (shard->frame + ETHERNET_HDR_LEN);
+    memcpy(ip, tmpl_ip, size_ip + size_tcp);
+    ip->tot_len = htons(size_ip + size_tcp + len);
+
+    tcp = (tc_tcph_t *) ((char *) ip + size_ip);
+    tcp->seq = htonl(seq);
+    memcpy((char *) tcp + size_tcp, data, len);
+
+    return ip;
+}
+
+
+/*
+ * Save data as the session's packets from seq on, in segments no longer
+ * than MAX_REPLAY_SEG_LEN
+ */
+static void
+save_replay_data(tc_sess_t *s, tc_mysql_shard_t *shard, tc_iph_t *tmpl_ip,
+        unsigned char *data, uint32_t len, uint32_t seq)
+{
+    uint32_t   n;
+    tc_iph_t  *ip;
+    tc_tcph_t *tcp;
+
+    while (len > 0) {
+        n  = len > MAX_REPLAY_SEG_LEN ? MAX_REPLAY_SEG_LEN : len;
+        ip = build_frame(shard, tmpl_ip, data, n, seq);
+        if (profile) {
+            tc_mysql_prof_rewrite(&shard->prof, data, n);
+        }
+        if (ip != NULL) {
+            tcp = (tc_tcph_t *) ((char *) ip + (ip->ihl << 2));
+            tc_save_pack(s, s->slide_win_packs, ip, tcp);
+        }
+        data += n;
+        seq  += n;
+        len  -= n;
+    }
+}
+
+
+/*
+ * Give a session seen only after it logged in the login of adopt_user.
+ * It is stored as the first auth of the session, so later renewals find
+ * it like any other.
+ */
+static tc_mysql_rec_t *
+adopt_session(tc_mysql_shard_t *shard, uint64_t key)
+{
+    tc_mysql_rec_t *rec;
+
+    rec = get_rec(shard, key);
+    if (rec == NULL) {
+        return NULL;
+    }
+
+    rec->fir_auth = tc_mysql_buf_create(shard->pool, adopt_auth,
+            adopt_auth_len);
+    if (rec->fir_auth != NULL) {
+        shard->stats.auth_bytes += rec->fir_auth->len;
+        shard->stats.adoptions++;
+    }
+
+    return rec;
+}
+
+
+/*
+ * Give every query restoring the state the empty attributes a session
+ * sending query attributes starts its queries with, moving the last
+ * packet first
+ */
+static uint32_t
+attr_state(unsigned char *buf, uint32_t len)
+{
+    uint32_t i, n, num, shift, offs[MAX_STATE_PKTS + 1];
+
+    shift = 0;
+    for (i = 0, num = 0; i < len && num < MAX_STATE_PKTS; i += n) {
+        offs[num++] = i;
+        n = MYSQL_HEADER_LEN + buf[i] + (buf[i + 1] << 8) + (buf[i + 2] << 16);
+        if (buf[i + MYSQL_HEADER_LEN] == COM_QUERY) {
+            shift += sizeof(no_query_attrs);
+        }
+    }
+    offs[num] = len;
+    len += shift;
+
+    for (i = num; i-- > 0; ) {
+        n = offs[i + 1] - offs[i];
+        if (buf[offs[i] + MYSQL_HEADER_LEN] != COM_QUERY) {
+            memmove(buf + offs[i] + shift, buf + offs[i], n);
+            continue;
+        }
+
+        shift -= sizeof(no_query_attrs);
+        memmove(buf + offs[i] + shift + MYSQL_HEADER_LEN + 1
+                + sizeof(no_query_attrs), buf + offs[i] + MYSQL_HEADER_LEN + 1,
+                n - MYSQL_HEADER_LEN - 1);
+        memmove(buf + offs[i] + shift, buf + offs[i], MYSQL_HEADER_LEN + 1);
+        memcpy(buf + offs[i] + shift + MYSQL_HEADER_LEN + 1, no_query_attrs,
+                sizeof(no_query_attrs));
+
+        n += sizeof(no_query_attrs) - MYSQL_HEADER_LEN;
+        buf[offs[i] + shift]     = n & 0xff;
+        buf[offs[i] + shift + 1] = (n >> 8) & 0xff;
+        buf[offs[i] + shift + 2] = (n >> 16) & 0xff;
+    }
+
+    return len;
+}
+
+
+/*
+ * Put every packet restoring the state into a frame of its own for a
+ * compressed session, moving the last one first
+ */
+static uint32_t
+wrap_state(unsigned char *buf, uint32_t len)
+{
+    uint32_t i, n, num, offs[MAX_STATE_PKTS + 1];
+
+    for (i = 0, num = 0; i < len && num < MAX_STATE_PKTS; i += n) {
+        offs[num++] = i;
+        n = MYSQL_HEADER_LEN + buf[i] + (buf[i + 1] << 8) + (buf[i + 2] << 16);
+    }
+    offs[num] = len;
+
+    for (i = num; i-- > 0; ) {
+        tc_mysql_zwrap(buf + offs[i] + i * MYSQL_ZHEADER_LEN, buf + offs[i],
+                offs[i + 1] - offs[i]);
+    }
+
+    return len + num * MYSQL_ZHEADER_LEN;
+}
+
+
+static int 
+prepare_for_renew_session(tc_sess_t *s, tc_iph_t *ip, tc_tcph_t *tcp)
+{
+    int                 compressed;
+    uint32_t            tot_clen, base_seq, state_len, hole_len;
+    uint64_t            key;
+    uint32_t            i, id, next_id, holes;
+    unsigned char      *hole;
+    unsigned char       state[MAX_STATE_LEN + MAX_STATE_PKTS
+                              * (MYSQL_ZHEADER_LEN + sizeof(no_query_attrs))];
+    tc_mysql_buf_t     *payload;
+    tc_mysql_rec_t     *rec;
+    tc_mysql_shard_t   *shard;
+    tc_mysql_session   *mysql_sess;
+
+    mysql_sess = s->data;
+    if (mysql_sess == NULL) {
+        tc_log_info(LOG_WARN, 0, "mysql session structure is not allocated");
+        return TC_ERR;
+    } else if (mysql_sess->auth_packet_already_added) {
+        tc_log_info(LOG_NOTICE, 0, "dup visit prepare_for_renew_session");
+        return TC_OK;
+    }
+
+    s->sm.need_rep_greet = 1;
+
+    key   = s->hash_key;
+    shard = get_shard(key);
+    rec   = find_rec(shard, key);
+    if ((rec == NULL || rec->fir_auth == NULL) && is_adoptable(key)) {
+        rec = adopt_session(shard, key);
+    }
+
+    if (rec == NULL || rec->fir_auth == NULL) {
+        tc_log_info(LOG_WARN, 0, "no first auth:%u", ntohs(s->src_port));
+        return TC_ERR;
+    }
+
+    tot_clen = rec->fir_auth->len;
+    if (rec->sec_auth != NULL) {
+        tot_clen += rec->sec_auth->len;
+    } else {
+        tc_log_debug1(LOG_INFO, 0, "no sec auth:%u", ntohs(s->src_port));
+    }
+
+    /* the schema and variables go first, the prepares may depend on them */
+    state_len  = 0;
+    compressed = is_compressed_rec(rec);
+    if (rec->state != NULL) {
+        state_len = tc_mysql_state_build(rec->state, state);
+        if (is_query_attrs_rec(rec)) {
+            state_len = attr_state(state, state_len);
+        }
+        if (compressed) {
+            state_len = wrap_state(state, state_len);
+        }
+        tot_clen += state_len;
+    }
+
+    /*
+     * The target hands out statement ids in prepare order, so every id
+     * that is no longer live is taken by a tiny placeholder to keep the
+     * ids of the live statements as the client knows them. Without all
+     * of them the ids would shift on the target and executes would run
+     * the wrong statements, so such a session is not replayed.
+     */
+    holes = rec->last_stmt_id - rec->stmt_num;
+    if (holes > MAX_STMT_HOLES) {
+        tc_log_info(LOG_WARN, 0, "too many stmt holes:%u, p:%u",
+                holes, ntohs(s->src_port));
+        shard->stats.ps_holes_refused++;
+        s->sm.sess_over = 1;
+        return TC_ERR;
+    }
+
+    if (compressed) {
+        hole     = stmt_zplaceholder;
+        hole_len = sizeof(stmt_zplaceholder);
+    } else {
+        hole     = stmt_placeholder;
+        hole_len = sizeof(stmt_placeholder);
+    }
+
+    tot_clen += rec->ps_cont_len + holes * hole_len;
+
+    tc_log_debug2(LOG_INFO, 0, "total len subtracted:%u,p:%u", tot_clen,
+            ntohs(s->src_port));
+
+    shard->stats.renewals++;
+    shard->stats.renewal_bytes += tot_clen;
+
+    mysql_sess->seq_after_ps = ntohl(tcp->seq);
+
+    /*
+     * Every packet replayed is framed with the headers of the packet that
+     * renews the session, which has the addresses the stored ones had
+     */
+    tcp->seq = htonl(ntohl(tcp->seq) - tot_clen);
+    base_seq = ntohl(tcp->seq) + 1;
+    save_replay_data(s, shard, ip, rec->fir_auth->data, rec->fir_auth->len,
+            base_seq);
+    base_seq += rec->fir_auth->len;
+    mysql_sess->auth_packet_already_added = 1;
+
+    if (rec->sec_auth != NULL) {
+        save_replay_data(s, shard, ip, rec->sec_auth->data,
+                rec->sec_auth->len, base_seq);
+        base_seq += rec->sec_auth->len;
+        tc_log_debug1(LOG_INFO, 0, "add sec auth:%u", ntohs(s->src_port));
+    }
+
+    if (state_len > 0) {
+        save_replay_data(s, shard, ip, state, state_len, base_seq);
+        base_seq += state_len;
+        shard->stats.state_replays++;
+    }
+
+    id = 1;
+    for (i = 0; i <= rec->stmt_num; i++) {
+        if (i < rec->stmt_num) {
+            next_id = rec->stmts[i]->id;
+        } else {
+            next_id = rec->last_stmt_id + 1;
+        }
+
+        for (; holes > 0 && id < next_id; id++) {
+            save_replay_data(s, shard, ip, hole, hole_len, base_seq);
+            base_seq += hole_len;
+        }
+
+        if (i == rec->stmt_num) {
+            break;
+        }
+
+        payload = rec->stmts[i]->payload;
+        save_replay_data(s, shard, ip, payload->data, payload->len,
+                base_seq);
+        base_seq += payload->len;
+        id = next_id + 1;
+    }
+
+    return TC_OK;
+}
+
+
+static void
+free_sess_data(tc_sess_t *s, tc_mysql_session *data)
+{
+    if (data->rsa_key != NULL) {
+        tc_pfree(s->pool, data->rsa_key);
+    }
+    if (data->auth_resp != NULL) {
+        tc_pfree(s->pool, data->auth_resp);
+    }
+    if (data->ps_capture != NULL) {
+        tc_pfree(s->pool, data->ps_capture);
+    }
+    if (data->cmp != NULL) {
+        tc_pfree(s->pool, data->cmp);
+    }
+    if (data->compress) {
+        tc_mysql_zframer_free(&data->clt_zframer);
+        tc_mysql_zframer_free(&data->srv_zframer);
+    }
+}
+
+
+static int 
+proc_when_sess_created(tc_sess_t *s)
+{
+    tc_mysql_shard_t *shard;
+    tc_mysql_session *data = s->data;
+
+    if (amplify > 1) {
+        tc_log_debug2(LOG_INFO, 0, "session copy:%u, p:%u",
+                get_copy_index(s->hash_key), ntohs(s->src_port));
+    }
+
+    /* renewed sessions were sampled when they were first seen */
+    if (!s->sm.fake_syn) {
+        shard = get_shard(s->hash_key);
+        shard->stats.sessions++;
+
+        if (!is_sampled(s->hash_key, sample_max)) {
+            shard->stats.sessions_skipped++;
+            s->sm.sess_over = 1;
+            if (data != NULL) {
+                free_sess_data(s, data);
+                tc_pfree(s->pool, data);
+                s->data = NULL;
+            }
+            return TC_OK;
+        }
+    }
+
+    if (data == NULL) {
+        data = (tc_mysql_session *) tc_pcalloc(s->pool, sizeof(tc_mysql_session));
+
+        if (data) {
+            s->data = data;
+        }
+    } else {
+        free_sess_data(s, data);
+        tc_memzero(data, sizeof(tc_mysql_session)); 
+    }
+
+    return TC_OK;
+}
+
+
+static int 
+proc_when_sess_destroyed(tc_sess_t *s)
+{
+    tc_mysql_session *data = s->data;
+
+    release_resources(s->hash_key);
+
+    if (data != NULL) {
+        free_sess_data(s, data);
+        tc_pfree(s->pool, data);
+        s->data = NULL;
+    }
+
+    return TC_OK;
+}
+
+
+static int
+proc_greet(tc_sess_t *s, tc_iph_t *ip, tc_tcph_t *tcp)
+{
+    int               ret, plugin; 
+    uint16_t          size_tcp, cont_len; 
+    unsigned char    *payload;
+    tc_mysql_session *mysql_sess;
+
+    mysql_sess = s->data;
+    if (mysql_sess == NULL) {
+        return PACK_STOP;
+    }
+
+    tc_log_debug1(LOG_INFO, 0, "recv greet from back:%u", ntohs(s->src_port));
+    size_tcp = tcp->doff << 2;
+    mysql_sess->auth_done       = 0;
+    mysql_sess->sha2_full_auth  = 0;
+    payload = (unsigned char *) ((char *) tcp + size_tcp);
+    tc_memzero(mysql_sess->scramble, SCRAMBLE_LENGTH + 1);
 
-    size_tcp = tcp->doff << 2;
     cont_len = s->cur_pack.cont_len;
 
-    if (!mysql_sess->first_auth_sent) {
+    plugin = AUTH_PLUGIN_NATIVE;
+    ret = parse_handshake_init_cont(payload, cont_len, mysql_sess->scramble,
+            &plugin);
+    if (!ret) {
+        if (cont_len > 11) {
+            tc_log_info(LOG_WARN, 0, "port:%u,payload:%s",
+                    ntohs(s->src_port), (char *) (payload + 11));
+        }
+        s->sm.sess_over = 1;
+        return PACK_STOP;
+    }
+
+    tc_log_debug2(LOG_INFO, 0, "target auth plugin:%s, p:%u",
+            get_auth_plugin_name(plugin), ntohs(s->src_port));
+    mysql_sess->auth_plugin = plugin;
+    mysql_sess->srv_compress = (get_server_capabilities(payload, cont_len)
+            & CLIENT_COMPRESS) != 0;
+    mysql_sess->srv_query_attrs = (get_server_capabilities(payload,
+                cont_len) & CLIENT_QUERY_ATTRIBUTES) != 0;
+
+    /* a renewed session replays commands the queue never saw */
+    if (digest_mode && !s->sm.fake_syn && mysql_sess->cmp == NULL) {
+        mysql_sess->cmp = tc_pcalloc(s->pool, sizeof(tc_mysql_cmp_t));
+        if (mysql_sess->cmp != NULL) {
+            mysql_sess->cmp->srv_caps = get_server_capabilities(payload,
+                    cont_len);
+        }
+    }
+
+    return PACK_CONTINUE;
+}
+
+
+static int 
+check_needed_for_sec_auth(tc_sess_t *s, tc_iph_t *ip, tc_tcph_t *tcp)
+{
+    int                i, auth_done;
+    uint16_t           size_tcp, cont_len;
+    uint64_t           now;
+    unsigned char     *payload;
+    tc_mysql_pkt_t    *pkt;
+    tc_mysql_session  *mysql_sess;
+    tc_mysql_frames_t  frames;
+
+    mysql_sess = s->data;
+    if (mysql_sess == NULL) {
+        return TC_OK;
+    }
+
+    size_tcp = tcp->doff << 2;
+    payload = (unsigned char *) ((char *) tcp + size_tcp);
+    cont_len = TCP_PAYLOAD_LENGTH(ip, tcp);
+    auth_done = mysql_sess->auth_done;
+    now = 0;
+
+    /* of a compressed response only the answer to a prepare is inflated */
+    if (mysql_sess->compress) {
+        tc_mysql_zframes(&mysql_sess->srv_zframer, ntohl(tcp->seq), payload,
+                cont_len, mysql_sess->pending_stmt_id ? MYSQL_HEAD_LEN : 0,
+                &frames);
+    } else {
+        frame_mysql_packets(&mysql_sess->srv_framer, ntohl(tcp->seq), payload,
+                cont_len, &frames);
+    }
+
+    /* the rest of an auth response that started in an earlier segment */
+    if (mysql_sess->auth_resp != NULL && frames.lead > 0) {
+        add_auth_resp(s, payload + frames.skip, frames.lead);
+    }
+
+    do {
+        for (i = 0; i < frames.num; i++) {
+            pkt = &frames.pkts[i];
+            if (pkt->cont) {
+                continue;
+            }
+
+            /* renewed sessions get answers to replayed prepares as well */
+            if (auth_done && !s->sm.fake_syn) {
+                proc_lat_resp(s, pkt, &now);
+            }
+
+            if (mysql_sess->first_auth_sent && !mysql_sess->auth_done) {
+                proc_auth_pkt(s, payload, pkt);
+            } else if (mysql_sess->pending_stmt_id) {
+                proc_prepare_resp(s, pkt->head, pkt->head_len);
+            }
+        }
+    } while (more_frames(mysql_sess->compress ? &mysql_sess->srv_zframer : NULL,
+                &mysql_sess->srv_framer, payload, cont_len,
+                mysql_sess->pending_stmt_id ? MYSQL_HEAD_LEN : 0, &frames));
+
+    if (auth_done && mysql_sess->cmp != NULL && !mysql_sess->cmp->lost) {
+        proc_resp_data(s, ntohl(tcp->seq), payload, cont_len, frames.skip);
+    }
+
+    return TC_OK;
+}
+
+
+static int 
+proc_auth(tc_sess_t *s, tc_iph_t *ip, tc_tcph_t *tcp)
+{
+    if (!s->sm.rcv_rep_greet || s->data == NULL) {
+        return PACK_STOP;
+    }
+
+    if (mysql_dispose_auth(s, ip, tcp) == TC_ERR) {
+        return PACK_STOP;
+    }
+
+    return PACK_CONTINUE;
+}
+
+
+/*
+ * With profile on, tcpcopy calls the module through these, which time
+ * every callback into the shard of its session
+ */
+static inline void
+prof_hook(uint64_t key, int hook, uint64_t start)
+{
+    tc_mysql_prof_hook_t *h;
+
+    h = &get_shard(key)->prof.hooks[hook];
+    h->calls++;
+    h->nsec += tc_mysql_nsec() - start;
+}
+
+
+static bool
+prof_check_renew_session(tc_iph_t *ip, tc_tcph_t *tcp)
+{
+    bool     ret;
+    uint64_t start;
+
+    if (!profile || ctx == NULL) {
+        return check_renew_session(ip, tcp);
+    }
+
+    start = tc_mysql_nsec();
+    ret   = check_renew_session(ip, tcp);
+    prof_hook(get_key(ip->saddr, tcp->source), PROF_RENEW_CHECK, start);
+
+    return ret;
+}
+
+
+static int
+prof_prepare_for_renew_session(tc_sess_t *s, tc_iph_t *ip, tc_tcph_t *tcp)
+{
+    int      ret;
+    uint64_t start;
+
+    if (!profile) {
+        return prepare_for_renew_session(s, ip, tcp);
+    }
+
+    start = tc_mysql_nsec();
+    ret   = prepare_for_renew_session(s, ip, tcp);
+    prof_hook(s->hash_key, PROF_RENEW, start);
+
+    return ret;
+}
+
+
+static bool
+prof_check_pack_needed_for_recons(tc_sess_t *s, tc_iph_t *ip,
+        tc_tcph_t *tcp)
+{
+    bool     ret;
+    uint64_t start;
+
+    if (!profile) {
+        return check_pack_needed_for_recons(s, ip, tcp);
+    }
+
+    start = tc_mysql_nsec();
+    ret   = check_pack_needed_for_recons(s, ip, tcp);
+    prof_hook(s->hash_key, PROF_RECONS, start);
+
+    return ret;
+}
+
+
+static int
+prof_proc_when_sess_created(tc_sess_t *s)
+{
+    int      ret;
+    uint64_t start;
+
+    if (!profile) {
+        return proc_when_sess_created(s);
+    }
+
+    start = tc_mysql_nsec();
+    ret   = proc_when_sess_created(s);
+    prof_hook(s->hash_key, PROF_CREATED, start);
+
+    return ret;
+}
+
+
+static int
+prof_proc_greet(tc_sess_t *s, tc_iph_t *ip, tc_tcph_t *tcp)
+{
+    int      ret;
+    uint64_t start;
+
+    if (!profile) {
+        return proc_greet(s, ip, tcp);
+    }
+
+    start = tc_mysql_nsec();
+    ret   = proc_greet(s, ip, tcp);
+    prof_hook(s->hash_key, PROF_GREET, start);
+
+    return ret;
+}
+
+
+static int
+prof_proc_auth(tc_sess_t *s, tc_iph_t *ip, tc_tcph_t *tcp)
+{
+    int      ret;
+    uint64_t start;
+
+    if (!profile) {
+        return proc_auth(s, ip, tcp);
+    }
+
+    start = tc_mysql_nsec();
+    ret   = proc_auth(s, ip, tcp);
+    prof_hook(s->hash_key, PROF_AUTH, start);
+
+    return ret;
+}
+
+
+static int
+prof_check_needed_for_sec_auth(tc_sess_t *s, tc_iph_t *ip, tc_tcph_t *tcp)
+{
+    int      ret;
+    uint64_t start;
+
+    if (!profile) {
+        return check_needed_for_sec_auth(s, ip, tcp);
+    }
+
+    start = tc_mysql_nsec();
+    ret   = check_needed_for_sec_auth(s, ip, tcp);
+    prof_hook(s->hash_key, PROF_RESP, start);
+
+    return ret;
+}
+
+
+static int
+mysql_parse_user_info(tc_conf_t *cf, tc_cmd_t *cmd)
+{
+    char       pass[MAX_USER_INFO];
+    tc_str_t  *user_password;
+
+    user_password = cf->args->elts;
+
+    tc_memzero(pass, MAX_USER_INFO);
+
+    if (user_password[1].len >= MAX_USER_INFO) {
+        tc_log_info(LOG_ERR, 0, "user password pair too long");
+        return TC_ERR;
+    }
+
+    memcpy(pass, user_password[1].data, user_password[1].len);
+
+    if (retrieve_mysql_user_pwd_info(cf->pool, pass) == -1) {
+        tc_log_info(LOG_ERR, 0, "parse user password error");
+        return TC_ERR;
+    }
+
+    return TC_OK;
+}
+
+
+static int
+mysql_parse_user_file(tc_conf_t *cf, tc_cmd_t *cmd)
+{
+    char      *path;
+    tc_str_t  *args;
+
+    args = cf->args->elts;
+
+    if (args[1].len == 0) {
+        tc_log_info(LOG_ERR, 0, "invalid user_file value");
+        return TC_ERR;
+    }
+
+    path = tc_pcalloc(cf->pool, args[1].len + 1);
+    if (path == NULL) {
+        return TC_ERR;
+    }
+    memcpy(path, args[1].data, args[1].len);
+
+    if (load_mysql_user_file(path) == -1) {
+        tc_log_info(LOG_ERR, 0, "load user file error:%s", path);
+        return TC_ERR;
+    }
+
+    return TC_OK;
+}
+
+
+static int
+mysql_parse_stats_file(tc_conf_t *cf, tc_cmd_t *cmd)
+{
+    tc_str_t  *args;
+
+    args = cf->args->elts;
+
+    if (args[1].len == 0) {
+        tc_log_info(LOG_ERR, 0, "invalid stats_file value");
+        return TC_ERR;
+    }
+
+    stats_file = tc_pcalloc(cf->pool, args[1].len + 1);
+    if (stats_file == NULL) {
+        return TC_ERR;
+    }
+    memcpy(stats_file, args[1].data, args[1].len);
+
+    return TC_OK;
+}
+
+
+static int
+mysql_parse_digest(tc_conf_t *cf, tc_cmd_t *cmd, int mode)
+{
+    tc_str_t  *args;
+
+    args = cf->args->elts;
+
+    if (args[1].len == 0) {
+        tc_log_info(LOG_ERR, 0, "invalid digest file value");
+        return TC_ERR;
+    }
+
+    if (digest_mode != 0) {
+        tc_log_info(LOG_ERR, 0, "digest_record and digest_check exclude "
+                "each other");
+        return TC_ERR;
+    }
+
+    digest_file = tc_pcalloc(cf->pool, args[1].len + 1);
+    if (digest_file == NULL) {
+        return TC_ERR;
+    }
+    memcpy(digest_file, args[1].data, args[1].len);
+    digest_mode = mode;
+
+    return TC_OK;
+}
+
+
+static int
+mysql_parse_digest_record(tc_conf_t *cf, tc_cmd_t *cmd)
+{
+    return mysql_parse_digest(cf, cmd, DIGEST_RECORD);
+}
+
+
+static int
+mysql_parse_digest_check(tc_conf_t *cf, tc_cmd_t *cmd)
+{
+    return mysql_parse_digest(cf, cmd, DIGEST_CHECK);
+}
+
+
+static int
+mysql_parse_top_file(tc_conf_t *cf, tc_cmd_t *cmd)
+{
+    tc_str_t  *args;
+
+    args = cf->args->elts;
+
+    if (args[1].len == 0) {
+        tc_log_info(LOG_ERR, 0, "invalid sql_top_file value");
+        return TC_ERR;
+    }
+
+    top_file = tc_pcalloc(cf->pool, args[1].len + 1);
+    if (top_file == NULL) {
+        return TC_ERR;
+    }
+    memcpy(top_file, args[1].data, args[1].len);
+
+    return TC_OK;
+}
+
+
+static int
+mysql_parse_top_num(tc_conf_t *cf, tc_cmd_t *cmd)
+{
+    int        num;
+    char       buf[16];
+    tc_str_t  *args;
+
+    args = cf->args->elts;
+
+    if (args[1].len == 0 || args[1].len >= sizeof(buf)) {
+        tc_log_info(LOG_ERR, 0, "invalid sql_top value");
+        return TC_ERR;
+    }
+
+    tc_memzero(buf, sizeof(buf));
+    memcpy(buf, args[1].data, args[1].len);
+
+    num = atoi(buf);
+    if (num <= 0 || num > MAX_TOP_NUM) {
+        tc_log_info(LOG_ERR, 0, "sql_top should be in [1, %d]:%s",
+                MAX_TOP_NUM, buf);
+        return TC_ERR;
+    }
+
+    top_num = (uint32_t) num;
+
+    return TC_OK;
+}
+
+
+/* a fraction such as 0.25 or a percentage such as 25% */
+static int
+parse_sample_ratio(char *buf, uint32_t *ratio)
+{
+    char   *end;
+    double  r;
+
+    errno = 0;
+    r = strtod(buf, &end);
+    if (end == buf || errno != 0) {
+        return TC_ERR;
+    }
+
+    if (*end == '%') {
+        r /= 100;
+        end++;
+    }
+
+    if (*end != '\0' || !(r > 0) || r > 1) {
+        return TC_ERR;
+    }
+
+    *ratio = (uint32_t) (r * SAMPLE_SCALE + 0.5);
+    if (*ratio == 0) {
+        *ratio = 1;
+    }
+
+    return TC_OK;
+}
+
+
+static int
+mysql_parse_sample(tc_conf_t *cf, tc_cmd_t *cmd)
+{
+    char       buf[32];
+    tc_str_t  *args;
+
+    args = cf->args->elts;
+
+    if (args[1].len == 0 || args[1].len >= sizeof(buf)) {
+        tc_log_info(LOG_ERR, 0, "invalid sample value");
+        return TC_ERR;
+    }
+
+    tc_memzero(buf, sizeof(buf));
+    memcpy(buf, args[1].data, args[1].len);
+
+    if (parse_sample_ratio(buf, &sample_ratio) != TC_OK) {
+        tc_log_info(LOG_ERR, 0, "sample should be in (0, 1] or (0%%, 100%%]:%s",
+                buf);
+        return TC_ERR;
+    }
+
+    return TC_OK;
+}
+
+
+/* user@ratio pairs separated by commas, as many directives as needed */
+static int
+mysql_parse_sample_user(tc_conf_t *cf, tc_cmd_t *cmd)
+{
+    char               buf[MAX_USER_INFO], *p, *next, *at;
+    tc_str_t          *args;
+    tc_mysql_sample_t *su;
+
+    args = cf->args->elts;
+
+    if (args[1].len == 0 || args[1].len >= MAX_USER_INFO) {
+        tc_log_info(LOG_ERR, 0, "invalid sample_user value");
+        return TC_ERR;
+    }
+
+    tc_memzero(buf, MAX_USER_INFO);
+    memcpy(buf, args[1].data, args[1].len);
+
+    for (p = buf; p != NULL; p = next) {
+        next = strchr(p, ',');
+        if (next != NULL) {
+            *next++ = '\0';
+        }
+
+        at = strrchr(p, '@');
+        if (at == NULL || at == p || at - p >= MAX_USER_LEN) {
+            tc_log_info(LOG_ERR, 0, "sample_user wants user@ratio:%s", p);
+            return TC_ERR;
+        }
+        *at++ = '\0';
 
-        payload = (unsigned char *) ((char *) tcp + size_tcp);
-        tc_log_debug1(LOG_INFO, 0, "change fir auth:%u", ntohs(s->src_port));
-        auth_success = change_clt_auth_content(payload, (int) cont_len, 
-               mysql_sess->map_user, mysql_sess->password, mysql_sess->scramble);
+        if (sample_user_num == MAX_SAMPLE_USERS) {
+            tc_log_info(LOG_ERR, 0, "too many sample users, max %d",
+                    MAX_SAMPLE_USERS);
+            return TC_ERR;
+        }
 
-        if (!auth_success) {
-            s->sm.sess_over  = 1; 
-            tc_log_info(LOG_WARN, 0, "change fir auth unsuccessful");
+        su = &sample_users[sample_user_num];
+        if (parse_sample_ratio(at, &su->ratio) != TC_OK) {
+            tc_log_info(LOG_ERR, 0, "invalid sample ratio of %s:%s", p, at);
             return TC_ERR;
         }
+        strcpy(su->user, p);
+        sample_user_num++;
+    }
 
-        mysql_sess->first_auth_sent = 1;
+    return TC_OK;
+}
 
-        if (!s->sm.fake_syn) {
-            release_resources(s->hash_key);
 
-            value = (void *) cp_fr_ip_pack(ctx.fir_auth_pool, ip);
-            hash_add(ctx.fir_auth_table, ctx.fir_auth_pool, s->hash_key, value);
-            mysql_sess->last_refresh_time = tc_time();
+static int
+mysql_parse_filter(tc_conf_t *cf, tc_cmd_t *cmd)
+{
+    char       buf[64], *p, *next;
+    tc_str_t  *args;
 
-#if (TC_DETECT_MEMORY)
-            tc_log_info(LOG_INFO, 0, "s:%p,hash add fir auth:%llu,value:%p, p:%u",
-                    s, s->hash_key, value, ntohs(s->src_port));
-#endif
-        } else {
-            hash_node *hn = hash_find_node(ctx.fir_auth_table, s->hash_key);
-            if (hn != NULL) {
-                mysql_sess->last_refresh_time = hn->create_time;
-            } else {
-                tc_log_info(LOG_WARN, 0, "hash node for key:%llu is nil", 
-                        s->hash_key);
-            }
-        }
+    args = cf->args->elts;
 
-    } else if (mysql_sess->first_auth_sent && mysql_sess->sec_auth_not_yet_done)
-    {
-        payload = (unsigned char *) ((char *) tcp + size_tcp);
+    if (args[1].len == 0 || args[1].len >= sizeof(buf)) {
+        tc_log_info(LOG_ERR, 0, "invalid filter value");
+        return TC_ERR;
+    }
 
-        tc_memzero(encryption, ENCRYPT_LEN);
-        tc_memzero(mysql_sess->seed323, SEED_323_LENGTH + 1);
-        memcpy(mysql_sess->seed323, mysql_sess->scramble, SEED_323_LENGTH);
-        new_crypt(encryption, mysql_sess->password, mysql_sess->seed323);
+    tc_memzero(buf, sizeof(buf));
+    memcpy(buf, args[1].data, args[1].len);
 
-        tc_log_debug1(LOG_INFO, 0, "change sec auth:%u", ntohs(s->src_port));
-        change_clt_second_auth_content(payload, cont_len, encryption);
-        mysql_sess->sec_auth_not_yet_done = 0;
+    for (p = buf; p != NULL; p = next) {
+        next = strchr(p, ',');
+        if (next != NULL) {
+            *next++ = '\0';
+        }
 
-        if (!s->sm.fake_syn) {
-            value = (void *) cp_fr_ip_pack(ctx.sec_auth_pool, ip);
-            hash_add(ctx.sec_auth_table, ctx.sec_auth_pool, s->hash_key, value);
+        if (strcmp(p, "write") == 0) {
+            filter_classes |= 1 << SQL_CLASS_WRITE;
+        } else if (strcmp(p, "ddl") == 0) {
+            filter_classes |= 1 << SQL_CLASS_DDL;
+        } else if (strcmp(p, "txn") == 0) {
+            filter_classes |= 1 << SQL_CLASS_TXN;
+        } else {
+            tc_log_info(LOG_ERR, 0, "filter takes write, ddl and txn:%s", p);
+            return TC_ERR;
         }
     }
 
@@ -547,216 +4041,286 @@ mysql_dispose_auth(tc_sess_t *s, tc_iph_t *ip, tc_tcph_t *tcp)
 }
 
 
-static int 
-prepare_for_renew_session(tc_sess_t *s, tc_iph_t *ip, tc_tcph_t *tcp)
+static int
+mysql_parse_profile(tc_conf_t *cf, tc_cmd_t *cmd)
 {
-    uint16_t            size_ip, fir_clen, sec_clen;
-    uint32_t            tot_clen, base_seq;
-    uint64_t            key;
-    tc_iph_t           *fir_ip, *t_ip, *sec_ip;
-    tc_tcph_t          *fir_tcp, *t_tcp, *sec_tcp;
-    p_link_node         ln;
-    unsigned char      *p;
-    mysql_table_item_t *item;
-    tc_mysql_session   *mysql_sess;
+    tc_str_t  *args;
 
-    mysql_sess = s->data;
-    if (mysql_sess == NULL) {
-        tc_log_info(LOG_WARN, 0, "mysql session structure is not allocated");
+    args = cf->args->elts;
+
+    if (args[1].len == 2 && memcmp(args[1].data, "on", 2) == 0) {
+        profile = 1;
+    } else if (args[1].len == 3 && memcmp(args[1].data, "off", 3) == 0) {
+        profile = 0;
+    } else {
+        tc_log_info(LOG_ERR, 0, "profile should be on or off");
         return TC_ERR;
-    } else if (mysql_sess->auth_packet_already_added) {
-        tc_log_info(LOG_NOTICE, 0, "dup visit prepare_for_renew_session");
-        return TC_OK;
     }
 
-    sec_ip = NULL;
-    sec_tcp = NULL;
-    s->sm.need_rep_greet = 1;
+    return TC_OK;
+}
 
-    key = s->hash_key;
 
-    p = (unsigned char *) hash_find(ctx.fir_auth_table, key);
+static int
+mysql_parse_adopt(tc_conf_t *cf, tc_cmd_t *cmd)
+{
+    char       buf[MAX_USER_LEN + MAX_DB_LEN + 1], *at;
+    tc_str_t  *args;
 
-    if (p != NULL) {
-        fir_ip   = (tc_iph_t *) (p + ETHERNET_HDR_LEN);
-        size_ip  = fir_ip->ihl << 2;
-        fir_tcp  = (tc_tcph_t *) ((char *) fir_ip + size_ip);
-        fir_clen = TCP_PAYLOAD_LENGTH(fir_ip, fir_tcp);
-        tot_clen = fir_clen;
-    } else {
-        tc_log_info(LOG_WARN, 0, "no first auth:%u", ntohs(s->src_port));
+    args = cf->args->elts;
+
+    if (args[1].len == 0 || args[1].len >= sizeof(buf)) {
+        tc_log_info(LOG_ERR, 0, "invalid adopt value");
         return TC_ERR;
     }
 
-    p = (unsigned char *) hash_find(ctx.sec_auth_table, key);
-    if (p != NULL) {
-        sec_ip    = (tc_iph_t *) (p + ETHERNET_HDR_LEN);
-        size_ip   = sec_ip->ihl << 2;
-        sec_tcp   = (tc_tcph_t *) ((char *) sec_ip + size_ip);
-        sec_clen  = TCP_PAYLOAD_LENGTH(sec_ip, sec_tcp);
-        tot_clen += sec_clen;
-    } else {
-        sec_clen  = 0;
-        tc_log_debug1(LOG_INFO, 0, "no sec auth:%u", ntohs(s->src_port));
+    tc_memzero(buf, sizeof(buf));
+    memcpy(buf, args[1].data, args[1].len);
+
+    at = strrchr(buf, '@');
+    if (at != NULL) {
+        *at++ = '\0';
+        if (strlen(at) > MAX_DB_LEN) {
+            tc_log_info(LOG_ERR, 0, "adopt db is too long:%s", at);
+            return TC_ERR;
+        }
+        strcpy(adopt_db, at);
     }
 
-    item = hash_find(ctx.ps_table, s->hash_key);
-    if (item) {
-        tot_clen += item->tot_cont_len;
+    if (buf[0] == '\0' || strlen(buf) >= MAX_USER_LEN) {
+        tc_log_info(LOG_ERR, 0, "adopt wants user[@db]:%s", buf);
+        return TC_ERR;
     }
+    strcpy(adopt_user, buf);
 
-    tc_log_debug2(LOG_INFO, 0, "total len subtracted:%u,p:%u", tot_clen,
-            ntohs(s->src_port));
+    return TC_OK;
+}
 
-    mysql_sess->seq_after_ps = ntohl(tcp->seq);
 
-    tcp->seq     = htonl(ntohl(tcp->seq) - tot_clen);
-    fir_tcp->seq = htonl(ntohl(tcp->seq) + 1);
-    tc_save_pack(s, s->slide_win_packs, fir_ip, fir_tcp);  
-    mysql_sess->auth_packet_already_added = 1;
+static int
+mysql_parse_adopt_caps(tc_conf_t *cf, tc_cmd_t *cmd)
+{
+    char           buf[16], *end;
+    unsigned long  caps;
+    tc_str_t      *args;
 
-    if (sec_tcp != NULL) {
-        sec_tcp->seq = htonl(ntohl(fir_tcp->seq) + fir_clen);
-        tc_save_pack(s, s->slide_win_packs, sec_ip, sec_tcp);
-        tc_log_debug1(LOG_INFO, 0, "add sec auth:%u", ntohs(s->src_port));
+    args = cf->args->elts;
+
+    if (args[1].len == 0 || args[1].len >= sizeof(buf)) {
+        tc_log_info(LOG_ERR, 0, "invalid adopt_caps value");
+        return TC_ERR;
     }
 
-    base_seq = ntohl(fir_tcp->seq) + fir_clen + sec_clen;
+    tc_memzero(buf, sizeof(buf));
+    memcpy(buf, args[1].data, args[1].len);
 
-    if (item) {
-        ln = link_list_first(item->list); 
-        while (ln) {
-            p = (unsigned char *) ln->data;
-            t_ip  = (tc_iph_t *) (p + ETHERNET_HDR_LEN);
-            t_tcp = (tc_tcph_t *) ((char *) t_ip + size_ip);
-            t_tcp->seq = htonl(base_seq);
-            tc_save_pack(s, s->slide_win_packs, t_ip, t_tcp);  
-            base_seq += TCP_PAYLOAD_LENGTH(t_ip, t_tcp);
-            ln = link_list_get_next(item->list, ln);
-        }
+    caps = strtoul(buf, &end, 0);
+    if (*end != '\0' || caps > UINT32_MAX) {
+        tc_log_info(LOG_ERR, 0, "adopt_caps should be client flags:%s", buf);
+        return TC_ERR;
     }
 
+    adopt_caps = caps;
+
     return TC_OK;
 }
 
 
-static int 
-proc_when_sess_created(tc_sess_t *s)
+static int
+mysql_parse_snapshot(tc_conf_t *cf, tc_cmd_t *cmd)
 {
-    tc_mysql_session *data = s->data;
+    tc_str_t  *args;
 
-    if (data == NULL) {
-        data = (tc_mysql_session *) tc_pcalloc(s->pool, sizeof(tc_mysql_session));
+    args = cf->args->elts;
 
-        if (data) {
-            s->data = data;
-        }
-    } else {
-        tc_memzero(data, sizeof(tc_mysql_session)); 
+    if (args[1].len == 0) {
+        tc_log_info(LOG_ERR, 0, "invalid snapshot value");
+        return TC_ERR;
+    }
+
+    snapshot_file = tc_pcalloc(cf->pool, args[1].len + 1);
+    if (snapshot_file == NULL) {
+        return TC_ERR;
     }
+    memcpy(snapshot_file, args[1].data, args[1].len);
 
     return TC_OK;
 }
 
 
-static int 
-proc_when_sess_destroyed(tc_sess_t *s)
+static int
+mysql_parse_snapshot_interval(tc_conf_t *cf, tc_cmd_t *cmd)
 {
-    release_resources(s->hash_key);
+    int        num;
+    char       buf[16];
+    tc_str_t  *args;
+
+    args = cf->args->elts;
+
+    if (args[1].len == 0 || args[1].len >= sizeof(buf)) {
+        tc_log_info(LOG_ERR, 0, "invalid snapshot_interval value");
+        return TC_ERR;
+    }
+
+    tc_memzero(buf, sizeof(buf));
+    memcpy(buf, args[1].data, args[1].len);
+
+    num = atoi(buf);
+    if (num < 0 || (num == 0 && buf[0] != '0')) {
+        tc_log_info(LOG_ERR, 0, "snapshot_interval should be seconds:%s", buf);
+        return TC_ERR;
+    }
+
+    snapshot_interval = num;
+
     return TC_OK;
 }
 
 
 static int
-proc_greet(tc_sess_t *s, tc_iph_t *ip, tc_tcph_t *tcp)
+mysql_parse_shard_num(tc_conf_t *cf, tc_cmd_t *cmd)
 {
-    int               ret; 
-    uint16_t          size_tcp, cont_len; 
-    unsigned char    *payload;
-    tc_mysql_session *mysql_sess;
+    int        num;
+    char       buf[16];
+    tc_str_t  *args;
 
-    mysql_sess = s->data;
-    tc_log_debug1(LOG_INFO, 0, "recv greet from back:%u", ntohs(s->src_port));
-    size_tcp = tcp->doff << 2;
-    mysql_sess->sec_auth_checked  = 0;
-    payload = (unsigned char *) ((char *) tcp + size_tcp);
-    tc_memzero(mysql_sess->scramble, SCRAMBLE_LENGTH + 1);
+    args = cf->args->elts;
 
-    cont_len = s->cur_pack.cont_len;
+    if (args[1].len == 0 || args[1].len >= sizeof(buf)) {
+        tc_log_info(LOG_ERR, 0, "invalid shards value");
+        return TC_ERR;
+    }
 
-    ret = parse_handshake_init_cont(payload, cont_len, mysql_sess->scramble);
-    if (!ret) {
-        if (cont_len > 11) {
-            tc_log_info(LOG_WARN, 0, "port:%u,payload:%s",
-                    ntohs(s->src_port), (char *) (payload + 11));
-        }
-        s->sm.sess_over = 1;
-        return PACK_STOP;
+    tc_memzero(buf, sizeof(buf));
+    memcpy(buf, args[1].data, args[1].len);
+
+    num = atoi(buf);
+    if (num <= 0 || num > MAX_SHARD_NUM) {
+        tc_log_info(LOG_ERR, 0, "shards should be in [1, %d]:%s",
+                MAX_SHARD_NUM, buf);
+        return TC_ERR;
     }
 
-    return PACK_CONTINUE;
+    shard_num = (uint32_t) num;
+
+    return TC_OK;
 }
 
 
-static int 
-check_needed_for_sec_auth(tc_sess_t *s, tc_iph_t *ip, tc_tcph_t *tcp)
+static int
+mysql_parse_amplify(tc_conf_t *cf, tc_cmd_t *cmd)
 {
-    uint16_t          size_tcp;
-    unsigned char    *payload;
-    tc_mysql_session *mysql_sess;
+    int        num;
+    char       buf[16];
+    tc_str_t  *args;
 
-    mysql_sess = s->data;
-    if (mysql_sess->sec_auth_checked == 0) {
-        size_tcp = tcp->doff << 2;
-        payload = (unsigned char *) ((char *) tcp + size_tcp);
-        if (is_last_data_packet(payload)) {
-            tc_log_debug1(LOG_INFO, 0, "needs sec auth:%u", ntohs(s->src_port));
-            mysql_sess->sec_auth_not_yet_done = 1;
-        }
-        mysql_sess->sec_auth_checked = 1;
+    args = cf->args->elts;
+
+    if (args[1].len == 0 || args[1].len >= sizeof(buf)) {
+        tc_log_info(LOG_ERR, 0, "invalid amplify value");
+        return TC_ERR;
+    }
+
+    tc_memzero(buf, sizeof(buf));
+    memcpy(buf, args[1].data, args[1].len);
+
+    num = atoi(buf);
+    if (num <= 0 || num > MAX_AMPLIFY) {
+        tc_log_info(LOG_ERR, 0, "amplify should be in [1, %d]:%s",
+                MAX_AMPLIFY, buf);
+        return TC_ERR;
     }
 
+    amplify = (uint32_t) num;
+
     return TC_OK;
 }
 
 
-static int 
-proc_auth(tc_sess_t *s, tc_iph_t *ip, tc_tcph_t *tcp)
+static int
+mysql_parse_ps_budget(tc_conf_t *cf, tc_cmd_t *cmd)
 {
-    if (!s->sm.rcv_rep_greet) {
-        return PACK_STOP;
+    char       buf[32], *end;
+    uint64_t   size;
+    tc_str_t  *args;
+
+    args = cf->args->elts;
+
+    if (args[1].len == 0 || args[1].len >= sizeof(buf)) {
+        tc_log_info(LOG_ERR, 0, "invalid ps_budget value");
+        return TC_ERR;
     }
 
-    if (mysql_dispose_auth(s, ip, tcp) == TC_ERR) {
-        return PACK_STOP;
+    tc_memzero(buf, sizeof(buf));
+    memcpy(buf, args[1].data, args[1].len);
+
+    size = strtoull(buf, &end, 10);
+    switch (*end) {
+    case 'g':
+    case 'G':
+        size <<= 10;
+        /* fall through */
+    case 'm':
+    case 'M':
+        size <<= 10;
+        /* fall through */
+    case 'k':
+    case 'K':
+        size <<= 10;
+        end++;
+        break;
     }
 
-    return PACK_CONTINUE;
+    if (size == 0 || *end != '\0') {
+        tc_log_info(LOG_ERR, 0, "invalid ps_budget value:%s", buf);
+        return TC_ERR;
+    }
+
+    ps_budget = size;
+
+    return TC_OK;
 }
 
 
 static int
-mysql_parse_user_info(tc_conf_t *cf, tc_cmd_t *cmd)
+mysql_parse_rsa_public_key(tc_conf_t *cf, tc_cmd_t *cmd)
 {
-    char       pass[MAX_USER_INFO];
-    tc_str_t  *user_password;
+    int        fd;
+    char       path[MAX_USER_INFO];
+    ssize_t    n;
+    tc_str_t  *args;
 
-    user_password = cf->args->elts;
+    args = cf->args->elts;
 
-    tc_memzero(pass, MAX_USER_INFO);
+    if (args[1].len == 0 || args[1].len >= MAX_USER_INFO) {
+        tc_log_info(LOG_ERR, 0, "invalid rsa_public_key value");
+        return TC_ERR;
+    }
 
-    if (user_password[1].len >= MAX_USER_INFO) {
-        tc_log_info(LOG_ERR, 0, "user password pair too long");
+    tc_memzero(path, MAX_USER_INFO);
+    memcpy(path, args[1].data, args[1].len);
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        tc_log_info(LOG_ERR, errno, "open rsa public key:%s failed", path);
         return TC_ERR;
     }
 
-    memcpy(pass, user_password[1].data, user_password[1].len);
+    rsa_public_key = tc_palloc(cf->pool, MAX_RSA_KEY_FILE_LEN);
+    if (rsa_public_key == NULL) {
+        close(fd);
+        return TC_ERR;
+    }
 
-    if (retrieve_mysql_user_pwd_info(cf->pool, pass) == -1) {
-        tc_log_info(LOG_ERR, 0, "parse user password error");
+    n = read(fd, rsa_public_key, MAX_RSA_KEY_FILE_LEN);
+    close(fd);
+    if (n <= 0 || n == MAX_RSA_KEY_FILE_LEN) {
+        tc_log_info(LOG_ERR, 0, "invalid rsa public key file:%s", path);
         return TC_ERR;
     }
 
+    rsa_public_key_len = n;
+
     return TC_OK;
 }
 
@@ -768,6 +4332,132 @@ static tc_cmd_t  mysql_commands[] = {
         TC_CONF_TAKE1,
         mysql_parse_user_info,
         NULL
+    },
+    { tc_string("user_file"),
+        0,
+        0,
+        TC_CONF_TAKE1,
+        mysql_parse_user_file,
+        NULL
+    },
+    { tc_string("sample"),
+        0,
+        0,
+        TC_CONF_TAKE1,
+        mysql_parse_sample,
+        NULL
+    },
+    { tc_string("sample_user"),
+        0,
+        0,
+        TC_CONF_TAKE1,
+        mysql_parse_sample_user,
+        NULL
+    },
+    { tc_string("filter"),
+        0,
+        0,
+        TC_CONF_TAKE1,
+        mysql_parse_filter,
+        NULL
+    },
+    { tc_string("shards"),
+        0,
+        0,
+        TC_CONF_TAKE1,
+        mysql_parse_shard_num,
+        NULL
+    },
+    { tc_string("amplify"),
+        0,
+        0,
+        TC_CONF_TAKE1,
+        mysql_parse_amplify,
+        NULL
+    },
+    { tc_string("ps_budget"),
+        0,
+        0,
+        TC_CONF_TAKE1,
+        mysql_parse_ps_budget,
+        NULL
+    },
+    { tc_string("stats_file"),
+        0,
+        0,
+        TC_CONF_TAKE1,
+        mysql_parse_stats_file,
+        NULL
+    },
+    { tc_string("digest_record"),
+        0,
+        0,
+        TC_CONF_TAKE1,
+        mysql_parse_digest_record,
+        NULL
+    },
+    { tc_string("digest_check"),
+        0,
+        0,
+        TC_CONF_TAKE1,
+        mysql_parse_digest_check,
+        NULL
+    },
+    { tc_string("sql_top"),
+        0,
+        0,
+        TC_CONF_TAKE1,
+        mysql_parse_top_num,
+        NULL
+    },
+    { tc_string("sql_top_file"),
+        0,
+        0,
+        TC_CONF_TAKE1,
+        mysql_parse_top_file,
+        NULL
+    },
+    { tc_string("adopt"),
+        0,
+        0,
+        TC_CONF_TAKE1,
+        mysql_parse_adopt,
+        NULL
+    },
+    { tc_string("adopt_caps"),
+        0,
+        0,
+        TC_CONF_TAKE1,
+        mysql_parse_adopt_caps,
+        NULL
+    },
+    { tc_string("snapshot"),
+        0,
+        0,
+        TC_CONF_TAKE1,
+        mysql_parse_snapshot,
+        NULL
+    },
+    { tc_string("snapshot_interval"),
+        0,
+        0,
+        TC_CONF_TAKE1,
+        mysql_parse_snapshot_interval,
+        NULL
+    },
+    { tc_string("profile"),
+        0,
+        0,
+        TC_CONF_TAKE1,
+        mysql_parse_profile,
+        NULL
+    },
+    { tc_string("rsa_public_key"),
+        0,
+        0,
+        TC_CONF_TAKE1,
+        mysql_parse_rsa_public_key,
+        NULL
     }
 };
 
@@ -778,15 +4468,15 @@ tc_module_t tc_mysql_module = {
     init_mysql_module,
     exit_mysql_module,
     remove_obsolete_resources,
-    check_renew_session,
-    prepare_for_renew_session,
-    check_pack_needed_for_recons,
-    proc_when_sess_created,
+    prof_check_renew_session,
+    prof_prepare_for_renew_session,
+    prof_check_pack_needed_for_recons,
+    prof_proc_when_sess_created,
     proc_when_sess_destroyed,
     release_resources,
-    proc_greet,
-    proc_auth,
-    check_needed_for_sec_auth,
+    prof_proc_greet,
+    prof_proc_auth,
+    prof_check_needed_for_sec_auth,
     NULL
 };
 
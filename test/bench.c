@@ -0,0 +1,429 @@
+
+#include <xcopy.h>
+#include "password.h"
+#include "pairs.h"
+#include "protocol.h"
+#include "buffer.h"
+#include "stats.h"
+#include "profile.h"
+
+#define BENCH_ROUNDS      200000
+#define BENCH_CRYPT_ROUNDS 20000
+#define BENCH_STORE_SIZE  65536
+#define BENCH_AUTH_LEN    160
+#define BENCH_SEG_LEN     1400
+#define BENCH_QUERY_LEN   46
+#define BENCH_NAME_LEN    16
+
+typedef struct {
+    FILE       *f;
+    const char *name;
+    uint64_t    start;
+    uint64_t    allocs;
+} bench_t;
+
+static uint32_t      user_nums[] = { 10, 1000, 100000 };
+static const char    bench_scramble[] = "abcdefghij0123456789";
+static const char    bench_pwd[] = "bench-password";
+
+/* sinks the results so that no call is taken for dead */
+static volatile unsigned char bench_sink;
+
+
+static void
+bench_begin(bench_t *b, const char *name)
+{
+    b->name   = name;
+    b->allocs = tc_shim_allocs;
+    b->start  = tc_mysql_nsec();
+}
+
+
+static void
+bench_end(bench_t *b, uint64_t ops)
+{
+    uint64_t nsec;
+
+    nsec = tc_mysql_nsec() - b->start;
+
+    fprintf(b->f, "bench.%s.ns_per_op %.1f\n", b->name, (double) nsec / ops);
+    fprintf(b->f, "bench.%s.allocs_per_op %.3f\n", b->name,
+            (double) (tc_shim_allocs - b->allocs) / ops);
+}
+
+
+static void
+bench_password(bench_t *b)
+{
+    int            i;
+    char           to[SHA256_HASH_SIZE + 1], seed[SCRAMBLE_LENGTH + 1];
+    unsigned char  stage1[SHA256_HASH_SIZE], stage2[SHA256_HASH_SIZE];
+
+    bench_begin(b, "scramble");
+    for (i = 0; i < BENCH_CRYPT_ROUNDS; i++) {
+        scramble(to, bench_scramble, bench_pwd);
+        bench_sink ^= to[0];
+    }
+    bench_end(b, BENCH_CRYPT_ROUNDS);
+
+    tc_sha1_digest_one(stage1, SHA1_HASH_SIZE,
+            (const unsigned char *) bench_pwd, strlen(bench_pwd));
+    tc_sha1_digest_one(stage2, SHA1_HASH_SIZE, stage1, SHA1_HASH_SIZE);
+
+    bench_begin(b, "sha1_stages");
+    for (i = 0; i < BENCH_CRYPT_ROUNDS; i++) {
+        tc_sha1_digest_one(stage1, SHA1_HASH_SIZE,
+                (const unsigned char *) bench_pwd, strlen(bench_pwd));
+        tc_sha1_digest_one(stage2, SHA1_HASH_SIZE, stage1, SHA1_HASH_SIZE);
+        bench_sink ^= stage2[0];
+    }
+    bench_end(b, BENCH_CRYPT_ROUNDS);
+
+    bench_begin(b, "scramble_from_stages");
+    for (i = 0; i < BENCH_CRYPT_ROUNDS; i++) {
+        scramble_from_stages(to, bench_scramble, stage1, stage2);
+        bench_sink ^= to[0];
+    }
+    bench_end(b, BENCH_CRYPT_ROUNDS);
+
+    bench_begin(b, "sha256_stages");
+    for (i = 0; i < BENCH_CRYPT_ROUNDS; i++) {
+        sha256_digest(stage1, (const unsigned char *) bench_pwd,
+                strlen(bench_pwd), NULL, 0);
+        sha256_digest(stage2, stage1, SHA256_HASH_SIZE, NULL, 0);
+        bench_sink ^= stage2[0];
+    }
+    bench_end(b, BENCH_CRYPT_ROUNDS);
+
+    bench_begin(b, "scramble_sha2_from_stages");
+    for (i = 0; i < BENCH_CRYPT_ROUNDS; i++) {
+        scramble_sha2_from_stages(to, bench_scramble, stage1, stage2);
+        bench_sink ^= to[0];
+    }
+    bench_end(b, BENCH_CRYPT_ROUNDS);
+
+    memcpy(seed, bench_scramble, 8);
+    seed[8] = '\0';
+
+    bench_begin(b, "new_crypt");
+    for (i = 0; i < BENCH_CRYPT_ROUNDS; i++) {
+        new_crypt(to, bench_pwd, seed);
+        bench_sink ^= to[0];
+    }
+    bench_end(b, BENCH_CRYPT_ROUNDS);
+}
+
+
+static void
+set_packet_header(unsigned char *p, uint32_t len, unsigned char seq)
+{
+    p[0] = len & 0xff;
+    p[1] = (len >> 8) & 0xff;
+    p[2] = (len >> 16) & 0xff;
+    p[3] = seq;
+}
+
+
+/* a protocol 10 greeting of a mysql_native_password server */
+static uint32_t
+build_greeting(unsigned char *buf)
+{
+    unsigned char *p;
+
+    p = buf + MYSQL_HEADER_LEN;
+    *p++ = 10;
+    p += sprintf((char *) p, "8.0.36") + 1;
+    memset(p, 1, 4);
+    p += 4;
+    memcpy(p, bench_scramble, 8);
+    p += 8;
+    *p++ = 0;
+    /* CLIENT_PROTOCOL_41 and CLIENT_SECURE_CONNECTION */
+    *p++ = 0x00;
+    *p++ = 0x82;
+    *p++ = 0x21;
+    *p++ = 0x02;
+    *p++ = 0x00;
+    /* CLIENT_PLUGIN_AUTH */
+    *p++ = 0x08;
+    *p++ = 0x00;
+    *p++ = SCRAMBLE_LENGTH + 1;
+    memset(p, 0, 10);
+    p += 10;
+    memcpy(p, bench_scramble + 8, SCRAMBLE_LENGTH - 8);
+    p += SCRAMBLE_LENGTH - 8;
+    *p++ = 0;
+    p += sprintf((char *) p, "mysql_native_password") + 1;
+
+    set_packet_header(buf, p - buf - MYSQL_HEADER_LEN, 0);
+
+    return p - buf;
+}
+
+
+/* a HandshakeResponse41 of user with a native scramble */
+static uint32_t
+build_auth(unsigned char *buf, const char *user)
+{
+    unsigned char *p;
+
+    p = buf + MYSQL_HEADER_LEN;
+    *p++ = 0x05;
+    *p++ = 0xa2;
+    *p++ = 0x08;
+    *p++ = 0x00;
+    memset(p, 0, 4 + 1 + 23);
+    p[3] = 1;
+    p += 4;
+    *p++ = 33;
+    p += 23;
+    p += sprintf((char *) p, "%s", user) + 1;
+    *p++ = SCRAMBLE_LENGTH;
+    memset(p, 0x5a, SCRAMBLE_LENGTH);
+    p += SCRAMBLE_LENGTH;
+    p += sprintf((char *) p, "mysql_native_password") + 1;
+
+    set_packet_header(buf, p - buf - MYSQL_HEADER_LEN, 1);
+
+    return p - buf;
+}
+
+
+/* a segment full of small COM_QUERY packets */
+static uint32_t
+build_queries(unsigned char *buf)
+{
+    uint32_t p;
+
+    for (p = 0; p + MYSQL_HEADER_LEN + BENCH_QUERY_LEN <= BENCH_SEG_LEN;
+            p += MYSQL_HEADER_LEN + BENCH_QUERY_LEN)
+    {
+        set_packet_header(buf + p, BENCH_QUERY_LEN, 0);
+        buf[p + MYSQL_HEADER_LEN] = 3;
+        memset(buf + p + MYSQL_HEADER_LEN + 1, 'x', BENCH_QUERY_LEN - 1);
+    }
+
+    return p;
+}
+
+
+static void
+bench_protocol(bench_t *b)
+{
+    int                i, plugin;
+    char               seed[SCRAMBLE_LENGTH + 1], m_user[MAX_USER_LEN];
+    char               password[MAX_PASSWORD_LEN];
+    uint32_t           len;
+    unsigned char      buf[BENCH_SEG_LEN];
+    mysql_user        *user_info;
+    tc_mysql_frames_t  frames;
+    tc_mysql_framer_t  framer;
+
+    len = build_greeting(buf);
+    bench_begin(b, "parse_handshake_init_cont");
+    for (i = 0; i < BENCH_ROUNDS; i++) {
+        tc_memzero(seed, sizeof(seed));
+        parse_handshake_init_cont(buf, len, seed, &plugin);
+        bench_sink ^= seed[0];
+    }
+    bench_end(b, BENCH_ROUNDS);
+
+    /* the user table of 10 users is installed by the caller */
+    len = build_auth(buf, "user7");
+    bench_begin(b, "change_clt_auth_content");
+    for (i = 0; i < BENCH_CRYPT_ROUNDS; i++) {
+        change_clt_auth_content(buf, len, m_user, password,
+                (char *) bench_scramble, &user_info);
+        bench_sink ^= buf[len - 1];
+    }
+    bench_end(b, BENCH_CRYPT_ROUNDS);
+
+    set_packet_header(buf, SCRAMBLE_LENGTH, 3);
+    bench_begin(b, "change_clt_second_auth_content");
+    for (i = 0; i < BENCH_ROUNDS; i++) {
+        change_clt_second_auth_content(buf, MYSQL_HEADER_LEN + SCRAMBLE_LENGTH,
+                (char *) bench_scramble, SCRAMBLE_LENGTH);
+        bench_sink ^= buf[MYSQL_HEADER_LEN];
+    }
+    bench_end(b, BENCH_ROUNDS);
+
+    len = build_queries(buf);
+    bench_begin(b, "frame_mysql_packets");
+    for (i = 0; i < BENCH_ROUNDS; i++) {
+        tc_memzero(&framer, sizeof(framer));
+        frame_mysql_packets(&framer, 1, buf, len, &frames);
+        do {
+            bench_sink ^= frames.num;
+        } while (frame_mysql_more(&framer, buf, len, &frames));
+    }
+    bench_end(b, BENCH_ROUNDS);
+}
+
+
+/* user lookups in tables of growing size, each swapped in for the run */
+static int
+bench_pairs(bench_t *b, tc_pool_t *pool)
+{
+    char              *pairs, *names, name[32];
+    size_t             pos;
+    uint32_t           i, j, n;
+    mysql_user_table  *table, *saved;
+
+    n = user_nums[sizeof(user_nums) / sizeof(user_nums[0]) - 1];
+
+    pairs = tc_palloc(pool, (size_t) n * 32);
+    names = tc_palloc(pool, (size_t) n * BENCH_NAME_LEN);
+    if (pairs == NULL || names == NULL) {
+        return TC_ERR;
+    }
+
+    for (i = 0; i < n; i++) {
+        snprintf(names + (size_t) i * BENCH_NAME_LEN, BENCH_NAME_LEN,
+                "user%u", i);
+    }
+
+    for (j = 0; j < sizeof(user_nums) / sizeof(user_nums[0]); j++) {
+        n   = user_nums[j];
+        pos = 0;
+        for (i = 0; i < n; i++) {
+            pos += sprintf(pairs + pos, "%suser%u:pw%u", i ? "," : "", i, i);
+        }
+
+        table = compile_mysql_user_table(pool, pairs);
+        if (table == NULL) {
+            return TC_ERR;
+        }
+        saved = swap_mysql_user_table(table);
+
+        snprintf(name, sizeof(name), "retrieve_user_info_%u", n);
+        bench_begin(b, name);
+        for (i = 0; i < BENCH_ROUNDS; i++) {
+            bench_sink ^= retrieve_user_info(names
+                    + (size_t) (i % n) * BENCH_NAME_LEN) != NULL;
+        }
+        bench_end(b, BENCH_ROUNDS);
+
+        if (j == 0) {
+            bench_protocol(b);
+        }
+
+        swap_mysql_user_table(saved);
+    }
+
+    return TC_OK;
+}
+
+
+/*
+ * Stored auth payloads kept alive and prepares interned in a store as full as
+ * a shard's, with hits on payloads stored and misses on fresh ones
+ */
+static int
+bench_buffer(bench_t *b, tc_pool_t *pool)
+{
+    uint32_t          i;
+    unsigned char     auth[BENCH_AUTH_LEN], payload[64];
+    tc_mysql_buf_t   *buf;
+    tc_mysql_store_t  store;
+
+    tc_memzero(auth, sizeof(auth));
+
+    bench_begin(b, "buf_create");
+    for (i = 0; i < BENCH_ROUNDS; i++) {
+        buf = tc_mysql_buf_create(pool, auth, sizeof(auth));
+        if (buf == NULL) {
+            return TC_ERR;
+        }
+        tc_mysql_buf_put(pool, buf);
+    }
+    bench_end(b, BENCH_ROUNDS);
+
+    if (tc_mysql_store_init(&store, pool, BENCH_STORE_SIZE) != TC_OK) {
+        return TC_ERR;
+    }
+
+    tc_memzero(payload, sizeof(payload));
+    for (i = 0; i < BENCH_STORE_SIZE; i++) {
+        snprintf((char *) payload + 5, sizeof(payload) - 5,
+                "select * from t where id = %08u", i);
+        if (tc_mysql_store_intern(&store, payload, sizeof(payload)) == NULL) {
+            return TC_ERR;
+        }
+    }
+
+    bench_begin(b, "store_intern_hit");
+    for (i = 0; i < BENCH_ROUNDS; i++) {
+        snprintf((char *) payload + 5, sizeof(payload) - 5,
+                "select * from t where id = %08u", i % BENCH_STORE_SIZE);
+        buf = tc_mysql_store_intern(&store, payload, sizeof(payload));
+        if (buf == NULL) {
+            return TC_ERR;
+        }
+        tc_mysql_store_put(&store, buf);
+    }
+    bench_end(b, BENCH_ROUNDS);
+
+    bench_begin(b, "store_intern_miss");
+    for (i = 0; i < BENCH_ROUNDS; i++) {
+        snprintf((char *) payload + 5, sizeof(payload) - 5,
+                "select * from u where id = %08u", i);
+        buf = tc_mysql_store_intern(&store, payload, sizeof(payload));
+        if (buf == NULL) {
+            return TC_ERR;
+        }
+        tc_mysql_store_put(&store, buf);
+    }
+    bench_end(b, BENCH_ROUNDS);
+
+    return TC_OK;
+}
+
+
+/*
+ * Time the primitives a login or a stored packet costs, each on its own,
+ * and write "bench.NAME.ns_per_op" and "bench.NAME.allocs_per_op" lines
+ * to PATH, or to stdout. allocs are what is allocated from pools.
+ */
+int
+main(int argc, char **argv)
+{
+    int        ret;
+    FILE      *f;
+    bench_t    b;
+    tc_pool_t *pool;
+
+    if (argc > 2) {
+        fprintf(stderr, "usage: bench [PATH]\n");
+        return 1;
+    }
+
+    f = argc == 2 ? tc_mysql_stats_open(argv[1]) : stdout;
+    if (f == NULL) {
+        return 1;
+    }
+
+    pool = tc_create_pool(TC_PLUGIN_POOL_SIZE, TC_PLUGIN_POOL_SUB_SIZE, 0);
+    if (pool == NULL) {
+        return 1;
+    }
+
+    b.f = f;
+    bench_password(&b);
+    ret = bench_pairs(&b, pool);
+    if (ret == TC_OK) {
+        ret = bench_buffer(&b, pool);
+    }
+
+    tc_destroy_pool(pool);
+
+    if (ret != TC_OK) {
+        tc_log_info(LOG_ERR, 0, "mysql bench failed");
+        return 1;
+    }
+
+    if (f != stdout && tc_mysql_stats_close(f, argv[1]) != TC_OK) {
+        return 1;
+    }
+
+    return 0;
+}
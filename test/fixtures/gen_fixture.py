@@ -0,0 +1,234 @@
+#!/usr/bin/env python3
+"""
+Write client.pcap and server.pcap for the replay harness.
+
+client.pcap holds what a client sent to the online server, server.pcap
+what the target answered, as intercept would return it. The traffic is
+synthesized byte for byte after the MySQL protocol, so that the fixture
+needs no server to be rebuilt:
+
+  40001  logs in, runs a query, prepares and executes a statement, quits
+  40002  logs in, sets its charset and schema, prepares two statements
+         and closes one; the target then resets the connection, and the
+         next execute renews the session on a new greeting
+  40003  was connected before the capture began: not replayed
+"""
+
+import hashlib
+import os
+import struct
+import sys
+
+CLIENT = bytes([10, 0, 0, 2])
+ONLINE = bytes([10, 0, 0, 1])
+TARGET = bytes([10, 0, 0, 9])
+PORT = 3306
+PASSWORD = b"secret"
+BASE = 1700000000
+
+CAPS = 0x000fa20f
+
+
+def sha1(b):
+    return hashlib.sha1(b).digest()
+
+
+def native(salt, password):
+    s1 = sha1(password)
+    s2 = sha1(salt + sha1(s1))
+    return bytes(a ^ b for a, b in zip(s1, s2))
+
+
+def pkt(seq, body):
+    return struct.pack("<I", len(body))[:3] + bytes([seq & 0xff]) + body
+
+
+def lenenc_str(s):
+    return bytes([len(s)]) + s
+
+
+def greeting(salt):
+    body = b"\x0a" + b"8.0.36\x00" + struct.pack("<I", 7)
+    body += salt[:8] + b"\x00"
+    body += struct.pack("<H", CAPS & 0xffff) + b"\x21" + b"\x02\x00"
+    body += struct.pack("<H", CAPS >> 16) + bytes([21]) + b"\x00" * 10
+    body += salt[8:] + b"\x00" + b"mysql_native_password\x00"
+    return pkt(0, body)
+
+
+def auth(salt, db=None):
+    caps = CAPS if db else CAPS & ~0x8
+    body = struct.pack("<IIB", caps, 1 << 24, 33) + b"\x00" * 23
+    body += b"app\x00" + bytes([20]) + native(salt, PASSWORD)
+    if db:
+        body += db + b"\x00"
+    body += b"mysql_native_password\x00"
+    return pkt(1, body)
+
+
+def ok(seq):
+    return pkt(seq, b"\x00\x00\x00\x02\x00\x00\x00")
+
+
+def eof(seq):
+    return pkt(seq, b"\xfe\x00\x00\x02\x00")
+
+
+def coldef(seq, name, kind):
+    body = b"".join(lenenc_str(s) for s in
+                    (b"def", b"shop", b"item", b"item", name, name))
+    body += b"\x0c" + struct.pack("<HIBHB", 33, 64, kind, 0, 0) + b"\x00\x00"
+    return pkt(seq, body)
+
+
+def command(code, data=b""):
+    return pkt(0, bytes([code]) + data)
+
+
+def prepare_ok(stmt_id, cols, params):
+    out = [pkt(1, b"\x00" + struct.pack("<IHHBH", stmt_id, cols, params,
+                                         0, 0))]
+    seq = 2
+    for i in range(params):
+        out.append(coldef(seq, b"?", 8))
+        seq += 1
+    if params:
+        out.append(eof(seq))
+        seq += 1
+    for i in range(cols):
+        out.append(coldef(seq, b"name", 253))
+        seq += 1
+    if cols:
+        out.append(eof(seq))
+    return b"".join(out)
+
+
+def execute(stmt_id, value):
+    data = struct.pack("<IBI", stmt_id, 0, 1) + b"\x00\x01\x08\x00"
+    return command(0x17, data + struct.pack("<q", value))
+
+
+def binary_rows(value):
+    return b"".join([pkt(1, b"\x01"), coldef(2, b"name", 253), eof(3),
+                     pkt(4, b"\x00\x00" + lenenc_str(value)), eof(5)])
+
+
+def text_rows():
+    return b"".join([pkt(1, b"\x01"), coldef(2, b"1", 8), eof(3),
+                     pkt(4, lenenc_str(b"1")), eof(5)])
+
+
+class Conn:
+    def __init__(self, port, cseq, sseq):
+        self.port = port
+        self.cseq = cseq
+        self.sseq = sseq
+
+
+def ipv4(src, dst, sport, dport, seq, ack, flags, data):
+    tcp = struct.pack("!HHIIBBHHH", sport, dport, seq, ack, 5 << 4, flags,
+                      65535, 0, 0)
+    ip = struct.pack("!BBHHHBBH4s4s", 0x45, 0, 20 + len(tcp) + len(data),
+                     0, 0x4000, 64, 6, 0, src, dst)
+    eth = b"\x02\x00\x00\x00\x00\x02" + b"\x02\x00\x00\x00\x00\x01" \
+        + b"\x08\x00"
+    return eth + ip + tcp + data
+
+
+SYN, FIN, RST, PSH, ACK = 0x02, 0x01, 0x04, 0x08, 0x10
+
+
+class Capture:
+    def __init__(self):
+        self.records = []
+
+    def add(self, t, frame):
+        self.records.append((t, frame))
+
+    def write(self, path):
+        with open(path, "wb") as f:
+            f.write(struct.pack("<IHHiIII", 0xa1b2c3d4, 2, 4, 0, 0, 65535, 1))
+            for t, frame in self.records:
+                sec = BASE + int(t)
+                usec = int(round((t - int(t)) * 1e6))
+                f.write(struct.pack("<IIII", sec, usec, len(frame),
+                                    len(frame)))
+                f.write(frame)
+
+
+clt = Capture()
+srv = Capture()
+
+
+def client(c, t, data=b"", flags=PSH | ACK):
+    clt.add(t, ipv4(CLIENT, ONLINE, c.port, PORT, c.cseq, c.sseq, flags,
+                    data))
+    c.cseq += len(data) + (1 if flags & (SYN | FIN) else 0)
+
+
+def server(c, t, data=b"", flags=PSH | ACK):
+    srv.add(t, ipv4(TARGET, CLIENT, PORT, c.port, c.sseq, c.cseq, flags,
+                    data))
+    c.sseq += len(data) + (1 if flags & (SYN | FIN) else 0)
+
+
+ONLINE_SALT = b"onlineonlineonline12"
+TARGET_SALTS = [b"targetAAAAAAAAAAAAAA", b"targetBBBBBBBBBBBBBB",
+                b"targetCCCCCCCCCCCCCC"]
+
+# 40001: a whole session
+a = Conn(40001, 1000, 5000)
+client(a, 0.000, flags=SYN)
+server(a, 0.001, flags=SYN | ACK)
+server(a, 0.002, greeting(TARGET_SALTS[0]))
+client(a, 0.003, auth(ONLINE_SALT))
+server(a, 0.004, ok(2))
+client(a, 0.005, command(0x03, b"select 1"))
+server(a, 0.006, text_rows())
+client(a, 0.007, command(0x16, b"select name from item where id = ?"))
+server(a, 0.008, prepare_ok(1, 1, 1))
+client(a, 0.009, execute(1, 42))
+server(a, 0.010, binary_rows(b"apple"))
+client(a, 0.011, command(0x01))
+client(a, 0.012, flags=FIN | ACK)
+
+# 40002: a session the target drops, renewed on its next execute
+b = Conn(40002, 2000, 6000)
+client(b, 1.000, flags=SYN)
+server(b, 1.001, flags=SYN | ACK)
+server(b, 1.002, greeting(TARGET_SALTS[1]))
+client(b, 1.003, auth(ONLINE_SALT, b"shop"))
+server(b, 1.004, ok(2))
+client(b, 1.005, command(0x03, b"SET NAMES utf8mb4"))
+server(b, 1.006, ok(1))
+client(b, 1.007, command(0x02, b"shop2"))
+server(b, 1.008, ok(1))
+client(b, 1.009, command(0x16, b"select name from item where id = ?"))
+server(b, 1.010, prepare_ok(1, 1, 1))
+client(b, 1.011, command(0x16, b"update item set n = n + 1 where id = ?"))
+server(b, 1.012, prepare_ok(2, 0, 1))
+client(b, 1.013, command(0x19, struct.pack("<I", 2)))
+client(b, 1.014, execute(1, 7))
+server(b, 1.015, binary_rows(b"pear"))
+server(b, 2.000, flags=RST | ACK)
+
+client(b, 3.000, execute(1, 8))
+b.sseq = 9000
+server(b, 3.001, flags=SYN | ACK)
+server(b, 3.002, greeting(TARGET_SALTS[2]))
+server(b, 3.003, ok(2))
+server(b, 3.004, ok(1))
+server(b, 3.005, ok(1))
+server(b, 3.006, prepare_ok(1, 1, 1))
+server(b, 3.007, prepare_ok(2, 0, 0))
+server(b, 3.008, binary_rows(b"plum"))
+client(b, 3.009, command(0x01))
+client(b, 3.010, flags=FIN | ACK)
+
+# 40003: connected before the capture began
+c = Conn(40003, 3000, 7000)
+client(c, 4.000, command(0x03, b"select 2"))
+
+out = os.path.dirname(os.path.abspath(sys.argv[0]))
+clt.write(os.path.join(out, "client.pcap"))
+srv.write(os.path.join(out, "server.pcap"))
@@ -0,0 +1,732 @@
+
+#include "../tc_mysql_module.c"
+
+/*
+ * Offline replay: feed a capture of what clients sent to the online
+ * server (CLIENT.pcap) and of what the target answered (SERVER.pcap)
+ * through the module callbacks in time order, with the session manager
+ * of tcpcopy played by this driver. Nothing is sent anywhere: what the
+ * target would have got is folded into a checksum, so that a change in
+ * the module that alters a rewritten byte shows up, and the time spent
+ * and the memory held are reported alongside.
+ *
+ * The driver follows tcpcopy where it matters to the module: a client
+ * SYN creates a session; client packets wait for the target's greeting;
+ * a client packet of no session asks for a renewal; a client FIN or RST
+ * destroys the session, while a RST from the target only drops it, with
+ * its record kept for the renewal.
+ */
+
+#define PCAP_MAGIC         0xa1b2c3d4
+#define PCAP_MAGIC_NS      0xa1b23c4d
+#define LINKTYPE_ETHERNET  1
+#define LINKTYPE_RAW       101
+#define LINKTYPE_SLL       113
+#define SLL_HDR_LEN        16
+#define MAX_DIRECTIVE      256
+#define FNV_OFFSET         0xcbf29ce484222325ULL
+#define FNV_PRIME          0x100000001b3ULL
+
+typedef struct {
+    uint64_t    usec;
+    int         from_client;
+    uint32_t    len;
+    unsigned char *data;
+} rp_pkt_t;
+
+typedef struct {
+    rp_pkt_t   *pkts;
+    size_t      num;
+    size_t      size;
+} rp_trace_t;
+
+typedef struct rp_queued_s {
+    struct rp_queued_s *next;
+    uint32_t            len;
+    unsigned char       data[];
+} rp_queued_t;
+
+typedef struct {
+    tc_sess_t    s;
+    int          ignored;
+    rp_queued_t *head;
+    rp_queued_t *tail;
+} rp_sess_t;
+
+static tc_pool_t  *rp_pool;
+static hash_table *rp_sessions;
+static rp_sess_t  *rp_saving;
+static int         rp_verbose;
+
+static uint64_t    rp_sum = FNV_OFFSET;
+static uint64_t    rp_client_pkts, rp_server_pkts, rp_sent_pkts, rp_sent_bytes;
+static uint64_t    rp_created, rp_renewed, rp_refused, rp_unknown, rp_saved;
+
+
+static int
+read_u32(FILE *f, uint32_t *v, int swap)
+{
+    if (fread(v, sizeof(uint32_t), 1, f) != 1) {
+        return -1;
+    }
+    if (swap) {
+        *v = __builtin_bswap32(*v);
+    }
+
+    return 0;
+}
+
+
+static int
+load_pcap(const char *path, int from_client, rp_trace_t *trace)
+{
+    int            swap, nano, skip;
+    FILE          *f;
+    uint32_t       magic, hdr[4], link, i;
+    unsigned char *frame;
+
+    f = fopen(path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (fread(&magic, sizeof(magic), 1, f) != 1) {
+        goto bad;
+    }
+
+    swap = (magic != PCAP_MAGIC && magic != PCAP_MAGIC_NS);
+    if (swap) {
+        magic = __builtin_bswap32(magic);
+    }
+    if (magic != PCAP_MAGIC && magic != PCAP_MAGIC_NS) {
+        goto bad;
+    }
+    nano = (magic == PCAP_MAGIC_NS);
+
+    /* version, thiszone, sigfigs, snaplen, then the link type */
+    for (i = 0; i < 5; i++) {
+        if (read_u32(f, &link, swap) == -1) {
+            goto bad;
+        }
+    }
+
+    switch (link) {
+    case LINKTYPE_ETHERNET:
+        skip = ETHERNET_HDR_LEN;
+        break;
+    case LINKTYPE_SLL:
+        skip = SLL_HDR_LEN;
+        break;
+    case LINKTYPE_RAW:
+        skip = 0;
+        break;
+    default:
+        fprintf(stderr, "%s: link type %u not supported\n", path, link);
+        fclose(f);
+        return -1;
+    }
+
+    for ( ;; ) {
+        for (i = 0; i < 4; i++) {
+            if (read_u32(f, &hdr[i], swap) == -1) {
+                break;
+            }
+        }
+        if (i == 0) {
+            break;
+        }
+        if (i < 4 || hdr[2] > 262144) {
+            goto bad;
+        }
+
+        frame = malloc(hdr[2]);
+        if (frame == NULL || fread(frame, 1, hdr[2], f) != hdr[2]) {
+            free(frame);
+            goto bad;
+        }
+
+        if (hdr[2] < (uint32_t) skip + sizeof(tc_iph_t)) {
+            free(frame);
+            continue;
+        }
+
+        if (trace->num == trace->size) {
+            trace->size = trace->size ? trace->size * 2 : 1024;
+            trace->pkts = realloc(trace->pkts, trace->size * sizeof(rp_pkt_t));
+            if (trace->pkts == NULL) {
+                fclose(f);
+                return -1;
+            }
+        }
+
+        memmove(frame, frame + skip, hdr[2] - skip);
+        trace->pkts[trace->num].usec = (uint64_t) hdr[0] * 1000000
+            + (nano ? hdr[1] / 1000 : hdr[1]);
+        trace->pkts[trace->num].from_client = from_client;
+        trace->pkts[trace->num].len = hdr[2] - skip;
+        trace->pkts[trace->num].data = frame;
+        trace->num++;
+    }
+
+    fclose(f);
+    return 0;
+
+bad:
+
+    fprintf(stderr, "%s: not a pcap file or truncated\n", path);
+    fclose(f);
+    return -1;
+}
+
+
+static int
+cmp_pkt(const void *a, const void *b)
+{
+    const rp_pkt_t *p1 = a, *p2 = b;
+
+    if (p1->usec != p2->usec) {
+        return p1->usec < p2->usec ? -1 : 1;
+    }
+
+    /* a client packet goes first on a tie, as the answer follows it */
+    if (p1->from_client != p2->from_client) {
+        return p1->from_client ? -1 : 1;
+    }
+
+    return p1 < p2 ? -1 : 1;
+}
+
+
+static int
+set_directive(char *line)
+{
+    char       *value;
+    size_t      i, n;
+    tc_str_t    args[2];
+    tc_conf_t   cf;
+    tc_array_t  arr;
+
+    value = strpbrk(line, " \t");
+    if (value == NULL) {
+        fprintf(stderr, "directive without a value: %s\n", line);
+        return -1;
+    }
+    *value++ = '\0';
+    value += strspn(value, " \t");
+    n = strcspn(value, ";\r\n");
+    while (n > 0 && (value[n - 1] == ' ' || value[n - 1] == '\t')) {
+        n--;
+    }
+    value[n] = '\0';
+
+    args[0].len = strlen(line);
+    args[0].data = (unsigned char *) line;
+    args[1].len = n;
+    args[1].data = (unsigned char *) value;
+    arr.elts = args;
+    arr.nelts = 2;
+    cf.args = &arr;
+    cf.pool = rp_pool;
+
+    n = sizeof(mysql_commands) / sizeof(mysql_commands[0]);
+    for (i = 0; i < n; i++) {
+        if (mysql_commands[i].name.len == args[0].len
+            && memcmp(mysql_commands[i].name.data, line, args[0].len) == 0)
+        {
+            return mysql_commands[i].set(&cf, &mysql_commands[i]) == TC_OK
+                ? 0 : -1;
+        }
+    }
+
+    fprintf(stderr, "unknown directive: %s\n", line);
+    return -1;
+}
+
+
+static int
+load_conf(const char *path)
+{
+    char  line[MAX_DIRECTIVE], *p;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        p = line + strspn(line, " \t");
+        if (*p == '#' || *p == '\n' || *p == '\r' || *p == '\0') {
+            continue;
+        }
+        if (set_directive(p) == -1) {
+            fclose(f);
+            return -1;
+        }
+    }
+
+    fclose(f);
+    return 0;
+}
+
+
+static void
+fold(const unsigned char *data, uint32_t len)
+{
+    uint32_t i;
+
+    for (i = 0; i < len; i++) {
+        rp_sum ^= data[i];
+        rp_sum *= FNV_PRIME;
+    }
+}
+
+
+static void
+dump(const char *what, tc_tcph_t *tcp, uint16_t cont_len)
+{
+    uint16_t       i;
+    unsigned char *p;
+
+    p = (unsigned char *) tcp + (tcp->doff << 2);
+    fprintf(stderr, "%s port:%u len:%u ", what, ntohs(tcp->source), cont_len);
+    for (i = 0; i < cont_len; i++) {
+        fprintf(stderr, "%02x", p[i]);
+    }
+    fputc('\n', stderr);
+}
+
+
+static rp_queued_t *
+copy_pack(tc_iph_t *ip)
+{
+    uint32_t     len;
+    rp_queued_t *q;
+
+    len = ntohs(ip->tot_len);
+    q = malloc(sizeof(rp_queued_t) + len);
+    if (q != NULL) {
+        q->next = NULL;
+        q->len = len;
+        memcpy(q->data, ip, len);
+    }
+
+    return q;
+}
+
+
+static void
+queue_pack(rp_sess_t *rs, tc_iph_t *ip)
+{
+    rp_queued_t *q;
+
+    q = copy_pack(ip);
+    if (q == NULL) {
+        return;
+    }
+    if (rs->tail == NULL) {
+        rs->head = q;
+    } else {
+        rs->tail->next = q;
+    }
+    rs->tail = q;
+}
+
+
+static void
+save_pack(tc_sess_t *s, tc_iph_t *ip, tc_tcph_t *tcp)
+{
+    if (rp_saving != NULL) {
+        rp_saved++;
+        queue_pack(rp_saving, ip);
+    }
+}
+
+
+static void
+drop_queue(rp_sess_t *rs)
+{
+    rp_queued_t *q, *next;
+
+    for (q = rs->head; q; q = next) {
+        next = q->next;
+        free(q);
+    }
+    rs->head = rs->tail = NULL;
+}
+
+
+static rp_sess_t *
+create_sess(uint64_t key, uint16_t port, int fake_syn)
+{
+    rp_sess_t *rs;
+
+    rs = calloc(1, sizeof(rp_sess_t));
+    if (rs == NULL) {
+        return NULL;
+    }
+
+    rs->s.hash_key = key;
+    rs->s.src_port = port;
+    rs->s.sm.fake_syn = fake_syn;
+    rs->s.sm.need_rep_greet = 1;
+    rs->s.pool = tc_create_pool(TC_PLUGIN_POOL_SIZE, 0, 0);
+    if (rs->s.pool == NULL) {
+        free(rs);
+        return NULL;
+    }
+
+    hash_add(rp_sessions, rp_pool, key, rs);
+    rp_created++;
+
+    tc_mysql_module.proc_when_sess_created(&rs->s);
+    if (rs->s.sm.sess_over) {
+        rs->ignored = 1;
+    }
+
+    return rs;
+}
+
+
+/* drop the session; the module hears of it only when the client ended it */
+static void
+drop_sess(rp_sess_t *rs, int destroyed)
+{
+    if (destroyed) {
+        tc_mysql_module.proc_when_sess_destroyed(&rs->s);
+    }
+
+    hash_del(rp_sessions, rp_pool, rs->s.hash_key);
+    drop_queue(rs);
+    tc_destroy_pool(rs->s.pool);
+    free(rs);
+}
+
+
+static void
+send_client(rp_sess_t *rs, tc_iph_t *ip)
+{
+    uint16_t    cont_len;
+    tc_tcph_t  *tcp;
+
+    tcp = (tc_tcph_t *) ((unsigned char *) ip + (ip->ihl << 2));
+    cont_len = TCP_PAYLOAD_LENGTH(ip, tcp);
+
+    rs->s.cur_pack.cont_len = cont_len;
+    if (tc_mysql_module.proc_auth(&rs->s, ip, tcp) == PACK_STOP
+        || rs->s.sm.sess_over)
+    {
+        rs->ignored = 1;
+        return;
+    }
+
+    /* sent either way; the answer only tells what a renewal needs */
+    tc_mysql_module.check_pack_needed_for_recons(&rs->s, ip, tcp);
+
+    if (rp_verbose) {
+        dump("send", tcp, cont_len);
+    }
+
+    rp_sent_pkts++;
+    rp_sent_bytes += cont_len;
+    fold((unsigned char *) tcp + (tcp->doff << 2), cont_len);
+}
+
+
+static void
+flush_queue(rp_sess_t *rs)
+{
+    rp_queued_t *q;
+
+    while ((q = rs->head) != NULL && !rs->ignored) {
+        rs->head = q->next;
+        if (rs->head == NULL) {
+            rs->tail = NULL;
+        }
+        send_client(rs, (tc_iph_t *) q->data);
+        free(q);
+    }
+}
+
+
+static void
+renew_sess(uint64_t key, tc_iph_t *ip, tc_tcph_t *tcp)
+{
+    int            ret;
+    uint32_t       hlen;
+    rp_sess_t     *rs;
+    unsigned char  syn[120];
+    tc_iph_t      *syn_ip;
+    tc_tcph_t     *syn_tcp;
+
+    rs = create_sess(key, tcp->source, 1);
+    if (rs == NULL) {
+        return;
+    }
+
+    /* the SYN tcpcopy makes up, one below the packet that asked for it */
+    hlen = (ip->ihl << 2) + (tcp->doff << 2);
+    if (hlen > sizeof(syn)) {
+        drop_sess(rs, 1);
+        return;
+    }
+    memcpy(syn, ip, hlen);
+    syn_ip = (tc_iph_t *) syn;
+    syn_tcp = (tc_tcph_t *) (syn + (ip->ihl << 2));
+    syn_ip->tot_len = htons(hlen);
+    syn_tcp->seq = htonl(ntohl(tcp->seq) - 1);
+    syn_tcp->syn = 1;
+    syn_tcp->ack = 0;
+    syn_tcp->psh = 0;
+
+    rp_saving = rs;
+    ret = tc_mysql_module.prepare_for_renew_session(&rs->s, syn_ip, syn_tcp);
+    rp_saving = NULL;
+
+    if (ret != TC_OK || rs->s.sm.sess_over) {
+        rp_refused++;
+        drop_sess(rs, 1);
+        return;
+    }
+
+    rp_renewed++;
+    queue_pack(rs, ip);
+}
+
+
+static void
+proc_client(tc_iph_t *ip, tc_tcph_t *tcp)
+{
+    uint64_t    key;
+    rp_sess_t  *rs;
+
+    rp_client_pkts++;
+    key = get_key(ip->saddr, tcp->source);
+    rs = hash_find(rp_sessions, key);
+
+    if (tcp->syn) {
+        if (rs != NULL) {
+            drop_sess(rs, 1);
+        }
+        create_sess(key, tcp->source, 0);
+        return;
+    }
+
+    if (TCP_PAYLOAD_LENGTH(ip, tcp) > 0) {
+        if (rs == NULL) {
+            if (tc_mysql_module.check_renew_session(ip, tcp)) {
+                renew_sess(key, ip, tcp);
+            } else {
+                rp_unknown++;
+            }
+
+        } else if (!rs->ignored) {
+            if (rs->s.sm.rcv_rep_greet) {
+                send_client(rs, ip);
+            } else {
+                queue_pack(rs, ip);
+            }
+        }
+    }
+
+    if ((tcp->fin || tcp->rst) && rs != NULL) {
+        drop_sess(rs, 1);
+    }
+}
+
+
+static void
+proc_server(tc_iph_t *ip, tc_tcph_t *tcp)
+{
+    int         ret;
+    uint16_t    cont_len;
+    rp_sess_t  *rs;
+
+    rp_server_pkts++;
+    rs = hash_find(rp_sessions, get_key(ip->daddr, tcp->dest));
+    if (rs == NULL) {
+        return;
+    }
+
+    if (tcp->rst) {
+        drop_sess(rs, 0);
+        return;
+    }
+
+    cont_len = TCP_PAYLOAD_LENGTH(ip, tcp);
+    if (cont_len == 0 || rs->ignored) {
+        return;
+    }
+
+    rs->s.cur_pack.cont_len = cont_len;
+
+    if (!rs->s.sm.rcv_rep_greet) {
+        ret = tc_mysql_module.proc_greet(&rs->s, ip, tcp);
+        if (ret != PACK_CONTINUE || rs->s.sm.sess_over) {
+            rs->ignored = 1;
+            return;
+        }
+        rs->s.sm.rcv_rep_greet = 1;
+        flush_queue(rs);
+        return;
+    }
+
+    tc_mysql_module.check_needed_for_sec_auth(&rs->s, ip, tcp);
+}
+
+
+static void
+drop_all(void)
+{
+    uint32_t    i;
+    hash_node  *hn;
+
+    for (i = 0; i < rp_sessions->size; i++) {
+        while ((hn = rp_sessions->buckets[i]) != NULL) {
+            drop_sess(hn->data, 1);
+        }
+    }
+}
+
+
+static uint64_t
+now_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static void
+usage(void)
+{
+    fprintf(stderr, "usage: replay [-c CONF] [-d \"DIRECTIVE VALUE\"]... "
+            "[-v] CLIENT.pcap SERVER.pcap\n");
+}
+
+
+int
+main(int argc, char **argv)
+{
+    int          opt;
+    char         directive[MAX_DIRECTIVE];
+    size_t       i;
+    time_t       last;
+    uint64_t     start, usec;
+    tc_iph_t    *ip;
+    tc_tcph_t   *tcp;
+    rp_trace_t   trace;
+
+    rp_pool = tc_create_pool(TC_PLUGIN_POOL_SIZE, 0, 0);
+    if (rp_pool == NULL) {
+        return 1;
+    }
+
+    while ((opt = getopt(argc, argv, "c:d:v")) != -1) {
+        switch (opt) {
+        case 'c':
+            if (load_conf(optarg) == -1) {
+                return 1;
+            }
+            break;
+        case 'd':
+            snprintf(directive, sizeof(directive), "%s", optarg);
+            if (set_directive(directive) == -1) {
+                return 1;
+            }
+            break;
+        case 'v':
+            rp_verbose = 1;
+            tc_shim_log_level = LOG_INFO;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    if (argc - optind != 2) {
+        usage();
+        return 1;
+    }
+
+    memset(&trace, 0, sizeof(trace));
+    if (load_pcap(argv[optind], 1, &trace) == -1
+        || load_pcap(argv[optind + 1], 0, &trace) == -1)
+    {
+        return 1;
+    }
+    qsort(trace.pkts, trace.num, sizeof(rp_pkt_t), cmp_pkt);
+
+    if (trace.num > 0) {
+        tc_shim_now = trace.pkts[0].usec / 1000000;
+    }
+    if (tc_mysql_module.init() != TC_OK) {
+        fprintf(stderr, "init failed\n");
+        return 1;
+    }
+
+    rp_sessions = hash_create(rp_pool, 65536);
+    tc_shim_save_pack = save_pack;
+    last = tc_shim_now;
+    start = now_usec();
+
+    for (i = 0; i < trace.num; i++) {
+        tc_shim_now = trace.pkts[i].usec / 1000000;
+        if (tc_shim_now != last) {
+            tc_mysql_module.remove_obsolete_resources(0);
+            last = tc_shim_now;
+        }
+
+        ip = (tc_iph_t *) trace.pkts[i].data;
+        if (ip->version != 4 || ip->protocol != IPPROTO_TCP
+            || trace.pkts[i].len < ntohs(ip->tot_len)
+            || ntohs(ip->tot_len) < (ip->ihl << 2) + sizeof(tc_tcph_t))
+        {
+            continue;
+        }
+        tcp = (tc_tcph_t *) ((unsigned char *) ip + (ip->ihl << 2));
+
+        if (trace.pkts[i].from_client) {
+            proc_client(ip, tcp);
+        } else {
+            proc_server(ip, tcp);
+        }
+    }
+
+    drop_all();
+    tc_mysql_module.remove_obsolete_resources(1);
+    usec = now_usec() - start;
+    tc_mysql_module.exit();
+
+    if (usec == 0) {
+        usec = 1;
+    }
+
+    printf("client_packets %llu\n", (unsigned long long) rp_client_pkts);
+    printf("server_packets %llu\n", (unsigned long long) rp_server_pkts);
+    printf("sessions %llu\n", (unsigned long long) rp_created);
+    printf("renewed %llu\n", (unsigned long long) rp_renewed);
+    printf("renew_refused %llu\n", (unsigned long long) rp_refused);
+    printf("unknown %llu\n", (unsigned long long) rp_unknown);
+    printf("replayed_packets %llu\n", (unsigned long long) rp_saved);
+    printf("sent_packets %llu\n", (unsigned long long) rp_sent_pkts);
+    printf("sent_bytes %llu\n", (unsigned long long) rp_sent_bytes);
+    printf("checksum %016llx\n", (unsigned long long) rp_sum);
+    printf("peak_pool_bytes %llu\n", (unsigned long long) tc_shim_peak_bytes);
+    printf("usec %llu\n", (unsigned long long) usec);
+    printf("packets_per_sec %.0f\n",
+            (rp_client_pkts + rp_server_pkts) * 1e6 / usec);
+    printf("sessions_per_sec %.0f\n", rp_created * 1e6 / usec);
+
+    for (i = 0; i < trace.num; i++) {
+        free(trace.pkts[i].data);
+    }
+    free(trace.pkts);
+
+    return 0;
+}
@@ -0,0 +1,327 @@
+
+#include <xcopy.h>
+#include <tcpcopy.h>
+#include <openssl/evp.h>
+
+/*
+ * Every block of a pool is linked into it, so that destroying the pool
+ * frees what was not freed one by one, and counted, so that a driver can
+ * tell what the module allocates and holds at most.
+ */
+struct tc_pool_block_s {
+    tc_pool_block_t  *prev;
+    tc_pool_block_t  *next;
+    size_t            size;
+    size_t            pad;
+};
+
+int       tc_shim_log_level = LOG_ERR;
+time_t    tc_shim_now;
+uint64_t  tc_shim_allocs;
+uint64_t  tc_shim_bytes;
+uint64_t  tc_shim_peak_bytes;
+
+void    (*tc_shim_save_pack)(tc_sess_t *s, tc_iph_t *ip, tc_tcph_t *tcp);
+
+
+void
+tc_log_info(int level, int err, const char *fmt, ...)
+{
+    va_list args;
+
+    if (level > tc_shim_log_level) {
+        return;
+    }
+
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+
+    if (err != 0) {
+        fprintf(stderr, " (%s)", strerror(err));
+    }
+    fputc('\n', stderr);
+}
+
+
+time_t
+tc_time(void)
+{
+    return tc_shim_now != 0 ? tc_shim_now : time(NULL);
+}
+
+
+tc_pool_t *
+tc_create_pool(size_t size, size_t sub_size, size_t pool_max)
+{
+    return calloc(1, sizeof(tc_pool_t));
+}
+
+
+void
+tc_destroy_pool(tc_pool_t *pool)
+{
+    tc_pool_block_t *b, *next;
+
+    for (b = pool->blocks; b; b = next) {
+        next = b->next;
+        tc_shim_bytes -= b->size;
+        free(b);
+    }
+
+    free(pool);
+}
+
+
+void *
+tc_palloc(tc_pool_t *pool, size_t size)
+{
+    tc_pool_block_t *b;
+
+    b = malloc(sizeof(tc_pool_block_t) + size);
+    if (b == NULL) {
+        return NULL;
+    }
+
+    b->size = size;
+    b->prev = NULL;
+    b->next = pool->blocks;
+    if (pool->blocks != NULL) {
+        pool->blocks->prev = b;
+    }
+    pool->blocks = b;
+
+    tc_shim_allocs++;
+    tc_shim_bytes += size;
+    if (tc_shim_bytes > tc_shim_peak_bytes) {
+        tc_shim_peak_bytes = tc_shim_bytes;
+    }
+
+    return b + 1;
+}
+
+
+void *
+tc_pcalloc(tc_pool_t *pool, size_t size)
+{
+    void *p;
+
+    p = tc_palloc(pool, size);
+    if (p != NULL) {
+        tc_memzero(p, size);
+    }
+
+    return p;
+}
+
+
+int
+tc_pfree(tc_pool_t *pool, void *p)
+{
+    tc_pool_block_t *b;
+
+    b = (tc_pool_block_t *) p - 1;
+    if (b->prev != NULL) {
+        b->prev->next = b->next;
+    } else {
+        pool->blocks = b->next;
+    }
+    if (b->next != NULL) {
+        b->next->prev = b->prev;
+    }
+
+    tc_shim_bytes -= b->size;
+    free(b);
+
+    return TC_OK;
+}
+
+
+link_list *
+link_list_create(tc_pool_t *pool)
+{
+    link_list *l;
+
+    l = tc_pcalloc(pool, sizeof(link_list));
+    if (l == NULL) {
+        return NULL;
+    }
+
+    l->head.prev = &l->head;
+    l->head.next = &l->head;
+
+    return l;
+}
+
+
+void
+link_list_append(link_list *l, p_link_node p)
+{
+    p->prev = l->head.prev;
+    p->next = &l->head;
+    l->head.prev->next = p;
+    l->head.prev = p;
+    l->size++;
+}
+
+
+p_link_node
+link_list_remove(link_list *l, p_link_node p)
+{
+    p->prev->next = p->next;
+    p->next->prev = p->prev;
+    p->prev = NULL;
+    p->next = NULL;
+    l->size--;
+
+    return p;
+}
+
+
+p_link_node
+link_list_first(link_list *l)
+{
+    return l->head.next == &l->head ? NULL : l->head.next;
+}
+
+
+p_link_node
+link_list_get_next(link_list *l, p_link_node p)
+{
+    return p->next == &l->head ? NULL : p->next;
+}
+
+
+hash_table *
+hash_create(tc_pool_t *pool, uint32_t size)
+{
+    hash_table *table;
+
+    table = tc_pcalloc(pool, sizeof(hash_table));
+    if (table == NULL) {
+        return NULL;
+    }
+
+    table->size    = size;
+    table->buckets = tc_pcalloc(pool, size * sizeof(hash_node *));
+    if (table->buckets == NULL) {
+        return NULL;
+    }
+
+    return table;
+}
+
+
+hash_node *
+hash_find_node(hash_table *table, uint64_t key)
+{
+    hash_node *hn;
+
+    for (hn = table->buckets[key % table->size]; hn; hn = hn->next) {
+        if (hn->key == key) {
+            hn->access_time = tc_time();
+            return hn;
+        }
+    }
+
+    return NULL;
+}
+
+
+void *
+hash_find(hash_table *table, uint64_t key)
+{
+    hash_node *hn;
+
+    hn = hash_find_node(table, key);
+
+    return hn != NULL ? hn->data : NULL;
+}
+
+
+bool
+hash_add(hash_table *table, tc_pool_t *pool, uint64_t key, void *data)
+{
+    hash_node *hn, **bucket;
+
+    hn = hash_find_node(table, key);
+    if (hn != NULL) {
+        hn->data = data;
+        return true;
+    }
+
+    hn = tc_palloc(pool, sizeof(hash_node));
+    if (hn == NULL) {
+        return false;
+    }
+
+    bucket = &table->buckets[key % table->size];
+    hn->key         = key;
+    hn->data        = data;
+    hn->create_time = tc_time();
+    hn->access_time = hn->create_time;
+    hn->next        = *bucket;
+    *bucket = hn;
+    table->total++;
+
+    return true;
+}
+
+
+bool
+hash_del(hash_table *table, tc_pool_t *pool, uint64_t key)
+{
+    hash_node *hn, **p;
+
+    for (p = &table->buckets[key % table->size]; *p; p = &(*p)->next) {
+        hn = *p;
+        if (hn->key == key) {
+            *p = hn->next;
+            tc_pfree(pool, hn);
+            table->total--;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+int
+tc_sha1_digest_one(unsigned char *digest, size_t len,
+        const unsigned char *m, size_t m_len)
+{
+    return tc_sha1_digest_two(digest, len, m, m_len, NULL, 0);
+}
+
+
+int
+tc_sha1_digest_two(unsigned char *digest, size_t len,
+        const unsigned char *m1, size_t m1_len,
+        const unsigned char *m2, size_t m2_len)
+{
+    int         ret;
+    EVP_MD_CTX *ctx;
+
+    ctx = EVP_MD_CTX_new();
+    if (ctx == NULL) {
+        return TC_ERR;
+    }
+
+    ret = EVP_DigestInit_ex(ctx, EVP_sha1(), NULL)
+        && EVP_DigestUpdate(ctx, m1, m1_len)
+        && (m2 == NULL || EVP_DigestUpdate(ctx, m2, m2_len))
+        && EVP_DigestFinal_ex(ctx, digest, NULL);
+    EVP_MD_CTX_free(ctx);
+
+    return ret ? TC_OK : TC_ERR;
+}
+
+
+void
+tc_save_pack(tc_sess_t *s, link_list *list, tc_iph_t *ip, tc_tcph_t *tcp)
+{
+    if (tc_shim_save_pack != NULL) {
+        tc_shim_save_pack(s, ip, tcp);
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef  TCPCOPY_INCLUDED
+#define  TCPCOPY_INCLUDED
+#include <xcopy.h>
+
+/*
+ * The part of a tcpcopy session the module sees. A driver plays the role
+ * of the session manager: it sets cur_pack before every callback and gets
+ * the packets the module saves through tc_shim_save_pack.
+ */
+typedef struct {
+    uint32_t  fake_syn:1;
+    uint32_t  sess_over:1;
+    uint32_t  need_rep_greet:1;
+    uint32_t  rcv_rep_greet:1;
+} tc_sess_sm_t;
+
+typedef struct {
+    uint16_t  cont_len;
+} tc_sess_pack_t;
+
+typedef struct tc_sess_s {
+    uint64_t        hash_key;
+    uint16_t        src_port;
+    tc_sess_sm_t    sm;
+    tc_sess_pack_t  cur_pack;
+    tc_pool_t      *pool;
+    link_list      *slide_win_packs;
+    void           *data;
+} tc_sess_t;
+
+extern void (*tc_shim_save_pack)(tc_sess_t *s, tc_iph_t *ip, tc_tcph_t *tcp);
+
+void tc_save_pack(tc_sess_t *s, link_list *list, tc_iph_t *ip,
+        tc_tcph_t *tcp);
+
+typedef struct {
+    void       *ctx;
+    tc_cmd_t   *cmds;
+    int       (*init)(void);
+    void      (*exit)(void);
+    void      (*remove_obsolete_resources)(int is_full);
+    bool      (*check_renew_session)(tc_iph_t *ip, tc_tcph_t *tcp);
+    int       (*prepare_for_renew_session)(tc_sess_t *s, tc_iph_t *ip,
+                  tc_tcph_t *tcp);
+    bool      (*check_pack_needed_for_recons)(tc_sess_t *s, tc_iph_t *ip,
+                  tc_tcph_t *tcp);
+    int       (*proc_when_sess_created)(tc_sess_t *s);
+    int       (*proc_when_sess_destroyed)(tc_sess_t *s);
+    int       (*release_resources)(uint64_t key);
+    int       (*proc_greet)(tc_sess_t *s, tc_iph_t *ip, tc_tcph_t *tcp);
+    int       (*proc_auth)(tc_sess_t *s, tc_iph_t *ip, tc_tcph_t *tcp);
+    int       (*check_needed_for_sec_auth)(tc_sess_t *s, tc_iph_t *ip,
+                  tc_tcph_t *tcp);
+    void       *end;
+} tc_module_t;
+
+extern tc_module_t tc_mysql_module;
+
+#endif   /* ----- #ifndef TCPCOPY_INCLUDED  ----- */
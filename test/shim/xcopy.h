@@ -0,0 +1,196 @@
+#ifndef  XCOPY_INCLUDED
+#define  XCOPY_INCLUDED
+
+/*
+ * A stand-in for the headers of the tcpcopy core, with just what the
+ * module uses, so that the module builds and runs without tcpcopy for
+ * the tests, the benchmarks and the replay harness. Pools count what is
+ * allocated from them, tc_time() follows the clock the driver sets and
+ * logging is quiet unless asked for.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+typedef unsigned int uint;
+
+#define TC_OK                    0
+#define TC_ERR                  -1
+#define PACK_STOP                0
+#define PACK_CONTINUE            1
+#define TC_DETECT_MEMORY         0
+#define TC_PLUGIN_POOL_SIZE      1048576
+#define TC_PLUGIN_POOL_SUB_SIZE  1024
+#define ETHERNET_HDR_LEN         14
+#define MAX_IDLE_TIME            120
+#define MAX_RETHRESH_TIME        60
+
+#define LOG_ERR                  3
+#define LOG_WARN                 4
+#define LOG_NOTICE               5
+#define LOG_INFO                 6
+#define LOG_DEBUG                7
+
+#define tc_memzero(b, n)         memset(b, 0, n)
+
+extern int      tc_shim_log_level;
+extern time_t   tc_shim_now;
+extern uint64_t tc_shim_allocs;
+extern uint64_t tc_shim_bytes;
+extern uint64_t tc_shim_peak_bytes;
+
+void tc_log_info(int level, int err, const char *fmt, ...);
+#define tc_log_debug0(level, err, fmt)
+#define tc_log_debug1(level, err, fmt, a1)
+#define tc_log_debug2(level, err, fmt, a1, a2)
+#define tc_log_debug3(level, err, fmt, a1, a2, a3)
+
+time_t tc_time(void);
+
+typedef struct tc_pool_block_s tc_pool_block_t;
+
+typedef struct {
+    tc_pool_block_t *blocks;
+} tc_pool_t;
+
+tc_pool_t *tc_create_pool(size_t size, size_t sub_size, size_t pool_max);
+void tc_destroy_pool(tc_pool_t *pool);
+void *tc_palloc(tc_pool_t *pool, size_t size);
+void *tc_pcalloc(tc_pool_t *pool, size_t size);
+int tc_pfree(tc_pool_t *pool, void *p);
+
+typedef struct link_node_s {
+    struct link_node_s *prev;
+    struct link_node_s *next;
+    void               *data;
+    uint32_t            key;
+} link_node, *p_link_node;
+
+typedef struct {
+    link_node head;
+    int       size;
+} link_list;
+
+link_list *link_list_create(tc_pool_t *pool);
+void link_list_append(link_list *l, p_link_node p);
+p_link_node link_list_remove(link_list *l, p_link_node p);
+p_link_node link_list_first(link_list *l);
+p_link_node link_list_get_next(link_list *l, p_link_node p);
+
+typedef struct hash_node_s {
+    uint64_t             key;
+    time_t               access_time;
+    time_t               create_time;
+    void                *data;
+    struct hash_node_s  *next;
+} hash_node;
+
+typedef struct {
+    uint32_t    size;
+    uint32_t    total;
+    hash_node **buckets;
+} hash_table;
+
+hash_table *hash_create(tc_pool_t *pool, uint32_t size);
+bool hash_add(hash_table *table, tc_pool_t *pool, uint64_t key, void *data);
+void *hash_find(hash_table *table, uint64_t key);
+hash_node *hash_find_node(hash_table *table, uint64_t key);
+bool hash_del(hash_table *table, tc_pool_t *pool, uint64_t key);
+
+typedef struct {
+    uint8_t   ihl:4,
+              version:4;
+    uint8_t   tos;
+    uint16_t  tot_len;
+    uint16_t  id;
+    uint16_t  frag_off;
+    uint8_t   ttl;
+    uint8_t   protocol;
+    uint16_t  check;
+    uint32_t  saddr;
+    uint32_t  daddr;
+} tc_iph_t;
+
+typedef struct {
+    uint16_t  source;
+    uint16_t  dest;
+    uint32_t  seq;
+    uint32_t  ack_seq;
+    uint16_t  res1:4,
+              doff:4,
+              fin:1,
+              syn:1,
+              rst:1,
+              psh:1,
+              ack:1,
+              urg:1,
+              res2:2;
+    uint16_t  window;
+    uint16_t  check;
+    uint16_t  urg_ptr;
+} tc_tcph_t;
+
+#define TCP_PAYLOAD_LENGTH(ip, tcp)                                         \
+    (ntohs((ip)->tot_len) - ((ip)->ihl << 2) - ((tcp)->doff << 2))
+
+#define before(seq1, seq2)  ((int32_t) ((uint32_t) (seq1) - (seq2)) < 0)
+#define after(seq2, seq1)   before(seq1, seq2)
+
+static inline uint64_t
+get_key(uint32_t ip, uint16_t port)
+{
+    return (((uint64_t) ip) << 16) + port;
+}
+
+int tc_sha1_digest_one(unsigned char *digest, size_t len,
+        const unsigned char *m, size_t m_len);
+int tc_sha1_digest_two(unsigned char *digest, size_t len,
+        const unsigned char *m1, size_t m1_len,
+        const unsigned char *m2, size_t m2_len);
+
+typedef struct {
+    size_t          len;
+    unsigned char  *data;
+} tc_str_t;
+
+#define tc_string(str)  { sizeof(str) - 1, (unsigned char *) str }
+
+typedef struct {
+    void      *elts;
+    unsigned   nelts;
+} tc_array_t;
+
+typedef struct {
+    tc_array_t *args;
+    tc_pool_t  *pool;
+} tc_conf_t;
+
+typedef struct tc_cmd_s tc_cmd_t;
+
+#define TC_CONF_TAKE1  2
+
+struct tc_cmd_s {
+    tc_str_t   name;
+    int        offset;
+    int        conf;
+    int        type;
+    int      (*set)(tc_conf_t *cf, tc_cmd_t *cmd);
+    void      *post;
+};
+
+#endif   /* ----- #ifndef XCOPY_INCLUDED  ----- */
@@ -0,0 +1,1614 @@
+
+#include "../tc_mysql_module.c"
+
+/*
+ * Unit tests of the module. Most drive it through its callbacks one
+ * packet at a time, checking the bytes it leaves in the packets and the
+ * state it keeps; each of those logs a session in against a greeting of
+ * its own. The framer and the parsers are fed bytes directly.
+ */
+
+#define T_CLIENT_IP    0x0200000a
+#define T_PKT_SIZE     2048
+
+#define T_CAPS         0x000fa20f
+#define T_SNAPSHOT     "unit.snapshot"
+
+typedef struct {
+    tc_iph_t       ip;
+    tc_tcph_t      tcp;
+    unsigned char  data[T_PKT_SIZE];
+} t_pkt_t;
+
+typedef struct {
+    tc_sess_t  s;
+    uint32_t   cseq;
+    uint32_t   sseq;
+} t_sess_t;
+
+static int          failures;
+static const char   t_salt[] = "targetAAAAAAAAAAAAAA";
+
+#define T_CHECK(cond)                                                       \
+    do {                                                                    \
+        if (!(cond)) {                                                      \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__,       \
+                    #cond);                                                 \
+            failures++;                                                     \
+        }                                                                   \
+    } while (0)
+
+
+static uint32_t
+put_packet(unsigned char *p, unsigned char seq, const void *body,
+        uint32_t len)
+{
+    p[0] = len & 0xff;
+    p[1] = (len >> 8) & 0xff;
+    p[2] = (len >> 16) & 0xff;
+    p[3] = seq;
+    memcpy(p + MYSQL_HEADER_LEN, body, len);
+
+    return MYSQL_HEADER_LEN + len;
+}
+
+
+static uint32_t
+put_command(unsigned char *p, unsigned char command, const void *data,
+        uint32_t len)
+{
+    unsigned char body[T_PKT_SIZE];
+
+    body[0] = command;
+    memcpy(body + 1, data, len);
+
+    return put_packet(p, 0, body, len + 1);
+}
+
+
+static void
+make_pkt(t_pkt_t *pkt, uint16_t sport, uint16_t dport, uint32_t seq,
+        uint32_t len)
+{
+    tc_memzero(&pkt->ip, sizeof(pkt->ip));
+    tc_memzero(&pkt->tcp, sizeof(pkt->tcp));
+    pkt->ip.version = 4;
+    pkt->ip.ihl = 5;
+    pkt->ip.protocol = IPPROTO_TCP;
+    pkt->ip.tot_len = htons(sizeof(tc_iph_t) + sizeof(tc_tcph_t) + len);
+    pkt->ip.saddr = T_CLIENT_IP;
+    pkt->tcp.source = htons(sport);
+    pkt->tcp.dest = htons(dport);
+    pkt->tcp.seq = htonl(seq);
+    pkt->tcp.doff = sizeof(tc_tcph_t) >> 2;
+    pkt->tcp.ack = 1;
+}
+
+
+/* the client sends len bytes of pkt->data; false if the session ended */
+static bool
+client_send(t_sess_t *ts, t_pkt_t *pkt, uint32_t len)
+{
+    make_pkt(pkt, ntohs(ts->s.src_port), 3306, ts->cseq, len);
+    ts->cseq += len;
+    ts->s.cur_pack.cont_len = len;
+
+    if (tc_mysql_module.proc_auth(&ts->s, &pkt->ip, &pkt->tcp) != PACK_CONTINUE
+        || ts->s.sm.sess_over)
+    {
+        return false;
+    }
+    tc_mysql_module.check_pack_needed_for_recons(&ts->s, &pkt->ip, &pkt->tcp);
+
+    return true;
+}
+
+
+static void
+server_send(t_sess_t *ts, const unsigned char *data, uint32_t len)
+{
+    t_pkt_t pkt;
+
+    make_pkt(&pkt, 3306, ntohs(ts->s.src_port), ts->sseq, len);
+    memcpy(pkt.data, data, len);
+    ts->sseq += len;
+    ts->s.cur_pack.cont_len = len;
+    tc_mysql_module.check_needed_for_sec_auth(&ts->s, &pkt.ip, &pkt.tcp);
+}
+
+
+static uint32_t
+build_greeting(unsigned char *buf, uint32_t caps)
+{
+    unsigned char  body[128], *p;
+
+    p = body;
+    *p++ = 10;
+    p += sprintf((char *) p, "8.0.36") + 1;
+    memset(p, 1, 4);
+    p += 4;
+    memcpy(p, t_salt, 8);
+    p += 8;
+    *p++ = 0;
+    *p++ = caps & 0xff;
+    *p++ = (caps >> 8) & 0xff;
+    *p++ = 33;
+    *p++ = 0x02;
+    *p++ = 0x00;
+    *p++ = (caps >> 16) & 0xff;
+    *p++ = (caps >> 24) & 0xff;
+    *p++ = SCRAMBLE_LENGTH + 1;
+    memset(p, 0, 10);
+    p += 10;
+    memcpy(p, t_salt + 8, SCRAMBLE_LENGTH - 8);
+    p += SCRAMBLE_LENGTH - 8;
+    *p++ = 0;
+    p += sprintf((char *) p, "mysql_native_password") + 1;
+
+    return put_packet(buf, 0, body, p - body);
+}
+
+
+static uint32_t
+build_auth(unsigned char *buf, uint32_t caps)
+{
+    unsigned char  body[128], *p;
+
+    p = body;
+    *p++ = caps & 0xff;
+    *p++ = (caps >> 8) & 0xff;
+    *p++ = (caps >> 16) & 0xff;
+    *p++ = (caps >> 24) & 0xff;
+    memset(p, 0, 4 + 1 + 23);
+    p[3] = 1;
+    p += 4;
+    *p++ = 33;
+    p += 23;
+    p += sprintf((char *) p, "app") + 1;
+    *p++ = SCRAMBLE_LENGTH;
+    memset(p, 0x5a, SCRAMBLE_LENGTH);
+    p += SCRAMBLE_LENGTH;
+    p += sprintf((char *) p, "mysql_native_password") + 1;
+
+    return put_packet(buf, 1, body, p - body);
+}
+
+
+static const unsigned char t_ok[] = { 0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00 };
+
+
+/* the greeting and the first auth of a session, with no answer yet */
+static bool
+begin_login(t_sess_t *ts, tc_pool_t *pool, uint16_t port, uint32_t caps)
+{
+    uint32_t       len;
+    t_pkt_t        pkt;
+
+    tc_memzero(ts, sizeof(*ts));
+    ts->s.hash_key = get_key(T_CLIENT_IP, htons(port));
+    ts->s.src_port = htons(port);
+    ts->s.pool = pool;
+    ts->cseq = 1000;
+    ts->sseq = 5000;
+
+    tc_mysql_module.proc_when_sess_created(&ts->s);
+    if (ts->s.data == NULL) {
+        return false;
+    }
+
+    len = build_greeting(pkt.data, caps);
+    make_pkt(&pkt, 3306, port, ts->sseq, len);
+    ts->sseq += len;
+    ts->s.cur_pack.cont_len = len;
+    if (tc_mysql_module.proc_greet(&ts->s, &pkt.ip, &pkt.tcp)
+        != PACK_CONTINUE)
+    {
+        return false;
+    }
+    ts->s.sm.rcv_rep_greet = 1;
+
+    len = build_auth(pkt.data, caps);
+
+    return client_send(ts, &pkt, len);
+}
+
+
+/* a session logged in with the capabilities given to both sides */
+static bool
+login(t_sess_t *ts, tc_pool_t *pool, uint16_t port, uint32_t caps)
+{
+    uint32_t       len;
+    unsigned char  buf[64];
+
+    if (!begin_login(ts, pool, port, caps)) {
+        return false;
+    }
+
+    len = put_packet(buf, 2, t_ok, sizeof(t_ok));
+    server_send(ts, buf, len);
+
+    return true;
+}
+
+
+static void
+logout(t_sess_t *ts)
+{
+    tc_mysql_module.proc_when_sess_destroyed(&ts->s);
+}
+
+
+static int
+set_directive(const char *name, const char *value)
+{
+    size_t      i;
+    tc_str_t    args[2];
+    tc_conf_t   cf;
+    tc_array_t  arr;
+
+    args[0].len = strlen(name);
+    args[0].data = (unsigned char *) name;
+    args[1].len = strlen(value);
+    args[1].data = (unsigned char *) value;
+    arr.elts = args;
+    arr.nelts = 2;
+    cf.args = &arr;
+    cf.pool = tc_create_pool(TC_PLUGIN_POOL_SIZE, 0, 0);
+
+    for (i = 0; i < sizeof(mysql_commands) / sizeof(mysql_commands[0]); i++) {
+        if (mysql_commands[i].name.len == args[0].len
+            && memcmp(mysql_commands[i].name.data, name, args[0].len) == 0)
+        {
+            return mysql_commands[i].set(&cf, &mysql_commands[i]);
+        }
+    }
+
+    return TC_ERR;
+}
+
+
+/* the filler, after the empty query attributes if attrs is 2 */
+static bool
+is_filler(const unsigned char *p, uint32_t len, uint32_t attrs)
+{
+    uint32_t i;
+
+    if (len < 1 + attrs + FILTER_STMT_LEN || p[0] != COM_QUERY
+        || memcmp(p + 1, no_query_attrs, attrs) != 0
+        || memcmp(p + 1 + attrs, FILTER_STMT, FILTER_STMT_LEN) != 0)
+    {
+        return false;
+    }
+
+    for (i = 1 + attrs + FILTER_STMT_LEN; i < len; i++) {
+        if (p[i] != ' ') {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+/*
+ * A filtered query and a filtered execute both leave as a "DO 0" query
+ * padded to the length of the packet, with the header as it was; a read
+ * goes as it came.
+ */
+static void
+test_filter(tc_pool_t *pool)
+{
+    uint32_t        len;
+    t_pkt_t         pkt;
+    t_sess_t        ts;
+    unsigned char   buf[128], exec[32];
+    const char     *sql;
+
+    T_CHECK(login(&ts, pool, 40001, T_CAPS));
+
+    sql = "update item set n = n + 1 where id = ?";
+    len = put_command(pkt.data, COM_STMT_PREPARE, sql, strlen(sql));
+    T_CHECK(client_send(&ts, &pkt, len));
+
+    /* PREPARE_OK for statement 1, no columns and one parameter */
+    buf[0] = 0x00;
+    buf[1] = 1;
+    memset(buf + 2, 0, 10);
+    buf[7] = 1;
+    len = put_packet(exec, 1, buf, 12);
+    server_send(&ts, exec, len);
+
+    memset(exec, 0, sizeof(exec));
+    exec[0] = 1;
+    exec[5] = 1;
+    exec[10] = 1;
+    exec[11] = 0x08;
+    exec[13] = 42;
+    len = put_command(pkt.data, COM_STMT_EXECUTE, exec, 21);
+    memcpy(buf, pkt.data, len);
+    T_CHECK(client_send(&ts, &pkt, len));
+    T_CHECK(memcmp(pkt.data, buf, MYSQL_HEADER_LEN) == 0);
+    T_CHECK(is_filler(pkt.data + MYSQL_HEADER_LEN, len - MYSQL_HEADER_LEN, 0));
+
+    sql = "delete from item where id = 3";
+    len = put_command(pkt.data, COM_QUERY, sql, strlen(sql));
+    memcpy(buf, pkt.data, len);
+    T_CHECK(client_send(&ts, &pkt, len));
+    T_CHECK(memcmp(pkt.data, buf, MYSQL_HEADER_LEN) == 0);
+    T_CHECK(is_filler(pkt.data + MYSQL_HEADER_LEN, len - MYSQL_HEADER_LEN, 0));
+
+    sql = "select n from item where id = 3";
+    len = put_command(pkt.data, COM_QUERY, sql, strlen(sql));
+    memcpy(buf, pkt.data, len);
+    T_CHECK(client_send(&ts, &pkt, len));
+    T_CHECK(memcmp(pkt.data, buf, len) == 0);
+
+    T_CHECK(get_shard(ts.s.hash_key)->stats.stmts_filtered == 2);
+
+    logout(&ts);
+}
+
+
+/* a query with attributes: none, or one string attribute id=abc */
+static uint32_t
+put_attrs_query(unsigned char *p, int attrs, const char *sql)
+{
+    uint32_t       n;
+    unsigned char  body[T_PKT_SIZE];
+    static const unsigned char  one_attr[] = {
+        0x01, 0x01, 0x00, 0x01, 0xfe, 0x00, 0x02, 'i', 'd', 0x03, 'a', 'b', 'c'
+    };
+
+    body[0] = COM_QUERY;
+    n = 1;
+    if (attrs) {
+        memcpy(body + n, one_attr, sizeof(one_attr));
+        n += sizeof(one_attr);
+    } else {
+        body[n++] = 0x00;
+        body[n++] = 0x01;
+    }
+    memcpy(body + n, sql, strlen(sql));
+
+    return put_packet(p, 0, body, n + strlen(sql));
+}
+
+
+/*
+ * With CLIENT_QUERY_ATTRIBUTES on both sides the statement of a query
+ * follows its attributes: it is classed and kept from there, and the
+ * filler carries no attributes of its own
+ */
+static void
+test_query_attrs(tc_pool_t *pool)
+{
+    uint32_t           len;
+    t_pkt_t            pkt;
+    t_sess_t           ts;
+    unsigned char      buf[128];
+    tc_mysql_rec_t    *rec;
+    tc_mysql_shard_t  *shard;
+    static const unsigned char  null_attr[] = {
+        COM_QUERY, 0x01, 0x01, 0x01, 0x01, 0xfe, 0x00, 0x01, 'x', 'D', 'O'
+    };
+
+    len = put_attrs_query(buf, 1, "select 1");
+    T_CHECK(get_query_text_off(buf + MYSQL_HEADER_LEN,
+                len - MYSQL_HEADER_LEN, 0) == 1);
+    T_CHECK(get_query_text_off(buf + MYSQL_HEADER_LEN,
+                len - MYSQL_HEADER_LEN, 1) == 14);
+    T_CHECK(get_query_text_off(buf + MYSQL_HEADER_LEN, 12, 1) == 0);
+    T_CHECK(get_query_text_off((unsigned char *) null_attr,
+                sizeof(null_attr), 1) == 9);
+
+    T_CHECK(login(&ts, pool, 40006, T_CAPS | CLIENT_QUERY_ATTRIBUTES));
+    T_CHECK(((tc_mysql_session *) ts.s.data)->query_attrs);
+    shard = get_shard(ts.s.hash_key);
+    shard->stats.stmts_filtered = 0;
+
+    len = put_attrs_query(pkt.data, 0, "delete from item where id = 3");
+    memcpy(buf, pkt.data, len);
+    T_CHECK(client_send(&ts, &pkt, len));
+    T_CHECK(memcmp(pkt.data, buf, MYSQL_HEADER_LEN) == 0);
+    T_CHECK(is_filler(pkt.data + MYSQL_HEADER_LEN, len - MYSQL_HEADER_LEN, 2));
+
+    len = put_attrs_query(pkt.data, 1, "update item set n = 1");
+    T_CHECK(client_send(&ts, &pkt, len));
+    T_CHECK(is_filler(pkt.data + MYSQL_HEADER_LEN, len - MYSQL_HEADER_LEN, 2));
+
+    len = put_attrs_query(pkt.data, 0,
+            "with c as (select 3 id) delete item from item join c using (id)");
+    T_CHECK(client_send(&ts, &pkt, len));
+    T_CHECK(is_filler(pkt.data + MYSQL_HEADER_LEN, len - MYSQL_HEADER_LEN, 2));
+
+    len = put_attrs_query(pkt.data, 1, "select n from item where id = 3");
+    memcpy(buf, pkt.data, len);
+    T_CHECK(client_send(&ts, &pkt, len));
+    T_CHECK(memcmp(pkt.data, buf, len) == 0);
+
+    T_CHECK(shard->stats.stmts_filtered == 3);
+
+    len = put_attrs_query(pkt.data, 1, "set session sql_mode = ''");
+    T_CHECK(client_send(&ts, &pkt, len));
+    rec = find_rec(shard, ts.s.hash_key);
+    T_CHECK(rec != NULL && rec->state != NULL && rec->state->var_num == 1
+            && memcmp(rec->state->vars[0].text, "session sql_mode", 16) == 0);
+
+    /* a renewal restores it with no attributes */
+    len = tc_mysql_state_build(rec->state, buf);
+    len = attr_state(buf, len);
+    T_CHECK(buf[0] == len - MYSQL_HEADER_LEN
+            && buf[MYSQL_HEADER_LEN] == COM_QUERY
+            && buf[MYSQL_HEADER_LEN + 1] == 0x00
+            && buf[MYSQL_HEADER_LEN + 2] == 0x01
+            && memcmp(buf + MYSQL_HEADER_LEN + 3, "SET session sql_mode", 20)
+            == 0);
+
+    logout(&ts);
+}
+
+
+/* a statement with common table expressions is what follows them */
+static void
+test_classify_with(void)
+{
+    size_t i;
+    static const struct {
+        const char  *sql;
+        int          cls;
+    } cases[] = {
+        { "WITH c AS (SELECT 1) SELECT * FROM c", SQL_CLASS_READ },
+        { "with recursive c (n) as (select 1 union all select n + 1 from c "
+          "where n < 3) update t join c on t.id = c.n set t.v = 0",
+          SQL_CLASS_WRITE },
+        { "WITH c AS (SELECT 1) DELETE FROM t", SQL_CLASS_WRITE },
+        { "WITH `a b` AS (SELECT ')'), d AS (SELECT 2) TABLE d",
+          SQL_CLASS_READ },
+        { "WITH c AS (SELECT 1) (SELECT * FROM c)", SQL_CLASS_READ },
+        { "/* x */ with c as (select 1) /*!80000 update */ t set v = 1",
+          SQL_CLASS_WRITE },
+        { "WITH c AS (SELECT 1 FROM", SQL_CLASS_WRITE },
+        { "select 1", SQL_CLASS_READ },
+        { "(select 1)", SQL_CLASS_READ },
+        { "withdraw", SQL_CLASS_OTHER }
+    };
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        if (tc_mysql_classify((unsigned char *) cases[i].sql,
+                    strlen(cases[i].sql)) != cases[i].cls)
+        {
+            fprintf(stderr, "classify: %s\n", cases[i].sql);
+            failures++;
+        }
+    }
+}
+
+
+
+/*
+ * Records of a snapshot that no session took before exit are written to
+ * the next snapshot again
+ */
+static void
+test_snapshot_exit(tc_pool_t *pool)
+{
+    t_sess_t  ts;
+
+    T_CHECK(set_directive("user", "app:secret") == TC_OK);
+    T_CHECK(set_directive("snapshot", T_SNAPSHOT) == TC_OK);
+    unlink(T_SNAPSHOT);
+
+    T_CHECK(tc_mysql_module.init() == TC_OK);
+    T_CHECK(login(&ts, pool, 40002, T_CAPS));
+    tc_mysql_module.exit();
+
+    /* nothing asks for the record this time */
+    T_CHECK(tc_mysql_module.init() == TC_OK);
+    T_CHECK(ctx->snapshot.rec_num == 1);
+    tc_mysql_module.exit();
+
+    T_CHECK(tc_mysql_module.init() == TC_OK);
+    T_CHECK(ctx->snapshot.rec_num == 1);
+    T_CHECK(tc_mysql_snapshot_take(&ctx->snapshot, ts.s.hash_key) != NULL);
+    tc_mysql_module.exit();
+
+    unlink(T_SNAPSHOT);
+    snapshot_file = NULL;
+}
+
+
+/* prepare sql in a session, answered as statement id of one parameter */
+static void
+prepare(t_sess_t *ts, const char *sql, uint32_t id)
+{
+    uint32_t        len;
+    t_pkt_t         pkt;
+    unsigned char   buf[12], ok[32];
+
+    len = put_command(pkt.data, COM_STMT_PREPARE, sql, strlen(sql));
+    T_CHECK(client_send(ts, &pkt, len));
+
+    memset(buf, 0, sizeof(buf));
+    buf[1] = id & 0xff;
+    buf[7] = 1;
+    len = put_packet(ok, 1, buf, sizeof(buf));
+    server_send(ts, ok, len);
+}
+
+
+/*
+ * A statement prepared by two sessions is written once, by a writer
+ * thread, and both records come back with it; the references the writer
+ * held are given back.
+ */
+static void
+test_snapshot_payloads(tc_pool_t *pool)
+{
+    uint64_t              refs;
+    t_sess_t              ts1, ts2;
+    tc_mysql_rec_t       *rec;
+    tc_mysql_store_t     *store;
+    tc_mysql_snap_job_t  *job;
+    const char           *sql;
+
+    T_CHECK(set_directive("user", "app:secret") == TC_OK);
+    T_CHECK(set_directive("snapshot", T_SNAPSHOT) == TC_OK);
+    unlink(T_SNAPSHOT);
+
+    T_CHECK(tc_mysql_module.init() == TC_OK);
+    sql = "select n from item where id = ?";
+    T_CHECK(login(&ts1, pool, 40007, T_CAPS));
+    prepare(&ts1, sql, 1);
+    T_CHECK(login(&ts2, pool, 40008, T_CAPS));
+    prepare(&ts2, sql, 1);
+
+    store = &get_shard(ts1.s.hash_key)->ps_store;
+    refs  = store->refs;
+
+    job = create_snapshot_job();
+    T_CHECK(job != NULL && job->rec_num == 2 && job->stmt_num == 2);
+    T_CHECK(tc_mysql_snapshot_start(job) == TC_OK);
+    T_CHECK(tc_mysql_snapshot_done(job, 1));
+    T_CHECK(job->err == 0 && job->payload_num == 1);
+    release_snapshot_job(job);
+    T_CHECK(store->refs == refs);
+    tc_mysql_module.exit();
+
+    T_CHECK(tc_mysql_module.init() == TC_OK);
+    T_CHECK(ctx->snapshot.rec_num == 2 && ctx->snapshot.payload_num == 1);
+    rec = restore_rec(get_shard(ts2.s.hash_key), ts2.s.hash_key);
+    T_CHECK(rec != NULL && rec->stmt_num == 1);
+    if (rec != NULL && rec->stmt_num == 1) {
+        T_CHECK(rec->stmts[0]->id == 1);
+        T_CHECK(rec->stmts[0]->payload->len
+                == MYSQL_HEADER_LEN + 1 + strlen(sql));
+        T_CHECK(memcmp(rec->stmts[0]->payload->data + MYSQL_HEADER_LEN + 1,
+                    sql, strlen(sql)) == 0);
+    }
+    tc_mysql_module.exit();
+
+    unlink(T_SNAPSHOT);
+    snapshot_file = NULL;
+}
+
+
+/* the server sends data in segments of cut bytes */
+static void
+server_send_cut(t_sess_t *ts, const unsigned char *data, uint32_t len,
+        uint32_t cut)
+{
+    uint32_t off, n;
+
+    for (off = 0; off < len; off += n) {
+        n = len - off < cut ? len - off : cut;
+        server_send(ts, data + off, n);
+    }
+}
+
+
+/*
+ * The target switches the login to plugin with a new salt, sent in
+ * segments of cut bytes; what the
+ * client sends back is rewritten into to
+ */
+static void
+switch_auth(t_sess_t *ts, const char *plugin, const char *salt,
+        uint32_t cut, unsigned char *to, uint32_t len)
+{
+    uint32_t       n;
+    t_pkt_t        pkt;
+    unsigned char  body[64], *p;
+
+    p = body;
+    *p++ = 0xfe;
+    p += sprintf((char *) p, "%s", plugin) + 1;
+    memcpy(p, salt, SCRAMBLE_LENGTH);
+    p += SCRAMBLE_LENGTH;
+    *p++ = 0;
+    n = put_packet(pkt.data, 2, body, p - body);
+    server_send_cut(ts, pkt.data, n, cut);
+
+    memset(body, 0x5a, len);
+    n = put_packet(pkt.data, 3, body, len);
+    T_CHECK(client_send(ts, &pkt, n));
+    memcpy(to, pkt.data + MYSQL_HEADER_LEN, len);
+}
+
+
+#define T_USERS 1000
+
+
+/*
+ * Users sharing buckets of the perfect hash are all found with their own
+ * entry, a duplicate keeps the first password and names close to those
+ * of the table are not found
+ */
+static void
+test_user_table(void)
+{
+    int                i;
+    char              *pairs, *p, name[32], pwd[32], map[32];
+    size_t             size;
+    tc_pool_t         *pool;
+    mysql_user        *u;
+    unsigned char      stage[SHA256_HASH_SIZE];
+    mysql_user_table  *table, *old;
+    static const char *misses[] = { "u1000", "u", "", "U1", "u1 ", "m1",
+                                    "u01", "u7u7" };
+
+    size  = T_USERS * 32 + 32;
+    pairs = malloc(size);
+    T_CHECK(pairs != NULL);
+    if (pairs == NULL) {
+        return;
+    }
+
+    p = pairs;
+    for (i = 0; i < T_USERS; i++) {
+        p += sprintf(p, "u%d#m%d:pw%d,", i, i, i);
+    }
+    sprintf(p, "u7:other");
+
+    pool  = tc_create_pool(TC_PLUGIN_POOL_SIZE, 0, 0);
+    table = compile_mysql_user_table(pool, pairs);
+    free(pairs);
+    T_CHECK(table != NULL);
+    if (table == NULL) {
+        tc_destroy_pool(pool);
+        return;
+    }
+    T_CHECK(table->bucket_num < T_USERS / 2);
+    old = swap_mysql_user_table(table);
+
+    for (i = 0; i < T_USERS; i++) {
+        sprintf(name, "u%d", i);
+        sprintf(map, "m%d", i);
+        sprintf(pwd, "pw%d", i);
+        u = retrieve_user_info(name);
+        if (u == NULL || strcmp(u->user, name) != 0
+            || strcmp(u->map_user, map) != 0 || strcmp(u->password, pwd) != 0)
+        {
+            fprintf(stderr, "user %s not found\n", name);
+            failures++;
+            continue;
+        }
+        tc_sha1_digest_one(stage, SHA1_HASH_SIZE, (const unsigned char *) pwd,
+                strlen(pwd));
+        T_CHECK(memcmp(u->hash_stage1, stage, SHA1_HASH_SIZE) == 0);
+        sha256_digest(stage, (const unsigned char *) pwd, strlen(pwd), NULL,
+                0);
+        T_CHECK(memcmp(u->sha2_stage1, stage, SHA256_HASH_SIZE) == 0);
+    }
+
+    for (i = 0; i < (int) (sizeof(misses) / sizeof(misses[0])); i++) {
+        T_CHECK(retrieve_user_info((char *) misses[i]) == NULL);
+    }
+
+    swap_mysql_user_table(old);
+    tc_destroy_pool(pool);
+}
+
+
+/*
+ * The answer to an auth switch comes from the stages of the user's entry,
+ * or from the password once the user table was reloaded
+ */
+static void
+test_auth_switch(tc_pool_t *pool)
+{
+    t_sess_t          ts;
+    mysql_user        fake;
+    unsigned char     got[SHA256_HASH_SIZE];
+    char              want[SHA256_HASH_SIZE + 1];
+    unsigned char     stage1[SHA256_HASH_SIZE], stage2[SHA256_HASH_SIZE];
+    const char       *salt = "switchBBBBBBBBBBBBBB";
+    tc_mysql_session *data;
+
+    T_CHECK(set_directive("user", "app:secret") == TC_OK);
+    T_CHECK(tc_mysql_module.init() == TC_OK);
+
+    T_CHECK(begin_login(&ts, pool, 40009, T_CAPS));
+    data = ts.s.data;
+    T_CHECK(data->user_info != NULL);
+    switch_auth(&ts, "mysql_native_password", salt, T_PKT_SIZE, got,
+            SCRAMBLE_LENGTH);
+    scramble(want, salt, "secret");
+    T_CHECK(memcmp(got, want, SCRAMBLE_LENGTH) == 0);
+    logout(&ts);
+
+    /* the stages are taken from the entry, not from the password */
+    T_CHECK(begin_login(&ts, pool, 40010, T_CAPS));
+    data = ts.s.data;
+    memset(&fake, 0, sizeof(fake));
+    memset(fake.hash_stage1, 1, SHA1_HASH_SIZE);
+    memset(fake.hash_stage2, 2, SHA1_HASH_SIZE);
+    data->user_info = &fake;
+    switch_auth(&ts, "mysql_native_password", salt, T_PKT_SIZE, got,
+            SCRAMBLE_LENGTH);
+    scramble_from_stages(want, salt, fake.hash_stage1, fake.hash_stage2);
+    T_CHECK(memcmp(got, want, SCRAMBLE_LENGTH) == 0);
+    logout(&ts);
+
+    /* a reloaded table retires the entry */
+    T_CHECK(begin_login(&ts, pool, 40011, T_CAPS));
+    data = ts.s.data;
+    data->user_info = &fake;
+    swap_mysql_user_table(swap_mysql_user_table(NULL));
+    switch_auth(&ts, "caching_sha2_password", salt, T_PKT_SIZE, got,
+            SHA256_HASH_SIZE);
+    sha256_digest(stage1, (const unsigned char *) "secret", 6, NULL, 0);
+    sha256_digest(stage2, stage1, SHA256_HASH_SIZE, NULL, 0);
+    scramble_sha2_from_stages(want, salt, stage1, stage2);
+    T_CHECK(memcmp(got, want, SHA256_HASH_SIZE) == 0);
+    logout(&ts);
+
+    tc_mysql_module.exit();
+}
+
+
+/*
+ * Answers of the target split across segments are parsed whole: a switch
+ * request cut inside its head and its salt, and a public key
+ */
+static void
+test_split_auth_resp(tc_pool_t *pool)
+{
+    char              pem[512];
+    uint32_t          len, pem_len;
+    t_sess_t          ts;
+    unsigned char     got[SCRAMBLE_LENGTH], buf[600];
+    char              want[SCRAMBLE_LENGTH + 1];
+    const char       *salt = "splitCCCCCCCCCCCCCCC";
+    tc_mysql_session *data;
+
+    T_CHECK(set_directive("user", "app:secret") == TC_OK);
+    T_CHECK(tc_mysql_module.init() == TC_OK);
+
+    T_CHECK(begin_login(&ts, pool, 40012, T_CAPS));
+    switch_auth(&ts, "mysql_native_password", salt, 7, got,
+            SCRAMBLE_LENGTH);
+    scramble(want, salt, "secret");
+    T_CHECK(memcmp(got, want, SCRAMBLE_LENGTH) == 0);
+    logout(&ts);
+
+    T_CHECK(begin_login(&ts, pool, 40013, T_CAPS));
+    data = ts.s.data;
+    pem[0] = 0x01;
+    pem_len = sprintf(pem + 1, "-----BEGIN PUBLIC KEY-----\n%0400d\n"
+            "-----END PUBLIC KEY-----\n", 0);
+    len = put_packet(buf, 2, pem, 1 + pem_len);
+    server_send_cut(&ts, buf, len, 200);
+    T_CHECK(data->auth_resp == NULL && data->sec_auth_not_yet_done);
+    T_CHECK(data->rsa_key_len == pem_len
+            && memcmp(data->rsa_key, pem + 1, pem_len) == 0);
+    logout(&ts);
+
+    tc_mysql_module.exit();
+}
+
+
+/* a response as the target sends it, and the crc of its row bytes */
+typedef struct {
+    unsigned char  data[512];
+    uint32_t       len;
+    unsigned char  seq;
+    uint32_t       crc;
+} t_resp_t;
+
+typedef struct {
+    const char  *name;
+    int          kind;
+    int          deprecate_eof;
+    void       (*build)(t_resp_t *b);
+    uint32_t     type;
+    uint64_t     affected;
+    uint64_t     rows;
+    uint32_t     columns;
+} t_resp_case_t;
+
+
+static void
+resp_add(t_resp_t *b, const void *body, uint32_t len)
+{
+    b->len += put_packet(b->data + b->len, ++b->seq, body, len);
+}
+
+
+static void
+resp_row(t_resp_t *b, const void *body, uint32_t len)
+{
+    resp_add(b, body, len);
+    b->crc = tc_crc32c(b->crc, (unsigned char *) body, len);
+}
+
+
+static const unsigned char t_coldef[] = { 0x03, 'd', 'e', 'f', 0x00, 0x01,
+                                          'n', 0x0c, 0x3f, 0x00 };
+static const unsigned char t_eof[] = { 0xfe, 0x00, 0x00, 0x02, 0x00 };
+static const unsigned char t_ok_eof[] = { 0xfe, 0x00, 0x00, 0x02, 0x00,
+                                          0x00, 0x00 };
+
+
+static void
+build_resp_ok(t_resp_t *b)
+{
+    static const unsigned char ok[] = { 0x00, 0x03, 0x00, 0x02, 0x00,
+                                        0x00, 0x00 };
+
+    resp_add(b, ok, sizeof(ok));
+}
+
+
+static void
+build_resp_err(t_resp_t *b)
+{
+    static const unsigned char err[] = { 0xff, 0x26, 0x04, '#', '2', '3',
+                                         '0', '0', '0', 'd', 'u', 'p' };
+
+    resp_add(b, err, sizeof(err));
+}
+
+
+/* two columns and two rows, the second with a NULL */
+static void
+build_rows(t_resp_t *b, int deprecate_eof)
+{
+    static const unsigned char count[] = { 0x02 };
+    static const unsigned char row1[] = { 0x01, 'a', 0x01, 'b' };
+    static const unsigned char row2[] = { 0x01, 'c', 0xfb };
+
+    resp_add(b, count, sizeof(count));
+    resp_add(b, t_coldef, sizeof(t_coldef));
+    resp_add(b, t_coldef, sizeof(t_coldef));
+    if (!deprecate_eof) {
+        resp_add(b, t_eof, sizeof(t_eof));
+    }
+    resp_row(b, row1, sizeof(row1));
+    resp_row(b, row2, sizeof(row2));
+    if (deprecate_eof) {
+        resp_add(b, t_ok_eof, sizeof(t_ok_eof));
+    } else {
+        resp_add(b, t_eof, sizeof(t_eof));
+    }
+}
+
+
+static void
+build_resp_rows(t_resp_t *b)
+{
+    build_rows(b, 0);
+}
+
+
+static void
+build_resp_rows_deprecate(t_resp_t *b)
+{
+    build_rows(b, 1);
+}
+
+
+/* an OK with MORE_RESULTS_EXISTS, then a result set of one row */
+static void
+build_resp_more(t_resp_t *b)
+{
+    static const unsigned char ok[] = { 0x00, 0x01, 0x00, 0x0a, 0x00,
+                                        0x00, 0x00 };
+    static const unsigned char count[] = { 0x01 };
+    static const unsigned char row[] = { 0x01, 'x' };
+
+    resp_add(b, ok, sizeof(ok));
+    resp_add(b, count, sizeof(count));
+    resp_add(b, t_coldef, sizeof(t_coldef));
+    resp_add(b, t_eof, sizeof(t_eof));
+    resp_row(b, row, sizeof(row));
+    resp_add(b, t_eof, sizeof(t_eof));
+}
+
+
+/* PREPARE_OK of one column and two parameters */
+static void
+build_prepare(t_resp_t *b, int deprecate_eof)
+{
+    static const unsigned char ok[] = { 0x00, 0x01, 0x00, 0x00, 0x00,
+                                        0x01, 0x00, 0x02, 0x00, 0x00,
+                                        0x00, 0x00 };
+
+    resp_add(b, ok, sizeof(ok));
+    resp_add(b, t_coldef, sizeof(t_coldef));
+    resp_add(b, t_coldef, sizeof(t_coldef));
+    if (!deprecate_eof) {
+        resp_add(b, t_eof, sizeof(t_eof));
+    }
+    resp_add(b, t_coldef, sizeof(t_coldef));
+    if (!deprecate_eof) {
+        resp_add(b, t_eof, sizeof(t_eof));
+    }
+}
+
+
+static void
+build_resp_prepare(t_resp_t *b)
+{
+    build_prepare(b, 0);
+}
+
+
+static void
+build_resp_prepare_deprecate(t_resp_t *b)
+{
+    build_prepare(b, 1);
+}
+
+
+static const t_resp_case_t t_resp_cases[] = {
+    { "ok", RESP_KIND_RESULT, 0, build_resp_ok, RESP_TYPE_OK, 3, 0, 0 },
+    { "err", RESP_KIND_RESULT, 0, build_resp_err, RESP_TYPE_ERR, 1062, 0, 0 },
+    { "rows", RESP_KIND_RESULT, 0, build_resp_rows, RESP_TYPE_RESULT,
+      0, 2, 2 },
+    { "rows deprecate eof", RESP_KIND_RESULT, 1, build_resp_rows_deprecate,
+      RESP_TYPE_RESULT, 0, 2, 2 },
+    { "more results", RESP_KIND_RESULT, 0, build_resp_more, RESP_TYPE_OK,
+      1, 1, 1 },
+    { "prepare", RESP_KIND_PREPARE, 0, build_resp_prepare, RESP_TYPE_OK,
+      0, 0, 1 },
+    { "prepare deprecate eof", RESP_KIND_PREPARE, 1,
+      build_resp_prepare_deprecate, RESP_TYPE_OK, 0, 0, 1 },
+};
+
+
+/*
+ * Feed a response in pieces cut at cut and then every step bytes, with
+ * the first byte of the next response behind it; true if it is done
+ * right at its end and digested as the case says
+ */
+static bool
+feed_resp(const t_resp_case_t *c, t_resp_t *b, uint32_t cut, uint32_t step)
+{
+    int              rc;
+    uint32_t         from, to;
+    unsigned char   *pos;
+    tc_mysql_resp_t  r;
+
+    tc_mysql_resp_init(&r, c->kind, c->deprecate_eof);
+    b->data[b->len] = 0x07;
+
+    rc = RESP_AGAIN;
+    for (from = 0; from <= b->len && rc == RESP_AGAIN; from = to) {
+        to = from < cut ? cut : from + step;
+        if (to > b->len + 1) {
+            to = b->len + 1;
+        }
+        pos = b->data + from;
+        rc  = tc_mysql_resp_parse(&r, &pos, b->data + to);
+        if (rc == RESP_AGAIN && pos != b->data + to) {
+            return false;
+        }
+        to = pos - b->data;
+    }
+
+    return rc == RESP_DONE && pos == b->data + b->len
+        && r.digest.type == c->type && r.digest.affected == c->affected
+        && r.digest.rows == c->rows && r.digest.columns == c->columns
+        && r.digest.crc == b->crc;
+}
+
+
+/*
+ * Every response is digested the same whole, byte by byte and cut in two
+ * anywhere, and stops right at its end
+ */
+static void
+test_resp_parse(void)
+{
+    size_t                i;
+    uint32_t              cut;
+    t_resp_t              b;
+    const t_resp_case_t  *c;
+
+    for (i = 0; i < sizeof(t_resp_cases) / sizeof(t_resp_cases[0]); i++) {
+        c = &t_resp_cases[i];
+        tc_memzero(&b, sizeof(b));
+        c->build(&b);
+
+        if (!feed_resp(c, &b, 0, b.len + 1)) {
+            fprintf(stderr, "%s: whole response\n", c->name);
+            failures++;
+        }
+        if (!feed_resp(c, &b, 0, 1)) {
+            fprintf(stderr, "%s: byte by byte\n", c->name);
+            failures++;
+        }
+        for (cut = 1; cut < b.len; cut++) {
+            if (!feed_resp(c, &b, cut, b.len + 1)) {
+                fprintf(stderr, "%s: cut at %u\n", c->name, cut);
+                failures++;
+            }
+        }
+    }
+}
+
+
+static void
+state_query(tc_pool_t *pool, tc_mysql_state_t **state, const char *sql)
+{
+    unsigned char *text = (unsigned char *) sql;
+
+    T_CHECK(tc_mysql_state_update(pool, state,
+                tc_mysql_state_class(COM_QUERY, text, strlen(sql)),
+                COM_QUERY, text, strlen(sql)) == TC_OK);
+}
+
+
+/*
+ * The isolation level and the access mode of the session are kept and
+ * restored apart, whether set alone or together; SET TRANSACTION of the
+ * next transaction alone is not kept
+ */
+static void
+test_state_txn(tc_pool_t *pool)
+{
+    uint32_t           len, len2;
+    unsigned char      buf[MAX_STATE_LEN], buf2[MAX_STATE_LEN];
+    tc_mysql_state_t  *state, *loaded;
+    static const char  iso[] = "SET SESSION TRANSACTION ISOLATION LEVEL "
+                               "SERIALIZABLE";
+    static const char  rw[] = "SET SESSION TRANSACTION READ WRITE";
+
+    state = NULL;
+    state_query(pool, &state, "SET SESSION TRANSACTION ISOLATION LEVEL "
+            "READ COMMITTED");
+    state_query(pool, &state, "set session transaction read only");
+    T_CHECK(state != NULL && state->var_num == 2);
+    state_query(pool, &state, "SET TRANSACTION READ WRITE");
+    state_query(pool, &state, "SET LOCAL TRANSACTION ISOLATION LEVEL "
+            "SERIALIZABLE , READ WRITE");
+    T_CHECK(state != NULL && state->var_num == 2);
+    if (state == NULL) {
+        return;
+    }
+
+    len = tc_mysql_state_build(state, buf);
+    T_CHECK(len == 2 * (MYSQL_HEADER_LEN + 1) + strlen(iso) + strlen(rw));
+    T_CHECK(buf[0] == 1 + strlen(iso) && buf[MYSQL_HEADER_LEN] == COM_QUERY
+            && memcmp(buf + MYSQL_HEADER_LEN + 1, iso, strlen(iso)) == 0);
+    T_CHECK(memcmp(buf + 2 * (MYSQL_HEADER_LEN + 1) + strlen(iso), rw,
+                strlen(rw)) == 0);
+
+    loaded = NULL;
+    T_CHECK(tc_mysql_state_load(pool, &loaded, buf, len) == TC_OK);
+    if (loaded != NULL) {
+        len2 = tc_mysql_state_build(loaded, buf2);
+        T_CHECK(len2 == len && memcmp(buf, buf2, len) == 0);
+        tc_mysql_state_free(pool, loaded);
+    }
+
+    tc_mysql_state_free(pool, state);
+}
+
+
+static unsigned char  t_saved[T_PKT_SIZE * 4];
+static uint32_t       t_saved_len;
+
+
+/* the payloads the module saves to replay, one after the other */
+static void
+save_payload(tc_sess_t *s, tc_iph_t *ip, tc_tcph_t *tcp)
+{
+    uint32_t len;
+
+    len = ntohs(ip->tot_len) - (ip->ihl << 2) - (tcp->doff << 2);
+    if (t_saved_len + len <= sizeof(t_saved)) {
+        memcpy(t_saved + t_saved_len, (unsigned char *) tcp + (tcp->doff << 2),
+                len);
+        t_saved_len += len;
+    }
+}
+
+
+/* what a renewal of the session of ts replays, in t_saved */
+static int
+renew(t_sess_t *ts, tc_pool_t *pool)
+{
+    int       ret;
+    uint32_t  len;
+    t_pkt_t   pkt;
+    t_sess_t  rs;
+
+    tc_memzero(&rs, sizeof(rs));
+    rs.s.hash_key = ts->s.hash_key;
+    rs.s.src_port = ts->s.src_port;
+    rs.s.pool = pool;
+    rs.s.sm.fake_syn = 1;
+    tc_mysql_module.proc_when_sess_created(&rs.s);
+
+    len = put_command(pkt.data, COM_QUERY, "select 1", 8);
+    make_pkt(&pkt, ntohs(ts->s.src_port), 3306, ts->cseq, len);
+
+    t_saved_len = 0;
+    tc_shim_save_pack = save_payload;
+    ret = tc_mysql_module.prepare_for_renew_session(&rs.s, &pkt.ip, &pkt.tcp);
+    tc_shim_save_pack = NULL;
+
+    /* the record stays, as it does when a renewal is given up */
+    free_sess_data(&rs.s, rs.s.data);
+    tc_pfree(pool, rs.s.data);
+
+    return ret;
+}
+
+
+static void
+execute(t_sess_t *ts, uint32_t id)
+{
+    uint32_t       len;
+    t_pkt_t        pkt;
+    unsigned char  exec[10];
+
+    memset(exec, 0, sizeof(exec));
+    exec[0] = id & 0xff;
+    exec[5] = 1;
+    len = put_command(pkt.data, COM_STMT_EXECUTE, exec, sizeof(exec));
+    T_CHECK(client_send(ts, &pkt, len));
+}
+
+
+/*
+ * Over its budget a shard evicts the statement executed least recently,
+ * and a renewal keeps the ids of the others with a placeholder in its
+ * place; a session with too many holes is not renewed
+ */
+static void
+test_ps_budget(tc_pool_t *pool)
+{
+    char               budget[32];
+    uint32_t           len, off;
+    t_sess_t           ts;
+    tc_mysql_rec_t    *rec;
+    tc_mysql_shard_t  *shard;
+    static const char *sqls[] = { "select a from t where id = ?",
+                                  "select b from t where id = ?",
+                                  "select c from t where id = ?" };
+
+    len = MYSQL_HEADER_LEN + 1 + strlen(sqls[0]);
+    snprintf(budget, sizeof(budget), "%u",
+            (uint32_t) (2 * (len + sizeof(tc_mysql_stmt_t))));
+    T_CHECK(set_directive("user", "app:secret") == TC_OK);
+    T_CHECK(set_directive("ps_budget", budget) == TC_OK);
+    T_CHECK(tc_mysql_module.init() == TC_OK);
+
+    T_CHECK(login(&ts, pool, 40014, T_CAPS));
+    shard = get_shard(ts.s.hash_key);
+    prepare(&ts, sqls[0], 1);
+    prepare(&ts, sqls[1], 2);
+    execute(&ts, 1);
+    prepare(&ts, sqls[2], 3);
+
+    rec = find_rec(shard, ts.s.hash_key);
+    T_CHECK(shard->stats.ps_evicted == 1);
+    T_CHECK(rec != NULL && rec->stmt_num == 2 && rec->last_stmt_id == 3);
+    if (rec == NULL || rec->stmt_num != 2) {
+        tc_mysql_module.exit();
+        ps_budget = DEFAULT_PS_BUDGET;
+        return;
+    }
+    T_CHECK(rec->stmts[0]->id == 1 && rec->stmts[1]->id == 3);
+    T_CHECK(shard->stats.ps_mem <= shard->ps_budget);
+
+    /* the first auth, statement 1, a placeholder for 2 and statement 3 */
+    T_CHECK(renew(&ts, pool) == TC_OK);
+    off = rec->fir_auth->len;
+    T_CHECK(t_saved_len == off + 2 * len + sizeof(stmt_placeholder));
+    T_CHECK(memcmp(t_saved, rec->fir_auth->data, off) == 0);
+    T_CHECK(memcmp(t_saved + off + MYSQL_HEADER_LEN + 1, sqls[0],
+                strlen(sqls[0])) == 0);
+    off += len;
+    T_CHECK(memcmp(t_saved + off, stmt_placeholder,
+                sizeof(stmt_placeholder)) == 0);
+    off += sizeof(stmt_placeholder);
+    T_CHECK(memcmp(t_saved + off + MYSQL_HEADER_LEN + 1, sqls[2],
+                strlen(sqls[2])) == 0);
+
+    rec->last_stmt_id = rec->stmt_num + MAX_STMT_HOLES + 1;
+    T_CHECK(renew(&ts, pool) == TC_ERR);
+    T_CHECK(shard->stats.ps_holes_refused == 1);
+    rec->last_stmt_id = 3;
+
+    logout(&ts);
+    tc_mysql_module.exit();
+    ps_budget = DEFAULT_PS_BUDGET;
+}
+
+
+/* a command in a compressed frame numbered 0, deflated */
+static uint32_t
+put_zcommand(unsigned char *p, unsigned char command, const char *sql)
+{
+    uLongf         zlen;
+    uint32_t       len;
+    unsigned char  raw[T_PKT_SIZE];
+
+    len  = put_command(raw, command, sql, strlen(sql));
+    zlen = T_PKT_SIZE - MYSQL_ZHEADER_LEN;
+    compress(p + MYSQL_ZHEADER_LEN, &zlen, raw, len);
+
+    p[0] = zlen & 0xff;
+    p[1] = (zlen >> 8) & 0xff;
+    p[2] = (zlen >> 16) & 0xff;
+    p[3] = 0;
+    p[4] = len & 0xff;
+    p[5] = (len >> 8) & 0xff;
+    p[6] = (len >> 16) & 0xff;
+
+    return MYSQL_ZHEADER_LEN + zlen;
+}
+
+
+/*
+ * A login asking for CLIENT_COMPRESS of a server offering it frames the
+ * session compressed from then on, its record is renewed compressed and
+ * the inflate stream goes with the session
+ */
+static void
+test_compress(tc_pool_t *pool)
+{
+    uint32_t           len;
+    uint64_t           bytes;
+    t_pkt_t            pkt;
+    t_sess_t           ts;
+    tc_mysql_session  *data;
+
+    T_CHECK(set_directive("user", "app:secret") == TC_OK);
+    T_CHECK(tc_mysql_module.init() == TC_OK);
+
+    T_CHECK(login(&ts, pool, 40003, T_CAPS));
+    data = ts.s.data;
+    T_CHECK(!data->compress);
+    logout(&ts);
+
+    bytes = tc_shim_bytes;
+
+    T_CHECK(login(&ts, pool, 40004, T_CAPS | CLIENT_COMPRESS));
+    data = ts.s.data;
+    T_CHECK(data->clt_compress && data->srv_compress && data->compress);
+    T_CHECK(get_shard(ts.s.hash_key)->stats.compressed == 1);
+
+    len = put_zcommand(pkt.data, COM_QUERY, "select n from item where id = 3");
+    T_CHECK(client_send(&ts, &pkt, len));
+    T_CHECK(data->clt_zframer.next_seq == ts.cseq);
+    T_CHECK(data->clt_zframer.zs != NULL);
+    T_CHECK(data->clt_zframer.head[MYSQL_HEADER_LEN] == COM_QUERY);
+
+    logout(&ts);
+    T_CHECK(ts.s.data == NULL);
+    T_CHECK(tc_shim_bytes == bytes);
+
+    /* were the session dropped, its next query would renew it compressed */
+    T_CHECK(login(&ts, pool, 40005, T_CAPS | CLIENT_COMPRESS));
+    T_CHECK(is_compressed_rec(find_rec(get_shard(ts.s.hash_key),
+                    ts.s.hash_key)));
+    len = put_zcommand(pkt.data, COM_QUERY, "select 1");
+    make_pkt(&pkt, 40005, 3306, ts.cseq, len);
+    T_CHECK(tc_mysql_module.check_renew_session(&pkt.ip, &pkt.tcp));
+    logout(&ts);
+
+    tc_mysql_module.exit();
+}
+
+
+/* a query of a session the module never saw log in */
+static bool
+query_renews(uint16_t port)
+{
+    uint32_t  len;
+    t_pkt_t   pkt;
+
+    len = put_command(pkt.data, COM_QUERY, "select 1", 8);
+    make_pkt(&pkt, port, 3306, 1000, len);
+
+    return tc_mysql_module.check_renew_session(&pkt.ip, &pkt.tcp);
+}
+
+
+/*
+ * A session is adopted only if the smallest ratio keeps it: with sample
+ * 50% and app sampled at 100%, about half are, and with sample 50% alone
+ * none dropped at its SYN comes back adopted
+ */
+static void
+test_adopt_sampled(tc_pool_t *pool)
+{
+    int        adopted, dropped;
+    uint16_t   port;
+    t_sess_t   ts;
+
+    T_CHECK(set_directive("user", "app:secret") == TC_OK);
+    T_CHECK(set_directive("adopt", "app") == TC_OK);
+    T_CHECK(set_directive("sample", "50%") == TC_OK);
+    T_CHECK(set_directive("sample_user", "app@100%") == TC_OK);
+    T_CHECK(tc_mysql_module.init() == TC_OK);
+
+    adopted = 0;
+    for (port = 41000; port < 41200; port++) {
+        if (query_renews(port)) {
+            adopted++;
+            T_CHECK(is_sampled(get_key(T_CLIENT_IP, htons(port)),
+                        sample_ratio));
+        }
+    }
+    T_CHECK(adopted > 0 && adopted < 200);
+
+    tc_mysql_module.exit();
+
+    sample_ratio = SAMPLE_SCALE;
+    sample_user_num = 0;
+    T_CHECK(set_directive("sample", "50%") == TC_OK);
+    T_CHECK(set_directive("user", "app:secret") == TC_OK);
+    T_CHECK(tc_mysql_module.init() == TC_OK);
+
+    dropped = 0;
+    for (port = 41000; port < 41200; port++) {
+        tc_memzero(&ts, sizeof(ts));
+        ts.s.hash_key = get_key(T_CLIENT_IP, htons(port));
+        ts.s.src_port = htons(port);
+        ts.s.pool = pool;
+        tc_mysql_module.proc_when_sess_created(&ts.s);
+        if (ts.s.sm.sess_over) {
+            dropped++;
+            T_CHECK(!query_renews(port));
+        }
+        logout(&ts);
+    }
+    T_CHECK(dropped > 0);
+
+    tc_mysql_module.exit();
+
+    sample_ratio = SAMPLE_SCALE;
+    adopt_user[0] = '\0';
+}
+
+
+#define T_STREAM_SIZE  (MYSQL_HEADER_LEN + MYSQL_MAX_PACKET_LEN + 256)
+#define T_STREAM_PKTS  64
+#define T_END          0xffffffff
+#define T_SEQ          0xffffff00
+
+/* a stream of packets and where each of them starts */
+typedef struct {
+    unsigned char  *data;
+    uint32_t        len;
+    int             num;
+    uint32_t        offs[T_STREAM_PKTS];
+    uint32_t        lens[T_STREAM_PKTS];
+} t_stream_t;
+
+typedef struct {
+    uint32_t  from;
+    uint32_t  to;
+} t_seg_t;
+
+typedef struct {
+    const char  *name;
+    void       (*build)(t_stream_t *st);
+    uint32_t     skip;
+    t_seg_t      segs[8];
+} t_frame_case_t;
+
+
+static void
+add_packet(t_stream_t *st, unsigned char seq, unsigned char command,
+        uint32_t len)
+{
+    unsigned char *p;
+
+    p = st->data + st->len;
+    p[0] = len & 0xff;
+    p[1] = (len >> 8) & 0xff;
+    p[2] = (len >> 16) & 0xff;
+    p[3] = seq;
+    if (len > 0) {
+        memset(p + MYSQL_HEADER_LEN, st->num, len);
+        p[MYSQL_HEADER_LEN] = command;
+    }
+
+    st->offs[st->num] = st->len;
+    st->lens[st->num] = len;
+    st->num++;
+    st->len += MYSQL_HEADER_LEN + len;
+}
+
+
+/* executes of statement ids that tell them apart, and a statistics */
+static void
+build_executes(t_stream_t *st)
+{
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        add_packet(st, 0, COM_STMT_EXECUTE, 20);
+    }
+    add_packet(st, 0, COM_STATISTICS, 1);
+}
+
+
+/* a command of 16M and more, its continuation and a command after it */
+static void
+build_large(t_stream_t *st)
+{
+    add_packet(st, 0, COM_STATISTICS, 1);
+    add_packet(st, 0, COM_QUERY, MYSQL_MAX_PACKET_LEN);
+    add_packet(st, 1, 0, 10);
+    add_packet(st, 0, COM_STMT_CLOSE, 5);
+}
+
+
+/* more packets than a batch holds, pipelined */
+static void
+build_pipelined(t_stream_t *st)
+{
+    int i;
+
+    for (i = 0; i < 40; i++) {
+        add_packet(st, 0, i % 3 ? COM_QUERY : COM_STMT_PREPARE, 12 + i % 7);
+    }
+}
+
+
+static const t_frame_case_t  t_frame_cases[] = {
+    { "one segment", build_executes, 0,
+      { { 0, T_END } } },
+    { "head split", build_executes, 0,
+      { { 0, 2 }, { 2, 6 }, { 6, 30 }, { 30, 31 }, { 31, T_END } } },
+    { "retransmitted", build_executes, 30 + 20,
+      { { 0, 30 }, { 0, 30 }, { 10, 50 }, { 50, T_END } } },
+    { "16M packet", build_large, 0,
+      { { 0, 1000 }, { 1000, 0x1000000 }, { 0x1000000, T_END } } },
+    { "pipelined", build_pipelined, 0,
+      { { 0, T_END } } },
+    { "pipelined split", build_pipelined, 0,
+      { { 0, 100 }, { 100, 103 }, { 103, T_END } } },
+    { NULL, NULL, 0, { { 0, 0 } } }
+};
+
+
+/*
+ * Every packet of the stream is reported once, in order, where it
+ * starts, with its head and whether it continues a packet of 16M; every
+ * byte fed is accounted for by skip, lead and the packets
+ */
+static void
+test_framer(void)
+{
+    int                    j, seen, hlen;
+    uint32_t               to, skip, fed, walked, at;
+    t_stream_t             st;
+    tc_mysql_pkt_t        *pkt;
+    tc_mysql_frames_t      frames;
+    tc_mysql_framer_t      framer;
+    const t_seg_t         *seg;
+    const t_frame_case_t  *c;
+
+    st.data = malloc(T_STREAM_SIZE);
+    T_CHECK(st.data != NULL);
+    if (st.data == NULL) {
+        return;
+    }
+
+    for (c = t_frame_cases; c->name != NULL; c++) {
+        st.len = 0;
+        st.num = 0;
+        c->build(&st);
+        tc_memzero(&framer, sizeof(framer));
+
+        seen   = 0;
+        skip   = 0;
+        fed    = 0;
+        walked = 0;
+        for (seg = c->segs; seg->to != 0; seg++) {
+            to = seg->to == T_END ? st.len : seg->to;
+            frame_mysql_packets(&framer, T_SEQ + seg->from,
+                    st.data + seg->from, to - seg->from, &frames);
+            fed    += to - seg->from;
+            skip   += frames.skip;
+            walked += frames.skip + frames.lead;
+
+            do {
+                T_CHECK(frames.num <= MAX_PKTS_PER_SEG);
+                for (j = 0; j < frames.num; j++, seen++) {
+                    pkt = &frames.pkts[j];
+                    at  = seg->from + pkt->off - pkt->prev_len;
+                    if (seen >= st.num || at != st.offs[seen]) {
+                        fprintf(stderr, "%s: packet %d at %u\n", c->name,
+                                seen, at);
+                        failures++;
+                        break;
+                    }
+                    hlen = MYSQL_HEADER_LEN + st.lens[seen];
+                    if (hlen > MYSQL_HEAD_LEN) {
+                        hlen = MYSQL_HEAD_LEN;
+                    }
+                    T_CHECK(pkt->len == st.lens[seen]);
+                    T_CHECK((int) pkt->head_len == hlen);
+                    T_CHECK(memcmp(pkt->head, st.data + at, hlen) == 0);
+                    T_CHECK(pkt->cont == (seen > 0
+                                && st.lens[seen - 1] == MYSQL_MAX_PACKET_LEN));
+                    walked += pkt->prev_len + pkt->seg_len;
+                }
+            } while (frame_mysql_more(&framer, st.data + seg->from,
+                        to - seg->from, &frames));
+        }
+
+        if (seen != st.num || skip != c->skip || walked != fed) {
+            fprintf(stderr, "%s: %d of %d packets, %u bytes skipped, "
+                    "%u of %u walked\n", c->name, seen, st.num, skip,
+                    walked, fed);
+            failures++;
+        }
+    }
+
+    free(st.data);
+}
+
+
+int
+main(int argc, char **argv)
+{
+    tc_pool_t *pool;
+
+    tc_shim_now = 1700000000;
+    pool = tc_create_pool(TC_PLUGIN_POOL_SIZE, 0, 0);
+
+    if (set_directive("user", "app:secret") != TC_OK
+        || set_directive("filter", "write") != TC_OK
+        || tc_mysql_module.init() != TC_OK)
+    {
+        fprintf(stderr, "module init failed\n");
+        return 1;
+    }
+    test_filter(pool);
+    test_query_attrs(pool);
+    tc_mysql_module.exit();
+    filter_classes = 0;
+
+    test_snapshot_exit(pool);
+    test_snapshot_payloads(pool);
+    test_auth_switch(pool);
+    test_split_auth_resp(pool);
+    test_ps_budget(pool);
+    test_adopt_sampled(pool);
+    test_compress(pool);
+    test_framer();
+    test_classify_with();
+    test_state_txn(pool);
+    test_resp_parse();
+    test_user_table();
+
+    tc_destroy_pool(pool);
+
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+
+    printf("unit: ok\n");
+    return 0;
+}